@@ -0,0 +1 @@
+"7d624c9704d4a072"
@@ -94,6 +94,7 @@
 #include "feature/nodelist/dirlist.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nickname.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/routerset.h"
@@ -106,6 +107,7 @@
 #include "feature/rend/rendservice.h"
 #include "lib/geoip/geoip.h"
 #include "feature/stats/geoip_stats.h"
+#include "lib/buf/buffers.h"
 #include "lib/compress/compress.h"
 #include "lib/confmgt/structvar.h"
 #include "lib/crypt_ops/crypto_init.h"
@@ -147,6 +149,7 @@
 #include "lib/process/process.h"
 #include "lib/net/gethostname.h"
 #include "lib/thread/numcpus.h"
+#include "lib/tls/tls_dataplane.h"
 
 #include "lib/encoding/keyval.h"
 #include "lib/fs/conffile.h"
@@ -389,6 +392,7 @@ static const config_var_t option_vars_[] = {
   V(CountPrivateBandwidth,       BOOL,     "0"),
   VAR_IMMUTABLE("DataDirectory", FILENAME, DataDirectory_option, NULL),
   V(DataDirectoryGroupReadable,  BOOL,     "0"),
+  V_IMMUTABLE(DataPlaneThreads,  POSINT,   "0"),
   V(DisableOOSCheck,             BOOL,     "1"),
   V(DisableNetwork,              BOOL,     "0"),
   V(DirAllowPrivateAddresses,    BOOL,     "0"),
@@ -540,6 +544,7 @@ static const config_var_t option_vars_[] = {
   VAR_D("HSLayer3Nodes",         ROUTERSET,  HSLayer3Nodes,  NULL),
   V(KeepalivePeriod,             INTERVAL, "5 minutes"),
   V_IMMUTABLE(KeepBindCapabilities,        AUTOBOOL, "auto"),
+  V_IMMUTABLE(KernelTLS,         BOOL,     "0"),
   VAR("Log",                     LINELIST, Logs,             NULL),
   V(LogMessageDomains,           BOOL,     "0"),
   V(LogTimeGranularity,          MSEC_INTERVAL, "1 second"),
@@ -553,6 +558,7 @@ static const config_var_t option_vars_[] = {
   V(MaxCircuitDirtiness,         INTERVAL, "10 minutes"),
   V(MaxClientCircuitsPending,    POSINT,     "32"),
   V(MaxConsensusAgeForDiffs,     INTERVAL, "0 seconds"),
+  V(MaxMemInBufferFreelists,     MEMUNIT,  "4 MB"),
   VAR("MaxMemInQueues",          MEMUNIT,   MaxMemInQueues_raw, "0"),
   OBSOLETE("MaxOnionsPending"),
   V(MaxOnionQueueDelay,          MSEC_INTERVAL, "1750 msec"),
@@ -572,6 +578,8 @@ static const config_var_t option_vars_[] = {
   V(NumEntryGuards,              POSINT,     "0"),
   V(NumPrimaryGuards,            POSINT,     "0"),
   V(OfflineMasterKey,            BOOL,     "0"),
+  V(OnionQueueDropInterval,      MSEC_INTERVAL, "1000 msec"),
+  V(OnionQueueTargetDelay,       MSEC_INTERVAL, "100 msec"),
   OBSOLETE("ORListenAddress"),
   VPORT(ORPort),
   V(OutboundBindAddress,         LINELIST,   NULL),
@@ -673,6 +681,7 @@ static const config_var_t option_vars_[] = {
   VAR("UseEntryGuards",          BOOL,     UseEntryGuards_option, "1"),
   OBSOLETE("UseEntryGuardsAsDirGuards"),
   V(UseGuardFraction,            AUTOBOOL, "auto"),
+  V_IMMUTABLE(UseIOUring,        BOOL,     "0"),
   V(UseMicrodescriptors,         AUTOBOOL, "auto"),
   OBSOLETE("UseNTorHandshake"),
   V_IMMUTABLE(User,              STRING,   NULL),
@@ -1445,6 +1454,22 @@ options_act_once_on_startup(char **msg_out)
    * happen here too.  How yucky. */
   scheduler_init();
 
+  /* The Sandbox doesn't allow any of the io_uring system calls. */
+  if (options->UseIOUring) {
+    if (options->Sandbox) {
+      log_notice(LD_CONFIG, "UseIOUring is not compatible with Sandbox; "
+                 "using ordinary socket I/O.");
+    } else if (mainloop_batch_io_init() < 0) {
+      log_notice(LD_CONFIG, "UseIOUring is set, but we couldn't set up "
+                 "io_uring. Using ordinary socket I/O.");
+    }
+  }
+  if (options->DataPlaneThreads &&
+      mainloop_dataplane_init(options->DataPlaneThreads) < 0) {
+    log_warn(LD_CONFIG, "Couldn't start the data-plane threads. Running TLS "
+             "on the main thread.");
+  }
+
   /* Attempt to lock all current and future memory with mlockall() only once.
    * This must happen before setuid. */
   if (options->DisableAllSwap) {
@@ -2027,6 +2052,24 @@ options_transition_affects_guards(const or_options_t *old_options,
   return 0;
 }
 
+/**
+ * Return true if changing the configuration from <b>old</b> to <b>new</b>
+ * affects the weights we give nodes when we choose them at random.
+ */
+static int
+options_transition_affects_node_weights(const or_options_t *old_options,
+                                        const or_options_t *new_options)
+{
+  /* NOTE: Make sure this function stays in sync with
+   * compute_weighted_bandwidths() */
+  tor_assert(old_options);
+  tor_assert(new_options);
+
+  YES_IF_CHANGED_INT(UseGuardFraction);
+
+  return 0;
+}
+
 /** Fetch the active option list, and take actions based on it. All of the
  * things we do should survive being done repeatedly.  If present,
  * <b>old_options</b> contains the previous value of the options.
@@ -2090,6 +2133,9 @@ options_act,(const or_options_t *old_options))
     set_protocol_warning_severity_level(warning_severity);
   }
 
+  buf_set_freelist_cap(options->MaxMemInBufferFreelists >= SIZE_MAX ?
+                       SIZE_MAX : (size_t)options->MaxMemInBufferFreelists);
+
   if (consider_adding_dir_servers(options, old_options) < 0) {
     // XXXX This should get validated earlier, and committed here, to
     // XXXX lower opportunities for reaching an error case.
@@ -2319,6 +2365,9 @@ options_act,(const or_options_t *old_options))
       }
     }
 
+    if (options_transition_affects_node_weights(old_options, options))
+      node_select_invalidate_weight_tables();
+
     if (abandon_circuits) {
       circuit_mark_all_unused_circs();
       circuit_mark_all_dirty_circs_as_unusable();
@@ -3571,6 +3620,12 @@ options_validate_cb(const void *old_options_, void *options_, char **msg)
   if (options->KeepalivePeriod < 1)
     REJECT("KeepalivePeriod option must be positive.");
 
+  if (options->DataPlaneThreads > TLS_DATAPLANE_MAX_THREADS) {
+    tor_asprintf(msg, "DataPlaneThreads must be at most %d.",
+                 TLS_DATAPLANE_MAX_THREADS);
+    return -1;
+  }
+
   if (config_ensure_bandwidth_cap(&options->BandwidthRate,
                            "BandwidthRate", msg) < 0)
     return -1;
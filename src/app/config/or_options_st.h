@@ -167,6 +167,9 @@ struct or_options_t {
                             * for queues and buffers, run the OOM handler */
   /** Above this value, consider ourselves low on RAM. */
   uint64_t MaxMemInQueues_low_threshold;
+  /** How much memory may we keep in unused buffer chunks, ready for
+   * reuse? */
+  uint64_t MaxMemInBufferFreelists;
 
   /** @name port booleans
    *
@@ -350,6 +353,12 @@ struct or_options_t {
                        * descriptor? Remember to publish them independently. */
   int KeepalivePeriod; /**< How often do we send padding cells to keep
                         * connections alive? */
+  int KernelTLS; /**< Boolean: should we ask the kernel to do TLS record
+                  * encryption on our connections, where it can? */
+  int UseIOUring; /**< Boolean: should we batch socket reads and writes
+                   * through io_uring, where we can? */
+  int DataPlaneThreads; /**< How many threads should run TLS for our open OR
+                         * connections? 0 for none. */
   int SocksTimeout; /**< How long do we let a socks connection wait
                      * unattached before we fail it? */
   int LearnCircuitBuildTimeout; /**< If non-zero, we attempt to learn a value
@@ -366,6 +375,13 @@ struct or_options_t {
                              * waiting for this many seconds. If zero, use
                              * our default internal timeout schedule. */
   int MaxOnionQueueDelay; /*< DOCDOC */
+  /** Once onionskins have been waiting longer than this many msec for an
+   * OnionQueueDropInterval, start dropping them from the head of the
+   * queue. 0 means never. */
+  int OnionQueueTargetDelay;
+  /** How many msec must onionskins wait longer than OnionQueueTargetDelay
+   * before we start dropping them? */
+  int OnionQueueDropInterval;
   int NewCircuitPeriod; /**< How long do we use a circuit before building
                          * a new one? */
   int MaxCircuitDirtiness; /**< Never use circs that were first used more than
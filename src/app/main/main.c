@@ -45,7 +45,9 @@
 #include "feature/hs/hs_dos.h"
 #include "feature/nodelist/authcert.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/nodelist_snapshot.h"
 #include "feature/nodelist/routerlist.h"
+#include "feature/nodelist/verified_digests.h"
 #include "feature/relay/dns.h"
 #include "feature/relay/ext_orport.h"
 #include "feature/relay/routerkeys.h"
@@ -56,6 +58,9 @@
 #include "feature/stats/rephist.h"
 #include "lib/compress/compress.h"
 #include "lib/buf/buffers.h"
+#include "lib/net/buffers_net.h"
+#include "lib/net/buffers_uring.h"
+#include "lib/tls/tls_dataplane.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_s2k.h"
 #include "lib/net/resolve.h"
@@ -305,10 +310,62 @@ dumpmemusage(int severity)
       (rephist_total_alloc), rephist_total_num);
   dump_routerlist_mem_usage(severity);
   dump_cell_pool_usage(severity);
+  buf_dump_freelist_sizes(severity);
   dump_dns_mem_usage(severity);
   tor_log_mallinfo(severity);
 }
 
+/** Log, at level <b>severity</b>, what we know about the TLS state of the
+ * <b>i</b>th connection, whose TLS object is <b>tls</b>. */
+static void
+dump_or_conn_tls_stats(int i, tor_tls_t *tls, int severity)
+{
+  size_t rbuf_cap, wbuf_cap, rbuf_len, wbuf_len;
+  int ktls_tx, ktls_rx;
+
+  if (tor_tls_get_buffer_sizes(tls, &rbuf_cap, &rbuf_len,
+                               &wbuf_cap, &wbuf_len) == 0) {
+    tor_log(severity, LD_GENERAL,
+        "Conn %d: %d/%d bytes used on OpenSSL read buffer; "
+        "%d/%d bytes used on write buffer.",
+        i, (int)rbuf_len, (int)rbuf_cap, (int)wbuf_len, (int)wbuf_cap);
+  }
+  if (tor_tls_get_kernel_offload(tls, &ktls_tx, &ktls_rx) == 0) {
+    tor_log(severity, LD_GENERAL,
+        "Conn %d: kernel TLS offload: send %s, receive %s.",
+        i, ktls_tx ? "yes" : "no", ktls_rx ? "yes" : "no");
+  }
+}
+
+/** Log the statistics for our batched socket I/O, if we're doing any, with
+ * log level <b>severity</b>. */
+static void
+dumpstats_batched_io(int severity)
+{
+  if (buf_uring_enabled()) {
+    buf_uring_stats_t uring_stats;
+    buf_uring_get_stats(&uring_stats);
+    tor_log(severity, LD_NET,
+            "io_uring: %"PRIu64" reads (%"PRIu64" bytes) and %"PRIu64
+            " writes (%"PRIu64" bytes) in %"PRIu64" system calls.",
+            uring_stats.n_reads, uring_stats.n_bytes_read,
+            uring_stats.n_writes, uring_stats.n_bytes_written,
+            uring_stats.n_enter_calls);
+  }
+  if (tls_dataplane_enabled()) {
+    tls_dataplane_stats_t dp_stats;
+    tls_dataplane_get_stats(&dp_stats);
+    tor_log(severity, LD_NET,
+            "Data plane: %"PRIu64" TLS reads (%"PRIu64" bytes) and %"PRIu64
+            " TLS writes (%"PRIu64" bytes) in %"PRIu64" batches, %"PRIu64
+            " of them spread over %d threads.",
+            dp_stats.n_reads, dp_stats.n_bytes_read,
+            dp_stats.n_writes, dp_stats.n_bytes_written,
+            dp_stats.n_batches, dp_stats.n_parallel_batches,
+            tls_dataplane_get_n_threads());
+  }
+}
+
 /** Write all statistics to the log, with log level <b>severity</b>. Called
  * in response to a SIGUSR1. */
 static void
@@ -316,7 +373,6 @@ dumpstats(int severity)
 {
   time_t now = time(NULL);
   time_t elapsed;
-  size_t rbuf_cap, wbuf_cap, rbuf_len, wbuf_len;
 
   tor_log(severity, LD_GENERAL, "Dumping stats:");
 
@@ -344,18 +400,8 @@ dumpstats(int severity)
           (int)connection_get_outbuf_len(conn),
           (int)buf_allocation(conn->outbuf),
           (int)(now - conn->timestamp_last_write_allowed));
-      if (conn->type == CONN_TYPE_OR) {
-        or_connection_t *or_conn = TO_OR_CONN(conn);
-        if (or_conn->tls) {
-          if (tor_tls_get_buffer_sizes(or_conn->tls, &rbuf_cap, &rbuf_len,
-                                       &wbuf_cap, &wbuf_len) == 0) {
-            tor_log(severity, LD_GENERAL,
-                "Conn %d: %d/%d bytes used on OpenSSL read buffer; "
-                "%d/%d bytes used on write buffer.",
-                i, (int)rbuf_len, (int)rbuf_cap, (int)wbuf_len, (int)wbuf_cap);
-          }
-        }
-      }
+      if (conn->type == CONN_TYPE_OR && TO_OR_CONN(conn)->tls)
+        dump_or_conn_tls_stats(i, TO_OR_CONN(conn)->tls, severity);
     }
     circuit_dump_by_conn(conn, severity); /* dump info about all the circuits
                                            * using this conn */
@@ -388,8 +434,20 @@ dumpstats(int severity)
         100*(((double)stats_n_data_bytes_received) /
              ((double)stats_n_data_cells_received*RELAY_PAYLOAD_SIZE)) );
 
+  {
+    buf_net_stats_t net_stats;
+    buf_net_get_stats(&net_stats);
+    tor_log(severity, LD_NET,
+            "Buffer I/O: %"PRIu64" bytes read in %"PRIu64" calls; "
+            "%"PRIu64" bytes written in %"PRIu64" calls.",
+            net_stats.n_bytes_read, net_stats.n_read_calls,
+            net_stats.n_bytes_written, net_stats.n_write_calls);
+  }
+  dumpstats_batched_io(severity);
+
   cpuworker_log_onionskin_overhead(severity, ONION_HANDSHAKE_TYPE_TAP, "TAP");
   cpuworker_log_onionskin_overhead(severity, ONION_HANDSHAKE_TYPE_NTOR,"ntor");
+  cpuworker_log_onionskin_batching(severity);
 
   if (now - time_of_process_start >= 0)
     elapsed = now - time_of_process_start;
@@ -837,10 +895,13 @@ sandbox_init_filter(void)
 
   OPEN_CACHEDIR_SUFFIX("cached-certs", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-consensus", ".tmp");
+  OPEN_CACHEDIR_SUFFIX("cached-consensus.snapshot", ".tmp");
   OPEN_CACHEDIR_SUFFIX("unverified-consensus", ".tmp");
   OPEN_CACHEDIR_SUFFIX("unverified-microdesc-consensus", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-microdesc-consensus", ".tmp");
+  OPEN_CACHEDIR_SUFFIX("cached-microdesc-consensus.snapshot", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-microdescs", ".tmp");
+  OPEN_CACHEDIR_SUFFIX("cached-microdescs.snapshot", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-microdescs.new", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-descriptors", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-descriptors.new", ".tmp");
@@ -848,12 +909,14 @@ sandbox_init_filter(void)
   OPEN_CACHEDIR_SUFFIX("cached-extrainfo", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-extrainfo.new", ".tmp");
   OPEN_CACHEDIR("cached-extrainfo.tmp.tmp");
+  OPEN_CACHEDIR_SUFFIX("cached-verified-digests", ".tmp");
 
   OPEN_DATADIR_SUFFIX("state", ".tmp");
   OPEN_DATADIR_SUFFIX("sr-state", ".tmp");
   OPEN_DATADIR_SUFFIX("unparseable-desc", ".tmp");
   OPEN_DATADIR_SUFFIX("v3-status-votes", ".tmp");
   OPEN_DATADIR("key-pinning-journal");
+  OPEN_DATADIR_SUFFIX("verified-digests-key", ".tmp");
   OPEN("/dev/srandom");
   OPEN("/dev/urandom");
   OPEN("/dev/random");
@@ -904,10 +967,13 @@ sandbox_init_filter(void)
 
   RENAME_CACHEDIR_SUFFIX("cached-certs", ".tmp");
   RENAME_CACHEDIR_SUFFIX("cached-consensus", ".tmp");
+  RENAME_CACHEDIR_SUFFIX("cached-consensus.snapshot", ".tmp");
   RENAME_CACHEDIR_SUFFIX("unverified-consensus", ".tmp");
   RENAME_CACHEDIR_SUFFIX("unverified-microdesc-consensus", ".tmp");
   RENAME_CACHEDIR_SUFFIX("cached-microdesc-consensus", ".tmp");
+  RENAME_CACHEDIR_SUFFIX("cached-microdesc-consensus.snapshot", ".tmp");
   RENAME_CACHEDIR_SUFFIX("cached-microdescs", ".tmp");
+  RENAME_CACHEDIR_SUFFIX("cached-microdescs.snapshot", ".tmp");
   RENAME_CACHEDIR_SUFFIX("cached-microdescs", ".new");
   RENAME_CACHEDIR_SUFFIX("cached-microdescs.new", ".tmp");
   RENAME_CACHEDIR_SUFFIX("cached-descriptors", ".tmp");
@@ -916,11 +982,13 @@ sandbox_init_filter(void)
   RENAME_CACHEDIR_SUFFIX("cached-extrainfo", ".tmp");
   RENAME_CACHEDIR_SUFFIX("cached-extrainfo", ".new");
   RENAME_CACHEDIR_SUFFIX("cached-extrainfo.new", ".tmp");
+  RENAME_CACHEDIR_SUFFIX("cached-verified-digests", ".tmp");
 
   RENAME_SUFFIX("state", ".tmp");
   RENAME_SUFFIX("sr-state", ".tmp");
   RENAME_SUFFIX("unparseable-desc", ".tmp");
   RENAME_SUFFIX("v3-status-votes", ".tmp");
+  RENAME_SUFFIX("verified-digests-key", ".tmp");
 
   if (options->BridgeAuthoritativeDir)
     RENAME_SUFFIX("networkstatus-bridges", ".tmp");
@@ -1132,6 +1200,14 @@ run_tor_main_loop(void)
     tor_free(fname);
   }
 
+  if (verified_digests_load() < 0) {
+    log_warn(LD_DIR, "Couldn't set up the verified-digest journal. We'll "
+             "check every signature on our cached directory documents, "
+             "and parse all of them.");
+  } else {
+    /* Snapshots are authenticated with the journal's key. */
+    nodelist_snapshot_enable();
+  }
   if (trusted_dirs_reload_certs()) {
     log_warn(LD_DIR,
              "Couldn't load all cached v3 certificates. Starting anyway.");
@@ -19,6 +19,7 @@
 #include "app/main/subsysmgr.h"
 #include "core/mainloop/connection.h"
 #include "core/mainloop/mainloop_pubsub.h"
+#include "core/or/cellpool.h"
 #include "core/or/channeltls.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuitmux_ewma.h"
@@ -36,19 +37,23 @@
 #include "feature/dirauth/shared_random.h"
 #include "feature/dircache/consdiffmgr.h"
 #include "feature/dircache/dirserv.h"
+#include "feature/dirparse/parsecommon.h"
 #include "feature/dirparse/routerparse.h"
 #include "feature/hibernate/hibernate.h"
 #include "feature/hs/hs_common.h"
 #include "feature/nodelist/microdesc.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/nodelist_snapshot.h"
 #include "feature/nodelist/routerlist.h"
+#include "feature/nodelist/verified_digests.h"
 #include "feature/relay/ext_orport.h"
 #include "feature/relay/relay_config.h"
 #include "feature/rend/rendcache.h"
 #include "feature/rend/rendclient.h"
 #include "feature/stats/geoip_stats.h"
 #include "feature/stats/rephist.h"
+#include "lib/buf/buffers.h"
 #include "lib/evloop/compat_libevent.h"
 #include "lib/geoip/geoip.h"
 
@@ -83,6 +88,7 @@ tor_cleanup(void)
       accounting_record_bandwidth_usage(now, get_or_state());
     or_state_mark_dirty(get_or_state(), 0); /* force an immediate save. */
     or_state_save(now);
+    verified_digests_save();
     if (authdir_mode(options)) {
       sr_save_and_cleanup();
     }
@@ -116,6 +122,8 @@ tor_free_all(int postfork)
   geoip_stats_free_all();
   routerlist_free_all();
   networkstatus_free_all();
+  verified_digests_free_all();
+  nodelist_snapshot_free_all();
   addressmap_free_all();
   dirserv_free_all();
   rend_cache_free_all();
@@ -133,6 +141,7 @@ tor_free_all(int postfork)
   nodelist_free_all();
   microdesc_free_all();
   routerparse_free_all();
+  parsecommon_free_all();
   control_free_all();
   bridges_free_all();
   consdiffmgr_free_all();
@@ -141,6 +150,8 @@ tor_free_all(int postfork)
   circuitmux_ewma_free_all();
   accounting_free_all();
   circpad_free_all();
+  cell_pool_free_all();
+  buf_shrink_freelists(1);
 
   if (!postfork) {
     config_free_all();
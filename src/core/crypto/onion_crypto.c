@@ -235,6 +235,81 @@ onion_skin_server_handshake(int type,
   return r;
 }
 
+/** Perform the server side of each of the <b>n_handshakes</b> handshakes
+ * in <b>handshakes</b>, as onion_skin_server_handshake() would, using the
+ * keys in <b>keys</b> and generating <b>keys_out_len</b> bytes of key
+ * material for each.  Set the result field of each handshake to what
+ * onion_skin_server_handshake() would have returned.
+ *
+ * We do all of the ntor handshakes together, so that their curve25519
+ * operations can share vector lanes; the others, one at a time.
+ */
+void
+onion_skin_server_handshake_batch(onion_server_handshake_t *handshakes,
+                                  int n_handshakes,
+                                  const server_onion_keys_t *keys,
+                                  size_t keys_out_len)
+{
+  const size_t keys_tmp_len = keys_out_len + DIGEST_LEN;
+  const uint8_t **onion_skins;
+  uint8_t **replies, **keys_tmp;
+  uint8_t *keys_tmp_buf;
+  int *ntor_idx, *results;
+  int i, n_ntor = 0;
+
+  tor_assert(keys_tmp_len <= MAX_KEYS_TMP_LEN);
+  onion_skins = tor_calloc(n_handshakes, sizeof(uint8_t *));
+  replies = tor_calloc(n_handshakes, sizeof(uint8_t *));
+  keys_tmp = tor_calloc(n_handshakes, sizeof(uint8_t *));
+  keys_tmp_buf = tor_calloc(n_handshakes, MAX_KEYS_TMP_LEN);
+  ntor_idx = tor_calloc(n_handshakes, sizeof(int));
+  results = tor_calloc(n_handshakes, sizeof(int));
+
+  for (i = 0; i < n_handshakes; ++i) {
+    onion_server_handshake_t *hs = &handshakes[i];
+    if (hs->type != ONION_HANDSHAKE_TYPE_NTOR ||
+        hs->onionskin_len < NTOR_ONIONSKIN_LEN) {
+      hs->result = onion_skin_server_handshake(hs->type,
+                                          hs->onion_skin, hs->onionskin_len,
+                                          keys, hs->reply_out,
+                                          hs->keys_out, keys_out_len,
+                                          hs->rend_nonce_out);
+      continue;
+    }
+    ntor_idx[n_ntor] = i;
+    onion_skins[n_ntor] = hs->onion_skin;
+    replies[n_ntor] = hs->reply_out;
+    keys_tmp[n_ntor] = keys_tmp_buf + n_ntor * MAX_KEYS_TMP_LEN;
+    ++n_ntor;
+  }
+
+  onion_skin_ntor_server_handshake_batch(n_ntor, onion_skins,
+                                         keys->curve25519_key_map,
+                                         keys->junk_keypair,
+                                         keys->my_identity,
+                                         replies, keys_tmp, keys_tmp_len,
+                                         results);
+
+  for (i = 0; i < n_ntor; ++i) {
+    onion_server_handshake_t *hs = &handshakes[ntor_idx[i]];
+    if (results[i] < 0) {
+      hs->result = -1;
+      continue;
+    }
+    memcpy(hs->keys_out, keys_tmp[i], keys_out_len);
+    memcpy(hs->rend_nonce_out, keys_tmp[i] + keys_out_len, DIGEST_LEN);
+    hs->result = NTOR_REPLY_LEN;
+  }
+
+  memwipe(keys_tmp_buf, 0, n_handshakes * MAX_KEYS_TMP_LEN);
+  tor_free(keys_tmp_buf);
+  tor_free(onion_skins);
+  tor_free(replies);
+  tor_free(keys_tmp);
+  tor_free(ntor_idx);
+  tor_free(results);
+}
+
 /** Perform the final (client-side) step of a circuit-creation handshake of
  * type <b>type</b>, using our state in <b>handshake_state</b> and the
  * server's response in <b>reply</b>. On success, generate <b>keys_out_len</b>
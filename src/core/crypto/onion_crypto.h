@@ -20,6 +20,19 @@ typedef struct server_onion_keys_t {
   struct curve25519_keypair_t *junk_keypair;
 } server_onion_keys_t;
 
+/** The arguments and result of one onion_skin_server_handshake() call, as
+ * passed to onion_skin_server_handshake_batch(). */
+typedef struct onion_server_handshake_t {
+  int type;
+  const uint8_t *onion_skin;
+  size_t onionskin_len;
+  uint8_t *reply_out;
+  uint8_t *keys_out;
+  uint8_t *rend_nonce_out;
+  /** Set to what onion_skin_server_handshake() would have returned. */
+  int result;
+} onion_server_handshake_t;
+
 void onion_handshake_state_release(onion_handshake_state_t *state);
 
 int onion_skin_create(int type,
@@ -32,6 +45,10 @@ int onion_skin_server_handshake(int type,
                       uint8_t *reply_out,
                       uint8_t *keys_out, size_t key_out_len,
                       uint8_t *rend_nonce_out);
+void onion_skin_server_handshake_batch(onion_server_handshake_t *handshakes,
+                                       int n_handshakes,
+                                       const server_onion_keys_t *keys,
+                                       size_t keys_out_len);
 int onion_skin_client_handshake(int type,
                       const onion_handshake_state_t *handshake_state,
                       const uint8_t *reply, size_t reply_len,
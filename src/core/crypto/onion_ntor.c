@@ -134,6 +134,20 @@ onion_skin_ntor_create(const uint8_t *router_id,
                         CURVE25519_PUBKEY_LEN*3 +       \
                         PROTOID_LEN + SERVER_STR_LEN)
 
+/** Sensitive state for the server side of one ntor handshake, kept
+ * together to make it easy to wipe. */
+typedef struct ntor_server_state_t {
+  uint8_t secret_input[SECRET_INPUT_LEN];
+  uint8_t auth_input[AUTH_INPUT_LEN];
+  curve25519_public_key_t pubkey_X;
+  curve25519_secret_key_t seckey_y;
+  curve25519_public_key_t pubkey_Y;
+  uint8_t verify[DIGEST256_LEN];
+  /** Our keypair that the client named, or junk_keys. NULL if we are
+   * rejecting this handshake without computing it. */
+  const curve25519_keypair_t *keypair_bB;
+} ntor_server_state_t;
+
 /**
  * Perform the server side of an ntor handshake. Given an
  * NTOR_ONIONSKIN_LEN-byte message in <b>onion_skin</b>, our own identity
@@ -153,97 +167,166 @@ onion_skin_ntor_server_handshake(const uint8_t *onion_skin,
                                  uint8_t *handshake_reply_out,
                                  uint8_t *key_out,
                                  size_t key_out_len)
+{
+  int result;
+  onion_skin_ntor_server_handshake_batch(1, &onion_skin, private_keys,
+                                         junk_keys, my_node_id,
+                                         &handshake_reply_out, &key_out,
+                                         key_out_len, &result);
+  return result;
+}
+
+/**
+ * Helper for onion_skin_ntor_server_handshake_batch(): once the curve25519
+ * operations for <b>s</b> are done, build its reply in
+ * <b>handshake_reply_out</b> and its keys in <b>key_out</b>.  Return 0 on
+ * success, -1 on failure.
+ */
+static int
+ntor_server_handshake_finish(ntor_server_state_t *s,
+                             const uint8_t *my_node_id,
+                             uint8_t *handshake_reply_out,
+                             uint8_t *key_out,
+                             size_t key_out_len)
 {
   const tweakset_t *T = &proto1_tweaks;
-  /* Sensitive stack-allocated material. Kept in an anonymous struct to make
-   * it easy to wipe. */
-  struct {
-    uint8_t secret_input[SECRET_INPUT_LEN];
-    uint8_t auth_input[AUTH_INPUT_LEN];
-    curve25519_public_key_t pubkey_X;
-    curve25519_secret_key_t seckey_y;
-    curve25519_public_key_t pubkey_Y;
-    uint8_t verify[DIGEST256_LEN];
-  } s;
-  uint8_t *si = s.secret_input, *ai = s.auth_input;
-  const curve25519_keypair_t *keypair_bB;
+  const curve25519_keypair_t *keypair_bB = s->keypair_bB;
+  uint8_t *si = s->secret_input, *ai = s->auth_input;
   int bad;
 
-  /* Decode the onion skin */
-  /* XXXX Does this possible early-return business threaten our security? */
-  if (tor_memneq(onion_skin, my_node_id, DIGEST_LEN))
-    return -1;
-  /* Note that on key-not-found, we go through with this operation anyway,
-   * using "junk_keys". This will result in failed authentication, but won't
-   * leak whether we recognized the key. */
-  keypair_bB = dimap_search(private_keys, onion_skin + DIGEST_LEN,
-                            (void*)junk_keys);
   if (!keypair_bB)
     return -1;
 
-  memcpy(s.pubkey_X.public_key, onion_skin+DIGEST_LEN+DIGEST256_LEN,
-         CURVE25519_PUBKEY_LEN);
-
-  /* Make y, Y */
-  curve25519_secret_key_generate(&s.seckey_y, 0);
-  curve25519_public_key_generate(&s.pubkey_Y, &s.seckey_y);
-
-  /* NOTE: If we ever use a group other than curve25519, or a different
-   * representation for its points, we may need to perform different or
-   * additional checks on X here and on Y in the client handshake, or lose our
-   * security properties. What checks we need would depend on the properties
-   * of the group and its representation.
-   *
-   * In short: if you use anything other than curve25519, this aspect of the
-   * code will need to be reconsidered carefully. */
-
   /* build secret_input */
-  curve25519_handshake(si, &s.seckey_y, &s.pubkey_X);
   bad = safe_mem_is_zero(si, CURVE25519_OUTPUT_LEN);
   si += CURVE25519_OUTPUT_LEN;
-  curve25519_handshake(si, &keypair_bB->seckey, &s.pubkey_X);
   bad |= safe_mem_is_zero(si, CURVE25519_OUTPUT_LEN);
   si += CURVE25519_OUTPUT_LEN;
 
   APPEND(si, my_node_id, DIGEST_LEN);
   APPEND(si, keypair_bB->pubkey.public_key, CURVE25519_PUBKEY_LEN);
-  APPEND(si, s.pubkey_X.public_key, CURVE25519_PUBKEY_LEN);
-  APPEND(si, s.pubkey_Y.public_key, CURVE25519_PUBKEY_LEN);
+  APPEND(si, s->pubkey_X.public_key, CURVE25519_PUBKEY_LEN);
+  APPEND(si, s->pubkey_Y.public_key, CURVE25519_PUBKEY_LEN);
   APPEND(si, PROTOID, PROTOID_LEN);
-  tor_assert(si == s.secret_input + sizeof(s.secret_input));
+  tor_assert(si == s->secret_input + sizeof(s->secret_input));
 
   /* Compute hashes of secret_input */
-  h_tweak(s.verify, s.secret_input, sizeof(s.secret_input), T->t_verify);
+  h_tweak(s->verify, s->secret_input, sizeof(s->secret_input), T->t_verify);
 
   /* Compute auth_input */
-  APPEND(ai, s.verify, DIGEST256_LEN);
+  APPEND(ai, s->verify, DIGEST256_LEN);
   APPEND(ai, my_node_id, DIGEST_LEN);
   APPEND(ai, keypair_bB->pubkey.public_key, CURVE25519_PUBKEY_LEN);
-  APPEND(ai, s.pubkey_Y.public_key, CURVE25519_PUBKEY_LEN);
-  APPEND(ai, s.pubkey_X.public_key, CURVE25519_PUBKEY_LEN);
+  APPEND(ai, s->pubkey_Y.public_key, CURVE25519_PUBKEY_LEN);
+  APPEND(ai, s->pubkey_X.public_key, CURVE25519_PUBKEY_LEN);
   APPEND(ai, PROTOID, PROTOID_LEN);
   APPEND(ai, SERVER_STR, SERVER_STR_LEN);
-  tor_assert(ai == s.auth_input + sizeof(s.auth_input));
+  tor_assert(ai == s->auth_input + sizeof(s->auth_input));
 
   /* Build the reply */
-  memcpy(handshake_reply_out, s.pubkey_Y.public_key, CURVE25519_PUBKEY_LEN);
+  memcpy(handshake_reply_out, s->pubkey_Y.public_key, CURVE25519_PUBKEY_LEN);
   h_tweak(handshake_reply_out+CURVE25519_PUBKEY_LEN,
-          s.auth_input, sizeof(s.auth_input),
+          s->auth_input, sizeof(s->auth_input),
           T->t_mac);
 
   /* Generate the key material */
   crypto_expand_key_material_rfc5869_sha256(
-                           s.secret_input, sizeof(s.secret_input),
+                           s->secret_input, sizeof(s->secret_input),
                            (const uint8_t*)T->t_key, strlen(T->t_key),
                            (const uint8_t*)T->m_expand, strlen(T->m_expand),
                            key_out, key_out_len);
 
-  /* Wipe all of our local state */
-  memwipe(&s, 0, sizeof(s));
-
   return bad ? -1 : 0;
 }
 
+/**
+ * Perform the server side of <b>n</b> ntor handshakes at once, as
+ * onion_skin_ntor_server_handshake() would, setting
+ * <b>results_out</b>[i] to its result for the onionskin in
+ * <b>onion_skins</b>[i], reply in <b>handshake_replies_out</b>[i], and
+ * keys in <b>keys_out</b>[i].
+ *
+ * This lets us do all of their curve25519 operations together, which is
+ * faster when curve25519_handshake_batch() can spread them across vector
+ * lanes.
+ */
+void
+onion_skin_ntor_server_handshake_batch(int n,
+                                 const uint8_t *const *onion_skins,
+                                 const di_digest256_map_t *private_keys,
+                                 const curve25519_keypair_t *junk_keys,
+                                 const uint8_t *my_node_id,
+                                 uint8_t *const *handshake_replies_out,
+                                 uint8_t *const *keys_out,
+                                 size_t key_out_len,
+                                 int *results_out)
+{
+  ntor_server_state_t *states = tor_calloc(n, sizeof(ntor_server_state_t));
+  uint8_t **dh_outputs = tor_calloc(2 * n, sizeof(uint8_t *));
+  const curve25519_secret_key_t **dh_seckeys =
+    tor_calloc(2 * n, sizeof(curve25519_secret_key_t *));
+  const curve25519_public_key_t **dh_pubkeys =
+    tor_calloc(2 * n, sizeof(curve25519_public_key_t *));
+  int i, n_dh = 0;
+
+  for (i = 0; i < n; ++i) {
+    ntor_server_state_t *s = &states[i];
+    const uint8_t *onion_skin = onion_skins[i];
+
+    /* Decode the onion skin */
+    /* XXXX Does this possible early-return business threaten our
+     * security? */
+    if (tor_memneq(onion_skin, my_node_id, DIGEST_LEN))
+      continue;
+    /* Note that on key-not-found, we go through with this operation anyway,
+     * using "junk_keys". This will result in failed authentication, but
+     * won't leak whether we recognized the key. */
+    s->keypair_bB = dimap_search(private_keys, onion_skin + DIGEST_LEN,
+                                 (void*)junk_keys);
+    if (!s->keypair_bB)
+      continue;
+
+    memcpy(s->pubkey_X.public_key, onion_skin+DIGEST_LEN+DIGEST256_LEN,
+           CURVE25519_PUBKEY_LEN);
+
+    /* Make y, Y */
+    curve25519_secret_key_generate(&s->seckey_y, 0);
+    curve25519_public_key_generate(&s->pubkey_Y, &s->seckey_y);
+
+    /* NOTE: If we ever use a group other than curve25519, or a different
+     * representation for its points, we may need to perform different or
+     * additional checks on X here and on Y in the client handshake, or lose
+     * our security properties. What checks we need would depend on the
+     * properties of the group and its representation.
+     *
+     * In short: if you use anything other than curve25519, this aspect of
+     * the code will need to be reconsidered carefully. */
+
+    /* The start of secret_input is EXP(X,y) | EXP(X,b). */
+    dh_outputs[n_dh] = s->secret_input;
+    dh_seckeys[n_dh] = &s->seckey_y;
+    dh_pubkeys[n_dh++] = &s->pubkey_X;
+    dh_outputs[n_dh] = s->secret_input + CURVE25519_OUTPUT_LEN;
+    dh_seckeys[n_dh] = &s->keypair_bB->seckey;
+    dh_pubkeys[n_dh++] = &s->pubkey_X;
+  }
+
+  curve25519_handshake_batch(n_dh, dh_outputs, dh_seckeys, dh_pubkeys);
+
+  for (i = 0; i < n; ++i) {
+    results_out[i] = ntor_server_handshake_finish(&states[i], my_node_id,
+                                                  handshake_replies_out[i],
+                                                  keys_out[i], key_out_len);
+  }
+
+  /* Wipe all of our local state */
+  memwipe(states, 0, n * sizeof(ntor_server_state_t));
+  tor_free(states);
+  tor_free(dh_outputs);
+  tor_free(dh_seckeys);
+  tor_free(dh_pubkeys);
+}
+
 /**
  * Perform the final client side of the ntor handshake, using the state in
  * <b>handshake_state</b> and the server's NTOR_REPLY_LEN-byte reply in
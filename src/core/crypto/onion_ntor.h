@@ -41,6 +41,16 @@ int onion_skin_ntor_server_handshake(const uint8_t *onion_skin,
                            uint8_t *key_out,
                            size_t key_out_len);
 
+void onion_skin_ntor_server_handshake_batch(int n,
+                           const uint8_t *const *onion_skins,
+                           const struct di_digest256_map_t *private_keys,
+                           const struct curve25519_keypair_t *junk_keypair,
+                           const uint8_t *my_node_id,
+                           uint8_t *const *handshake_replies_out,
+                           uint8_t *const *keys_out,
+                           size_t key_out_len,
+                           int *results_out);
+
 int onion_skin_ntor_client_handshake(
                              const ntor_handshake_state_t *handshake_state,
                              const uint8_t *handshake_reply,
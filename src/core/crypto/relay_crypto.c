@@ -86,6 +86,16 @@ relay_digest_matches(crypto_digest_t *digest, cell_t *cell)
   return rv;
 }
 
+/** Return true iff the relay header in <b>payload</b> has its "recognized"
+ * field set to zero, so that the cell might be for us.  This lets us skip
+ * unpacking the header and checking the digest for the great majority of
+ * cells, which are just passing through. */
+static inline int
+relay_payload_maybe_recognized(const uint8_t *payload)
+{
+  return get_uint16(payload + 1) == 0;
+}
+
 /** Apply <b>cipher</b> to CELL_PAYLOAD_SIZE bytes of <b>in</b>
  * (in place).
  *
@@ -97,6 +107,53 @@ relay_crypt_one_payload(crypto_cipher_t *cipher, uint8_t *in)
   crypto_cipher_crypt_inplace(cipher, (char*) in, CELL_PAYLOAD_SIZE);
 }
 
+/** Apply <b>cipher</b> to the CELL_PAYLOAD_SIZE-byte payloads in
+ * <b>payloads</b>, in place, with the same result as calling
+ * relay_crypt_one_payload() on each of them in order.
+ *
+ * Since the payloads are consecutive stretches of a single counter-mode
+ * keystream, we generate the keystream for up to RELAY_CRYPT_BATCH_MAX of
+ * them with one call to the cipher, and then xor it into each payload.
+ * We wipe the keystream from the stack before returning.
+ */
+void
+relay_crypt_payloads(crypto_cipher_t *cipher, uint8_t **payloads,
+                     int n_payloads)
+{
+  uint64_t ks[RELAY_CRYPT_BATCH_MAX * CELL_PAYLOAD_SIZE / 8 + 1];
+  const uint8_t *ks_bytes = (const uint8_t *) ks;
+  size_t ks_used = 0;
+  int i, j;
+
+  tor_assert(n_payloads >= 0);
+
+  while (n_payloads > 1) {
+    const int n = MIN(n_payloads, RELAY_CRYPT_BATCH_MAX);
+    const size_t len = n * CELL_PAYLOAD_SIZE;
+    memset(ks, 0, len);
+    crypto_cipher_crypt_inplace(cipher, (char *) ks, len);
+    ks_used = MAX(ks_used, len);
+    for (i = 0; i < n; ++i) {
+      uint8_t *p = payloads[i];
+      const uint8_t *k = ks_bytes + i * CELL_PAYLOAD_SIZE;
+      for (j = 0; j + 8 <= CELL_PAYLOAD_SIZE; j += 8) {
+        uint64_t a, b;
+        memcpy(&a, p + j, 8);
+        memcpy(&b, k + j, 8);
+        a ^= b;
+        memcpy(p + j, &a, 8);
+      }
+      for (; j < CELL_PAYLOAD_SIZE; ++j)
+        p[j] ^= k[j];
+    }
+    payloads += n;
+    n_payloads -= n;
+  }
+  memwipe(ks, 0, ks_used);
+  if (n_payloads == 1)
+    relay_crypt_one_payload(cipher, payloads[0]);
+}
+
 /** Return the sendme_digest within the <b>crypto</b> object. */
 uint8_t *
 relay_crypto_get_sendme_digest(relay_crypto_t *crypto)
@@ -146,8 +203,6 @@ relay_decrypt_cell(circuit_t *circ, cell_t *cell,
                    cell_direction_t cell_direction,
                    crypt_path_t **layer_hint, char *recognized)
 {
-  relay_header_t rh;
-
   tor_assert(circ);
   tor_assert(cell);
   tor_assert(recognized);
@@ -170,8 +225,7 @@ relay_decrypt_cell(circuit_t *circ, cell_t *cell,
         /* decrypt one layer */
         cpath_crypt_cell(thishop, cell->payload, true);
 
-        relay_header_unpack(&rh, cell->payload);
-        if (rh.recognized == 0) {
+        if (relay_payload_maybe_recognized(cell->payload)) {
           /* it's possibly recognized. have to check digest to be sure. */
           if (relay_digest_matches(cpath_get_incoming_digest(thishop), cell)) {
             *recognized = 1;
@@ -196,8 +250,7 @@ relay_decrypt_cell(circuit_t *circ, cell_t *cell,
 
     relay_crypt_one_payload(crypto->f_crypto, cell->payload);
 
-    relay_header_unpack(&rh, cell->payload);
-    if (rh.recognized == 0) {
+    if (relay_payload_maybe_recognized(cell->payload)) {
       /* it's possibly recognized. have to check digest to be sure. */
       if (relay_digest_matches(crypto->f_digest, cell)) {
         *recognized = 1;
@@ -208,6 +261,54 @@ relay_decrypt_cell(circuit_t *circ, cell_t *cell,
   return 0;
 }
 
+/** Do the appropriate en/decryptions for the <b>n_cells</b> cells in
+ * <b>cells</b>, all arriving in order on <b>circ</b> in direction
+ * <b>cell_direction</b>.  <b>circ</b> must not be an origin circuit.
+ *
+ * The result is the same as calling relay_decrypt_cell() on each cell in
+ * turn, but we run the cipher over up to RELAY_CRYPT_BATCH_MAX cells at a
+ * time.  For each cell, set recognized[i] to 1 if the cell is for us, and to
+ * 0 otherwise.
+ */
+void
+relay_decrypt_cells(circuit_t *circ, cell_t **cells, int n_cells,
+                    cell_direction_t cell_direction, char *recognized)
+{
+  uint8_t *payloads[RELAY_CRYPT_BATCH_MAX];
+  relay_crypto_t *crypto;
+  crypto_cipher_t *cipher;
+  int i, j;
+
+  tor_assert(circ);
+  tor_assert(! CIRCUIT_IS_ORIGIN(circ));
+  tor_assert(n_cells >= 0);
+  tor_assert(n_cells == 0 || (cells && recognized));
+  tor_assert(cell_direction == CELL_DIRECTION_IN ||
+             cell_direction == CELL_DIRECTION_OUT);
+
+  crypto = &TO_OR_CIRCUIT(circ)->crypto;
+  /* In the middle, we encrypt one layer inbound and decrypt one layer
+   * outbound; only outbound cells can be for us. */
+  cipher = (cell_direction == CELL_DIRECTION_IN) ?
+    crypto->b_crypto : crypto->f_crypto;
+
+  for (i = 0; i < n_cells; i += RELAY_CRYPT_BATCH_MAX) {
+    const int n = MIN(n_cells - i, RELAY_CRYPT_BATCH_MAX);
+    for (j = 0; j < n; ++j)
+      payloads[j] = cells[i + j]->payload;
+    relay_crypt_payloads(cipher, payloads, n);
+  }
+
+  for (i = 0; i < n_cells; ++i) {
+    recognized[i] = 0;
+    if (cell_direction == CELL_DIRECTION_OUT &&
+        relay_payload_maybe_recognized(cells[i]->payload) &&
+        relay_digest_matches(crypto->f_digest, cells[i])) {
+      recognized[i] = 1;
+    }
+  }
+}
+
 /**
  * Encrypt a cell <b>cell</b> that we are creating, and sending outbound on
  * <b>circ</b> until the hop corresponding to <b>layer_hint</b>.
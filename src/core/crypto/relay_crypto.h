@@ -19,6 +19,8 @@ int relay_crypto_init(relay_crypto_t *crypto,
 int relay_decrypt_cell(circuit_t *circ, cell_t *cell,
                        cell_direction_t cell_direction,
                        crypt_path_t **layer_hint, char *recognized);
+void relay_decrypt_cells(circuit_t *circ, cell_t **cells, int n_cells,
+                         cell_direction_t cell_direction, char *recognized);
 void relay_encrypt_cell_outbound(cell_t *cell, origin_circuit_t *or_circ,
                             crypt_path_t *layer_hint);
 void relay_encrypt_cell_inbound(cell_t *cell, or_circuit_t *or_circ);
@@ -35,6 +37,13 @@ void relay_crypto_record_sendme_digest(relay_crypto_t *crypto,
 void
 relay_crypt_one_payload(crypto_cipher_t *cipher, uint8_t *in);
 
+/** Largest number of cell payloads that relay_crypt_payloads() passes to the
+ * cipher in a single call. */
+#define RELAY_CRYPT_BATCH_MAX 16
+
+void relay_crypt_payloads(crypto_cipher_t *cipher, uint8_t **payloads,
+                          int n_payloads);
+
 void
 relay_set_digest(crypto_digest_t *digest, cell_t *cell);
 
@@ -112,6 +112,8 @@
 #include "lib/cc/ctassert.h"
 #include "lib/sandbox/sandbox.h"
 #include "lib/net/buffers_net.h"
+#include "lib/net/buffers_uring.h"
+#include "lib/tls/tls_dataplane.h"
 #include "lib/tls/tortls.h"
 #include "lib/evloop/compat_libevent.h"
 #include "lib/compress/compress.h"
@@ -4365,6 +4367,87 @@ connection_flush(connection_t *conn)
   return connection_handle_write(conn, 1);
 }
 
+/** Return true iff the main loop may batch socket reads and writes for
+ * <b>conn</b>.  Open OR connections go to the TLS data plane, if we're
+ * using one; connections that talk directly to their sockets go to
+ * io_uring, if we're using it.  Listeners and linked connections don't
+ * read or write sockets at all. */
+int
+connection_can_batch_io(const connection_t *conn)
+{
+  if (!SOCKET_OK(conn->s) ||
+      conn->marked_for_close ||
+      conn->linked ||
+      conn->in_flushed_some ||
+      connection_is_listener((connection_t *)conn))
+    return 0;
+
+  if (connection_speaks_cells(conn)) {
+    /* Only open connections: handshakes and renegotiations have to happen
+     * on the main thread. */
+    return tls_dataplane_enabled() &&
+      conn->state == OR_CONN_STATE_OPEN &&
+      TO_OR_CONN((connection_t *)conn)->tls != NULL;
+  }
+  return buf_uring_enabled();
+}
+
+/** Add to the current batch the read that connection_handle_read() would
+ * next make from <b>conn</b>, so that connection_handle_read() can collect
+ * its result. */
+void
+connection_prepare_batched_read(connection_t *conn)
+{
+  ssize_t at_most;
+  size_t slack_in_buf;
+
+  tor_assert(connection_can_batch_io(conn));
+
+  /* This mirrors connection_buf_read_from_socket(). */
+  connection_bucket_refill_single(conn, monotime_coarse_get_stamp());
+  at_most = connection_bucket_read_limit(conn, approx_time());
+  const ssize_t maximum = BUF_MAX_LEN - buf_datalen(conn->inbuf);
+  if (at_most > maximum)
+    at_most = maximum;
+  slack_in_buf = buf_slack(conn->inbuf);
+  if ((size_t)at_most > slack_in_buf && slack_in_buf >= 1024)
+    at_most = slack_in_buf;
+
+  if (connection_speaks_cells(conn)) {
+    tls_dataplane_prepare_read(conn->inbuf, TO_OR_CONN(conn)->tls, at_most,
+                               (unsigned) conn->global_identifier);
+  } else {
+    buf_uring_prepare_read(conn->inbuf, conn->s, at_most);
+  }
+}
+
+/** Add to the current batch the write that connection_handle_write() would
+ * next make to <b>conn</b>, so that connection_handle_write() can collect
+ * its result. */
+void
+connection_prepare_batched_write(connection_t *conn)
+{
+  size_t max_to_write;
+
+  tor_assert(connection_can_batch_io(conn));
+
+  /* A connection that's still connecting needs its first write event to
+   * tell us whether the connect() worked. */
+  if (connection_state_is_connecting(conn))
+    return;
+
+  connection_bucket_refill_single(conn, monotime_coarse_get_stamp());
+  max_to_write = connection_bucket_write_limit(conn, approx_time());
+  if (connection_speaks_cells(conn)) {
+    tls_dataplane_prepare_flush(conn->outbuf, TO_OR_CONN(conn)->tls,
+                                max_to_write, &conn->outbuf_flushlen,
+                                (unsigned) conn->global_identifier);
+  } else {
+    buf_uring_prepare_flush(conn->outbuf, conn->s, max_to_write,
+                            &conn->outbuf_flushlen);
+  }
+}
+
 /** Helper for connection_write_to_buf_impl and connection_write_buf_to_buf:
  *
  * Return true iff it is okay to queue bytes on <b>conn</b>'s outbuf for
@@ -4513,6 +4596,30 @@ connection_buf_add_buf(connection_t *conn, buf_t *buf)
   connection_write_to_buf_commit(conn, len);
 }
 
+/**
+ * Add the <b>len</b> bytes at <b>data</b> to <b>conn</b>'s outbuf without
+ * copying them, as buf_add_external() does.  Call <b>free_fn</b> on
+ * <b>free_arg</b> once the outbuf (or whichever buffer the bytes end up on)
+ * is done with them.
+ */
+void
+connection_buf_add_external(const char *data, size_t len,
+                            connection_t *conn,
+                            void (*free_fn)(void *), void *free_arg)
+{
+  tor_assert(conn);
+  if (!len || !connection_may_write_to_buf(conn)) {
+    free_fn(free_arg);
+    return;
+  }
+
+  if (buf_add_external(conn->outbuf, data, len, free_fn, free_arg) < 0) {
+    connection_write_to_buf_failed(conn);
+    return;
+  }
+  connection_write_to_buf_commit(conn, len);
+}
+
 #define CONN_GET_ALL_TEMPLATE(var, test) \
   STMT_BEGIN \
     smartlist_t *conns = get_connection_array();   \
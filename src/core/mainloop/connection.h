@@ -247,6 +247,9 @@ int connection_wants_to_flush(struct connection_t *conn);
 int connection_outbuf_too_full(struct connection_t *conn);
 int connection_handle_write(struct connection_t *conn, int force);
 int connection_flush(struct connection_t *conn);
+int connection_can_batch_io(const struct connection_t *conn);
+void connection_prepare_batched_read(struct connection_t *conn);
+void connection_prepare_batched_write(struct connection_t *conn);
 
 MOCK_DECL(void, connection_write_to_buf_impl_,
           (const char *string, size_t len, struct connection_t *conn,
@@ -264,6 +267,9 @@ connection_buf_add(const char *string, size_t len, struct connection_t *conn)
 void connection_buf_add_compress(const char *string, size_t len,
                                  struct dir_connection_t *conn, int done);
 void connection_buf_add_buf(struct connection_t *conn, struct buf_t *buf);
+void connection_buf_add_external(const char *data, size_t len,
+                                 struct connection_t *conn,
+                                 void (*free_fn)(void *), void *free_arg);
 
 size_t connection_get_inbuf_len(struct connection_t *conn);
 size_t connection_get_outbuf_len(struct connection_t *conn);
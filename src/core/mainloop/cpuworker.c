@@ -14,9 +14,11 @@
  * Right now, we use this infrastructure
  *  <ul><li>for processing onionskins in onion.c
  *      <li>for compressing consensuses in consdiffmgr.c,
- *      <li>and for calculating diffs and compressing them in consdiffmgr.c.
+ *      <li>for calculating diffs and compressing them in consdiffmgr.c,
+ *      <li>and for parsing large networkstatus documents in ns_parse.c.
  *  </ul>
  **/
+#define CPUWORKER_PRIVATE
 #include "core/or/or.h"
 #include "core/or/channel.h"
 #include "core/or/circuitlist.h"
@@ -31,6 +33,7 @@
 #include "feature/stats/rephist.h"
 #include "feature/relay/router.h"
 #include "lib/evloop/workqueue.h"
+#include "lib/thread/threads.h"
 #include "core/crypto/onion_crypto.h"
 
 #include "core/or/or_circuit_st.h"
@@ -75,6 +78,17 @@ static threadpool_t *threadpool = NULL;
 
 static int total_pending_tasks = 0;
 static int max_pending_tasks = 128;
+/** How many threads are in our threadpool? */
+static int n_cpuworker_threads = 1;
+
+/** How many replies have the cpuworkers sent us for onion handshake jobs? */
+static uint64_t onionskin_replies_n_received = 0;
+/** How many onionskins have the cpuworkers answered in those replies? */
+static uint64_t onionskin_replies_n_answered = 0;
+/** When did we last log onionskin batching statistics, and how many
+ * onionskins had we answered at the time? */
+static time_t onionskin_batch_stats_last_logged = 0;
+static uint64_t onionskin_batch_stats_last_n_answered = 0;
 
 /** Initialize the cpuworker subsystem. It is OK to call this more than once
  * during Tor's lifetime.
@@ -93,6 +107,7 @@ cpu_init(void)
       least one thread of each kind.
     */
     const int n_threads = get_num_cpus(get_options()) + 1;
+    n_cpuworker_threads = n_threads;
     threadpool = threadpool_new(n_threads,
                                 replyqueue,
                                 worker_state_new,
@@ -104,6 +119,9 @@ cpu_init(void)
     tor_assert(r == 0);
   }
 
+  if (!onionskin_batch_stats_last_logged)
+    onionskin_batch_stats_last_logged = approx_time();
+
   /* Total voodoo. Can we make this more sensible? */
   max_pending_tasks = get_num_cpus(get_options()) * 64;
 }
@@ -168,6 +186,15 @@ typedef struct cpuworker_job_u_t {
   } u;
 } cpuworker_job_t;
 
+/** A group of onion handshakes that a cpuworker performs as a single job,
+ * sending back a single reply for all of them. */
+typedef struct cpuworker_batch_t {
+  /** How many jobs are in this batch? */
+  int n_jobs;
+  /** The jobs themselves. */
+  cpuworker_job_t *jobs[CPUWORKER_MAX_BATCH];
+} cpuworker_batch_t;
+
 static workqueue_reply_t
 update_state_threadfn(void *state_, void *work_)
 {
@@ -307,11 +334,57 @@ cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
          onionskin_type_name, (unsigned)overhead, relative_overhead*100);
 }
 
-/** Handle a reply from the worker threads. */
+/** Log how many onionskins the cpuworkers have answered per reply, and how
+ * many per second since we last logged this; and how often replies from
+ * the cpuworkers have woken up the main thread. */
+void
+cpuworker_log_onionskin_batching(int severity)
+{
+  const time_t now = approx_time();
+  uint64_t n_answered;
+  double per_reply, per_sec = 0.0;
+  replyqueue_stats_t rq_stats;
+
+  if (replyqueue) {
+    replyqueue_get_stats(replyqueue, &rq_stats);
+    if (rq_stats.n_replies)
+      log_fn(severity, LD_OR,
+             "Cpuworker replies: %"PRIu64" handled in %"PRIu64" passes "
+             "(%.3f per reply), after %"PRIu64" wakeups from the workers "
+             "(%.3f per reply); %"PRIu64" passes stopped early so that "
+             "other events could run.",
+             rq_stats.n_replies, rq_stats.n_passes,
+             ((double)rq_stats.n_passes) / rq_stats.n_replies,
+             rq_stats.n_alerts,
+             ((double)rq_stats.n_alerts) / rq_stats.n_replies,
+             rq_stats.n_deferred);
+  }
+
+  if (!onionskin_replies_n_received)
+    return;
+
+  n_answered = onionskin_replies_n_answered -
+    onionskin_batch_stats_last_n_answered;
+  per_reply = ((double)onionskin_replies_n_answered) /
+    onionskin_replies_n_received;
+  if (now > onionskin_batch_stats_last_logged)
+    per_sec = ((double)n_answered) / (now - onionskin_batch_stats_last_logged);
+
+  log_fn(severity, LD_OR,
+         "Cpuworkers have answered %"PRIu64" onionskins in %"PRIu64" "
+         "replies (%.2f onionskins per reply); %.1f onionskins per second "
+         "since we last checked.",
+         onionskin_replies_n_answered, onionskin_replies_n_received,
+         per_reply, per_sec);
+
+  onionskin_batch_stats_last_logged = now;
+  onionskin_batch_stats_last_n_answered = onionskin_replies_n_answered;
+}
+
+/** Handle the reply to a single onion handshake <b>job</b>, and free it. */
 static void
-cpuworker_onion_handshake_replyfn(void *work_)
+cpuworker_onion_handshake_reply_one(cpuworker_job_t *job)
 {
-  cpuworker_job_t *job = work_;
   cpuworker_reply_t rpl;
   or_circuit_t *circ = NULL;
 
@@ -393,98 +466,305 @@ cpuworker_onion_handshake_replyfn(void *work_)
   memwipe(&rpl, 0, sizeof(rpl));
   memwipe(job, 0, sizeof(*job));
   tor_free(job);
-  queue_pending_tasks();
 }
 
-/** Implementation function for onion handshake requests. */
-static workqueue_reply_t
-cpuworker_onion_handshake_threadfn(void *state_, void *work_)
+/** Handle a reply from the worker threads. */
+static void
+cpuworker_onion_handshake_replyfn(void *work_)
 {
-  worker_state_t *state = state_;
-  cpuworker_job_t *job = work_;
+  cpuworker_batch_t *batch = work_;
+  int i;
 
-  /* variables for onion processing */
-  server_onion_keys_t *onion_keys = state->onion_keys;
-  cpuworker_request_t req;
-  cpuworker_reply_t rpl;
+  ++onionskin_replies_n_received;
+  onionskin_replies_n_answered += batch->n_jobs;
 
-  memcpy(&req, &job->u.request, sizeof(req));
+  for (i = 0; i < batch->n_jobs; ++i)
+    cpuworker_onion_handshake_reply_one(batch->jobs[i]);
 
-  tor_assert(req.magic == CPUWORKER_REQUEST_MAGIC);
-  memset(&rpl, 0, sizeof(rpl));
+  tor_free(batch);
+  queue_pending_tasks();
+}
 
-  const create_cell_t *cc = &req.create_cell;
-  created_cell_t *cell_out = &rpl.created_cell;
+/** Perform the onion handshakes in the <b>n_jobs</b> jobs in <b>jobs</b>
+ * together, replacing the request in each job with our reply.
+ *
+ * If we time them, we charge each handshake an equal share of the time
+ * that they took together, so the caller should only group handshakes of
+ * the same type. */
+static workqueue_reply_t
+cpuworker_onion_handshakes(worker_state_t *state, cpuworker_job_t **jobs,
+                           int n_jobs)
+{
+  /* variables for onion processing */
+  server_onion_keys_t *onion_keys = state->onion_keys;
+  cpuworker_request_t *reqs = tor_calloc(n_jobs, sizeof(cpuworker_request_t));
+  cpuworker_reply_t *rpls = tor_calloc(n_jobs, sizeof(cpuworker_reply_t));
+  onion_server_handshake_t *hs =
+    tor_calloc(n_jobs, sizeof(onion_server_handshake_t));
+  workqueue_reply_t result = WQ_RPL_REPLY;
   struct timeval tv_start = {0,0}, tv_end;
-  int n;
-  rpl.timed = req.timed;
-  rpl.started_at = req.started_at;
-  rpl.handshake_type = cc->handshake_type;
-  if (req.timed)
-    tor_gettimeofday(&tv_start);
-  n = onion_skin_server_handshake(cc->handshake_type,
-                                  cc->onionskin, cc->handshake_len,
-                                  onion_keys,
-                                  cell_out->reply,
-                                  rpl.keys, CPATH_KEY_MATERIAL_LEN,
-                                  rpl.rend_auth_material);
-  if (n < 0) {
-    /* failure */
-    log_debug(LD_OR,"onion_skin_server_handshake failed.");
-    memset(&rpl, 0, sizeof(rpl));
-    rpl.success = 0;
-  } else {
-    /* success */
-    log_debug(LD_OR,"onion_skin_server_handshake succeeded.");
-    cell_out->handshake_len = n;
-    switch (cc->cell_type) {
-    case CELL_CREATE:
-      cell_out->cell_type = CELL_CREATED; break;
-    case CELL_CREATE2:
-      cell_out->cell_type = CELL_CREATED2; break;
-    case CELL_CREATE_FAST:
-      cell_out->cell_type = CELL_CREATED_FAST; break;
-    default:
-      tor_assert(0);
-      return WQ_RPL_SHUTDOWN;
-    }
-    rpl.success = 1;
+  int64_t usec = 0;
+  int i, timed = 0;
+
+  for (i = 0; i < n_jobs; ++i) {
+    const create_cell_t *cc = &reqs[i].create_cell;
+    created_cell_t *cell_out = &rpls[i].created_cell;
+
+    memcpy(&reqs[i], &jobs[i]->u.request, sizeof(cpuworker_request_t));
+    tor_assert(reqs[i].magic == CPUWORKER_REQUEST_MAGIC);
+
+    rpls[i].timed = reqs[i].timed;
+    rpls[i].started_at = reqs[i].started_at;
+    rpls[i].handshake_type = cc->handshake_type;
+    timed |= reqs[i].timed;
+
+    hs[i].type = cc->handshake_type;
+    hs[i].onion_skin = cc->onionskin;
+    hs[i].onionskin_len = cc->handshake_len;
+    hs[i].reply_out = cell_out->reply;
+    hs[i].keys_out = rpls[i].keys;
+    hs[i].rend_nonce_out = rpls[i].rend_auth_material;
   }
-  rpl.magic = CPUWORKER_REPLY_MAGIC;
-  if (req.timed) {
+
+  if (timed)
+    tor_gettimeofday(&tv_start);
+  onion_skin_server_handshake_batch(hs, n_jobs, onion_keys,
+                                    CPATH_KEY_MATERIAL_LEN);
+  if (timed) {
     struct timeval tv_diff;
-    int64_t usec;
     tor_gettimeofday(&tv_end);
     timersub(&tv_end, &tv_start, &tv_diff);
     usec = ((int64_t)tv_diff.tv_sec)*1000000 + tv_diff.tv_usec;
-    if (usec < 0 || usec > MAX_BELIEVABLE_ONIONSKIN_DELAY)
-      rpl.n_usec = MAX_BELIEVABLE_ONIONSKIN_DELAY;
-    else
-      rpl.n_usec = (uint32_t) usec;
+    usec /= n_jobs;
   }
 
-  memcpy(&job->u.reply, &rpl, sizeof(rpl));
+  for (i = 0; i < n_jobs; ++i) {
+    const create_cell_t *cc = &reqs[i].create_cell;
+    cpuworker_reply_t *rpl = &rpls[i];
+    created_cell_t *cell_out = &rpl->created_cell;
+
+    if (hs[i].result < 0) {
+      /* failure */
+      log_debug(LD_OR,"onion_skin_server_handshake failed.");
+      memset(rpl, 0, sizeof(*rpl));
+      rpl->success = 0;
+    } else {
+      /* success */
+      log_debug(LD_OR,"onion_skin_server_handshake succeeded.");
+      cell_out->handshake_len = hs[i].result;
+      switch (cc->cell_type) {
+      case CELL_CREATE:
+        cell_out->cell_type = CELL_CREATED; break;
+      case CELL_CREATE2:
+        cell_out->cell_type = CELL_CREATED2; break;
+      case CELL_CREATE_FAST:
+        cell_out->cell_type = CELL_CREATED_FAST; break;
+      default:
+        tor_assert(0);
+        result = WQ_RPL_SHUTDOWN;
+        goto done;
+      }
+      rpl->success = 1;
+    }
+    rpl->magic = CPUWORKER_REPLY_MAGIC;
+    if (reqs[i].timed) {
+      if (usec < 0 || usec > MAX_BELIEVABLE_ONIONSKIN_DELAY)
+        rpl->n_usec = MAX_BELIEVABLE_ONIONSKIN_DELAY;
+      else
+        rpl->n_usec = (uint32_t) usec;
+    }
 
-  memwipe(&req, 0, sizeof(req));
-  memwipe(&rpl, 0, sizeof(req));
+    memcpy(&jobs[i]->u.reply, rpl, sizeof(cpuworker_reply_t));
+  }
+
+ done:
+  memwipe(reqs, 0, n_jobs * sizeof(cpuworker_request_t));
+  memwipe(rpls, 0, n_jobs * sizeof(cpuworker_reply_t));
+  tor_free(reqs);
+  tor_free(rpls);
+  tor_free(hs);
+  return result;
+}
+
+/** Implementation function for onion handshake requests: answer every
+ * onionskin in the batch, so that they all go back in a single reply.
+ *
+ * We answer the ntor onionskins all together, so that they can share
+ * vector lanes for their curve25519 operations, and the rest one at a
+ * time. */
+static workqueue_reply_t
+cpuworker_onion_handshake_threadfn(void *state_, void *work_)
+{
+  worker_state_t *state = state_;
+  cpuworker_batch_t *batch = work_;
+  cpuworker_job_t *ntor_jobs[CPUWORKER_MAX_BATCH];
+  int i, n_ntor = 0;
+
+  for (i = 0; i < batch->n_jobs; ++i) {
+    cpuworker_job_t *job = batch->jobs[i];
+    if (job->u.request.create_cell.handshake_type ==
+        ONION_HANDSHAKE_TYPE_NTOR) {
+      ntor_jobs[n_ntor++] = job;
+    } else if (cpuworker_onion_handshakes(state, &job, 1) != WQ_RPL_REPLY) {
+      return WQ_RPL_SHUTDOWN;
+    }
+  }
+  if (n_ntor &&
+      cpuworker_onion_handshakes(state, ntor_jobs, n_ntor) != WQ_RPL_REPLY)
+    return WQ_RPL_SHUTDOWN;
   return WQ_RPL_REPLY;
 }
 
-/** Take pending tasks from the queue and assign them to cpuworkers. */
+/** Return the number of onionskins to put in the next cpuworker job, when
+ * <b>n_queued</b> onionskins are waiting and we have <b>n_threads</b> worker
+ * threads.
+ *
+ * While the queue is short, we hand out onionskins one at a time, to keep
+ * latency low.  As it grows, we give each thread bigger jobs, so that every
+ * reply (and every wakeup of the main thread) answers more of them; but we
+ * keep at least two jobs per thread, so that none of them sits idle while
+ * the others finish. */
+STATIC int
+cpuworker_get_batch_size(int n_queued, int n_threads)
+{
+  int n;
+  if (n_threads < 1)
+    n_threads = 1;
+  n = n_queued / (2 * n_threads);
+  return CLAMP(1, n, CPUWORKER_MAX_BATCH);
+}
+
+/** Forget about every job in <b>batch</b>, which we couldn't hand to the
+ * cpuworkers, and free it. */
+static void
+cpuworker_batch_drop(cpuworker_batch_t *batch)
+{
+  int i;
+  for (i = 0; i < batch->n_jobs; ++i) {
+    cpuworker_job_t *job = batch->jobs[i];
+    job->circ->workqueue_entry = NULL;
+    tor_assert(total_pending_tasks > 0);
+    --total_pending_tasks;
+    memwipe(job, 0xe0, sizeof(*job));
+    tor_free(job);
+  }
+  tor_free(batch);
+}
+
+/** Hand <b>batch</b> to the cpuworkers, and remember its queue entry on the
+ * circuit of every job in it.  Its jobs must already be counted in
+ * total_pending_tasks.  Return 0 on success; on failure, drop the batch and
+ * return -1. */
+static int
+cpuworker_queue_batch(cpuworker_batch_t *batch)
+{
+  workqueue_entry_t *queue_entry;
+  int i;
+
+  tor_assert(batch->n_jobs > 0);
+
+  queue_entry = threadpool_queue_work_priority(threadpool,
+                                      WQ_PRI_HIGH,
+                                      cpuworker_onion_handshake_threadfn,
+                                      cpuworker_onion_handshake_replyfn,
+                                      batch);
+  if (!queue_entry) {
+    log_warn(LD_BUG, "Couldn't queue work on threadpool");
+    cpuworker_batch_drop(batch);
+    return -1;
+  }
+
+  log_debug(LD_OR, "Queued batch %p of %d tasks (qe=%p)",
+            batch, batch->n_jobs, queue_entry);
+
+  for (i = 0; i < batch->n_jobs; ++i)
+    batch->jobs[i]->circ->workqueue_entry = queue_entry;
+
+  return 0;
+}
+
+/** Build a cpuworker job to perform the onion handshake in <b>onionskin</b>
+ * for <b>circ</b>, and count it as pending.  Always takes ownership of
+ * <b>onionskin</b>.  Return NULL if the circuit has lost its channel. */
+static cpuworker_job_t *
+cpuworker_job_new(or_circuit_t *circ, create_cell_t *onionskin)
+{
+  cpuworker_job_t *job;
+  cpuworker_request_t req;
+  int should_time;
+
+  if (!circ->p_chan) {
+    log_info(LD_OR,"circ->p_chan gone. Failing circ.");
+    tor_free(onionskin);
+    return NULL;
+  }
+
+  if (!channel_is_client(circ->p_chan))
+    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
+
+  should_time = should_time_request(onionskin->handshake_type);
+  memset(&req, 0, sizeof(req));
+  req.magic = CPUWORKER_REQUEST_MAGIC;
+  req.timed = should_time;
+
+  memcpy(&req.create_cell, onionskin, sizeof(create_cell_t));
+
+  tor_free(onionskin);
+
+  if (should_time)
+    tor_gettimeofday(&req.started_at);
+
+  job = tor_malloc_zero(sizeof(cpuworker_job_t));
+  job->circ = circ;
+  memcpy(&job->u.request, &req, sizeof(req));
+  memwipe(&req, 0, sizeof(req));
+
+  ++total_pending_tasks;
+  return job;
+}
+
+/** Take pending tasks from the queue and assign them to cpuworkers, in
+ * batches sized by cpuworker_get_batch_size(). */
 static void
 queue_pending_tasks(void)
 {
   or_circuit_t *circ;
   create_cell_t *onionskin = NULL;
+  cpuworker_batch_t *batch;
+  cpuworker_job_t *job;
+  int batch_size, n_queued;
 
   while (total_pending_tasks < max_pending_tasks) {
-    circ = onion_next_task(&onionskin);
-
-    if (!circ)
+    n_queued = onion_num_pending(ONION_HANDSHAKE_TYPE_TAP) +
+      onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR);
+    if (!n_queued)
       return;
+    batch_size = cpuworker_get_batch_size(n_queued, n_cpuworker_threads);
+    if (total_pending_tasks + batch_size > max_pending_tasks) {
+      /* Wait until enough replies have come back to make room for a whole
+       * batch; the jobs in flight will keep the threads busy meanwhile. */
+      if (total_pending_tasks)
+        return;
+      batch_size = max_pending_tasks;
+    }
+
+    batch = tor_malloc_zero(sizeof(cpuworker_batch_t));
+    while (batch->n_jobs < batch_size) {
+      circ = onion_next_task(&onionskin);
+      if (!circ)
+        break;
+      job = cpuworker_job_new(circ, onionskin);
+      if (!job) {
+        log_info(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+        continue;
+      }
+      batch->jobs[batch->n_jobs++] = job;
+    }
 
-    if (assign_onionskin_to_cpuworker(circ, onionskin) < 0)
-      log_info(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+    if (batch->n_jobs)
+      cpuworker_queue_batch(batch);
+    else
+      tor_free(batch);
   }
 }
 
@@ -504,6 +784,150 @@ cpuworker_queue_work,(workqueue_priority_t priority,
                                         arg);
 }
 
+/** Return the number of threads in our threadpool, or 0 if we don't have
+ * one. */
+MOCK_IMPL(int,
+cpuworker_get_n_threads,(void))
+{
+  return threadpool ? n_cpuworker_threads : 0;
+}
+
+/** State shared by all the jobs in one call to cpuworker_run_parallel(). */
+typedef struct parallel_jobs_t {
+  /** Protects n_unfinished. */
+  tor_mutex_t lock;
+  /** Signalled when n_unfinished drops to zero. */
+  tor_cond_t cond;
+  /** How many of our queued jobs haven't been cancelled or finished? */
+  int n_unfinished;
+  /** How many queued jobs still point to this object, plus one while
+   * cpuworker_run_parallel() is running.  Only used from the main thread. */
+  int refcnt;
+} parallel_jobs_t;
+
+/** One job queued by cpuworker_run_parallel(). */
+typedef struct parallel_job_t {
+  parallel_jobs_t *jobs;
+  void (*fn)(void *);
+  void *arg;
+} parallel_job_t;
+
+/** Drop a reference to <b>jobs</b>, and free it if that was the last. */
+static void
+parallel_jobs_decref(parallel_jobs_t *jobs)
+{
+  if (--jobs->refcnt > 0)
+    return;
+  tor_cond_uninit(&jobs->cond);
+  tor_mutex_uninit(&jobs->lock);
+  tor_free(jobs);
+}
+
+/** Worker function: run one job for cpuworker_run_parallel(), and tell the
+ * main thread when the last one is done. */
+static workqueue_reply_t
+parallel_job_threadfn(void *state_, void *work_)
+{
+  parallel_job_t *job = work_;
+  parallel_jobs_t *jobs = job->jobs;
+  (void)state_;
+
+  job->fn(job->arg);
+
+  tor_mutex_acquire(&jobs->lock);
+  if (--jobs->n_unfinished == 0)
+    tor_cond_signal_one(&jobs->cond);
+  tor_mutex_release(&jobs->lock);
+  return WQ_RPL_REPLY;
+}
+
+/** Reply function: free a job that a worker ran for
+ * cpuworker_run_parallel().  This usually happens after that function has
+ * returned. */
+static void
+parallel_job_replyfn(void *work_)
+{
+  parallel_job_t *job = work_;
+  parallel_jobs_decref(job->jobs);
+  tor_free(job);
+}
+
+/** Call <b>fn</b> on each of the <b>n</b> elements of <b>args</b>, in no
+ * particular order, and return once all the calls are done.  The main
+ * thread takes the first call, and our worker threads take as many of the
+ * others as they can get to; whatever is still queued once the main thread
+ * is done, it runs itself.  Without a threadpool, just make the calls one
+ * after another.
+ *
+ * <b>fn</b> must be safe to run from any thread, and concurrently with the
+ * other calls. */
+MOCK_IMPL(void,
+cpuworker_run_parallel,(void (*fn)(void *), void **args, int n))
+{
+  parallel_jobs_t *jobs;
+  workqueue_entry_t **entries;
+  int i;
+
+  if (!threadpool || n < 2) {
+    for (i = 0; i < n; ++i)
+      fn(args[i]);
+    return;
+  }
+
+  jobs = tor_malloc_zero(sizeof(parallel_jobs_t));
+  tor_mutex_init_for_cond(&jobs->lock);
+  tor_cond_init(&jobs->cond);
+  jobs->refcnt = 1;
+  entries = tor_calloc(n, sizeof(workqueue_entry_t *));
+
+  for (i = 1; i < n; ++i) {
+    parallel_job_t *job = tor_malloc_zero(sizeof(parallel_job_t));
+    job->jobs = jobs;
+    job->fn = fn;
+    job->arg = args[i];
+    tor_mutex_acquire(&jobs->lock);
+    ++jobs->n_unfinished;
+    tor_mutex_release(&jobs->lock);
+    entries[i] = threadpool_queue_work_priority(threadpool, WQ_PRI_HIGH,
+                                                parallel_job_threadfn,
+                                                parallel_job_replyfn,
+                                                job);
+    if (entries[i]) {
+      ++jobs->refcnt;
+    } else {
+      tor_mutex_acquire(&jobs->lock);
+      --jobs->n_unfinished;
+      tor_mutex_release(&jobs->lock);
+      tor_free(job);
+      fn(args[i]);
+    }
+  }
+
+  fn(args[0]);
+
+  /* Take back whatever the workers haven't started, newest first, since
+   * those are the least likely to be picked up soon. */
+  for (i = n - 1; i >= 1; --i) {
+    parallel_job_t *job;
+    if (!entries[i] || !(job = workqueue_entry_cancel(entries[i])))
+      continue;
+    fn(job->arg);
+    tor_free(job);
+    --jobs->refcnt;
+    tor_mutex_acquire(&jobs->lock);
+    --jobs->n_unfinished;
+    tor_mutex_release(&jobs->lock);
+  }
+
+  tor_mutex_acquire(&jobs->lock);
+  while (jobs->n_unfinished > 0)
+    tor_cond_wait(&jobs->cond, &jobs->lock, NULL);
+  tor_mutex_release(&jobs->lock);
+
+  tor_free(entries);
+  parallel_jobs_decref(jobs);
+}
+
 /** Try to tell a cpuworker to perform the public key operations necessary to
  * respond to <b>onionskin</b> for the circuit <b>circ</b>.
  *
@@ -513,10 +937,8 @@ int
 assign_onionskin_to_cpuworker(or_circuit_t *circ,
                               create_cell_t *onionskin)
 {
-  workqueue_entry_t *queue_entry;
+  cpuworker_batch_t *batch;
   cpuworker_job_t *job;
-  cpuworker_request_t req;
-  int should_time;
 
   tor_assert(threadpool);
 
@@ -535,44 +957,13 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
     return 0;
   }
 
-  if (!channel_is_client(circ->p_chan))
-    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
-
-  should_time = should_time_request(onionskin->handshake_type);
-  memset(&req, 0, sizeof(req));
-  req.magic = CPUWORKER_REQUEST_MAGIC;
-  req.timed = should_time;
-
-  memcpy(&req.create_cell, onionskin, sizeof(create_cell_t));
-
-  tor_free(onionskin);
-
-  if (should_time)
-    tor_gettimeofday(&req.started_at);
-
-  job = tor_malloc_zero(sizeof(cpuworker_job_t));
-  job->circ = circ;
-  memcpy(&job->u.request, &req, sizeof(req));
-  memwipe(&req, 0, sizeof(req));
-
-  ++total_pending_tasks;
-  queue_entry = threadpool_queue_work_priority(threadpool,
-                                      WQ_PRI_HIGH,
-                                      cpuworker_onion_handshake_threadfn,
-                                      cpuworker_onion_handshake_replyfn,
-                                      job);
-  if (!queue_entry) {
-    log_warn(LD_BUG, "Couldn't queue work on threadpool");
-    tor_free(job);
+  job = cpuworker_job_new(circ, onionskin);
+  if (!job)
     return -1;
-  }
-
-  log_debug(LD_OR, "Queued task %p (qe=%p, circ=%p)",
-            job, queue_entry, job->circ);
-
-  circ->workqueue_entry = queue_entry;
 
-  return 0;
+  batch = tor_malloc_zero(sizeof(cpuworker_batch_t));
+  batch->jobs[batch->n_jobs++] = job;
+  return cpuworker_queue_batch(batch);
 }
 
 /** If <b>circ</b> has a pending handshake that hasn't been processed yet,
@@ -580,18 +971,32 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
 void
 cpuworker_cancel_circ_handshake(or_circuit_t *circ)
 {
-  cpuworker_job_t *job;
+  cpuworker_batch_t *batch;
+  int i, n_kept = 0;
   if (circ->workqueue_entry == NULL)
     return;
 
-  job = workqueue_entry_cancel(circ->workqueue_entry);
-  if (job) {
-    /* It successfully cancelled. */
-    memwipe(job, 0xe0, sizeof(*job));
-    tor_free(job);
-    tor_assert(total_pending_tasks > 0);
-    --total_pending_tasks;
-    /* if (!job), this is done in cpuworker_onion_handshake_replyfn. */
+  batch = workqueue_entry_cancel(circ->workqueue_entry);
+  if (batch) {
+    /* It successfully cancelled.  Free this circuit's job, and queue the
+     * rest of its batch again. */
+    for (i = 0; i < batch->n_jobs; ++i) {
+      cpuworker_job_t *job = batch->jobs[i];
+      if (job->circ == circ) {
+        memwipe(job, 0xe0, sizeof(*job));
+        tor_free(job);
+        tor_assert(total_pending_tasks > 0);
+        --total_pending_tasks;
+      } else {
+        batch->jobs[n_kept++] = job;
+      }
+    }
+    batch->n_jobs = n_kept;
+    /* if (!batch), this is done in cpuworker_onion_handshake_replyfn. */
     circ->workqueue_entry = NULL;
+    if (n_kept)
+      cpuworker_queue_batch(batch);
+    else
+      tor_free(batch);
   }
 }
@@ -22,6 +22,9 @@ MOCK_DECL(struct workqueue_entry_t *, cpuworker_queue_work, (
                     enum workqueue_reply_t (*fn)(void *, void *),
                     void (*reply_fn)(void *),
                     void *arg));
+MOCK_DECL(int, cpuworker_get_n_threads, (void));
+MOCK_DECL(void, cpuworker_run_parallel, (void (*fn)(void *), void **args,
+                                         int n));
 
 struct create_cell_t;
 int assign_onionskin_to_cpuworker(or_circuit_t *circ,
@@ -31,7 +34,15 @@ uint64_t estimated_usec_for_onionskins(uint32_t n_requests,
                                        uint16_t onionskin_type);
 void cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
                                       const char *onionskin_type_name);
+void cpuworker_log_onionskin_batching(int severity);
 void cpuworker_cancel_circ_handshake(or_circuit_t *circ);
 
+/** Largest number of onionskins that we put in a single cpuworker job. */
+#define CPUWORKER_MAX_BATCH 16
+
+#ifdef CPUWORKER_PRIVATE
+STATIC int cpuworker_get_batch_size(int n_queued, int n_threads);
+#endif
+
 #endif /* !defined(TOR_CPUWORKER_H) */
 
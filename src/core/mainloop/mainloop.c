@@ -57,6 +57,7 @@
 #include "core/mainloop/mainloop.h"
 #include "core/mainloop/netstatus.h"
 #include "core/mainloop/periodic.h"
+#include "core/or/cell_queue.h"
 #include "core/or/channel.h"
 #include "core/or/channelpadding.h"
 #include "core/or/channeltls.h"
@@ -66,6 +67,7 @@
 #include "core/or/connection_edge.h"
 #include "core/or/connection_or.h"
 #include "core/or/dos.h"
+#include "core/or/relay.h"
 #include "core/or/status.h"
 #include "feature/client/addressmap.h"
 #include "feature/client/bridges.h"
@@ -102,6 +104,8 @@
 #include "lib/tls/buffers_tls.h"
 
 #include "lib/net/buffers_net.h"
+#include "lib/net/buffers_uring.h"
+#include "lib/tls/tls_dataplane.h"
 #include "lib/evloop/compat_libevent.h"
 
 #include <event2/event.h>
@@ -202,9 +206,24 @@ static void connection_start_reading_from_linked_conn(connection_t *conn);
 static int connection_should_read_from_linked_conn(connection_t *conn);
 static void conn_read_callback(evutil_socket_t fd, short event, void *_conn);
 static void conn_write_callback(evutil_socket_t fd, short event, void *_conn);
+static void conn_forget_batched_events(connection_t *conn);
 static void shutdown_did_not_work_callback(evutil_socket_t fd, short event,
                                            void *arg) ATTR_NORETURN;
 
+/** How many submissions does our io_uring instance take at a time? */
+#define MAINLOOP_URING_ENTRIES 1024
+
+/** Connections whose read events are waiting for the next batch of socket
+ * I/O.  An entry is NULL if its connection was freed before the batch
+ * ran. */
+static smartlist_t *batch_read_pending_lst = NULL;
+/** Connections whose write events are waiting for the next batch of socket
+ * I/O.  An entry is NULL if its connection was freed before the batch
+ * ran. */
+static smartlist_t *batch_write_pending_lst = NULL;
+/** Event that runs io_batch_cb(). */
+static mainloop_event_t *io_batch_ev = NULL;
+
 /****************************************************************************
  *
  * This section contains accessors and other methods on the connection_array
@@ -353,6 +372,8 @@ connection_unlink(connection_t *conn)
   }
   smartlist_remove(closeable_connection_lst, conn);
   smartlist_remove(active_linked_connection_lst, conn);
+  if (batch_read_pending_lst)
+    conn_forget_batched_events(conn);
   if (conn->type == CONN_TYPE_EXIT) {
     assert_connection_edge_not_dns_pending(TO_EDGE_CONN(conn));
   }
@@ -866,6 +887,136 @@ connection_count_moribund, (void))
   return moribund;
 }
 
+static void conn_handle_read_event(connection_t *conn);
+static void conn_handle_write_event(connection_t *conn);
+
+/**
+ * Callback: make all the socket reads and writes that the connections on
+ * batch_read_pending_lst and batch_write_pending_lst are waiting for, at
+ * once, and then handle their events as Libevent would have done.  The
+ * data-plane threads handle TLS connections while io_uring handles the
+ * rest.
+ *
+ * This runs as a postloop event, after every socket event from this pass
+ * through the loop has been collected.
+ */
+static void
+io_batch_cb(mainloop_event_t *event, void *arg)
+{
+  (void)event;
+  (void)arg;
+
+  SMARTLIST_FOREACH(batch_read_pending_lst, connection_t *, conn,
+    if (conn && connection_can_batch_io(conn))
+      connection_prepare_batched_read(conn));
+  SMARTLIST_FOREACH(batch_write_pending_lst, connection_t *, conn,
+    if (conn && connection_can_batch_io(conn))
+      connection_prepare_batched_write(conn));
+
+  tls_dataplane_start();
+  buf_uring_submit();
+  tls_dataplane_finish();
+
+  /* Handling one connection's event can free another connection; when that
+   * happens, connection_unlink() clears its entry in these lists. */
+  SMARTLIST_FOREACH_BEGIN(batch_read_pending_lst, connection_t *, conn) {
+    if (!conn)
+      continue;
+    conn->batch_read_pending = 0;
+    conn_handle_read_event(conn);
+  } SMARTLIST_FOREACH_END(conn);
+  SMARTLIST_FOREACH_BEGIN(batch_write_pending_lst, connection_t *, conn) {
+    if (!conn)
+      continue;
+    conn->batch_write_pending = 0;
+    conn_handle_write_event(conn);
+  } SMARTLIST_FOREACH_END(conn);
+
+  smartlist_clear(batch_read_pending_lst);
+  smartlist_clear(batch_write_pending_lst);
+  tls_dataplane_clear_results();
+  buf_uring_clear_results();
+}
+
+/** Set up the lists and the event that we use to batch socket I/O, if we
+ * haven't already. */
+static void
+io_batch_setup(void)
+{
+  if (!batch_read_pending_lst) {
+    batch_read_pending_lst = smartlist_new();
+    batch_write_pending_lst = smartlist_new();
+    io_batch_ev = mainloop_event_postloop_new(io_batch_cb, NULL);
+  }
+}
+
+/** Start batching socket reads and writes through io_uring.  Return 0 on
+ * success, or -1 if we can't. */
+int
+mainloop_batch_io_init(void)
+{
+  if (buf_uring_init(MAINLOOP_URING_ENTRIES) < 0)
+    return -1;
+  io_batch_setup();
+  log_notice(LD_NET, "Batching socket I/O on non-TLS connections with "
+             "io_uring.");
+  return 0;
+}
+
+/** Start running TLS reads and writes for open OR connections on
+ * <b>n_threads</b> data-plane threads.  Return 0 on success, or -1 if we
+ * can't. */
+int
+mainloop_dataplane_init(int n_threads)
+{
+  if (tls_dataplane_init(n_threads) < 0)
+    return -1;
+  io_batch_setup();
+  log_notice(LD_NET, "Running TLS for open OR connections on %d data-plane "
+             "thread%s.", n_threads, n_threads == 1 ? "" : "s");
+  return 0;
+}
+
+/** If we are batching socket I/O, and <b>conn</b> can take part, add it to
+ * the next batch, as a write if <b>is_write</b> is true and as a read
+ * otherwise, and return true.  Otherwise return false: the caller should
+ * handle the event now. */
+static bool
+conn_defer_event_to_batch(connection_t *conn, bool is_write)
+{
+  if (!io_batch_ev || !connection_can_batch_io(conn))
+    return false;
+
+  if (is_write && !conn->batch_write_pending) {
+    conn->batch_write_pending = 1;
+    smartlist_add(batch_write_pending_lst, conn);
+  } else if (!is_write && !conn->batch_read_pending) {
+    conn->batch_read_pending = 1;
+    smartlist_add(batch_read_pending_lst, conn);
+  }
+  mainloop_event_activate(io_batch_ev);
+  return true;
+}
+
+/** Remove <b>conn</b>, which is about to be freed, from the next batch of
+ * socket I/O, and drop any results for its buffers from the current one. */
+static void
+conn_forget_batched_events(connection_t *conn)
+{
+  int idx;
+  if (conn->batch_read_pending &&
+      (idx = smartlist_pos(batch_read_pending_lst, conn)) >= 0)
+    smartlist_set(batch_read_pending_lst, idx, NULL);
+  if (conn->batch_write_pending &&
+      (idx = smartlist_pos(batch_write_pending_lst, conn)) >= 0)
+    smartlist_set(batch_write_pending_lst, idx, NULL);
+  conn->batch_read_pending = conn->batch_write_pending = 0;
+  buf_uring_forget(conn->inbuf);
+  buf_uring_forget(conn->outbuf);
+  tls_dataplane_forget(conn->inbuf);
+  tls_dataplane_forget(conn->outbuf);
+}
+
 /** Libevent callback: this gets invoked when (connection_t*)<b>conn</b> has
  * some data to read. */
 static void
@@ -875,6 +1026,17 @@ conn_read_callback(evutil_socket_t fd, short event, void *_conn)
   (void)fd;
   (void)event;
 
+  if (conn_defer_event_to_batch(conn, false))
+    return;
+
+  conn_handle_read_event(conn);
+}
+
+/** Handle a read event on <b>conn</b>, either from Libevent or from a
+ * batch of socket I/O. */
+static void
+conn_handle_read_event(connection_t *conn)
+{
   log_debug(LD_NET,"socket %d wants to read.",(int)conn->s);
 
   /* assert_connection_ok(conn, time(NULL)); */
@@ -917,6 +1079,17 @@ conn_write_callback(evutil_socket_t fd, short events, void *_conn)
   (void)fd;
   (void)events;
 
+  if (conn_defer_event_to_batch(conn, true))
+    return;
+
+  conn_handle_write_event(conn);
+}
+
+/** Handle a write event on <b>conn</b>, either from Libevent or from a
+ * batch of socket I/O. */
+static void
+conn_handle_write_event(connection_t *conn)
+{
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "socket %d wants to write.",
                      (int)conn->s));
 
@@ -2016,6 +2189,10 @@ clean_caches_callback(time_t now, const or_options_t *options)
   hs_cache_clean_as_client(now);
   hs_cache_clean_as_dir(now);
   microdesc_cache_rebuild(NULL, 0);
+  /* Give back the rings of cell queues that grew for a burst and have been
+   * empty since. */
+#define CELL_QUEUE_IDLE_SHRINK_MSEC (10*60*1000)
+  cell_queues_shrink_idle(CELL_QUEUE_IDLE_SHRINK_MSEC);
 #define CLEAN_CACHES_INTERVAL (30*60)
   return CLEAN_CACHES_INTERVAL;
 }
@@ -2549,6 +2726,11 @@ tor_mainloop_free_all(void)
   mainloop_event_free(handle_deferred_signewnym_ev);
   mainloop_event_free(scheduled_shutdown_ev);
   mainloop_event_free(rescan_periodic_events_ev);
+  mainloop_event_free(io_batch_ev);
+  smartlist_free(batch_read_pending_lst);
+  smartlist_free(batch_write_pending_lst);
+  buf_uring_free_all();
+  tls_dataplane_free_all();
 
 #ifdef HAVE_SYSTEMD_209
   periodic_timer_free(systemd_watchdog_timer);
@@ -62,6 +62,8 @@ void reset_all_main_loop_timers(void);
 void reschedule_directory_downloads(void);
 void reschedule_or_state_save(void);
 void mainloop_schedule_postloop_cleanup(void);
+int mainloop_batch_io_init(void);
+int mainloop_dataplane_init(int n_threads);
 void rescan_periodic_events(const or_options_t *options);
 MOCK_DECL(void, schedule_rescan_periodic_events,(void));
 
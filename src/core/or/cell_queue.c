@@ -0,0 +1,169 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file cell_queue.c
+ * \brief FIFO queues of packed cells waiting to be flushed to a channel.
+ *
+ * Each circuit has a cell queue for each direction.  A queue is a ring of
+ * pointers to packed_cell_t objects (which come from the cell pool), that
+ * doubles in size whenever it fills up.  A queue keeps its grown ring when
+ * it drains, since busy circuits drain and refill all the time; the ring is
+ * given back by cell_queues_shrink_idle() once the queue has been empty for
+ * a while, or right away when we are low on memory.
+ **/
+
+#include "core/or/or.h"
+#include "core/or/cell_queue.h"
+#include "core/or/cellpool.h"
+#include "core/or/circuitlist.h"
+#include "lib/time/compat_time.h"
+
+#include "core/or/cell_queue_st.h"
+#include "core/or/circuit_st.h"
+#include "core/or/or_circuit_st.h"
+
+/** Return the index in <b>queue</b>'s ring of the <b>idx</b>th oldest cell. */
+static inline int
+cell_queue_slot(const cell_queue_t *queue, int idx)
+{
+  return (queue->head + idx) & (queue->capacity - 1);
+}
+
+/** Release the storage for <b>queue</b>'s ring, which must be empty. */
+static void
+cell_queue_release_ring(cell_queue_t *queue)
+{
+  tor_assert(queue->n == 0);
+  tor_free(queue->cells);
+  queue->capacity = 0;
+  queue->head = 0;
+}
+
+/** Double the number of slots in <b>queue</b>'s ring, moving its cells so
+ * that the oldest one is in slot 0. */
+static void
+cell_queue_grow(cell_queue_t *queue)
+{
+  int new_capacity = queue->capacity ? queue->capacity * 2
+                                     : CELL_QUEUE_MIN_CAPACITY;
+  packed_cell_t **cells;
+  int i;
+
+  tor_assert(new_capacity > queue->capacity);
+  cells = tor_calloc(new_capacity, sizeof(packed_cell_t *));
+  for (i = 0; i < queue->n; ++i) {
+    cells[i] = queue->cells[cell_queue_slot(queue, i)];
+  }
+  tor_free(queue->cells);
+  queue->cells = cells;
+  queue->capacity = new_capacity;
+  queue->head = 0;
+}
+
+/** Append <b>cell</b> to the end of <b>queue</b>. */
+void
+cell_queue_append(cell_queue_t *queue, packed_cell_t *cell)
+{
+  if (PREDICT_UNLIKELY(queue->n == queue->capacity))
+    cell_queue_grow(queue);
+  queue->cells[cell_queue_slot(queue, queue->n)] = cell;
+  ++queue->n;
+}
+
+/** Return the cell at the head of <b>queue</b> without removing it, or NULL
+ * if <b>queue</b> is empty. */
+const packed_cell_t *
+cell_queue_peek(const cell_queue_t *queue)
+{
+  if (queue->n == 0)
+    return NULL;
+  return queue->cells[queue->head];
+}
+
+/** Initialize <b>queue</b> as an empty cell queue. */
+void
+cell_queue_init(cell_queue_t *queue)
+{
+  memset(queue, 0, sizeof(cell_queue_t));
+}
+
+/** Remove and free every cell in <b>queue</b>, and release the storage for
+ * its ring. */
+void
+cell_queue_clear(cell_queue_t *queue)
+{
+  int i;
+  for (i = 0; i < queue->n; ++i) {
+    cell_pool_release(queue->cells[cell_queue_slot(queue, i)]);
+  }
+  queue->n = 0;
+  cell_queue_release_ring(queue);
+}
+
+/** Extract and return the cell at the head of <b>queue</b>; return NULL if
+ * <b>queue</b> is empty. */
+packed_cell_t *
+cell_queue_pop(cell_queue_t *queue)
+{
+  packed_cell_t *cell;
+  if (queue->n == 0)
+    return NULL;
+  cell = queue->cells[queue->head];
+  queue->head = cell_queue_slot(queue, 1);
+  if (--queue->n == 0) {
+    /* Keep the ring at whatever size the last burst needed: busy circuits
+     * drain and refill all the time.  cell_queues_shrink_idle() gives back
+     * the large ones that stay empty. */
+    queue->head = 0;
+    queue->drained_timestamp = monotime_coarse_get_stamp();
+  }
+  return cell;
+}
+
+/** If <b>queue</b> is empty, and an earlier burst made its ring grow past
+ * CELL_QUEUE_MIN_CAPACITY slots, release the ring.  Return the number of
+ * bytes freed. */
+size_t
+cell_queue_shrink(cell_queue_t *queue)
+{
+  size_t freed;
+  if (queue->n != 0 || queue->capacity <= CELL_QUEUE_MIN_CAPACITY)
+    return 0;
+  freed = queue->capacity * sizeof(packed_cell_t *);
+  cell_queue_release_ring(queue);
+  return freed;
+}
+
+/** Helper for cell_queues_shrink_idle(): shrink <b>queue</b> if it has been
+ * empty for at least <b>min_idle_msec</b> msec as of <b>now</b>. */
+static size_t
+cell_queue_shrink_if_idle(cell_queue_t *queue, uint32_t now,
+                          uint32_t min_idle_msec)
+{
+  if (queue->n != 0 || queue->capacity <= CELL_QUEUE_MIN_CAPACITY)
+    return 0;
+  if (monotime_coarse_stamp_units_to_approx_msec(
+                            now - queue->drained_timestamp) < min_idle_msec)
+    return 0;
+  return cell_queue_shrink(queue);
+}
+
+/** Release the grown rings of every circuit cell queue that has been empty
+ * for at least <b>min_idle_msec</b> msec.  Return the number of bytes
+ * freed. */
+size_t
+cell_queues_shrink_idle(uint32_t min_idle_msec)
+{
+  const uint32_t now = monotime_coarse_get_stamp();
+  size_t freed = 0;
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
+    freed += cell_queue_shrink_if_idle(&circ->n_chan_cells, now,
+                                       min_idle_msec);
+    if (! CIRCUIT_IS_ORIGIN(circ)) {
+      freed += cell_queue_shrink_if_idle(&TO_OR_CIRCUIT(circ)->p_chan_cells,
+                                         now, min_idle_msec);
+    }
+  } SMARTLIST_FOREACH_END(circ);
+  return freed;
+}
@@ -0,0 +1,24 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file cell_queue.h
+ * \brief Header file for cell_queue.c.
+ **/
+
+#ifndef TOR_CELL_QUEUE_H
+#define TOR_CELL_QUEUE_H
+
+/** Number of slots that we allocate for a cell queue's ring the first time
+ * we put a cell on it.  Must be a power of 2. */
+#define CELL_QUEUE_MIN_CAPACITY 16
+
+void cell_queue_init(cell_queue_t *queue);
+void cell_queue_clear(cell_queue_t *queue);
+void cell_queue_append(cell_queue_t *queue, packed_cell_t *cell);
+const packed_cell_t *cell_queue_peek(const cell_queue_t *queue);
+packed_cell_t *cell_queue_pop(cell_queue_t *queue);
+size_t cell_queue_shrink(cell_queue_t *queue);
+size_t cell_queues_shrink_idle(uint32_t min_idle_msec);
+
+#endif /* !defined(TOR_CELL_QUEUE_H) */
@@ -12,23 +12,28 @@
 #ifndef PACKED_CELL_ST_H
 #define PACKED_CELL_ST_H
 
-#include "tor_queue.h"
-
 /** A cell as packed for writing to the network. */
 struct packed_cell_t {
-  /** Next cell queued on this circuit. */
-  TOR_SIMPLEQ_ENTRY(packed_cell_t) next;
   char body[CELL_MAX_NETWORK_SIZE]; /**< Cell as packed for network. */
   uint32_t inserted_timestamp; /**< Time (in timestamp units) when this cell
                                 * was inserted */
 };
 
 /** A queue of cells on a circuit, waiting to be added to the
- * or_connection_t's outbuf. */
+ * or_connection_t's outbuf.
+ *
+ * The queue is a ring buffer of pointers to packed cells, which grows as
+ * needed: the oldest cell is at <b>cells</b>[<b>head</b>], and the rest
+ * follow it in order, wrapping around at <b>capacity</b>. */
 struct cell_queue_t {
-  /** Linked list of packed_cell_t*/
-  TOR_SIMPLEQ_HEAD(cell_simpleq_t, packed_cell_t) head;
+  /** Storage for the ring, or NULL if we have not allocated any yet. */
+  packed_cell_t **cells;
+  int capacity; /**< Number of slots in <b>cells</b>: 0 or a power of 2. */
+  int head; /**< Index of the oldest cell in <b>cells</b>. */
   int n; /**< The number of cells in the queue. */
+  /** When this queue last became empty, in timestamp units.  We use this to
+   * find grown rings that have been idle long enough to give back. */
+  uint32_t drained_timestamp;
 };
 
 #endif /* !defined(PACKED_CELL_ST_H) */
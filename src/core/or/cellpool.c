@@ -0,0 +1,339 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file cellpool.c
+ * \brief Slab allocator for packed_cell_t objects.
+ *
+ * Every cell that we queue on a circuit lives in a packed_cell_t, and a busy
+ * relay allocates and frees millions of them each second.  Rather than going
+ * to the general-purpose allocator for each of those, we carve cells out of
+ * large slabs, each of which keeps a free-list of its own unused cells.
+ *
+ * Slabs live on one of three lists, depending on how many of their cells are
+ * handed out: "used" slabs (partially allocated) are where new cells come
+ * from, so that we fill existing slabs before touching fresh memory.  The
+ * slab at the head of that list is allowed to be empty, so that a queue
+ * which repeatedly drains and refills doesn't churn through slabs.  "Full"
+ * slabs are out of the way until one of their cells is released; and
+ * "empty" slabs are kept as a small reserve, up to
+ * CELL_POOL_MAX_EMPTY_SLABS, before we give them back to the allocator.
+ *
+ * In front of all that sits a single cached item: the most recently
+ * released cell, which the next allocation gets back without touching any
+ * slab.  A cell that is freed and then replaced right away, which is the
+ * common case on a relay, costs no list or slab bookkeeping at all.  The
+ * cached item still counts as allocated in its slab.
+ *
+ * All cell allocation happens in the main thread, so there is exactly one
+ * pool and it needs no locking.
+ **/
+
+#include "core/or/or.h"
+#include "core/or/cellpool.h"
+#include "core/or/cell_queue_st.h"
+
+typedef struct cell_pool_slab_t cell_pool_slab_t;
+
+/** A single slot in a slab.  While the slot is in use, it holds a
+ * packed_cell_t; while it is free, it holds a link to the next free slot in
+ * its slab. */
+typedef struct cell_pool_item_t {
+  /** The slab that this item was carved from. */
+  cell_pool_slab_t *slab;
+  union {
+    /** If this item is free, the next free item in the same slab. */
+    struct cell_pool_item_t *next_free;
+    /** If this item is allocated, the cell itself. */
+    packed_cell_t cell;
+  } u;
+} cell_pool_item_t;
+
+/** A contiguous run of CELL_POOL_CELLS_PER_SLAB cell slots. */
+struct cell_pool_slab_t {
+  /** Next slab on the same list as this one. */
+  cell_pool_slab_t *next;
+  /** Previous slab on the same list as this one. */
+  cell_pool_slab_t *prev;
+  /** Head of this slab's free-list of released items. */
+  cell_pool_item_t *first_free;
+  /** Number of items in this slab that are currently handed out. */
+  int n_allocated;
+  /** Index of the first item in <b>items</b> that has never been handed
+   * out.  We hand these out in order, so that we don't need to touch every
+   * item in a slab when we allocate it. */
+  int next_never_used;
+  /** The storage for this slab's items. */
+  cell_pool_item_t items[CELL_POOL_CELLS_PER_SLAB];
+};
+
+/** Slabs with some, but not all, of their items handed out. */
+static cell_pool_slab_t *used_slabs = NULL;
+/** Slabs with all of their items handed out. */
+static cell_pool_slab_t *full_slabs = NULL;
+/** Slabs with none of their items handed out. */
+static cell_pool_slab_t *empty_slabs = NULL;
+
+/** Number of slabs on the empty_slabs list. */
+static size_t n_empty_slabs = 0;
+/** Number of slabs we are holding, on any list. */
+static size_t n_slabs = 0;
+/** Largest value that n_slabs has ever had. */
+static size_t n_slabs_max = 0;
+/** Number of cells that we have handed out and not yet had released. */
+static size_t n_cells_allocated = 0;
+/** Largest value that n_cells_allocated has ever had. */
+static size_t n_cells_allocated_max = 0;
+/** The most recently released item, if we are holding on to it for the next
+ * allocation; otherwise NULL.  Its slab still counts it as handed out. */
+static cell_pool_item_t *cached_item = NULL;
+
+/** Add <b>slab</b> to the front of the list at *<b>headp</b>. */
+static inline void
+slab_list_push(cell_pool_slab_t **headp, cell_pool_slab_t *slab)
+{
+  slab->prev = NULL;
+  slab->next = *headp;
+  if (*headp)
+    (*headp)->prev = slab;
+  *headp = slab;
+}
+
+/** Remove <b>slab</b> from the list at *<b>headp</b>. */
+static inline void
+slab_list_remove(cell_pool_slab_t **headp, cell_pool_slab_t *slab)
+{
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    *headp = slab->next;
+  if (slab->next)
+    slab->next->prev = slab->prev;
+  slab->next = slab->prev = NULL;
+}
+
+/** Release all storage held by <b>slab</b>, which must not be on any list. */
+static void
+slab_free(cell_pool_slab_t *slab)
+{
+  --n_slabs;
+  tor_free(slab);
+}
+
+/** Take <b>slab</b>, which has no items handed out, off the used_slabs list,
+ * and either keep it as a spare or free it. */
+static void
+slab_retire_empty(cell_pool_slab_t *slab)
+{
+  tor_assert(slab->n_allocated == 0);
+  slab_list_remove(&used_slabs, slab);
+  if (n_empty_slabs >= CELL_POOL_MAX_EMPTY_SLABS) {
+    slab_free(slab);
+  } else {
+    slab_list_push(&empty_slabs, slab);
+    ++n_empty_slabs;
+  }
+}
+
+/** Make <b>slab</b> the slab that we allocate from next.  The slab it
+ * replaces is retired if it has become empty. */
+static void
+used_slabs_push(cell_pool_slab_t *slab)
+{
+  cell_pool_slab_t *old_head = used_slabs;
+  slab_list_push(&used_slabs, slab);
+  if (old_head && old_head->n_allocated == 0)
+    slab_retire_empty(old_head);
+}
+
+/** Allocate and return a new slab with no items handed out. */
+static cell_pool_slab_t *
+slab_new(void)
+{
+  cell_pool_slab_t *slab = tor_malloc_zero(sizeof(cell_pool_slab_t));
+  if (++n_slabs > n_slabs_max)
+    n_slabs_max = n_slabs;
+  return slab;
+}
+
+/** Helper: take an unused item from the slab that we are allocating from,
+ * finding or making a new slab if we need to. */
+static cell_pool_item_t *
+slab_alloc_item(void)
+{
+  cell_pool_slab_t *slab = used_slabs;
+  cell_pool_item_t *item;
+
+  if (PREDICT_UNLIKELY(!slab)) {
+    if (empty_slabs) {
+      slab = empty_slabs;
+      slab_list_remove(&empty_slabs, slab);
+      --n_empty_slabs;
+    } else {
+      slab = slab_new();
+    }
+    used_slabs_push(slab);
+  }
+
+  if (slab->first_free) {
+    item = slab->first_free;
+    slab->first_free = item->u.next_free;
+  } else {
+    tor_assert(slab->next_never_used < CELL_POOL_CELLS_PER_SLAB);
+    item = &slab->items[slab->next_never_used++];
+    item->slab = slab;
+  }
+
+  if (++slab->n_allocated == CELL_POOL_CELLS_PER_SLAB) {
+    slab_list_remove(&used_slabs, slab);
+    slab_list_push(&full_slabs, slab);
+  }
+  return item;
+}
+
+/** Return a newly allocated packed_cell_t from the cell pool.  Its contents
+ * are uninitialized.  The caller must release it with cell_pool_release(). */
+packed_cell_t *
+cell_pool_alloc(void)
+{
+  cell_pool_item_t *item;
+
+  if (PREDICT_LIKELY(cached_item)) {
+    item = cached_item;
+    cached_item = NULL;
+  } else {
+    item = slab_alloc_item();
+  }
+  if (++n_cells_allocated > n_cells_allocated_max)
+    n_cells_allocated_max = n_cells_allocated;
+
+  return &item->u.cell;
+}
+
+/** Helper: put <b>item</b>, which has been released, back on its slab's
+ * free-list, and move the slab to whichever list it now belongs on. */
+static void
+item_return_to_slab(cell_pool_item_t *item)
+{
+  cell_pool_slab_t *slab = item->slab;
+
+  tor_assert(slab);
+  tor_assert(slab->n_allocated > 0);
+
+  item->u.next_free = slab->first_free;
+  slab->first_free = item;
+
+  if (slab->n_allocated-- == CELL_POOL_CELLS_PER_SLAB) {
+    slab_list_remove(&full_slabs, slab);
+    used_slabs_push(slab);
+  }
+  /* If this slab is the one we're currently allocating from, leave it where
+   * it is even if it's empty: otherwise a queue that keeps draining to zero
+   * and refilling would bounce the slab between lists on every cell. */
+  if (slab->n_allocated == 0 && slab != used_slabs) {
+    slab_retire_empty(slab);
+  }
+}
+
+/** Return <b>cell</b>, which must have come from cell_pool_alloc(), to the
+ * cell pool. */
+void
+cell_pool_release(packed_cell_t *cell)
+{
+  cell_pool_item_t *item = SUBTYPE_P(cell, cell_pool_item_t, u.cell);
+
+  tor_assert(n_cells_allocated > 0);
+  --n_cells_allocated;
+
+  /* Keep the newest cell for the next allocation, and hand the one that
+   * it displaces back to its slab. */
+  if (cached_item)
+    item_return_to_slab(cached_item);
+  cached_item = item;
+}
+
+/** If we are holding on to a released item for the next allocation, give it
+ * back to its slab. */
+static void
+cell_pool_flush_cache(void)
+{
+  if (cached_item) {
+    item_return_to_slab(cached_item);
+    cached_item = NULL;
+  }
+}
+
+/** Give all but <b>n_to_keep</b> of our empty slabs back to the allocator.
+ * Return the number of bytes released. */
+size_t
+cell_pool_clean(int n_to_keep)
+{
+  size_t freed = 0;
+  tor_assert(n_to_keep >= 0);
+  cell_pool_flush_cache();
+  while (n_empty_slabs > (size_t)n_to_keep) {
+    cell_pool_slab_t *slab = empty_slabs;
+    slab_list_remove(&empty_slabs, slab);
+    --n_empty_slabs;
+    slab_free(slab);
+    freed += sizeof(cell_pool_slab_t);
+  }
+  return freed;
+}
+
+/** Return the number of bytes that the cell pool is holding in slabs that
+ * have no cells handed out. */
+size_t
+cell_pool_get_idle_allocation(void)
+{
+  return n_empty_slabs * sizeof(cell_pool_slab_t);
+}
+
+/** Return the number of bytes of pool storage used by each allocated cell,
+ * including its bookkeeping overhead. */
+size_t
+cell_pool_item_mem_cost(void)
+{
+  return sizeof(cell_pool_item_t);
+}
+
+/** Fill in <b>stats_out</b> with a description of the cell pool's current
+ * state. */
+void
+cell_pool_get_stats(cell_pool_stats_t *stats_out)
+{
+  const size_t n_nonempty = n_slabs - n_empty_slabs;
+  tor_assert(stats_out);
+  stats_out->n_cells_allocated = n_cells_allocated;
+  stats_out->n_cells_allocated_max = n_cells_allocated_max;
+  stats_out->n_slabs = n_slabs;
+  stats_out->n_slabs_max = n_slabs_max;
+  stats_out->n_empty_slabs = n_empty_slabs;
+  stats_out->n_fragmented_cells =
+    n_nonempty * CELL_POOL_CELLS_PER_SLAB - n_cells_allocated;
+  stats_out->bytes_allocated = n_slabs * sizeof(cell_pool_slab_t);
+}
+
+/** Release every slab in the list at *<b>headp</b>. */
+static void
+slab_list_free_all(cell_pool_slab_t **headp)
+{
+  while (*headp) {
+    cell_pool_slab_t *slab = *headp;
+    slab_list_remove(headp, slab);
+    slab_free(slab);
+  }
+}
+
+/** Release all storage held by the cell pool.  Any cells still allocated
+ * from it become invalid. */
+void
+cell_pool_free_all(void)
+{
+  cached_item = NULL;
+  slab_list_free_all(&used_slabs);
+  slab_list_free_all(&full_slabs);
+  slab_list_free_all(&empty_slabs);
+  n_empty_slabs = 0;
+  n_cells_allocated = 0;
+}
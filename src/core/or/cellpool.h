@@ -0,0 +1,46 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file cellpool.h
+ * \brief Header file for cellpool.c.
+ **/
+
+#ifndef TOR_CELLPOOL_H
+#define TOR_CELLPOOL_H
+
+/** How many packed cells do we put in each slab of the cell pool? */
+#define CELL_POOL_CELLS_PER_SLAB 128
+
+/** How many completely unused slabs do we keep around before we start
+ * handing them back to the allocator? */
+#define CELL_POOL_MAX_EMPTY_SLABS 4
+
+/** Summary of the cell pool's state, as reported by cell_pool_get_stats(). */
+typedef struct cell_pool_stats_t {
+  /** Number of cells currently handed out by the pool. */
+  size_t n_cells_allocated;
+  /** Largest value that n_cells_allocated has ever had. */
+  size_t n_cells_allocated_max;
+  /** Number of slabs that we are holding, in any state. */
+  size_t n_slabs;
+  /** Largest value that n_slabs has ever had. */
+  size_t n_slabs_max;
+  /** Number of slabs with no cells handed out. */
+  size_t n_empty_slabs;
+  /** Number of unused cell slots in slabs that are partially in use. These
+   * slots can't be returned to the allocator until their slab empties. */
+  size_t n_fragmented_cells;
+  /** Total bytes held by the pool, including empty slabs. */
+  size_t bytes_allocated;
+} cell_pool_stats_t;
+
+packed_cell_t *cell_pool_alloc(void);
+void cell_pool_release(packed_cell_t *cell);
+size_t cell_pool_clean(int n_to_keep);
+size_t cell_pool_get_idle_allocation(void);
+size_t cell_pool_item_mem_cost(void);
+void cell_pool_get_stats(cell_pool_stats_t *stats_out);
+void cell_pool_free_all(void);
+
+#endif /* !defined(TOR_CELLPOOL_H) */
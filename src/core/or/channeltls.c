@@ -1151,6 +1151,29 @@ channel_tls_handle_cell(cell_t *cell, or_connection_t *conn)
   }
 }
 
+/**
+ * Handle a batch of incoming cells on a channel_tls_t.
+ *
+ * Process the <b>n_cells</b> fixed-length cells in <b>cells</b>, which were
+ * just received in that order on <b>conn</b>, as if each had been passed to
+ * channel_tls_handle_cell().  If handling one of them closes the connection,
+ * the rest are dropped.
+ */
+void
+channel_tls_handle_cells(cell_t *cells, int n_cells, or_connection_t *conn)
+{
+  int i;
+
+  tor_assert(cells);
+  tor_assert(conn);
+
+  for (i = 0; i < n_cells; ++i) {
+    if (conn->base_.marked_for_close)
+      break;
+    channel_tls_handle_cell(&cells[i], conn);
+  }
+}
+
 /**
  * Handle an incoming variable-length cell on a channel_tls_t.
  *
@@ -55,6 +55,7 @@
 #include "lib/cc/torint.h"  /* TOR_PRIuSZ */
 
 #include "core/or/or.h"
+#include "core/or/cell_queue.h"
 #include "core/or/channel.h"
 #include "core/or/channeltls.h"
 #include "feature/client/circpathbias.h"
@@ -2498,14 +2499,14 @@ STATIC uint32_t
 circuit_max_queued_cell_age(const circuit_t *c, uint32_t now)
 {
   uint32_t age = 0;
-  packed_cell_t *cell;
+  const packed_cell_t *cell;
 
-  if (NULL != (cell = TOR_SIMPLEQ_FIRST(&c->n_chan_cells.head)))
+  if (NULL != (cell = cell_queue_peek(&c->n_chan_cells)))
     age = now - cell->inserted_timestamp;
 
   if (! CIRCUIT_IS_ORIGIN(c)) {
     const or_circuit_t *orcirc = CONST_TO_OR_CIRCUIT(c);
-    if (NULL != (cell = TOR_SIMPLEQ_FIRST(&orcirc->p_chan_cells.head))) {
+    if (NULL != (cell = cell_queue_peek(&orcirc->p_chan_cells))) {
       uint32_t age2 = now - cell->inserted_timestamp;
       if (age2 > age)
         return age2;
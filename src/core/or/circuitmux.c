@@ -72,6 +72,7 @@
 #define CIRCUITMUX_PRIVATE
 
 #include "core/or/or.h"
+#include "core/or/cell_queue.h"
 #include "core/or/channel.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuitmux.h"
@@ -1674,6 +1674,20 @@ connection_or_tls_renegotiated_cb(tor_tls_t *tls, void *_conn)
   }
 }
 
+/** Log whether the kernel has taken over TLS record encryption on
+ * <b>conn</b>, which has just finished its TLS handshake. */
+static void
+connection_or_log_kernel_offload(or_connection_t *conn)
+{
+  int tx = 0, rx = 0;
+  if (tor_tls_get_kernel_offload(conn->tls, &tx, &rx) < 0 || !(tx || rx))
+    return;
+  log_info(LD_OR, "Kernel TLS offload on connection to %s: send %s, "
+           "receive %s.",
+           safe_str_client(conn->base_.address),
+           tx ? "yes" : "no", rx ? "yes" : "no");
+}
+
 /** Move forward with the tls handshake. If it finishes, hand
  * <b>conn</b> to connection_tls_finish_handshake().
  *
@@ -1696,6 +1710,7 @@ connection_tls_continue_handshake(or_connection_t *conn)
              tor_tls_err_to_string(result));
       return -1;
     case TOR_TLS_DONE:
+      connection_or_log_kernel_offload(conn);
       if (! tor_tls_used_v1_handshake(conn->tls)) {
         if (!tor_tls_is_server(conn->tls)) {
           tor_assert(conn->base_.state == OR_CONN_STATE_TLS_HANDSHAKING);
@@ -2310,10 +2325,29 @@ connection_fetch_var_cell_from_buf(or_connection_t *or_conn, var_cell_t **out)
   return fetch_var_cell_from_buf(conn->inbuf, out, or_conn->link_proto);
 }
 
+/** How many fixed-length cells do we unpack from an OR connection's inbuf
+ * before we hand them to the channel layer? */
+#define OR_CONN_CELL_BATCH_MAX 16
+
+/** Unpack up to <b>max_cells</b> fixed-length cells that lie entirely in
+ * the first chunk of <b>or_conn</b>'s inbuf into <b>cells_out</b>.  Return
+ * values as for fetch_cells_from_buf(). */
+static int
+connection_fetch_cells_from_buf(or_connection_t *or_conn, cell_t *cells_out,
+                                int max_cells)
+{
+  connection_t *conn = TO_CONN(or_conn);
+  return fetch_cells_from_buf(conn->inbuf, cells_out, max_cells,
+                              or_conn->link_proto);
+}
+
 /** Process cells from <b>conn</b>'s inbuf.
  *
  * Loop: while inbuf contains a cell, pull it off the inbuf, unpack it,
- * and hand it to command_process_cell().
+ * and hand it to command_process_cell().  Fixed-length cells that sit whole
+ * in the inbuf's first chunk are unpacked straight from the chunk and handed
+ * over OR_CONN_CELL_BATCH_MAX at a time; only variable-length cells and
+ * cells that straddle two chunks are copied out first.
  *
  * Always return 0.
  */
@@ -2336,12 +2370,23 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
    */
 
   while (1) {
+    cell_t cells[OR_CONN_CELL_BATCH_MAX];
+    int n_cells;
     log_debug(LD_OR,
               TOR_SOCKET_T_FORMAT": starting, inbuf_datalen %d "
               "(%d pending in tls object).",
               conn->base_.s,(int)connection_get_inbuf_len(TO_CONN(conn)),
               tor_tls_get_pending_bytes(conn->tls));
-    if (connection_fetch_var_cell_from_buf(conn, &var_cell)) {
+    n_cells = connection_fetch_cells_from_buf(conn, cells,
+                                              OR_CONN_CELL_BATCH_MAX);
+    if (n_cells) {
+      /* Touch the channel's active timestamp if there is one */
+      if (conn->chan)
+        channel_timestamp_active(TLS_CHAN_TO_BASE(conn->chan));
+
+      circuit_build_times_network_is_live(get_circuit_build_times_mutable());
+      channel_tls_handle_cells(cells, n_cells, conn);
+    } else if (connection_fetch_var_cell_from_buf(conn, &var_cell)) {
       if (!var_cell)
         return 0; /* not yet. */
 
@@ -69,6 +69,12 @@ struct connection_t {
   /** True if connection_handle_write is currently running on this connection.
    */
   unsigned int in_connection_handle_write:1;
+  /** True iff this connection's read event is waiting for the main loop's
+   * next batch of socket I/O. */
+  unsigned int batch_read_pending:1;
+  /** True iff this connection's write event is waiting for the main loop's
+   * next batch of socket I/O. */
+  unsigned int batch_write_pending:1;
 
   /* For linked connections:
    */
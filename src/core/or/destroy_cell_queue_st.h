@@ -13,6 +13,7 @@
 #define DESTROY_CELL_QUEUE_ST_H
 
 #include "core/or/cell_queue_st.h"
+#include "ext/tor_queue.h"
 
 /** A single queued destroy cell. */
 struct destroy_cell_t {
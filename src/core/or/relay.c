@@ -50,6 +50,8 @@
 #include "feature/client/addressmap.h"
 #include "lib/err/backtrace.h"
 #include "lib/buf/buffers.h"
+#include "core/or/cell_queue.h"
+#include "core/or/cellpool.h"
 #include "core/or/channel.h"
 #include "feature/client/circpathbias.h"
 #include "core/or/circuitbuild.h"
@@ -2488,24 +2490,23 @@ circuit_consider_stop_edge_reading(circuit_t *circ, crypt_path_t *layer_hint)
   return 0;
 }
 
-/** The total number of cells we have allocated. */
-static size_t total_cells_allocated = 0;
-
 /** Release storage held by <b>cell</b>. */
 static inline void
 packed_cell_free_unchecked(packed_cell_t *cell)
 {
-  --total_cells_allocated;
-  tor_free(cell);
+  cell_pool_release(cell);
 }
 
-/** Allocate and return a new packed_cell_t. */
+#ifdef TOR_UNIT_TESTS
+/** Allocate and return a new, zeroed packed_cell_t. */
 STATIC packed_cell_t *
 packed_cell_new(void)
 {
-  ++total_cells_allocated;
-  return tor_malloc_zero(sizeof(packed_cell_t));
+  packed_cell_t *cell = cell_pool_alloc();
+  memset(cell, 0, sizeof(*cell));
+  return cell;
 }
+#endif /* defined(TOR_UNIT_TESTS) */
 
 /** Return a packed cell used outside by channel_t lower layer */
 void
@@ -2523,6 +2524,7 @@ dump_cell_pool_usage(int severity)
 {
   int n_circs = 0;
   int n_cells = 0;
+  cell_pool_stats_t pool;
   SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, c) {
     n_cells += c->n_chan_cells.n;
     if (!CIRCUIT_IS_ORIGIN(c))
@@ -2530,28 +2532,32 @@ dump_cell_pool_usage(int severity)
     ++n_circs;
   }
   SMARTLIST_FOREACH_END(c);
+  cell_pool_get_stats(&pool);
   tor_log(severity, LD_MM,
           "%d cells allocated on %d circuits. %d cells leaked.",
-          n_cells, n_circs, (int)total_cells_allocated - n_cells);
+          n_cells, n_circs, (int)pool.n_cells_allocated - n_cells);
+  tor_log(severity, LD_MM,
+          "Cell pool: %"TOR_PRIuSZ" slabs (%"TOR_PRIuSZ" empty) holding "
+          "%"TOR_PRIuSZ" bytes; %"TOR_PRIuSZ" unused cell slots in partially "
+          "used slabs. High-water marks: %"TOR_PRIuSZ" cells, "
+          "%"TOR_PRIuSZ" slabs.",
+          pool.n_slabs, pool.n_empty_slabs, pool.bytes_allocated,
+          pool.n_fragmented_cells, pool.n_cells_allocated_max,
+          pool.n_slabs_max);
 }
 
 /** Allocate a new copy of packed <b>cell</b>. */
 static inline packed_cell_t *
 packed_cell_copy(const cell_t *cell, int wide_circ_ids)
 {
-  packed_cell_t *c = packed_cell_new();
+  /* cell_pack() fills in the whole body, so there's no need to zero it
+   * first: clearing a cell costs more than the pool does to hand it out. */
+  packed_cell_t *c = cell_pool_alloc();
   cell_pack(c, cell, wide_circ_ids);
+  c->inserted_timestamp = 0;
   return c;
 }
 
-/** Append <b>cell</b> to the end of <b>queue</b>. */
-void
-cell_queue_append(cell_queue_t *queue, packed_cell_t *cell)
-{
-  TOR_SIMPLEQ_INSERT_TAIL(&queue->head, cell, next);
-  ++queue->n;
-}
-
 /** Append a newly allocated copy of <b>cell</b> to the end of the
  * <b>exitward</b> (or app-ward) <b>queue</b> of <b>circ</b>.  If
  * <b>use_stats</b> is true, record statistics about the cell.
@@ -2571,40 +2577,6 @@ cell_queue_append_packed_copy(circuit_t *circ, cell_queue_t *queue,
   cell_queue_append(queue, copy);
 }
 
-/** Initialize <b>queue</b> as an empty cell queue. */
-void
-cell_queue_init(cell_queue_t *queue)
-{
-  memset(queue, 0, sizeof(cell_queue_t));
-  TOR_SIMPLEQ_INIT(&queue->head);
-}
-
-/** Remove and free every cell in <b>queue</b>. */
-void
-cell_queue_clear(cell_queue_t *queue)
-{
-  packed_cell_t *cell;
-  while ((cell = TOR_SIMPLEQ_FIRST(&queue->head))) {
-    TOR_SIMPLEQ_REMOVE_HEAD(&queue->head, next);
-    packed_cell_free_unchecked(cell);
-  }
-  TOR_SIMPLEQ_INIT(&queue->head);
-  queue->n = 0;
-}
-
-/** Extract and return the cell at the head of <b>queue</b>; return NULL if
- * <b>queue</b> is empty. */
-STATIC packed_cell_t *
-cell_queue_pop(cell_queue_t *queue)
-{
-  packed_cell_t *cell = TOR_SIMPLEQ_FIRST(&queue->head);
-  if (!cell)
-    return NULL;
-  TOR_SIMPLEQ_REMOVE_HEAD(&queue->head, next);
-  --queue->n;
-  return cell;
-}
-
 /** Initialize <b>queue</b> as an empty cell queue. */
 void
 destroy_cell_queue_init(destroy_cell_queue_t *queue)
@@ -2659,31 +2631,36 @@ destroy_cell_queue_append(destroy_cell_queue_t *queue,
 static packed_cell_t *
 destroy_cell_to_packed_cell(destroy_cell_t *inp, int wide_circ_ids)
 {
-  packed_cell_t *packed = packed_cell_new();
+  packed_cell_t *packed;
   cell_t cell;
   memset(&cell, 0, sizeof(cell));
   cell.circ_id = inp->circid;
   cell.command = CELL_DESTROY;
   cell.payload[0] = inp->reason;
-  cell_pack(packed, &cell, wide_circ_ids);
+  packed = packed_cell_copy(&cell, wide_circ_ids);
 
   tor_free(inp);
   return packed;
 }
 
-/** Return the total number of bytes used for each packed_cell in a queue.
+/** Return the total number of bytes used for each packed_cell in a queue:
+ * its slot in the cell pool, and its slot in the queue's ring.
  * Approximate. */
 size_t
 packed_cell_mem_cost(void)
 {
-  return sizeof(packed_cell_t);
+  return cell_pool_item_mem_cost() + sizeof(packed_cell_t *);
 }
 
-/* DOCDOC */
+/** Return the total number of bytes used for packed cells: those that are
+ * allocated, plus the idle slabs that the cell pool is holding on to. */
 size_t
 cell_queues_get_total_allocation(void)
 {
-  return total_cells_allocated * packed_cell_mem_cost();
+  cell_pool_stats_t pool;
+  cell_pool_get_stats(&pool);
+  return pool.n_cells_allocated * packed_cell_mem_cost() +
+    cell_pool_get_idle_allocation();
 }
 
 /** How long after we've been low on memory should we try to conserve it? */
@@ -2711,6 +2688,13 @@ cell_queues_check_size(void)
   alloc += dns_cache_total;
   if (alloc >= get_options()->MaxMemInQueues_low_threshold) {
     last_time_under_memory_pressure = approx_time();
+    /* Before we go looking for anything to kill, hand back the cell slabs
+     * that nobody is using, and some of our spare buffer chunks.  Empty
+     * cell queues give back their rings too, though we don't count those
+     * in alloc. */
+    alloc -= cell_pool_clean(0);
+    alloc -= buf_shrink_freelists(0);
+    cell_queues_shrink_idle(0);
     if (alloc >= get_options()->MaxMemInQueues) {
       /* If we're spending over 20% of the memory limit on hidden service
        * descriptors, free them until we're down to 10%. Do the same for geoip
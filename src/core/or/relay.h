@@ -59,9 +59,6 @@ void packed_cell_free_(packed_cell_t *cell);
 #define packed_cell_free(cell) \
   FREE_AND_NULL(packed_cell_t, packed_cell_free_, (cell))
 
-void cell_queue_init(cell_queue_t *queue);
-void cell_queue_clear(cell_queue_t *queue);
-void cell_queue_append(cell_queue_t *queue, packed_cell_t *cell);
 void cell_queue_append_packed_copy(circuit_t *circ, cell_queue_t *queue,
                                    int exitward, const cell_t *cell,
                                    int wide_circ_ids, int use_stats);
@@ -120,8 +117,9 @@ STATIC int resolved_cell_parse(const cell_t *cell, const relay_header_t *rh,
 STATIC int connection_edge_process_resolved_cell(edge_connection_t *conn,
                                                  const cell_t *cell,
                                                  const relay_header_t *rh);
+#ifdef TOR_UNIT_TESTS
 STATIC packed_cell_t *packed_cell_new(void);
-STATIC packed_cell_t *cell_queue_pop(cell_queue_t *queue);
+#endif
 STATIC destroy_cell_t *destroy_cell_queue_pop(destroy_cell_queue_t *queue);
 STATIC int cell_queues_check_size(void);
 STATIC int connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
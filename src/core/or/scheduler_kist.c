@@ -19,6 +19,7 @@
 #define SCHEDULER_PRIVATE
 #include "core/or/scheduler.h"
 #include "lib/math/fp.h"
+#include "lib/tls/tls_dataplane.h"
 
 #include "core/or/or_connection_st.h"
 
@@ -131,6 +132,19 @@ channel_outbuf_length(channel_t *chan)
   return buf_datalen(TO_CONN(BASE_CHAN_TO_TLS(chan)->conn)->outbuf);
 }
 
+/* Little helper function for HT_FOREACH_FN: add the write that
+ * channel_write_to_kernel() will make for this channel to the current
+ * data-plane batch, if it can take part. */
+static int
+each_channel_prepare_write(outbuf_table_ent_t *ent, void *data)
+{
+  (void) data; /* Make compiler happy. */
+  channel_tls_t *tlschan = BASE_CHAN_TO_TLS(ent->chan);
+  if (tlschan->conn && connection_can_batch_io(TO_CONN(tlschan->conn)))
+    connection_prepare_batched_write(TO_CONN(tlschan->conn));
+  return 0;
+}
+
 /* Little helper function for HT_FOREACH_FN. */
 static int
 each_channel_write_to_kernel(outbuf_table_ent_t *ent, void *data)
@@ -720,9 +734,18 @@ kist_scheduler_run(void)
     }
   } /* End of main scheduling loop */
 
-  /* Write the outbuf of any channels that still have data */
+  /* Write the outbuf of any channels that still have data.  If we have
+   * data-plane threads, they do the TLS work for all of these writes at
+   * once, and channel_write_to_kernel() collects the results. */
+  if (tls_dataplane_enabled()) {
+    HT_FOREACH_FN(outbuf_table_s, &outbuf_table, each_channel_prepare_write,
+                  NULL);
+    tls_dataplane_start();
+    tls_dataplane_finish();
+  }
   HT_FOREACH_FN(outbuf_table_s, &outbuf_table, each_channel_write_to_kernel,
                 NULL);
+  tls_dataplane_clear_results();
   /* We are done with it. */
   HT_FOREACH_FN(outbuf_table_s, &outbuf_table, free_outbuf_info_by_ent, NULL);
   HT_CLEAR(outbuf_table_s, &outbuf_table);
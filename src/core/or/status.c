@@ -32,6 +32,7 @@
 #include "feature/hs/hs_service.h"
 #include "core/or/dos.h"
 #include "feature/stats/geoip_stats.h"
+#include "feature/relay/onion_queue.h"
 
 #include "app/config/or_state_st.h"
 #include "feature/nodelist/routerinfo_st.h"
@@ -174,6 +175,7 @@ log_heartbeat(time_t now)
 
   if (public_server_mode(options)) {
     rep_hist_log_circuit_handshake_stats(now);
+    onion_queue_log_delay_stats();
     rep_hist_log_link_protocol_counts();
     dos_log_heartbeat();
   }
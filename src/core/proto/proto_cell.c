@@ -8,8 +8,6 @@
  * @file proto_cell.c
  * @brief Decodes Tor cells from buffers.
  **/
-/* Right now it only handles variable-length cells, but eventually
- * we should refactor other cell-reading code into here. */
 
 #include "core/or/or.h"
 #include "lib/buf/buffers.h"
@@ -17,6 +15,7 @@
 
 #include "core/or/connection_or.h"
 
+#include "core/or/cell_st.h"
 #include "core/or/var_cell_st.h"
 
 /** True iff the cell command <b>command</b> is one that implies a
@@ -90,3 +89,52 @@ fetch_var_cell_from_buf(buf_t *buf, var_cell_t **out, int linkproto)
   *out = result;
   return 1;
 }
+
+/** Unpack as many fixed-length cells as we can, up to <b>max_cells</b>, from
+ * the first chunk of <b>buf</b> into <b>cells_out</b>, according to the rules
+ * of link protocol version <b>linkproto</b>.  Remove them from the buffer,
+ * and return the number of cells unpacked.
+ *
+ * We stop early at anything that might be a variable-length cell, and at any
+ * cell that isn't entirely within the first chunk, so a return value of 0
+ * doesn't mean that there's no cell on <b>buf</b>: the caller should fall
+ * back to fetch_var_cell_from_buf() and to copying the next cell out. */
+int
+fetch_cells_from_buf(buf_t *buf, cell_t *cells_out, int max_cells,
+                     int linkproto)
+{
+  const int wide_circ_ids = linkproto >= MIN_LINK_PROTO_FOR_WIDE_CIRC_IDS;
+  const size_t circ_id_len = get_circ_id_size(wide_circ_ids);
+  const size_t cell_network_size = get_cell_network_size(wide_circ_ids);
+  const char *head;
+  size_t len;
+  int n = 0;
+
+  /* With a byte count of 0, this never moves any data: it just tells us
+   * where the first chunk is. */
+  buf_pullup(buf, 0, &head, &len);
+
+  while (n < max_cells && len >= cell_network_size) {
+    cell_t *cell = &cells_out[n];
+    const uint8_t command = get_uint8(head + circ_id_len);
+    if (cell_command_is_var_length(command, linkproto))
+      break;
+    if (wide_circ_ids)
+      cell->circ_id = ntohl(get_uint32(head));
+    else
+      cell->circ_id = ntohs(get_uint16(head));
+    cell->command = command;
+    /* memmove(), not memcpy(): some compilers turn a fixed-size memcpy()
+     * into an inline "rep movs", which is very slow when the source and
+     * destination are misaligned relative to one another, as most cells in
+     * a chunk are. */
+    memmove(cell->payload, head + circ_id_len + 1, CELL_PAYLOAD_SIZE);
+    head += cell_network_size;
+    len -= cell_network_size;
+    ++n;
+  }
+
+  if (n)
+    buf_drain(buf, n * cell_network_size);
+  return n;
+}
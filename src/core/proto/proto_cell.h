@@ -13,9 +13,12 @@
 #define TOR_PROTO_CELL_H
 
 struct buf_t;
+struct cell_t;
 struct var_cell_t;
 
 int fetch_var_cell_from_buf(struct buf_t *buf, struct var_cell_t **out,
                             int linkproto);
+int fetch_cells_from_buf(struct buf_t *buf, struct cell_t *cells_out,
+                         int max_cells, int linkproto);
 
 #endif /* !defined(TOR_PROTO_CELL_H) */
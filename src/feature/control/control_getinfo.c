@@ -51,6 +51,7 @@
 #include "feature/rend/rendcache.h"
 #include "feature/stats/geoip_stats.h"
 #include "feature/stats/predict_ports.h"
+#include "lib/buf/buffers.h"
 #include "lib/version/torversion.h"
 #include "lib/encoding/kvline.h"
 
@@ -180,6 +181,8 @@ getinfo_helper_misc(control_connection_t *conn, const char *question,
   } else if (!strcmp(question, "limits/max-mem-in-queues")) {
     tor_asprintf(answer, "%"PRIu64,
                  (get_options()->MaxMemInQueues));
+  } else if (!strcmp(question, "buffers/freelists")) {
+    *answer = buf_get_freelist_summary();
   } else if (!strcmp(question, "fingerprint")) {
     crypto_pk_t *server_key;
     if (!server_mode(get_options())) {
@@ -1620,6 +1623,8 @@ static const getinfo_item_t getinfo_items[] = {
        "Username under which the tor process is running."),
   ITEM("process/descriptor-limit", misc, "File descriptor limit."),
   ITEM("limits/max-mem-in-queues", misc, "Actual limit on memory in queues"),
+  ITEM("buffers/freelists", misc,
+       "Usage and hit rates of the buffer chunk free-lists."),
   PREFIX("desc-annotations/id/", dir, "Router annotations by hexdigest."),
   PREFIX("dir/server/", dir,"Router descriptors as retrieved from a DirPort."),
   PREFIX("dir/status/", dir,
@@ -28,6 +28,7 @@
 #include "feature/nodelist/describe.h"
 #include "feature/nodelist/microdesc.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerinfo.h"
 #include "feature/nodelist/routerlist.h"
@@ -959,6 +960,7 @@ directory_remove_invalid(void)
       node->is_bad_exit = (r&RTR_BADEXIT) ? 1: 0;
     }
   } SMARTLIST_FOREACH_END(node);
+  node_select_invalidate_weight_tables();
 
   routerlist_assert_ok(rl);
   smartlist_free(nodes);
@@ -22,6 +22,7 @@
 #include "feature/hibernate/hibernate.h"
 #include "feature/nodelist/dirlist.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/routerset.h"
@@ -313,6 +314,8 @@ dirserv_compute_performance_thresholds(digestmap_t *omit_as_sybil)
       ++n_active;
     }
   } SMARTLIST_FOREACH_END(node);
+  /* We may have changed some nodes' Exit flags. */
+  node_select_invalidate_weight_tables();
 
   /* Now, compute thresholds. */
   if (n_active) {
@@ -706,6 +706,24 @@ find_best_compression_method(unsigned compression_methods, int stream)
   return NO_METHOD;
 }
 
+/** Largest compressed response size for which we prefer our built-in
+ * Zstandard dictionary: above this, plain Zstandard is both smaller and
+ * faster. */
+#define ZSTD_DICT_MAX_RESPONSE_LEN (8*1024)
+
+/** Return the compression method we should use for streaming a response
+ * of descriptors, expected to be about <b>size_guess</b> bytes once
+ * compressed, to a client that supports <b>compression_methods</b>. */
+STATIC compress_method_t
+choose_compression_method_for_size(unsigned compression_methods,
+                                   size_t size_guess)
+{
+  if ((compression_methods & (1u<<ZSTD_DICT_METHOD)) &&
+      size_guess <= ZSTD_DICT_MAX_RESPONSE_LEN)
+    return ZSTD_DICT_METHOD;
+  return find_best_compression_method(compression_methods, 1);
+}
+
 /** Check if any of the digests in <b>digests</b> matches the latest consensus
  *  flavor (given in <b>flavor</b>) that we have available. */
 static int
@@ -1107,7 +1125,7 @@ static int
 handle_get_microdesc(dir_connection_t *conn, const get_handler_args_t *args)
 {
   const char *url = args->url;
-  const compress_method_t compress_method =
+  compress_method_t compress_method =
     find_best_compression_method(args->compression_supported, 1);
   int clear_spool = 1;
   {
@@ -1122,6 +1140,8 @@ handle_get_microdesc(dir_connection_t *conn, const get_handler_args_t *args)
     dirserv_spool_remove_missing_and_guess_size(conn, 0,
                                                 compress_method != NO_METHOD,
                                                 &size_guess, NULL);
+    compress_method = choose_compression_method_for_size(
+                                 args->compression_supported, size_guess);
     if (smartlist_len(conn->spool) == 0) {
       write_short_http_response(conn, 404, "Not found");
       goto done;
@@ -1161,7 +1181,7 @@ static int
 handle_get_descriptor(dir_connection_t *conn, const get_handler_args_t *args)
 {
   const char *url = args->url;
-  const compress_method_t compress_method =
+  compress_method_t compress_method =
     find_best_compression_method(args->compression_supported, 1);
   const or_options_t *options = get_options();
   int clear_spool = 1;
@@ -1203,6 +1223,8 @@ handle_get_descriptor(dir_connection_t *conn, const get_handler_args_t *args)
     dirserv_spool_remove_missing_and_guess_size(conn, publish_cutoff,
                                                 compress_method != NO_METHOD,
                                                 &size_guess, &n_expired);
+    compress_method = choose_compression_method_for_size(
+                                 args->compression_supported, size_guess);
 
     /* If we are the bridge authority and the descriptor is a bridge
      * descriptor, remember that we served this descriptor for desc stats. */
@@ -383,6 +383,14 @@ spooled_resource_free_(spooled_resource_t *spooled)
  * at least this much. */
 #define DIRSERV_CACHED_DIR_CHUNK_SIZE 8192
 
+/** Release the reference to a consensus cache entry that we gave to an
+ * outbuf along with some of the entry's body. */
+static void
+spooled_cce_body_release(void *arg)
+{
+  consensus_cache_entry_decref(arg);
+}
+
 /** Return an compression ratio for compressing objects from <b>source</b>.
  */
 static double
@@ -509,8 +517,18 @@ spooled_resource_flush_some(spooled_resource_t *spooled,
       return SRFS_ERR;
     ssize_t bytes = (ssize_t) MIN(DIRSERV_CACHED_DIR_CHUNK_SIZE, remaining);
 
-    connection_dir_buf_add(ptr + spooled->cached_dir_offset,
-                           bytes, conn, 0);
+    if (cce && !conn->compress_state) {
+      /* The entry's body is mapped, and stays put for as long as anybody
+       * holds a reference to the entry: let the outbuf refer to it rather
+       * than copying it. */
+      consensus_cache_entry_incref(cce);
+      connection_buf_add_external(ptr + spooled->cached_dir_offset, bytes,
+                                  TO_CONN(conn),
+                                  spooled_cce_body_release, cce);
+    } else {
+      connection_dir_buf_add(ptr + spooled->cached_dir_offset,
+                             bytes, conn, 0);
+    }
 
     spooled->cached_dir_offset += bytes;
     if (spooled->cached_dir_offset >= (off_t)total_len) {
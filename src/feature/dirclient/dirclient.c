@@ -1875,6 +1875,10 @@ dir_client_decompress_response_body(char **bodyp, size_t *bodylenp,
   int tried_both = 0;
   compress_method_t guessed = detect_compression_method(body, body_len);
 
+  /* A Zstandard frame that uses our dictionary looks like any other. */
+  if (guessed == ZSTD_METHOD && compression == ZSTD_DICT_METHOD)
+    guessed = ZSTD_DICT_METHOD;
+
   description1 = compression_method_get_human_name(compression);
 
   if (BUG(description1 == NULL))
@@ -3023,6 +3027,7 @@ connection_dir_client_refetch_hsdesc_if_needed(dir_connection_t *dir_conn)
  * compressed data, ordered from best to worst. */
 static compress_method_t client_meth_pref[] = {
   LZMA_METHOD,
+  ZSTD_DICT_METHOD,
   ZSTD_METHOD,
   ZLIB_METHOD,
   GZIP_METHOD,
@@ -15,11 +15,12 @@
  * it, relying on gen_ed_diff to generate the ed diff and some digest helper
  * functions to generate the digest hashes.
  *
- * gen_ed_diff is the tricky bit. In it simplest form, it will take quadratic
- * time and linear space to generate an ed diff given two smartlists. As shown
- * in its comment section, calling calc_changes on the entire two consensuses
- * will calculate what is to be added and what is to be deleted in the diff.
- * Its comment section briefly explains how it works.
+ * gen_ed_diff is the tricky bit. In it simplest form, it will take O(ND)
+ * time, for N lines with D of them changed, and linear space to generate an
+ * ed diff given two smartlists. As shown in its comment section, calling
+ * calc_changes on the entire two consensuses will calculate what is to be
+ * added and what is to be deleted in the diff. Its comment section briefly
+ * explains how it works.
  *
  * In our case specific to consensuses, we take advantage of the fact that
  * consensuses list routers sorted by their identities. We use that
@@ -154,58 +155,6 @@ smartlist_slice(const smartlist_t *list, int start, int end)
   return slice;
 }
 
-/** Helper: Compute the longest common subsequence lengths for the two slices.
- * Used as part of the diff generation to find the column at which to split
- * slice2 while still having the optimal solution.
- * If direction is -1, the navigation is reversed. Otherwise it must be 1.
- * The length of the resulting integer array is that of the second slice plus
- * one.
- */
-STATIC int *
-lcs_lengths(const smartlist_slice_t *slice1, const smartlist_slice_t *slice2,
-            int direction)
-{
-  size_t a_size = sizeof(int) * (slice2->len+1);
-
-  /* Resulting lcs lengths. */
-  int *result = tor_malloc_zero(a_size);
-  /* Copy of the lcs lengths from the last iteration. */
-  int *prev = tor_malloc(a_size);
-
-  tor_assert(direction == 1 || direction == -1);
-
-  int si = slice1->offset;
-  if (direction == -1) {
-    si += (slice1->len-1);
-  }
-
-  for (int i = 0; i < slice1->len; ++i, si+=direction) {
-
-    const cdline_t *line1 = smartlist_get(slice1->list, si);
-    /* Store the last results. */
-    memcpy(prev, result, a_size);
-
-    int sj = slice2->offset;
-    if (direction == -1) {
-      sj += (slice2->len-1);
-    }
-
-    for (int j = 0; j < slice2->len; ++j, sj+=direction) {
-
-      const cdline_t *line2 = smartlist_get(slice2->list, sj);
-      if (lines_eq(line1, line2)) {
-        /* If the lines are equal, the lcs is one line longer. */
-        result[j + 1] = prev[j] + 1;
-      } else {
-        /* If not, see what lcs parent path is longer. */
-        result[j + 1] = MAX(result[j], prev[j + 1]);
-      }
-    }
-  }
-  tor_free(prev);
-  return result;
-}
-
 /** Helper: Trim any number of lines that are equally at the start or the end
  * of both slices.
  */
@@ -282,51 +231,139 @@ set_changed(bitarray_t *changed1, bitarray_t *changed2,
   }
 }
 
-/*
- * Helper: Given that slice1 has been split by half into top and bot, we want
- * to fetch the column at which to split slice2 so that we are still on track
- * to the optimal diff solution, i.e. the shortest one. We use lcs_lengths
- * since the shortest diff is just another way to say the longest common
- * subsequence.
+/** Helper: Find a point at which we can split slice1 and slice2, such that
+ * a shortest edit script between them passes through it.  Store that point,
+ * as a number of lines from the start of each slice, in *<b>x_out</b> and
+ * *<b>y_out</b>.
+ *
+ * This is the "middle snake" search from Eugene W. Myers, "An O(ND)
+ * Difference Algorithm and Its Variations" (1986).  We search forward from
+ * the start of the slices and backward from their ends, one edit at a time,
+ * until the two paths meet.  Given N total lines and D lines to add or
+ * remove, this takes O(ND) time and O(N) space.
+ *
+ * The slices must hold at least two lines each, and must have been passed
+ * through trim_slices().  Then D is at least 2, and the point we find is
+ * never at the start or end of both slices.
  */
-static int
-optimal_column_to_split(const smartlist_slice_t *top,
-                        const smartlist_slice_t *bot,
-                        const smartlist_slice_t *slice2)
+STATIC void
+find_middle_snake(const smartlist_slice_t *slice1,
+                  const smartlist_slice_t *slice2,
+                  int *x_out, int *y_out)
 {
-  int *lens_top = lcs_lengths(top, slice2, 1);
-  int *lens_bot = lcs_lengths(bot, slice2, -1);
-  int column=0, max_sum=-1;
-
-  for (int i = 0; i < slice2->len+1; ++i) {
-    int sum = lens_top[i] + lens_bot[slice2->len-i];
-    if (sum > max_sum) {
-      column = i;
-      max_sum = sum;
+  const int len1 = slice1->len, len2 = slice2->len;
+  const int delta = len1 - len2;
+  /* If delta is odd, the paths can first meet on a forward step; otherwise
+   * on a backward one. */
+  const int front = (delta & 1);
+  const int max_d = (len1 + len2 + 1) / 2;
+  const int v_offset = max_d + 1;
+  const int v_len = 2 * max_d + 3;
+  /* fwd[v_offset+k] is how many lines of slice1 the furthest forward path
+   * along diagonal k (that is, x - y == k) has consumed so far; bwd is the
+   * same for backward paths, counting from the end. -1 means "none yet". */
+  int *fwd = tor_malloc(sizeof(int) * v_len);
+  int *bwd = tor_malloc(sizeof(int) * v_len);
+  /* How far to stay away from the edges of the diagonals we explore, once
+   * paths along them have run off the end of one of the slices. */
+  int fwd_start = 0, fwd_end = 0, bwd_start = 0, bwd_end = 0;
+  int d, k;
+
+  memset(fwd, 0xff, sizeof(int) * v_len);
+  memset(bwd, 0xff, sizeof(int) * v_len);
+  fwd[v_offset + 1] = bwd[v_offset + 1] = 0;
+
+  for (d = 0; d <= max_d; ++d) {
+    /* Extend the forward paths by one edit each. */
+    for (k = -d + fwd_start; k <= d - fwd_end; k += 2) {
+      int x, y;
+      if (k == -d || (k != d && fwd[v_offset+k-1] < fwd[v_offset+k+1])) {
+        x = fwd[v_offset+k+1];
+      } else {
+        x = fwd[v_offset+k-1] + 1;
+      }
+      y = x - k;
+      while (x < len1 && y < len2 &&
+             lines_eq(smartlist_get(slice1->list, slice1->offset + x),
+                      smartlist_get(slice2->list, slice2->offset + y))) {
+        ++x;
+        ++y;
+      }
+      fwd[v_offset+k] = x;
+      if (x > len1) {
+        fwd_end += 2;
+      } else if (y > len2) {
+        fwd_start += 2;
+      } else if (front) {
+        int bk = v_offset + delta - k;
+        if (bk >= 0 && bk < v_len && bwd[bk] != -1 &&
+            x >= len1 - bwd[bk]) {
+          *x_out = x;
+          *y_out = y;
+          goto done;
+        }
+      }
+    }
+
+    /* Extend the backward paths by one edit each. */
+    for (k = -d + bwd_start; k <= d - bwd_end; k += 2) {
+      int x, y;
+      if (k == -d || (k != d && bwd[v_offset+k-1] < bwd[v_offset+k+1])) {
+        x = bwd[v_offset+k+1];
+      } else {
+        x = bwd[v_offset+k-1] + 1;
+      }
+      y = x - k;
+      while (x < len1 && y < len2 &&
+             lines_eq(smartlist_get(slice1->list,
+                                    slice1->offset + len1 - x - 1),
+                      smartlist_get(slice2->list,
+                                    slice2->offset + len2 - y - 1))) {
+        ++x;
+        ++y;
+      }
+      bwd[v_offset+k] = x;
+      if (x > len1) {
+        bwd_end += 2;
+      } else if (y > len2) {
+        bwd_start += 2;
+      } else if (!front) {
+        int fk = v_offset + delta - k;
+        if (fk >= 0 && fk < v_len && fwd[fk] != -1 &&
+            fwd[fk] >= len1 - x) {
+          *x_out = fwd[fk];
+          *y_out = fwd[fk] - (delta - k);
+          goto done;
+        }
+      }
     }
   }
-  tor_free(lens_top);
-  tor_free(lens_bot);
 
-  return column;
+  /* LCOV_EXCL_START -- the paths always meet by the time d reaches max_d */
+  tor_assert_nonfatal_unreached();
+  *x_out = len1 / 2;
+  *y_out = len2 / 2;
+  /* LCOV_EXCL_STOP */
+
+ done:
+  tor_free(fwd);
+  tor_free(bwd);
 }
 
 /**
  * Helper: Figure out what elements are new or gone on the second smartlist
- * relative to the first smartlist, and store the booleans in the bitarrays.
- * True on the first bitarray means the element is gone, true on the second
- * bitarray means it's new.
+ * relative to the first smartlist, as for calc_changes, by splitting the
+ * slices recursively.
  *
  * In its base case, either of the smartlists is of length <= 1 and we can
- * quickly see what elements are new or are gone. In the other case, we will
- * split one smartlist by half and we'll use optimal_column_to_split to find
- * the optimal column at which to split the second smartlist so that we are
- * finding the smallest diff possible.
+ * quickly see what elements are new or are gone. In the other case, we use
+ * find_middle_snake to find a point on a shortest edit script between the
+ * two smartlists, split both of them there, and handle each half in turn.
  */
-STATIC void
-calc_changes(smartlist_slice_t *slice1,
-             smartlist_slice_t *slice2,
-             bitarray_t *changed1, bitarray_t *changed2)
+static void
+calc_changes_split(smartlist_slice_t *slice1,
+                   smartlist_slice_t *slice2,
+                   bitarray_t *changed1, bitarray_t *changed2)
 {
   trim_slices(slice1, slice2);
 
@@ -336,24 +373,21 @@ calc_changes(smartlist_slice_t *slice1,
   } else if (slice2->len <= 1) {
     set_changed(changed2, changed1, slice2, slice1);
 
-  /* Keep on splitting the slices in two. */
+  /* Split the slices where a shortest edit script crosses their middle. */
   } else {
     smartlist_slice_t *top, *bot, *left, *right;
+    int mid1, mid2;
 
-    /* Split the first slice in half. */
-    int mid = slice1->len/2;
-    top = smartlist_slice(slice1->list, slice1->offset, slice1->offset+mid);
-    bot = smartlist_slice(slice1->list, slice1->offset+mid,
+    find_middle_snake(slice1, slice2, &mid1, &mid2);
+    top = smartlist_slice(slice1->list, slice1->offset, slice1->offset+mid1);
+    bot = smartlist_slice(slice1->list, slice1->offset+mid1,
         slice1->offset+slice1->len);
-
-    /* Split the second slice by the optimal column. */
-    int mid2 = optimal_column_to_split(top, bot, slice2);
     left = smartlist_slice(slice2->list, slice2->offset, slice2->offset+mid2);
     right = smartlist_slice(slice2->list, slice2->offset+mid2,
         slice2->offset+slice2->len);
 
-    calc_changes(top, left, changed1, changed2);
-    calc_changes(bot, right, changed1, changed2);
+    calc_changes_split(top, left, changed1, changed2);
+    calc_changes_split(bot, right, changed1, changed2);
     tor_free(top);
     tor_free(bot);
     tor_free(left);
@@ -361,6 +395,137 @@ calc_changes(smartlist_slice_t *slice1,
   }
 }
 
+/** A line from one of the two slices passed to calc_changes, along with
+ * where it came from. */
+typedef struct sorted_line_t {
+  const cdline_t *line;
+  /** 0 for the first slice, 1 for the second. */
+  int which;
+  /** Position of the line within its slice. */
+  int idx;
+} sorted_line_t;
+
+/** Helper for qsort: order sorted_line_t by the contents of their lines. */
+static int
+compare_sorted_lines_(const void *a_, const void *b_)
+{
+  const cdline_t *a = ((const sorted_line_t *)a_)->line;
+  const cdline_t *b = ((const sorted_line_t *)b_)->line;
+  int r = fast_memcmp(a->s, b->s, MIN(a->len, b->len));
+  if (r)
+    return r;
+  if (a->len != b->len)
+    return a->len < b->len ? -1 : 1;
+  return 0;
+}
+
+/** Don't bother looking for lines that only one slice has unless there are
+ * at least this many lines in both slices together. */
+#define MIN_LINES_TO_DISCARD 64
+
+/**
+ * Helper: Figure out what elements are new or gone on the second smartlist
+ * relative to the first smartlist, and store the booleans in the bitarrays.
+ * True on the first bitarray means the element is gone, true on the second
+ * bitarray means it's new.
+ *
+ * A line that appears in only one of the slices can't be part of any common
+ * subsequence, so when the slices are large, we mark those lines as changed
+ * first, and only diff the rest with calc_changes_split.  When routers have
+ * come and gone, that leaves far fewer lines to diff.
+ */
+STATIC void
+calc_changes(smartlist_slice_t *slice1,
+             smartlist_slice_t *slice2,
+             bitarray_t *changed1, bitarray_t *changed2)
+{
+  trim_slices(slice1, slice2);
+
+  const int len1 = slice1->len, len2 = slice2->len;
+  if (len1 <= 1 || len2 <= 1 || len1 + len2 < MIN_LINES_TO_DISCARD) {
+    calc_changes_split(slice1, slice2, changed1, changed2);
+    return;
+  }
+
+  sorted_line_t *sorted = tor_calloc(len1 + len2, sizeof(sorted_line_t));
+  bitarray_t *matched1 = bitarray_init_zero(len1);
+  bitarray_t *matched2 = bitarray_init_zero(len2);
+  int i, j, n1 = 0, n2 = 0;
+
+  for (i = 0; i < len1; ++i) {
+    sorted[i].line = smartlist_get(slice1->list, slice1->offset + i);
+    sorted[i].which = 0;
+    sorted[i].idx = i;
+  }
+  for (i = 0; i < len2; ++i) {
+    sorted[len1+i].line = smartlist_get(slice2->list, slice2->offset + i);
+    sorted[len1+i].which = 1;
+    sorted[len1+i].idx = i;
+  }
+  qsort(sorted, len1 + len2, sizeof(sorted_line_t), compare_sorted_lines_);
+
+  /* Find each run of equal lines, and see whether both slices have it. */
+  for (i = 0; i < len1 + len2; i = j) {
+    int seen[2] = { 0, 0 };
+    for (j = i; j < len1 + len2 &&
+           lines_eq(sorted[i].line, sorted[j].line); ++j) {
+      seen[sorted[j].which] = 1;
+    }
+    if (seen[0] && seen[1]) {
+      for ( ; i < j; ++i) {
+        bitarray_set(sorted[i].which ? matched2 : matched1, sorted[i].idx);
+      }
+    }
+  }
+  tor_free(sorted);
+
+  /* Diff the lines that both slices have, and map the results back. */
+  smartlist_t *kept1 = smartlist_new(), *kept2 = smartlist_new();
+  int *map1 = tor_calloc(len1, sizeof(int));
+  int *map2 = tor_calloc(len2, sizeof(int));
+  for (i = 0; i < len1; ++i) {
+    if (bitarray_is_set(matched1, i)) {
+      map1[n1++] = slice1->offset + i;
+      smartlist_add(kept1, smartlist_get(slice1->list, slice1->offset + i));
+    } else {
+      bitarray_set(changed1, slice1->offset + i);
+    }
+  }
+  for (i = 0; i < len2; ++i) {
+    if (bitarray_is_set(matched2, i)) {
+      map2[n2++] = slice2->offset + i;
+      smartlist_add(kept2, smartlist_get(slice2->list, slice2->offset + i));
+    } else {
+      bitarray_set(changed2, slice2->offset + i);
+    }
+  }
+
+  bitarray_t *kept_changed1 = bitarray_init_zero(n1);
+  bitarray_t *kept_changed2 = bitarray_init_zero(n2);
+  smartlist_slice_t *kept1_sl = smartlist_slice(kept1, 0, -1);
+  smartlist_slice_t *kept2_sl = smartlist_slice(kept2, 0, -1);
+  calc_changes_split(kept1_sl, kept2_sl, kept_changed1, kept_changed2);
+  for (i = 0; i < n1; ++i) {
+    if (bitarray_is_set(kept_changed1, i))
+      bitarray_set(changed1, map1[i]);
+  }
+  for (i = 0; i < n2; ++i) {
+    if (bitarray_is_set(kept_changed2, i))
+      bitarray_set(changed2, map2[i]);
+  }
+
+  tor_free(kept1_sl);
+  tor_free(kept2_sl);
+  bitarray_free(kept_changed1);
+  bitarray_free(kept_changed2);
+  bitarray_free(matched1);
+  bitarray_free(matched2);
+  smartlist_free(kept1);
+  smartlist_free(kept2);
+  tor_free(map1);
+  tor_free(map2);
+}
+
 /* This table is from crypto.c. The SP and PAD defines are different. */
 #define NOT_VALID_BASE64 255
 #define X NOT_VALID_BASE64
@@ -610,7 +775,7 @@ preprocess_consensus(memarea_t *area,
  * in one of the inputs, or are newly allocated lines in the provided memarea.
  *
  * This implementation is consensus-specific. To generate an ed diff for any
- * given input in quadratic time, you can replace all the code until the
+ * given input in O(ND) time, you can replace all the code until the
  * navigation in reverse order with the following:
  *
  *   int len1 = smartlist_len(cons1);
@@ -848,110 +1013,180 @@ get_linenum(const char **s, int *num_out)
   }
 }
 
-/** Apply the ed diff, starting at <b>diff_starting_line</b>, to the consensus
- * and return a new consensus, also as a line-based smartlist. Will return
- * NULL if the ed diff is not properly formatted.
- *
- * All cdline_t objects in the resulting object are references to lines
- * in one of the inputs; nothing is copied.
+/** One command from an ed diff, as parsed by parse_ed_command(). */
+typedef struct ed_command_t {
+  /** The first and last lines of the base consensus that the command acts
+   * on, counting from 1.  For an 'a' command, both are the line after which
+   * to add new lines. */
+  int start;
+  int end;
+  /** One of 'a', 'c', or 'd'. */
+  char action;
+  /** For 'a' and 'c' commands, the position in the diff of the first line
+   * to add, and the number of lines to add.  (Only apply_ed_diff_str()
+   * uses these.) */
+  int first_added;
+  int n_added;
+} ed_command_t;
+
+/** Helper: Parse the ed command in <b>line</b> into *<b>cmd_out</b>, for a
+ * base consensus of <b>n_lines</b> lines.  Since commands must come in
+ * reverse order, no command may refer to a line after line <b>j</b>.  Return
+ * 0 on success; log a warning and return -1 on failure.
  */
-STATIC smartlist_t *
-apply_ed_diff(const smartlist_t *cons1, const smartlist_t *diff,
-              int diff_starting_line)
+static int
+parse_ed_command(const cdline_t *line, int n_lines, int j,
+                 ed_command_t *cmd_out)
 {
-  int diff_len = smartlist_len(diff);
-  int j = smartlist_len(cons1);
-  smartlist_t *cons2 = smartlist_new();
-
-  for (int i=diff_starting_line; i<diff_len; ++i) {
-    const cdline_t *diff_cdline = smartlist_get(diff, i);
-    char diff_line[128];
+  char diff_line[128];
 
-    if (diff_cdline->len > sizeof(diff_line) - 1) {
+  if (line->len > sizeof(diff_line) - 1) {
+    log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
+             "an ed command was far too long");
+    return -1;
+  }
+  /* Copy the line to make it nul-terminated. */
+  memcpy(diff_line, line->s, line->len);
+  diff_line[line->len] = 0;
+  const char *ptr = diff_line;
+  int start = 0, end = 0;
+  int had_range = 0;
+  int end_was_eof = 0;
+  if (get_linenum(&ptr, &start) < 0) {
+    log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
+             "an ed command was missing a line number.");
+    return -1;
+  }
+  if (*ptr == ',') {
+    /* Two-item range */
+    had_range = 1;
+    ++ptr;
+    if (*ptr == '$') {
+      end_was_eof = 1;
+      end = n_lines;
+      ++ptr;
+    } else if (get_linenum(&ptr, &end) < 0) {
       log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
-               "an ed command was far too long");
-      goto error_cleanup;
+               "an ed command was missing a range end line number.");
+      return -1;
     }
-    /* Copy the line to make it nul-terminated. */
-    memcpy(diff_line, diff_cdline->s, diff_cdline->len);
-    diff_line[diff_cdline->len] = 0;
-    const char *ptr = diff_line;
-    int start = 0, end = 0;
-    int had_range = 0;
-    int end_was_eof = 0;
-    if (get_linenum(&ptr, &start) < 0) {
+    /* Incoherent range. */
+    if (end <= start) {
       log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
-               "an ed command was missing a line number.");
-      goto error_cleanup;
-    }
-    if (*ptr == ',') {
-      /* Two-item range */
-      had_range = 1;
-      ++ptr;
-      if (*ptr == '$') {
-        end_was_eof = 1;
-        end = smartlist_len(cons1);
-        ++ptr;
-      } else if (get_linenum(&ptr, &end) < 0) {
-        log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
-                 "an ed command was missing a range end line number.");
-        goto error_cleanup;
-      }
-      /* Incoherent range. */
-      if (end <= start) {
-        log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
-                 "an invalid range was found in an ed command.");
-        goto error_cleanup;
-      }
-    } else {
-      /* We'll take <n1> as <n1>,<n1> for simplicity. */
-      end = start;
+               "an invalid range was found in an ed command.");
+      return -1;
     }
+  } else {
+    /* We'll take <n1> as <n1>,<n1> for simplicity. */
+    end = start;
+  }
 
-    if (end > j) {
-      log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
-          "its commands are not properly sorted in reverse order.");
-      goto error_cleanup;
-    }
+  if (end > j) {
+    log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
+        "its commands are not properly sorted in reverse order.");
+    return -1;
+  }
 
-    if (*ptr == '\0') {
-      log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
-               "a line with no ed command was found");
-      goto error_cleanup;
-    }
+  if (*ptr == '\0') {
+    log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
+             "a line with no ed command was found");
+    return -1;
+  }
+
+  if (*(ptr+1) != '\0') {
+    log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
+        "an ed command longer than one char was found.");
+    return -1;
+  }
+
+  char action = *ptr;
 
-    if (*(ptr+1) != '\0') {
+  switch (action) {
+    case 'a':
+    case 'c':
+    case 'd':
+      break;
+    default:
       log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
-          "an ed command longer than one char was found.");
-      goto error_cleanup;
-    }
+          "an unrecognised ed command was found.");
+      return -1;
+  }
 
-    char action = *ptr;
+  /** $ is not allowed with non-d actions. */
+  if (end_was_eof && action != 'd') {
+    log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
+             "it wanted to use $ with a command other than delete");
+    return -1;
+  }
 
-    switch (action) {
-      case 'a':
-      case 'c':
-      case 'd':
-        break;
-      default:
-        log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
-            "an unrecognised ed command was found.");
-        goto error_cleanup;
-    }
+  /* 'a' commands are not allowed to have ranges. */
+  if (had_range && action == 'a') {
+    log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
+        "it wanted to add lines after a range.");
+    return -1;
+  }
 
-    /** $ is not allowed with non-d actions. */
-    if (end_was_eof && action != 'd') {
+  cmd_out->start = start;
+  cmd_out->end = end;
+  cmd_out->action = action;
+  return 0;
+}
+
+/** Helper: Given that line <b>i</b> of <b>diff</b> is an 'a' or 'c' command,
+ * return the index of the "." line that ends the lines it adds.  Log a
+ * warning and return -1 if there is no such line, or if the command adds no
+ * lines at all.
+ */
+static int
+find_end_of_added_lines(const smartlist_t *diff, int i)
+{
+  const int diff_len = smartlist_len(diff);
+  const int added_end = i;
+
+  i++; /* Skip the line with the range and command. */
+  while (i < diff_len) {
+    if (line_str_eq(smartlist_get(diff, i), ".")) {
+      break;
+    }
+    if (++i == diff_len) {
       log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
-               "it wanted to use $ with a command other than delete");
-      goto error_cleanup;
+          "it has lines to be inserted that don't end with a \".\".");
+      return -1;
     }
+  }
 
-    /* 'a' commands are not allowed to have ranges. */
-    if (had_range && action == 'a') {
-      log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
-          "it wanted to add lines after a range.");
+  /* It would make no sense to add zero new lines. */
+  if (i-1 == added_end) {
+    log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
+        "it has an ed command that tries to insert zero lines.");
+    return -1;
+  }
+  return i;
+}
+
+/** Apply the ed diff, starting at <b>diff_starting_line</b>, to the consensus
+ * and return a new consensus, also as a line-based smartlist. Will return
+ * NULL if the ed diff is not properly formatted.
+ *
+ * All cdline_t objects in the resulting object are references to lines
+ * in one of the inputs; nothing is copied.
+ */
+STATIC smartlist_t *
+apply_ed_diff(const smartlist_t *cons1, const smartlist_t *diff,
+              int diff_starting_line)
+{
+  int diff_len = smartlist_len(diff);
+  int j = smartlist_len(cons1);
+  smartlist_t *cons2 = smartlist_new();
+
+  for (int i=diff_starting_line; i<diff_len; ++i) {
+    ed_command_t cmd;
+    if (parse_ed_command(smartlist_get(diff, i), smartlist_len(cons1), j,
+                         &cmd) < 0) {
       goto error_cleanup;
     }
+    const int start = cmd.start, end = cmd.end;
+    const char action = cmd.action;
 
     /* Add unchanged lines. */
     for (; j && j > end; --j) {
@@ -972,27 +1207,12 @@ apply_ed_diff(const smartlist_t *cons1, const smartlist_t *diff,
     if (action == 'a' || action == 'c') {
       int added_end = i;
 
-      i++; /* Skip the line with the range and command. */
-      while (i < diff_len) {
-        if (line_str_eq(smartlist_get(diff, i), ".")) {
-          break;
-        }
-        if (++i == diff_len) {
-          log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
-              "it has lines to be inserted that don't end with a \".\".");
-          goto error_cleanup;
-        }
-      }
-
-      int added_i = i-1;
-
-      /* It would make no sense to add zero new lines. */
-      if (added_i == added_end) {
-        log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
-            "it has an ed command that tries to insert zero lines.");
+      i = find_end_of_added_lines(diff, i);
+      if (i < 0) {
         goto error_cleanup;
       }
 
+      int added_i = i-1;
       while (added_i > added_end) {
         cdline_t *added_line = smartlist_get(diff, added_i--);
         smartlist_add(cons2, added_line);
@@ -1017,6 +1237,118 @@ apply_ed_diff(const smartlist_t *cons1, const smartlist_t *diff,
   return NULL;
 }
 
+/** Helper: Advance *<b>pos</b>, which points to the start of line
+ * *<b>line_no</b>+1 of a document made of NL-terminated lines, until it points
+ * to the start of line <b>target</b>+1.
+ */
+static inline void
+skip_lines(const char **pos, const char *eos, int *line_no, int target)
+{
+  for ( ; *line_no < target; ++*line_no) {
+    const char *eol = memchr(*pos, '\n', eos - *pos);
+    tor_assert(eol);
+    *pos = eol + 1;
+  }
+}
+
+/** Don't add the output of apply_ed_diff_str() to its digest until we have
+ * at least this many bytes of it: feeding the digest a line or two at a
+ * time is far slower than hashing the whole document at once. */
+#define DIGEST_CHUNK_LEN (64*1024)
+
+/** Like apply_ed_diff, but take the consensus as <b>cons1_len</b> bytes of
+ * text at <b>cons1</b>, and return the new consensus as a newly allocated
+ * NUL-terminated string, with its length in *<b>len_out</b>.  Add the new
+ * consensus to <b>digest</b> as we write it, while it's still in cache.
+ *
+ * We never split the consensus into lines: once we've checked the commands,
+ * we walk through it once, copying each unchanged run of lines at a time.
+ * So we need no more memory than the two documents take up themselves.
+ */
+STATIC char *
+apply_ed_diff_str(const char *cons1, size_t cons1_len,
+                  const smartlist_t *diff, int diff_starting_line,
+                  crypto_digest_t *digest, size_t *len_out)
+{
+  const char *eos = cons1 + cons1_len;
+  const int diff_len = smartlist_len(diff);
+  ed_command_t *cmds = NULL;
+  int n_cmds = 0, n_lines, j, c;
+  size_t added_len = 0;
+  char *result = NULL;
+
+  n_lines = consensus_count_lines(cons1, cons1_len);
+  if (n_lines < 0) {
+    log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
+             "the base consensus was not made of complete lines.");
+    return NULL;
+  }
+
+  /* Check every command before we write anything, remembering where the
+   * lines each one adds come from. */
+  cmds = tor_calloc(MAX(diff_len, 1), sizeof(ed_command_t));
+  j = n_lines;
+  for (int i = diff_starting_line; i < diff_len; ++i) {
+    ed_command_t *cmd = &cmds[n_cmds++];
+    if (parse_ed_command(smartlist_get(diff, i), n_lines, j, cmd) < 0) {
+      goto done;
+    }
+    j = (cmd->action == 'a') ? cmd->end : cmd->start - 1;
+    if (cmd->action == 'a' || cmd->action == 'c') {
+      cmd->first_added = i + 1;
+      i = find_end_of_added_lines(diff, i);
+      if (i < 0) {
+        goto done;
+      }
+      cmd->n_added = i - cmd->first_added;
+      for (int k = cmd->first_added; k < i; ++k) {
+        added_len += ((const cdline_t *)smartlist_get(diff, k))->len + 1;
+      }
+    }
+  }
+
+  /* Now apply the commands from the start of the consensus to its end,
+   * which is the opposite of the order in which they appear. */
+  result = tor_malloc(cons1_len + added_len + 1);
+  char *out = result, *hashed = result;
+  const char *pos = cons1;
+  int line_no = 0;
+  for (c = n_cmds - 1; c >= 0; --c) {
+    const ed_command_t *cmd = &cmds[c];
+    const char *unchanged = pos;
+    skip_lines(&pos, eos, &line_no,
+               (cmd->action == 'a') ? cmd->start : cmd->start - 1);
+    memcpy(out, unchanged, pos - unchanged);
+    out += pos - unchanged;
+    if (cmd->action == 'c' || cmd->action == 'd') {
+      skip_lines(&pos, eos, &line_no, cmd->end);
+    }
+    if (cmd->action == 'a' || cmd->action == 'c') {
+      for (int k = 0; k < cmd->n_added; ++k) {
+        const cdline_t *line = smartlist_get(diff, cmd->first_added + k);
+        memcpy(out, line->s, line->len);
+        out += line->len;
+        *out++ = '\n';
+      }
+    }
+    if (out - hashed >= DIGEST_CHUNK_LEN) {
+      crypto_digest_add_bytes(digest, hashed, out - hashed);
+      hashed = out;
+    }
+  }
+  memcpy(out, pos, eos - pos);
+  out += eos - pos;
+  crypto_digest_add_bytes(digest, hashed, out - hashed);
+  *out = '\0';
+
+  *len_out = out - result;
+  result = tor_realloc(result, *len_out + 1);
+
+ done:
+  tor_free(cmds);
+  return result;
+}
+
 /** Generate a consensus diff as a smartlist from two given consensuses, also
  * as smartlists. Will return NULL if the consensus diff could not be
  * generated. Neither of the two consensuses are modified in any way, so it's
@@ -1183,18 +1515,20 @@ consdiff_get_digests(const smartlist_t *diff,
   return 1;
 }
 
-/** Apply the consensus diff to the given consensus and return a new
- * consensus, also as a line-based smartlist. Will return NULL if the diff
- * could not be applied. Neither the consensus nor the diff are modified in
- * any way, so it's up to the caller to free their resources.
+/** Apply the consensus diff to the <b>cons1_len</b>-byte consensus at
+ * <b>cons1</b>, and return a new consensus as a newly allocated string.
+ * Will return NULL if the diff could not be applied. Neither the consensus
+ * nor the diff are modified in any way, so it's up to the caller to free
+ * their resources.
  */
 char *
-consdiff_apply_diff(const smartlist_t *cons1,
+consdiff_apply_diff(const char *cons1, size_t cons1_len,
                     const smartlist_t *diff,
                     const consensus_digest_t *digests1)
 {
-  smartlist_t *cons2 = NULL;
+  crypto_digest_t *cons2_digest = NULL;
   char *cons2_str = NULL;
+  size_t cons2_len = 0;
   char e_cons1_hash[DIGEST256_LEN];
   char e_cons2_hash[DIGEST256_LEN];
 
@@ -1219,26 +1553,22 @@ consdiff_apply_diff(const smartlist_t *cons1,
     goto error_cleanup;
   }
 
-  /* Grab the ed diff and calculate the resulting consensus. */
+  /* Grab the ed diff and calculate the resulting consensus, computing its
+   * digest as we go. */
   /* Skip the first two lines. */
-  cons2 = apply_ed_diff(cons1, diff, 2);
+  cons2_digest = crypto_digest256_new(DIGEST_SHA3_256);
+  cons2_str = apply_ed_diff_str(cons1, cons1_len, diff, 2,
+                                cons2_digest, &cons2_len);
 
-  /* ed diff could not be applied - reason already logged by apply_ed_diff. */
-  if (!cons2) {
+  /* ed diff could not be applied - reason already logged by
+   * apply_ed_diff_str. */
+  if (!cons2_str) {
     goto error_cleanup;
   }
 
-  cons2_str = consensus_join_lines(cons2);
-
   consensus_digest_t cons2_digests;
-  if (consensus_compute_digest(cons2_str, strlen(cons2_str),
-                               &cons2_digests) < 0) {
-    /* LCOV_EXCL_START -- digest can't fail */
-    log_warn(LD_CONSDIFF, "Could not compute digests of the consensus "
-        "resulting from applying a consensus diff.");
-    goto error_cleanup;
-    /* LCOV_EXCL_STOP */
-  }
+  crypto_digest_get_digest(cons2_digest, (char *)cons2_digests.sha3_256,
+                           DIGEST256_LEN);
 
   /* See that the resulting consensus matches its hash. */
   if (!consensus_digest_eq(cons2_digests.sha3_256,
@@ -1263,9 +1593,7 @@ consdiff_apply_diff(const smartlist_t *cons1,
   tor_free(cons2_str); /* Sets it to NULL */
 
  done:
-  if (cons2) {
-    smartlist_free(cons2);
-  }
+  crypto_digest_free(cons2_digest);
 
   return cons2_str;
 }
@@ -1311,6 +1639,27 @@ consensus_split_lines(smartlist_t *out,
   return 0;
 }
 
+/**
+ * Helper: Return the number of NL-terminated lines in <b>s</b>, or -1 if
+ * consensus_split_lines() would reject it.
+ */
+STATIC int
+consensus_count_lines(const char *s, size_t len)
+{
+  const char *end_of_str = s + len;
+  int n = 0;
+
+  while (s < end_of_str) {
+    const char *eol = memchr(s, '\n', end_of_str - s);
+    if (!eol || eol - s > CONSENSUS_LINE_MAX_LEN || n == INT_MAX) {
+      return -1;
+    }
+    ++n;
+    s = eol+1;
+  }
+  return n;
+}
+
 /** Given a list of cdline_t, return a newly allocated string containing
  * all of the lines, terminated with NL, concatenated.
  *
@@ -1384,7 +1733,7 @@ consensus_diff_apply(const char *consensus,
                      size_t diff_len)
 {
   consensus_digest_t d1;
-  smartlist_t *lines1 = NULL, *lines2 = NULL;
+  smartlist_t *lines2 = NULL;
   int r1;
   char *result = NULL;
   memarea_t *area = memarea_new();
@@ -1393,17 +1742,15 @@ consensus_diff_apply(const char *consensus,
   if (BUG(r1 < 0))
     goto done;
 
-  lines1 = smartlist_new();
+  /* We only split the diff into lines: the consensus itself is much larger,
+   * so we apply the diff to its text directly. */
   lines2 = smartlist_new();
-  if (consensus_split_lines(lines1, consensus, consensus_len, area) < 0)
-    goto done;
   if (consensus_split_lines(lines2, diff, diff_len, area) < 0)
     goto done;
 
-  result = consdiff_apply_diff(lines1, lines2, &d1);
+  result = consdiff_apply_diff(consensus, consensus_len, lines2, &d1);
 
  done:
-  smartlist_free(lines1);
   smartlist_free(lines2);
   memarea_drop_all(area);
 
@@ -41,7 +41,7 @@ STATIC smartlist_t *consdiff_gen_diff(const smartlist_t *cons1,
                                       const consensus_digest_t *digests1,
                                       const consensus_digest_t *digests2,
                                       struct memarea_t *area);
-STATIC char *consdiff_apply_diff(const smartlist_t *cons1,
+STATIC char *consdiff_apply_diff(const char *cons1, size_t cons1_len,
                                  const smartlist_t *diff,
                                  const consensus_digest_t *digests1);
 STATIC int consdiff_get_digests(const smartlist_t *diff,
@@ -66,14 +66,18 @@ STATIC smartlist_t *gen_ed_diff(const smartlist_t *cons1,
 STATIC smartlist_t *apply_ed_diff(const smartlist_t *cons1,
                                   const smartlist_t *diff,
                                   int start_line);
+STATIC char *apply_ed_diff_str(const char *cons1, size_t cons1_len,
+                               const smartlist_t *diff, int start_line,
+                               struct crypto_digest_t *digest,
+                               size_t *len_out);
 STATIC void calc_changes(smartlist_slice_t *slice1, smartlist_slice_t *slice2,
                          bitarray_t *changed1, bitarray_t *changed2);
 STATIC smartlist_slice_t *smartlist_slice(const smartlist_t *list,
                                           int start, int end);
 STATIC int next_router(const smartlist_t *cons, int cur);
-STATIC int *lcs_lengths(const smartlist_slice_t *slice1,
-                        const smartlist_slice_t *slice2,
-                        int direction);
+STATIC void find_middle_snake(const smartlist_slice_t *slice1,
+                              const smartlist_slice_t *slice2,
+                              int *x_out, int *y_out);
 STATIC void trim_slices(smartlist_slice_t *slice1, smartlist_slice_t *slice2);
 STATIC int base64cmp(const cdline_t *hash1, const cdline_t *hash2);
 STATIC int get_id_hash(const cdline_t *line, cdline_t *hash_out);
@@ -86,6 +90,7 @@ STATIC void set_changed(bitarray_t *changed1, bitarray_t *changed2,
 STATIC int consensus_split_lines(smartlist_t *out,
                                  const char *s, size_t len,
                                  struct memarea_t *area);
+STATIC int consensus_count_lines(const char *s, size_t len);
 STATIC void smartlist_add_linecpy(smartlist_t *lst, struct memarea_t *area,
                                   const char *s);
 STATIC int lines_eq(const cdline_t *a, const cdline_t *b);
@@ -29,6 +29,13 @@ static token_rule_t dir_key_certificate_table[] = {
 };
 // clang-format on
 
+/** Called on startup: index our token table. */
+void
+authcert_parse_init(void)
+{
+  token_table_add_index(dir_key_certificate_table);
+}
+
 /** Parse a key certificate from <b>s</b>; point <b>end-of-string</b> to
  * the first character after the certificate. */
 authority_cert_t *
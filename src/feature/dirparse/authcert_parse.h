@@ -15,5 +15,6 @@
 authority_cert_t *authority_cert_parse_from_string(const char *s,
                                                    size_t maxlen,
                                                    const char **end_of_string);
+void authcert_parse_init(void);
 
 #endif /* !defined(TOR_AUTHCERT_PARSE_H) */
@@ -42,6 +42,13 @@ static token_rule_t microdesc_token_table[] = {
 };
 // clang-format on
 
+/** Called on startup: index our token table. */
+void
+microdesc_parse_init(void)
+{
+  token_table_add_index(microdesc_token_table);
+}
+
 /** Assuming that s starts with a microdesc, return the start of the
  * *NEXT* one.  Return NULL on "not found." */
 static const char *
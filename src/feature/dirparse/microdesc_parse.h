@@ -16,5 +16,6 @@ smartlist_t *microdescs_parse_from_string(const char *s, const char *eos,
                                           int allow_annotations,
                                           saved_location_t where,
                                           smartlist_t *invalid_digests_out);
+void microdesc_parse_init(void);
 
 #endif /* !defined(TOR_MICRODESC_PARSE_H) */
@@ -13,6 +13,7 @@
 
 #include "core/or/or.h"
 #include "app/config/config.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/versions.h"
 #include "feature/client/entrynodes.h"
 #include "feature/dirauth/dirvote.h"
@@ -27,6 +28,7 @@
 #include "feature/nodelist/describe.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nickname.h"
+#include "feature/nodelist/nodelist_snapshot.h"
 #include "lib/crypt_ops/crypto_format.h"
 #include "lib/memarea/memarea.h"
 
@@ -153,6 +155,16 @@ static token_rule_t networkstatus_vote_footer_token_table[] = {
 };
 // clang-format on
 
+/** Called on startup: index our token tables. */
+void
+ns_parse_init(void)
+{
+  token_table_add_index(rtrstatus_token_table);
+  token_table_add_index(networkstatus_token_table);
+  token_table_add_index(networkstatus_consensus_token_table);
+  token_table_add_index(networkstatus_vote_footer_token_table);
+}
+
 /** Try to find the start and end of the signed portion of a networkstatus
  * document in <b>s</b>. On success, set <b>start_out</b> to the first
  * character of the document, and <b>end_out</b> to a position one after the
@@ -228,6 +240,28 @@ find_start_of_next_routerstatus(const char *s, const char *s_eos)
     return eos;
 }
 
+/** Helper: given a string <b>s</b> at the start of a line, which is not the
+ * start of a document, return the start of the directory footer or of the
+ * next directory signature.  If neither is found, return the end of the
+ * string. */
+static const char *
+find_start_of_footer(const char *s, const char *eos)
+{
+  const char *footer, *sig;
+  /* Search from the newline before s, so that we notice a footer at s. */
+  footer = tor_memstr(s-1, eos-s+1, "\ndirectory-footer");
+  sig = tor_memstr(s-1, eos-s+1, "\ndirectory-signature");
+
+  if (footer && sig)
+    return MIN(footer, sig) + 1;
+  else if (footer)
+    return footer+1;
+  else if (sig)
+    return sig+1;
+  else
+    return eos;
+}
+
 /** Parse the GuardFraction string from a consensus or vote.
  *
  *  If <b>vote</b> or <b>vote_rs</b> are set the document getting
@@ -298,6 +332,10 @@ routerstatus_parse_guardfraction(const char *guardfraction_str,
  * make that consensus.
  *
  * Parse according to the syntax used by the consensus flavor <b>flav</b>.
+ *
+ * If <b>tokens</b> is not empty, it already holds the tokens for this
+ * routerstatus, in memory that the caller manages; in that case,
+ * <b>area</b> may be NULL.
  **/
 STATIC routerstatus_t *
 routerstatus_parse_entry_from_string(memarea_t *area,
@@ -323,7 +361,8 @@ routerstatus_parse_entry_from_string(memarea_t *area,
 
   eos = find_start_of_next_routerstatus(*s, s_eos);
 
-  if (tokenize_string(area,*s, eos, tokens, rtrstatus_token_table,0)) {
+  if (smartlist_len(tokens) == 0 &&
+      tokenize_string(area,*s, eos, tokens, rtrstatus_token_table,0)) {
     log_warn(LD_DIR, "Error tokenizing router status");
     goto err;
   }
@@ -588,6 +627,142 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   return rs;
 }
 
+/** Smallest number of routerstatus entries that we'll hand to one thread
+ * when tokenizing a networkstatus document in parallel. */
+STATIC int ns_parse_min_rs_per_chunk = 1000;
+
+/** A run of routerstatus entries in a networkstatus document, for one thread
+ * to tokenize. */
+typedef struct rs_chunk_t {
+  /** The start of every routerstatus entry in the document, followed by the
+   * end of the last one. */
+  const char **starts;
+  /** The indices of the first entry in this chunk, and of the first entry
+   * after it. */
+  int lo, hi;
+  /** Where to put the tokens for each entry, indexed like <b>starts</b>.
+   * Entries that we couldn't tokenize get an empty list. */
+  smartlist_t **tokens;
+  /** Memory for the tokens of this chunk. */
+  memarea_t *area;
+} rs_chunk_t;
+
+/** Tokenize every routerstatus entry in the rs_chunk_t <b>arg</b>.  Runs on
+ * a worker thread, so this must not touch anything outside the chunk, except
+ * to log. */
+static void
+rs_chunk_tokenize(void *arg)
+{
+  rs_chunk_t *chunk = arg;
+  int i;
+
+  for (i = chunk->lo; i < chunk->hi; ++i) {
+    smartlist_t *tokens = smartlist_new();
+    if (tokenize_string(chunk->area, chunk->starts[i], chunk->starts[i+1],
+                        tokens, rtrstatus_token_table, 0)) {
+      /* Leave this one for the main thread, so that it gets logged and
+       * dumped just like it would have been without threads. */
+      SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+      smartlist_clear(tokens);
+    }
+    chunk->tokens[i] = tokens;
+  }
+}
+
+/** Parse the routerstatus entries at *<b>s</b> in the networkstatus
+ * document <b>ns</b>, of flavor <b>flav</b>, and add them to
+ * ns-&gt;routerstatus_list in order.  Advance *<b>s</b> past the last of
+ * them.  Use <b>area</b> and <b>tokens</b> as scratch space.
+ *
+ * Tokenizing is most of the work of parsing these entries, so when there are
+ * enough of them and we have worker threads, split them into chunks and
+ * tokenize the chunks in parallel first.  Everything else stays on the main
+ * thread, since it touches shared state. */
+static void
+parse_routerstatus_entries(networkstatus_t *ns, const char **s,
+                           const char *eos, memarea_t *area,
+                           smartlist_t *tokens, consensus_flavor_t flav)
+{
+  smartlist_t *starts = smartlist_new();
+  smartlist_t **entry_tokens = NULL;
+  rs_chunk_t *chunks = NULL;
+  const char *cp = *s;
+  int i, n, n_chunks = 0;
+
+  while (eos - cp >= 2 && fast_memeq(cp, "r ", 2)) {
+    smartlist_add(starts, (char *)cp);
+    cp = find_start_of_next_routerstatus(cp, eos);
+  }
+  n = smartlist_len(starts);
+  smartlist_add(starts, (char *)cp);
+
+  /* One chunk per CPU: the main thread takes one, and the workers the
+   * rest.  (We have one more worker than CPUs, so that there's always a
+   * thread for low-priority work; we don't want that one.) */
+  if (ns_parse_min_rs_per_chunk > 0 && cpuworker_get_n_threads() > 0)
+    n_chunks = MIN(n / ns_parse_min_rs_per_chunk,
+                   get_num_cpus(get_options()));
+  if (n_chunks >= 2) {
+    void **args = tor_calloc(n_chunks, sizeof(void *));
+    entry_tokens = tor_calloc(n, sizeof(smartlist_t *));
+    chunks = tor_calloc(n_chunks, sizeof(rs_chunk_t));
+    for (i = 0; i < n_chunks; ++i) {
+      chunks[i].starts = (const char **)starts->list;
+      chunks[i].lo = (int)((int64_t)n * i / n_chunks);
+      chunks[i].hi = (int)((int64_t)n * (i+1) / n_chunks);
+      chunks[i].tokens = entry_tokens;
+      chunks[i].area = memarea_new();
+      args[i] = &chunks[i];
+    }
+    cpuworker_run_parallel(rs_chunk_tokenize, args, n_chunks);
+    tor_free(args);
+  }
+
+  for (i = 0; i < n; ++i) {
+    const char *entry = smartlist_get(starts, i);
+    const char *entry_eos = smartlist_get(starts, i+1);
+    memarea_t *entry_area = area;
+    smartlist_t *entry_toks = tokens;
+    if (entry_tokens && smartlist_len(entry_tokens[i])) {
+      entry_area = NULL;
+      entry_toks = entry_tokens[i];
+    }
+    if (ns->type != NS_TYPE_CONSENSUS) {
+      vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
+      if (routerstatus_parse_entry_from_string(entry_area, &entry, entry_eos,
+                                               entry_toks, ns, rs, 0, 0)) {
+        smartlist_add(ns->routerstatus_list, rs);
+      } else {
+        vote_routerstatus_free(rs);
+      }
+    } else {
+      routerstatus_t *rs;
+      if ((rs = routerstatus_parse_entry_from_string(entry_area, &entry,
+                                                     entry_eos,
+                                                     entry_toks,
+                                                     NULL, NULL,
+                                                     ns->consensus_method,
+                                                     flav))) {
+        /* Use exponential-backoff scheduling when downloading microdescs */
+        smartlist_add(ns->routerstatus_list, rs);
+      }
+    }
+  }
+  *s = cp;
+
+  if (entry_tokens) {
+    for (i = 0; i < n; ++i)
+      smartlist_free(entry_tokens[i]);
+    tor_free(entry_tokens);
+  }
+  if (chunks) {
+    for (i = 0; i < n_chunks; ++i)
+      memarea_drop_all(chunks[i].area);
+    tor_free(chunks);
+  }
+  smartlist_free(starts);
+}
+
 int
 compare_vote_routerstatus_entries(const void **_a, const void **_b)
 {
@@ -1443,29 +1618,16 @@ networkstatus_parse_vote_from_string(const char *s,
   rs_tokens = smartlist_new();
   rs_area = memarea_new();
   s = end_of_header;
-  ns->routerstatus_list = smartlist_new();
-
-  while (eos - s >= 2 && fast_memeq(s, "r ", 2)) {
-    if (ns->type != NS_TYPE_CONSENSUS) {
-      vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
-      if (routerstatus_parse_entry_from_string(rs_area, &s, eos, rs_tokens, ns,
-                                               rs, 0, 0)) {
-        smartlist_add(ns->routerstatus_list, rs);
-      } else {
-        vote_routerstatus_free(rs);
-      }
-    } else {
-      routerstatus_t *rs;
-      if ((rs = routerstatus_parse_entry_from_string(rs_area, &s, eos,
-                                                     rs_tokens,
-                                                     NULL, NULL,
-                                                     ns->consensus_method,
-                                                     flav))) {
-        /* Use exponential-backoff scheduling when downloading microdescs */
-        smartlist_add(ns->routerstatus_list, rs);
-      }
-    }
+  if (ns->type == NS_TYPE_CONSENSUS &&
+      (ns->routerstatus_list = nodelist_snapshot_get_routerstatuses(flav,
+                               (const uint8_t*)ns_digests.d[DIGEST_SHA256]))) {
+    /* We have parsed this consensus before; skip its routerstatus entries. */
+    s = find_start_of_footer(s, eos);
+  } else {
+    ns->routerstatus_list = smartlist_new();
   }
+
+  parse_routerstatus_entries(ns, &s, eos, rs_area, rs_tokens, flav);
   for (i = 1; i < smartlist_len(ns->routerstatus_list); ++i) {
     routerstatus_t *rs1, *rs2;
     if (ns->type != NS_TYPE_CONSENSUS) {
@@ -20,6 +20,7 @@ int router_get_networkstatus_v3_signed_boundaries(const char *s, size_t len,
 int router_get_networkstatus_v3_sha3_as_signed(uint8_t *digest_out,
                                                const char *s, size_t len);
 int compare_vote_routerstatus_entries(const void **_a, const void **_b);
+void ns_parse_init(void);
 
 int networkstatus_verify_bw_weights(networkstatus_t *ns, int);
 enum networkstatus_type_t;
@@ -42,6 +43,7 @@ STATIC routerstatus_t *routerstatus_parse_entry_from_string(
                                      vote_routerstatus_t *vote_rs,
                                      int consensus_method,
                                      consensus_flavor_t flav);
+EXTERN(int, ns_parse_min_rs_per_chunk)
 #endif /* defined(NS_PARSE_PRIVATE) */
 
 #endif /* !defined(TOR_NS_PARSE_H) */
@@ -16,6 +16,7 @@
 #include "lib/memarea/memarea.h"
 #include "lib/crypt_ops/crypto_rsa.h"
 #include "lib/ctime/di_ops.h"
+#include "lib/malloc/malloc.h"
 
 #include <string.h>
 
@@ -44,6 +45,176 @@ token_clear(directory_token_t *tok)
     crypto_pk_free(tok->key);
 }
 
+/** A perfect hash of the keywords in a token table, so that we can find the
+ * rule for a keyword without scanning the whole table. */
+typedef struct token_table_index_t {
+  /** The table that we index. */
+  const token_rule_t *table;
+  /** The number of rules in the table. */
+  int n_rules;
+  /** The keyword of each rule. */
+  const char **keywords;
+  /** The length of each keyword. */
+  size_t *lens;
+  /** The seed for keyword_hash() that gives no collisions in slots. */
+  uint32_t seed;
+  /** The number of slots, minus one.  Always one less than a power of 2. */
+  uint32_t mask;
+  /** For each slot, the position in the table of the rule whose keyword
+   * hashes to it, or -1.  NULL if we couldn't find a perfect hash, in which
+   * case we just scan the table. */
+  int16_t *slots;
+} token_table_index_t;
+
+/** Try at most this many seeds at each table size. */
+#define TOKEN_INDEX_MAX_SEEDS 256
+/** Never use more than this many slots in an index. */
+#define TOKEN_INDEX_MAX_SLOTS 4096
+
+/** An index for each token table passed to token_table_add_index().  We
+ * only add to this list at startup, before we launch any threads, so the
+ * worker threads can read it without a lock. */
+static smartlist_t *token_table_indices = NULL;
+
+/** Return a hash of the <b>len</b>-byte keyword at <b>s</b>, using
+ * <b>seed</b>. */
+static inline uint32_t
+keyword_hash(const char *s, size_t len, uint32_t seed)
+{
+  uint32_t h = seed ^ (uint32_t)len;
+  size_t i;
+  for (i = 0; i < len; ++i)
+    h = (h ^ (uint8_t)s[i]) * 0x01000193; /* FNV-1a */
+  return h ^ (h >> 16);
+}
+
+/** Try to fill in the slots of <b>idx</b> using its current seed and mask.
+ * Return 0 on success, or -1 if two different keywords collided. */
+static int
+token_table_index_fill(token_table_index_t *idx)
+{
+  int i;
+  memset(idx->slots, 0xff, (idx->mask + 1) * sizeof(int16_t));
+  for (i = 0; i < idx->n_rules; ++i) {
+    uint32_t slot = keyword_hash(idx->keywords[i], idx->lens[i],
+                                 idx->seed) & idx->mask;
+    int other = idx->slots[slot];
+    if (other < 0) {
+      idx->slots[slot] = i;
+    } else if (idx->lens[other] != idx->lens[i] ||
+               !fast_memeq(idx->keywords[other], idx->keywords[i],
+                           idx->lens[i])) {
+      return -1;
+    }
+    /* Otherwise, this keyword is repeated in the table.  Keep the first
+     * rule for it, as a scan of the table would. */
+  }
+  return 0;
+}
+
+/** Release all storage held by <b>idx</b>. */
+static void
+token_table_index_free(token_table_index_t *idx)
+{
+  if (!idx)
+    return;
+  tor_free(idx->keywords);
+  tor_free(idx->lens);
+  tor_free(idx->slots);
+  tor_free(idx);
+}
+
+/** Build and return a new index for the token table <b>table</b>. */
+static token_table_index_t *
+token_table_index_new(const token_rule_t *table)
+{
+  token_table_index_t *idx = tor_malloc_zero(sizeof(token_table_index_t));
+  uint32_t n_slots;
+  int i;
+
+  idx->table = table;
+  for (i = 0; table[i].t; ++i)
+    ;
+  idx->n_rules = i;
+  idx->keywords = tor_calloc(idx->n_rules + 1, sizeof(const char *));
+  idx->lens = tor_calloc(idx->n_rules + 1, sizeof(size_t));
+  for (i = 0; i < idx->n_rules; ++i) {
+    idx->keywords[i] = table[i].t;
+    idx->lens[i] = strlen(table[i].t);
+  }
+
+  for (n_slots = 4; n_slots < 2 * (uint32_t)idx->n_rules; n_slots <<= 1)
+    ;
+  for ( ; n_slots <= TOKEN_INDEX_MAX_SLOTS; n_slots <<= 1) {
+    idx->slots = tor_reallocarray(idx->slots, n_slots, sizeof(int16_t));
+    idx->mask = n_slots - 1;
+    for (idx->seed = 1; idx->seed <= TOKEN_INDEX_MAX_SEEDS; ++idx->seed) {
+      if (token_table_index_fill(idx) == 0)
+        return idx;
+    }
+  }
+  tor_free(idx->slots);
+  return idx;
+}
+
+/** Build an index for the static token table <b>table</b>, so that
+ * tokenize_string() can look up its keywords without scanning it.  The
+ * table must not change afterwards.
+ *
+ * Call this only at startup, from the main thread, before we launch any
+ * worker threads.  Tables that we never index still work: we just scan
+ * them. */
+void
+token_table_add_index(const token_rule_t *table)
+{
+  if (!token_table_indices)
+    token_table_indices = smartlist_new();
+  SMARTLIST_FOREACH(token_table_indices, const token_table_index_t *, idx,
+                    if (idx->table == table) return);
+  smartlist_add(token_table_indices, token_table_index_new(table));
+}
+
+/** Return the index for the token table <b>table</b>, or NULL if we didn't
+ * build one. */
+static const token_table_index_t *
+token_table_get_index(const token_rule_t *table)
+{
+  if (!token_table_indices)
+    return NULL;
+  SMARTLIST_FOREACH(token_table_indices, const token_table_index_t *, idx,
+                    if (idx->table == table) return idx);
+  return NULL;
+}
+
+/** Return the position in <b>idx</b>'s table of the rule for the
+ * <b>len</b>-byte keyword at <b>s</b>, or -1 if there is none. */
+static inline int
+token_table_index_lookup(const token_table_index_t *idx,
+                         const char *s, size_t len)
+{
+  uint32_t slot = keyword_hash(s, len, idx->seed) & idx->mask;
+  int i = idx->slots[slot];
+  if (i >= 0 && idx->lens[i] == len && fast_memeq(s, idx->keywords[i], len))
+    return i;
+  return -1;
+}
+
+/** Release all storage held by the tokenizer. */
+void
+parsecommon_free_all(void)
+{
+  if (token_table_indices) {
+    SMARTLIST_FOREACH(token_table_indices, token_table_index_t *, idx,
+                      token_table_index_free(idx));
+    smartlist_free(token_table_indices);
+  }
+}
+
+static directory_token_t *get_next_token_impl(memarea_t *area,
+                                          const char **s, const char *eos,
+                                          const token_rule_t *table,
+                                          const token_table_index_t *index);
+
 /** Read all tokens from a string between <b>start</b> and <b>end</b>, and add
  * them to <b>out</b>.  Parse according to the token rules in <b>table</b>.
  * Caller must free tokens in <b>out</b>.  If <b>end</b> is NULL, use the
@@ -56,6 +227,7 @@ tokenize_string(memarea_t *area,
 {
   const char **s;
   directory_token_t *tok = NULL;
+  const token_table_index_t *index;
   int counts[NIL_];
   int i;
   int first_nonannotation;
@@ -77,8 +249,9 @@ tokenize_string(memarea_t *area,
 
   SMARTLIST_FOREACH(out, const directory_token_t *, t, ++counts[t->tp]);
 
+  index = token_table_get_index(table);
   while (*s < end && (!tok || tok->tp != EOF_)) {
-    tok = get_next_token(area, s, end, table);
+    tok = get_next_token_impl(area, s, end, table, index);
     if (tok->tp == ERR_) {
       log_warn(LD_DIR, "parse error: %s", tok->error);
       token_clear(tok);
@@ -174,8 +347,9 @@ get_token_arguments(memarea_t *area, directory_token_t *tok,
     if (j == MAX_ARGS)
       return -1;
     args[j++] = cp;
-    cp = (char*)find_whitespace(cp);
-    if (!cp || !*cp)
+    /* Same as find_whitespace(), but libc can do this a block at a time. */
+    cp += strcspn(cp, " \t\r\n#");
+    if (!*cp)
       break; /* End of the line. */
     *cp++ = '\0';
     cp = (char*)eat_whitespace(cp);
@@ -261,106 +435,85 @@ mem_eq_token(const void *mem, size_t memlen, const char *token)
   return memlen == len && fast_memeq(mem, token, len);
 }
 
-/** Helper function: read the next token from *s, advance *s to the end of the
- * token, and return the parsed token.  Parse *<b>s</b> according to the list
- * of tokens in <b>table</b>.
- */
-directory_token_t *
-get_next_token(memarea_t *area,
-               const char **s, const char *eos, const token_rule_t *table)
+/** Return the position in <b>table</b> of the rule for the <b>len</b>-byte
+ * keyword at <b>s</b>, or -1 if there is none.  Use <b>index</b> if it is
+ * not NULL and has a perfect hash for <b>table</b>. */
+static inline int
+token_table_find(const token_rule_t *table, const token_table_index_t *index,
+                 const char *s, size_t len)
 {
-  /** Reject any object at least this big; it is probably an overflow, an
-   * attack, a bug, or some other nonsense. */
-#define MAX_UNPARSED_OBJECT_SIZE (128*1024)
-  /** Reject any line at least this big; it is probably an overflow, an
-   * attack, a bug, or some other nonsense. */
-#define MAX_LINE_LENGTH (128*1024)
-
-  const char *next, *eol;
-  size_t obname_len;
   int i;
-  directory_token_t *tok;
-  obj_syntax o_syn = NO_OBJ;
-  char ebuf[128];
-  const char *kwd = "";
-
-  tor_assert(area);
-  tok = ALLOC_ZERO(sizeof(directory_token_t));
-  tok->tp = ERR_;
-
-  /* Set *s to first token, eol to end-of-line, next to after first token */
-  *s = eat_whitespace_eos(*s, eos); /* eat multi-line whitespace */
-  tor_assert(eos >= *s);
-  eol = memchr(*s, '\n', eos-*s);
-  if (!eol)
-    eol = eos;
-  if (eol - *s > MAX_LINE_LENGTH) {
-    RET_ERR("Line far too long");
-  }
-
-  next = find_whitespace_eos(*s, eol);
-
-  if (mem_eq_token(*s, next-*s, "opt")) {
-    /* Skip past an "opt" at the start of the line. */
-    *s = eat_whitespace_eos_no_nl(next, eol);
-    next = find_whitespace_eos(*s, eol);
-  } else if (*s == eos) {  /* If no "opt", and end-of-line, line is invalid */
-    RET_ERR("Unexpected EOF");
-  }
-
-  /* Search the table for the appropriate entry.  (I tried a binary search
-   * instead, but it wasn't any faster.) */
+  /* (I tried a binary search instead, but it wasn't any faster.  A perfect
+   * hash is.) */
+  if (index && index->slots)
+    return token_table_index_lookup(index, s, len);
   for (i = 0; table[i].t ; ++i) {
-    if (mem_eq_token(*s, next-*s, table[i].t)) {
-      /* We've found the keyword. */
-      kwd = table[i].t;
-      tok->tp = table[i].v;
-      o_syn = table[i].os;
-      *s = eat_whitespace_eos_no_nl(next, eol);
-      /* We go ahead whether there are arguments or not, so that tok->args is
-       * always set if we want arguments. */
-      if (table[i].concat_args) {
-        /* The keyword takes the line as a single argument */
-        tok->args = ALLOC(sizeof(char*));
-        tok->args[0] = STRNDUP(*s,eol-*s); /* Grab everything on line */
-        tok->n_args = 1;
-      } else {
-        /* This keyword takes multiple arguments. */
-        if (get_token_arguments(area, tok, *s, eol)<0) {
-          tor_snprintf(ebuf, sizeof(ebuf),"Far too many arguments to %s", kwd);
-          RET_ERR(ebuf);
-        }
-        *s = eol;
-      }
-      if (tok->n_args < table[i].min_args) {
-        tor_snprintf(ebuf, sizeof(ebuf), "Too few arguments to %s", kwd);
-        RET_ERR(ebuf);
-      } else if (tok->n_args > table[i].max_args) {
-        tor_snprintf(ebuf, sizeof(ebuf), "Too many arguments to %s", kwd);
-        RET_ERR(ebuf);
-      }
-      break;
-    }
+    if (mem_eq_token(s, len, table[i].t))
+      return i;
   }
+  return -1;
+}
 
-  if (tok->tp == ERR_) {
-    /* No keyword matched; call it an "K_opt" or "A_unrecognized" */
-    if (*s < eol && **s == '@')
-      tok->tp = A_UNKNOWN_;
-    else
-      tok->tp = K_OPT;
+/** Helper: parse the arguments on the line from *<b>s</b> to <b>eol</b> for
+ * the token <b>tok</b>, whose keyword matched <b>rule</b>, and make sure
+ * that there are as many as <b>rule</b> allows.  Advance *<b>s</b> past the
+ * arguments we consumed.  Allocate all storage in <b>area</b>.  Return
+ * <b>tok</b> on success, or a new ERR_ token if the arguments were wrong.
+ **/
+static inline directory_token_t *
+token_get_keyword_args(memarea_t *area, directory_token_t *tok,
+                       const token_rule_t *rule,
+                       const char **s, const char *eol)
+{
+  char ebuf[128];
+  tok->tp = rule->v;
+  /* We go ahead whether there are arguments or not, so that tok->args is
+   * always set if we want arguments. */
+  if (rule->concat_args) {
+    /* The keyword takes the line as a single argument */
     tok->args = ALLOC(sizeof(char*));
-    tok->args[0] = STRNDUP(*s, eol-*s);
+    tok->args[0] = STRNDUP(*s,eol-*s); /* Grab everything on line */
     tok->n_args = 1;
-    o_syn = OBJ_OK;
+  } else {
+    /* This keyword takes multiple arguments. */
+    if (get_token_arguments(area, tok, *s, eol)<0) {
+      tor_snprintf(ebuf, sizeof(ebuf),"Far too many arguments to %s", rule->t);
+      RET_ERR(ebuf);
+    }
+    *s = eol;
+  }
+  if (tok->n_args < rule->min_args) {
+    tor_snprintf(ebuf, sizeof(ebuf), "Too few arguments to %s", rule->t);
+    RET_ERR(ebuf);
+  } else if (tok->n_args > rule->max_args) {
+    tor_snprintf(ebuf, sizeof(ebuf), "Too many arguments to %s", rule->t);
+    RET_ERR(ebuf);
   }
 
-  /* Check whether there's an object present */
-  *s = eat_whitespace_eos(eol, eos);  /* Scan from end of first line */
-  tor_assert(eos >= *s);
+ done_tokenizing:
+  return tok;
+}
+
+/** Helper: if an object begins at *<b>s</b>, parse it into <b>tok</b>,
+ * whose keyword allows objects of syntax <b>o_syn</b>, and advance *<b>s</b>
+ * to the end of the object; never read past <b>eos</b>.  Allocate all
+ * storage in <b>area</b>.  Return <b>tok</b> on success or if there is no
+ * object, or a new ERR_ token if the object was malformed.
+ **/
+static inline directory_token_t *
+get_token_object(memarea_t *area, directory_token_t *tok,
+                 const char **s, const char *eos, obj_syntax o_syn)
+{
+  /** Reject any object at least this big; it is probably an overflow, an
+   * attack, a bug, or some other nonsense. */
+#define MAX_UNPARSED_OBJECT_SIZE (128*1024)
+  const char *next, *eol;
+  size_t obname_len;
+  char ebuf[128];
+
   eol = memchr(*s, '\n', eos-*s);
   if (!eol || eol-*s<11 || strcmpstart(*s, "-----BEGIN ")) /* No object. */
-    goto check_object;
+    return tok;
 
   if (eol - *s <= 16 || memchr(*s+11,'\0',eol-*s-16) || /* no short lines, */
       !mem_eq_token(eol-5, 5, "-----") ||   /* nuls or invalid endings */
@@ -421,7 +574,93 @@ get_next_token(memarea_t *area,
   }
   *s = eol;
 
- check_object:
+ done_tokenizing:
+  return tok;
+}
+
+/** Helper function: read the next token from *s, advance *s to the end of the
+ * token, and return the parsed token.  Parse *<b>s</b> according to the list
+ * of tokens in <b>table</b>.
+ */
+directory_token_t *
+get_next_token(memarea_t *area,
+               const char **s, const char *eos, const token_rule_t *table)
+{
+  return get_next_token_impl(area, s, eos, table, NULL);
+}
+
+/** As get_next_token(), but look keywords up in <b>index</b>, if it is
+ * not NULL and has a perfect hash for <b>table</b>. */
+static directory_token_t *
+get_next_token_impl(memarea_t *area,
+                    const char **s, const char *eos,
+                    const token_rule_t *table,
+                    const token_table_index_t *index)
+{
+  /** Reject any line at least this big; it is probably an overflow, an
+   * attack, a bug, or some other nonsense. */
+#define MAX_LINE_LENGTH (128*1024)
+
+  const char *next, *eol;
+  int i;
+  directory_token_t *tok;
+  obj_syntax o_syn = NO_OBJ;
+  const char *kwd = "";
+
+  tor_assert(area);
+  tok = ALLOC_ZERO(sizeof(directory_token_t));
+  tok->tp = ERR_;
+
+  /* Set *s to first token, eol to end-of-line, next to after first token */
+  *s = eat_whitespace_eos(*s, eos); /* eat multi-line whitespace */
+  tor_assert(eos >= *s);
+  eol = memchr(*s, '\n', eos-*s);
+  if (!eol)
+    eol = eos;
+  if (eol - *s > MAX_LINE_LENGTH) {
+    RET_ERR("Line far too long");
+  }
+
+  next = find_whitespace_eos(*s, eol);
+
+  if (mem_eq_token(*s, next-*s, "opt")) {
+    /* Skip past an "opt" at the start of the line. */
+    *s = eat_whitespace_eos_no_nl(next, eol);
+    next = find_whitespace_eos(*s, eol);
+  } else if (*s == eos) {  /* If no "opt", and end-of-line, line is invalid */
+    RET_ERR("Unexpected EOF");
+  }
+
+  /* Search the table for the appropriate entry. */
+  i = token_table_find(table, index, *s, next-*s);
+
+  if (i >= 0) {
+    /* We've found the keyword. */
+    kwd = table[i].t;
+    o_syn = table[i].os;
+    *s = eat_whitespace_eos_no_nl(next, eol);
+    tok = token_get_keyword_args(area, tok, &table[i], s, eol);
+    if (tok->tp == ERR_)
+      goto done_tokenizing;
+  } else {
+    /* No keyword matched; call it an "K_opt" or "A_unrecognized" */
+    if (*s < eol && **s == '@')
+      tok->tp = A_UNKNOWN_;
+    else
+      tok->tp = K_OPT;
+    tok->args = ALLOC(sizeof(char*));
+    tok->args[0] = STRNDUP(*s, eol-*s);
+    tok->n_args = 1;
+    o_syn = OBJ_OK;
+  }
+
+  /* Check whether there's an object present */
+  *s = eat_whitespace_eos(eol, eos);  /* Scan from end of first line */
+  tor_assert(eos >= *s);
+  tok = get_token_object(area, tok, s, eos, o_syn);
+  if (tok->tp == ERR_)
+    goto done_tokenizing;
+
   tok = token_check_object(area, kwd, tok, o_syn);
 
  done_tokenizing:
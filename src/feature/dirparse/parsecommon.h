@@ -298,6 +298,8 @@ typedef struct token_rule_t {
 } token_rule_t;
 
 void token_clear(directory_token_t *tok);
+void token_table_add_index(const token_rule_t *table);
+void parsecommon_free_all(void);
 
 int tokenize_string(struct memarea_t *area,
                     const char *start, const char *end,
@@ -21,6 +21,7 @@
 #include "feature/hs/hs_circuitmap.h"
 #include "feature/hs/hs_client.h"
 #include "feature/hs/hs_common.h"
+#include "feature/hs/hs_descriptor.h"
 #include "feature/hs/hs_dos.h"
 #include "feature/hs/hs_ob.h"
 #include "feature/hs/hs_ident.h"
@@ -1819,6 +1820,7 @@ hs_init(void)
   hs_circuitmap_init();
   hs_service_init();
   hs_cache_init();
+  hs_desc_init();
 }
 
 /** Release and cleanup all memory of the HS subsystem (all version). This is
@@ -153,6 +153,16 @@ static token_rule_t hs_desc_intro_point_v3_token_table[] = {
   END_OF_TABLE
 };
 
+/** Index our token tables. This is called in hs_init() on startup. */
+void
+hs_desc_init(void)
+{
+  token_table_add_index(hs_desc_v3_token_table);
+  token_table_add_index(hs_desc_superencrypted_v3_token_table);
+  token_table_add_index(hs_desc_encrypted_v3_token_table);
+  token_table_add_index(hs_desc_intro_point_v3_token_table);
+}
+
 /** Using a key, salt and encrypted payload, build a MAC and put it in mac_out.
  * We use SHA3-256 for the MAC computation.
  * This function can't fail. */
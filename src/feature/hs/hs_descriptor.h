@@ -255,6 +255,7 @@ hs_desc_is_supported_version(uint32_t version)
 
 /* Public API. */
 
+void hs_desc_init(void);
 void hs_descriptor_free_(hs_descriptor_t *desc);
 #define hs_descriptor_free(desc) \
   FREE_AND_NULL(hs_descriptor_t, hs_descriptor_free_, (desc))
@@ -26,6 +26,7 @@
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nodefamily.h"
 #include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/nodelist_snapshot.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/relay/router.h"
 
@@ -526,8 +527,18 @@ microdesc_cache_reload(microdesc_cache_t *cache)
   mm = cache->cache_content = tor_mmap_file(cache->cache_fname);
   if (mm) {
     warn_if_nul_found(mm->data, mm->size, 0, "scanning microdesc cache");
-    added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
-                                    SAVED_IN_CACHE, 0, -1, NULL);
+    added = nodelist_snapshot_get_microdescs(mm->data, mm->size);
+    if (added) {
+      smartlist_t *snapshot = added;
+      added = microdescs_add_list_to_cache(cache, snapshot,
+                                           SAVED_IN_CACHE, 0);
+      smartlist_free(snapshot);
+    } else {
+      added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
+                                      SAVED_IN_CACHE, 0, -1, NULL);
+      if (added)
+        nodelist_snapshot_save_microdescs(added, mm->data, mm->size);
+    }
     if (added) {
       total += smartlist_len(added);
       smartlist_free(added);
@@ -823,6 +834,9 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
     }
   } SMARTLIST_FOREACH_END(md);
 
+  if (cache->cache_content)
+    nodelist_snapshot_save_microdescs(wrote, cache->cache_content->data,
+                                      cache->cache_content->size);
   smartlist_free(wrote);
 
   write_str_to_file(cache->journal_fname, "", 1);
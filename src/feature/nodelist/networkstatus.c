@@ -77,9 +77,11 @@
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/nodelist_snapshot.h"
 #include "feature/nodelist/routerinfo.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/torcert.h"
+#include "feature/nodelist/verified_digests.h"
 #include "feature/relay/routermode.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
@@ -450,10 +452,36 @@ networkstatus_get_voter_sig_by_alg(const networkstatus_voter_info_t *voter,
   return NULL;
 }
 
+/** Set <b>digest_out</b> to the digest that identifies the signature
+ * <b>sig</b> on <b>consensus</b> in the verified-digest journal.  It covers
+ * the signed digest, the keys, and the signature itself. */
+static void
+document_signature_get_verified_digest(uint8_t *digest_out,
+                                       const networkstatus_t *consensus,
+                                       const document_signature_t *sig)
+{
+  const int dlen = sig->alg == DIGEST_SHA1 ? DIGEST_LEN : DIGEST256_LEN;
+  char *body = NULL;
+  size_t body_len = 1 + dlen + 2*DIGEST_LEN + sig->signature_len;
+
+  body = tor_malloc(body_len);
+  body[0] = (char) sig->alg;
+  memcpy(body + 1, consensus->digests.d[sig->alg], dlen);
+  memcpy(body + 1 + dlen, sig->identity_digest, DIGEST_LEN);
+  memcpy(body + 1 + dlen + DIGEST_LEN, sig->signing_key_digest, DIGEST_LEN);
+  memcpy(body + 1 + dlen + 2*DIGEST_LEN, sig->signature, sig->signature_len);
+  verified_digests_compute(digest_out, "consensus-signature",
+                           body, body_len);
+  tor_free(body);
+}
+
 /** Check whether the signature <b>sig</b> is correctly signed with the
  * signing key in <b>cert</b>.  Return -1 if <b>cert</b> doesn't match the
  * signing key; otherwise set the good_signature or bad_signature flag on
- * <b>voter</b>, and return 0. */
+ * <b>voter</b>, and return 0.
+ *
+ * If the verified-digest journal says that we have already checked this
+ * signature, believe it, rather than checking it again. */
 int
 networkstatus_check_document_signature(const networkstatus_t *consensus,
                                        document_signature_t *sig,
@@ -463,6 +491,7 @@ networkstatus_check_document_signature(const networkstatus_t *consensus,
   const int dlen = sig->alg == DIGEST_SHA1 ? DIGEST_LEN : DIGEST256_LEN;
   char *signed_digest;
   size_t signed_digest_len;
+  uint8_t verified_digest[DIGEST256_LEN];
 
   if (crypto_pk_get_digest(cert->signing_key, key_digest)<0)
     return -1;
@@ -482,6 +511,14 @@ networkstatus_check_document_signature(const networkstatus_t *consensus,
     return 0;
   }
 
+  if (verified_digests_is_loaded()) {
+    document_signature_get_verified_digest(verified_digest, consensus, sig);
+    if (verified_digests_contains(verified_digest)) {
+      sig->good_signature = 1;
+      return 0;
+    }
+  }
+
   signed_digest_len = crypto_pk_keysize(cert->signing_key);
   signed_digest = tor_malloc(signed_digest_len);
   if (crypto_pk_public_checksig(cert->signing_key,
@@ -494,6 +531,8 @@ networkstatus_check_document_signature(const networkstatus_t *consensus,
     sig->bad_signature = 1;
   } else {
     sig->good_signature = 1;
+    if (verified_digests_is_loaded())
+      verified_digests_add(verified_digest);
   }
   tor_free(signed_digest);
   return 0;
@@ -2163,7 +2202,9 @@ networkstatus_set_current_consensus(const char *consensus,
 
   if (!from_cache) {
     write_bytes_to_file(consensus_fname, consensus, consensus_len, 1);
+    verified_digests_save();
   }
+  nodelist_snapshot_save_routerstatuses(c);
 
   warn_early_consensus(c, flavor, now);
 
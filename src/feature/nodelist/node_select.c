@@ -474,6 +474,126 @@ choose_array_element_by_weight(const uint64_t *entries, int n_entries)
                            entries, n_entries, total, rand_val);
 }
 
+/** Build and return a new alias_table_t for choosing among
+ * <b>n_entries</b> entries, each with a probability proportional to its
+ * weight in <b>weights</b>.  Negative weights count as 0.
+ *
+ * This is Vose's variant of Walker's alias method.  We scale the weights to
+ * integers first, so that the probabilities in the table are exact.
+ */
+STATIC alias_table_t *
+alias_table_new(const double *weights, int n_entries)
+{
+  alias_table_t *table;
+  uint64_t *scaled;
+  int *small, *large;
+  int n_small = 0, n_large = 0;
+  double total_in = 0.0, scale_factor = 0.0;
+  uint64_t total = 0;
+  int i;
+
+  tor_assert(weights);
+  tor_assert(n_entries > 0);
+
+  for (i = 0; i < n_entries; ++i) {
+    if (weights[i] > 0.0)
+      total_in += weights[i];
+  }
+
+  /* Scale the weights so that they add up to no more than about 2^62/n, so
+   * that each of them times n_entries still fits comfortably in a
+   * uint64_t. */
+  if (total_in > 0.0) {
+    scale_factor = ((double)(UINT64_C(1) << 62)) / n_entries;
+    scale_factor /= total_in;
+  }
+
+  table = tor_malloc_zero(sizeof(alias_table_t));
+  table->n_entries = n_entries;
+  table->cutoff = tor_calloc(n_entries, sizeof(uint64_t));
+  table->alias = tor_calloc(n_entries, sizeof(int));
+
+  scaled = table->cutoff;
+  for (i = 0; i < n_entries; ++i) {
+    scaled[i] = (weights[i] > 0.0) ?
+      (uint64_t) tor_llround(weights[i] * scale_factor) : 0;
+    total += scaled[i];
+  }
+  table->total = total;
+
+  /* Every column has height <b>total</b>, and each entry needs
+   * weight*n_entries of space in all.  Sort the entries into those that
+   * need less than a column, and those that need at least one. */
+  small = tor_calloc(n_entries, sizeof(int));
+  large = tor_calloc(n_entries, sizeof(int));
+  for (i = 0; i < n_entries; ++i) {
+    scaled[i] *= (uint64_t) n_entries;
+    table->alias[i] = i;
+    if (scaled[i] < total)
+      small[n_small++] = i;
+    else
+      large[n_large++] = i;
+  }
+
+  /* Fill up the rest of each small entry's column with a large entry. */
+  while (n_small && n_large) {
+    const int s = small[--n_small];
+    const int l = large[n_large - 1];
+    table->alias[s] = l;
+    scaled[l] -= total - scaled[s];
+    if (scaled[l] < total) {
+      --n_large;
+      small[n_small++] = l;
+    }
+  }
+
+  /* Since the arithmetic above is exact, everything left over needs
+   * exactly one column. */
+  while (n_large)
+    scaled[large[--n_large]] = total;
+  while (n_small)
+    scaled[small[--n_small]] = total;
+
+  tor_free(small);
+  tor_free(large);
+  return table;
+}
+
+/** Release all storage held by <b>table</b>. */
+STATIC void
+alias_table_free_(alias_table_t *table)
+{
+  if (!table)
+    return;
+  tor_free(table->cutoff);
+  tor_free(table->alias);
+  tor_free(table);
+}
+
+/** Pick a random entry of <b>table</b>, with a probability proportional to
+ * its weight, and return its index.  If all the weights are 0, choose an
+ * index at random.
+ *
+ * Unlike choose_array_element_by_weight(), this takes constant time, but
+ * which memory it touches depends on the index that it returns.
+ */
+STATIC int
+alias_table_choose(const alias_table_t *table)
+{
+  uint64_t rand_val;
+  int col;
+
+  if (table->total == 0)
+    return crypto_rand_int(table->n_entries);
+
+  /* One random value picks both the column and the height within it. */
+  rand_val = crypto_rand_uint64(table->total * table->n_entries);
+  col = (int) (rand_val / table->total);
+  rand_val %= table->total;
+
+  return (rand_val < table->cutoff[col]) ? col : table->alias[col];
+}
+
 /** Return bw*1000, unless bw*1000 would overflow, in which case return
  * INT32_MAX. */
 static inline int32_t
@@ -926,6 +1046,125 @@ nodelist_subtract(smartlist_t *sl, const smartlist_t *excluded)
   bitarray_free(excluded_idx);
 }
 
+/** For each rule that router_choose_random_node() weights by, an
+ * alias_table_t whose entries are the nodes in the nodelist, in nodelist
+ * order, weighted according to that rule.  Each table is built the first
+ * time it is used, and freed by node_select_invalidate_weight_tables(). */
+static alias_table_t *node_weight_tables[3];
+
+/** Return the index in node_weight_tables of the table for <b>rule</b>. */
+static inline int
+node_weight_table_idx(bandwidth_weight_rule_t rule)
+{
+  switch (rule) {
+    case WEIGHT_FOR_EXIT: return 0;
+    case WEIGHT_FOR_MID: return 1;
+    case WEIGHT_FOR_GUARD: return 2;
+    case NO_WEIGHTING:
+    case WEIGHT_FOR_DIR:
+    default:
+      tor_assert_unreached();
+      return 0;
+  }
+}
+
+/** Forget every cached node weight table.  Must be called whenever the
+ * nodelist, or anything that goes into the nodes' weights, changes. */
+void
+node_select_invalidate_weight_tables(void)
+{
+  unsigned i;
+  for (i = 0; i < ARRAY_LENGTH(node_weight_tables); ++i)
+    alias_table_free(node_weight_tables[i]);
+}
+
+/** Return the alias_table_t for choosing among all the nodes in the nodelist
+ * according to <b>rule</b>, building it if necessary.  Return NULL if we
+ * have no nodes. */
+static const alias_table_t *
+get_node_weight_table(bandwidth_weight_rule_t rule)
+{
+  const smartlist_t *nodes = nodelist_get_list();
+  alias_table_t **tablep;
+  double *bandwidths = NULL;
+
+  tablep = &node_weight_tables[node_weight_table_idx(rule)];
+
+  /* Anything that adds or removes a node should have invalidated the
+   * table; check anyway, so that we never return an index past the end. */
+  if (*tablep && BUG((*tablep)->n_entries != smartlist_len(nodes)))
+    alias_table_free(*tablep);
+
+  if (*tablep)
+    return *tablep;
+
+  if (compute_weighted_bandwidths(nodes, rule, &bandwidths, NULL) < 0)
+    return NULL;
+
+  *tablep = alias_table_new(bandwidths, smartlist_len(nodes));
+  tor_free(bandwidths);
+  return *tablep;
+}
+
+/** How many nodes should we draw from a node weight table, looking for one
+ * that router_choose_random_node() could use, before we give up and build
+ * the list of all the nodes it could use instead? */
+#define MAX_WEIGHT_TABLE_DRAWS 64
+
+/** Helper for router_choose_random_node(): try to choose a node as it would,
+ * by drawing nodes from the cached weight table for <b>rule</b> and
+ * rejecting the ones that don't meet our restrictions.  Since the weight of
+ * each node doesn't depend on which other nodes we could choose, the
+ * accepted nodes have the same distribution as a weighted choice from the
+ * list of usable nodes.
+ *
+ * Return NULL if no node was accepted after MAX_WEIGHT_TABLE_DRAWS tries;
+ * the caller should then choose from the full list of usable nodes.
+ */
+static const node_t *
+choose_random_node_from_weight_table(const smartlist_t *excludednodes,
+                                     const routerset_t *excludedset,
+                                     router_crn_flags_t flags,
+                                     bandwidth_weight_rule_t rule)
+{
+  const int need_uptime = (flags & CRN_NEED_UPTIME) != 0;
+  const int need_capacity = (flags & CRN_NEED_CAPACITY) != 0;
+  const int need_guard = (flags & CRN_NEED_GUARD) != 0;
+  const int need_desc = (flags & CRN_NEED_DESC) != 0;
+  const int pref_addr = (flags & CRN_PREF_ADDR) != 0;
+  const int direct_conn = (flags & CRN_DIRECT_CONN) != 0;
+  const int rendezvous_v3 = (flags & CRN_RENDEZVOUS_V3) != 0;
+  const smartlist_t *node_list = nodelist_get_list();
+  const alias_table_t *table;
+  int i;
+
+  if (!(table = get_node_weight_table(rule)))
+    return NULL;
+
+  for (i = 0; i < MAX_WEIGHT_TABLE_DRAWS; ++i) {
+    const node_t *node = smartlist_get(node_list, alias_table_choose(table));
+
+    if (node_allows_single_hop_exits(node))
+      continue;
+    if (rendezvous_v3 && !node_supports_v3_rendezvous_point(node))
+      continue;
+    if (!router_node_is_usable_for_circuit(node, need_uptime, need_capacity,
+                                           need_guard, need_desc, pref_addr,
+                                           direct_conn))
+      continue;
+    if (smartlist_contains(excludednodes, node))
+      continue;
+    if (excludedset && routerset_contains_node(excludedset, node))
+      continue;
+
+    return node;
+  }
+
+  log_debug(LD_CIRC, "No usable node in %d draws from the %s weight table.",
+            MAX_WEIGHT_TABLE_DRAWS, bandwidth_weight_rule_to_string(rule));
+  return NULL;
+}
+
 /** Return a random running node from the nodelist. Never
  * pick a node that is in
  * <b>excludedsmartlist</b>, or which matches <b>excludedset</b>,
@@ -961,7 +1200,7 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
   const int rendezvous_v3 = (flags & CRN_RENDEZVOUS_V3) != 0;
 
   const smartlist_t *node_list = nodelist_get_list();
-  smartlist_t *sl=smartlist_new(),
+  smartlist_t *sl=NULL,
     *excludednodes=smartlist_new();
   const node_t *choice = NULL;
   const routerinfo_t *r;
@@ -971,6 +1210,23 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
   rule = weight_for_exit ? WEIGHT_FOR_EXIT :
     (need_guard ? WEIGHT_FOR_GUARD : WEIGHT_FOR_MID);
 
+  /* If the node_t is not found we won't be to exclude ourself but we
+   * won't be able to pick ourself in router_choose_random_node() so
+   * this is fine to at least try with our routerinfo_t object. */
+  if ((r = router_get_my_routerinfo()))
+    routerlist_add_node_and_family(excludednodes, r);
+
+  if (excludedsmartlist) {
+    smartlist_add_all(excludednodes, excludedsmartlist);
+  }
+
+  /* Usually a few draws from the cached weights for the whole nodelist
+   * will find us a node, and we don't need to look at every node. */
+  choice = choose_random_node_from_weight_table(excludednodes, excludedset,
+                                                flags, rule);
+  if (choice)
+    goto done;
+
   SMARTLIST_FOREACH_BEGIN(node_list, const node_t *, node) {
     if (node_allows_single_hop_exits(node)) {
       /* Exclude relays that allow single hop exit circuits. This is an
@@ -985,12 +1241,7 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
     }
   } SMARTLIST_FOREACH_END(node);
 
-  /* If the node_t is not found we won't be to exclude ourself but we
-   * won't be able to pick ourself in router_choose_random_node() so
-   * this is fine to at least try with our routerinfo_t object. */
-  if ((r = router_get_my_routerinfo()))
-    routerlist_add_node_and_family(excludednodes, r);
-
+  sl = smartlist_new();
   router_add_running_nodes_to_smartlist(sl, need_uptime, need_capacity,
                                         need_guard, need_desc, pref_addr,
                                         direct_conn);
@@ -998,9 +1249,6 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
            "We found %d running nodes.",
             smartlist_len(sl));
 
-  if (excludedsmartlist) {
-    smartlist_add_all(excludednodes, excludedsmartlist);
-  }
   nodelist_subtract(sl, excludednodes);
 
   if (excludedset) {
@@ -1013,6 +1261,7 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
   // Always weight by bandwidth
   choice = node_sl_choose_by_bandwidth(sl, rule);
 
+ done:
   smartlist_free(sl);
   if (!choice && (need_uptime || need_capacity || need_guard || pref_addr)) {
     /* try once more -- recurse but with fewer restrictions. */
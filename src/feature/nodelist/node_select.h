@@ -79,6 +79,7 @@ double frac_nodes_with_descriptors(const smartlist_t *sl,
 const node_t *router_choose_random_node(smartlist_t *excludedsmartlist,
                                         struct routerset_t *excludedset,
                                         router_crn_flags_t flags);
+void node_select_invalidate_weight_tables(void);
 
 const routerstatus_t *router_pick_trusteddirserver(dirinfo_type_t type,
                                                    int flags);
@@ -86,6 +87,28 @@ const routerstatus_t *router_pick_fallback_dirserver(dirinfo_type_t type,
                                                      int flags);
 
 #ifdef NODE_SELECT_PRIVATE
+/** A precomputed table for choosing among a fixed set of weighted entries in
+ * constant time, using the alias method.
+ *
+ * The table has one column per entry, all of height <b>total</b>.  Column i
+ * belongs to entry i up to <b>cutoff</b>[i], and to entry <b>alias</b>[i]
+ * above that; we choose a column uniformly, then a height within it. */
+typedef struct alias_table_t {
+  /** How many entries (and columns) are in this table? */
+  int n_entries;
+  /** The sum of the entries' weights, after scaling to integers. */
+  uint64_t total;
+  /** For each column, the height below which it belongs to its own entry. */
+  uint64_t *cutoff;
+  /** For each column, the entry that owns the rest of it. */
+  int *alias;
+} alias_table_t;
+
+STATIC alias_table_t *alias_table_new(const double *weights, int n_entries);
+STATIC void alias_table_free_(alias_table_t *table);
+#define alias_table_free(table) \
+  FREE_AND_NULL(alias_table_t, alias_table_free_, (table))
+STATIC int alias_table_choose(const alias_table_t *table);
 STATIC int choose_array_element_by_weight(const uint64_t *entries,
                                           int n_entries);
 STATIC void scale_array_elements_to_u64(uint64_t *entries_out,
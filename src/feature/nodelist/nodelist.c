@@ -256,6 +256,8 @@ node_get_or_create(const char *identity_digest)
 
   node->country = -1;
 
+  node_select_invalidate_weight_tables();
+
   return node;
 }
 
@@ -536,6 +538,7 @@ nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out)
       *ri_old_out = NULL;
   }
   node->ri = ri;
+  node_select_invalidate_weight_tables();
 
   node_add_to_ed25519_map(node);
 
@@ -716,6 +719,8 @@ nodelist_set_consensus(networkstatus_t *ns)
   if (networkstatus_is_live(ns, approx_time())) {
     the_nodelist->live_consensus_valid_after = ns->valid_after;
   }
+  /* The nodes' flags and bandwidths have all changed. */
+  node_select_invalidate_weight_tables();
 }
 
 /** Return 1 iff <b>node</b> has Exit flag and no BadExit flag.
@@ -756,6 +761,7 @@ nodelist_remove_routerinfo(routerinfo_t *ri)
   node_t *node = node_get_mutable_by_id(ri->cache_info.identity_digest);
   if (node && node->ri == ri) {
     node->ri = NULL;
+    node_select_invalidate_weight_tables();
     if (! node_is_usable(node)) {
       nodelist_drop_node(node, 1);
       node_free(node);
@@ -786,6 +792,8 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
     tmp->nodelist_idx = idx;
   }
   node->nodelist_idx = -1;
+
+  node_select_invalidate_weight_tables();
 }
 
 /** Return a newly allocated smartlist of the nodes that have <b>md</b> as
@@ -853,6 +861,8 @@ nodelist_purge(void)
 void
 nodelist_free_all(void)
 {
+  node_select_invalidate_weight_tables();
+
   if (PREDICT_UNLIKELY(the_nodelist == NULL))
     return;
 
@@ -2367,6 +2377,7 @@ void
 router_dir_info_changed(void)
 {
   need_to_update_have_min_dir_info = 1;
+  node_select_invalidate_weight_tables();
   rend_hsdir_routers_changed();
   hs_service_dir_info_changed();
   hs_client_dir_info_changed();
@@ -0,0 +1,789 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file nodelist_snapshot.c
+ *
+ * \brief Save the parsed form of our cached directory information, so that
+ * we can load it again without parsing it.
+ *
+ * When Tor starts, it rebuilds its view of the network from the text of
+ * its cached consensus documents and microdescriptors.  Parsing thousands of
+ * routerstatus entries and microdescriptors is most of the work of getting
+ * to "enough directory info", even though we parsed exactly the same text
+ * the last time we ran.
+ *
+ * So after we accept a consensus, and whenever we rewrite or close the
+ * microdescriptor cache, we write the parsed objects to a binary snapshot
+ * file beside the text.  The snapshot is a fixed header followed by a
+ * sequence of records, one per routerstatus_t or microdesc_t.  The file is
+ * mmap'd on load and decoded in one pass without tokenizing anything.
+ *
+ * The text files remain authoritative.  Each snapshot records what it was
+ * made from: for routerstatuses, the SHA256 digest of the consensus's signed
+ * portion, which covers every entry; for microdescriptors, the SHA256
+ * digest of the whole cache file.  The callers compute that digest from the
+ * text they have, and we use the snapshot only if it matches.  We also
+ * refuse a snapshot written by any other build of Tor.
+ *
+ * Since we trust a snapshot's records without parsing or checking them,
+ * anybody who could write a snapshot could tell us whatever they liked about
+ * the network.  So each snapshot ends with an HMAC over the rest of the file,
+ * under the key that authenticates the verified-digest journal, and we
+ * refuse a snapshot whose MAC doesn't match.  In all these cases the caller
+ * parses the text as usual.
+ *
+ * We don't snapshot node_t objects: they are built from the routerstatuses
+ * and microdescriptors, and building them is cheap next to parsing.
+ *
+ * This module does nothing until nodelist_snapshot_enable() has been
+ * called, and needs verified_digests_load() to have set up our key.
+ **/
+
+#define NODELIST_SNAPSHOT_PRIVATE
+
+#include "core/or/or.h"
+#include "app/config/config.h"
+#include "core/or/policies.h"
+#include "feature/nodelist/microdesc.h"
+#include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/nodefamily.h"
+#include "feature/nodelist/nodelist_snapshot.h"
+#include "feature/nodelist/verified_digests.h"
+#include "lib/buf/buffers.h"
+#include "lib/crypt_ops/crypto_curve25519.h"
+#include "lib/crypt_ops/crypto_digest.h"
+#include "lib/crypt_ops/crypto_ed25519.h"
+#include "lib/crypt_ops/crypto_util.h"
+#include "lib/fs/files.h"
+#include "lib/fs/mmap.h"
+#include "lib/version/torversion.h"
+
+#include "feature/nodelist/microdesc_st.h"
+#include "feature/nodelist/networkstatus_st.h"
+#include "feature/nodelist/routerstatus_st.h"
+
+/** First bytes of every snapshot. */
+#define SNAPSHOT_MAGIC "TorSnap\n"
+/** Length of SNAPSHOT_MAGIC. */
+#define SNAPSHOT_MAGIC_LEN 8
+/** Version of the snapshot format that we read and write. */
+#define SNAPSHOT_FORMAT_VERSION 2
+/** Length of a snapshot header: the magic, the format version, the kind,
+ * the build digest, the source digest, the flavor, and the number of
+ * entries. */
+#define SNAPSHOT_HEADER_LEN \
+  (SNAPSHOT_MAGIC_LEN + 4 + 4 + DIGEST256_LEN + DIGEST256_LEN + 4 + 4)
+/** Length of the MAC at the end of a snapshot. */
+#define SNAPSHOT_MAC_LEN DIGEST256_LEN
+/** Length that we use for a missing string. */
+#define SNAPSHOT_NO_STRING UINT32_MAX
+
+/** True iff we should read and write snapshots. */
+static int snapshots_enabled = 0;
+/** For each consensus flavor, the digest of the last consensus that we
+ * read or wrote a snapshot for; or all zeros if there isn't one. */
+static uint8_t routerstatus_snapshot_digest[N_CONSENSUS_FLAVORS]
+                                            [DIGEST256_LEN];
+
+/** Start reading and writing snapshots. */
+void
+nodelist_snapshot_enable(void)
+{
+  snapshots_enabled = 1;
+}
+
+/** Return true iff we read and write snapshots. */
+int
+nodelist_snapshot_is_enabled(void)
+{
+  return snapshots_enabled;
+}
+
+/** Return the filename for the snapshot of type <b>kind</b>, and for a
+ * routerstatus snapshot, of consensus flavor <b>flav</b>. */
+STATIC char *
+nodelist_snapshot_get_fname(int kind, consensus_flavor_t flav)
+{
+  char *fname = NULL;
+  if (kind == SNAPSHOT_KIND_MICRODESC) {
+    fname = get_cachedir_fname("cached-microdescs.snapshot");
+  } else {
+    char *consensus_fname = networkstatus_get_cache_fname(flav,
+                                  networkstatus_get_flavor_name(flav), 0);
+    tor_asprintf(&fname, "%s.snapshot", consensus_fname);
+    tor_free(consensus_fname);
+  }
+  return fname;
+}
+
+/** Set <b>out</b> to a digest that identifies this build of Tor, so that we
+ * never read a snapshot whose records might mean something else to us. */
+static void
+snapshot_get_build_digest(uint8_t *out)
+{
+  char *s = NULL;
+  tor_asprintf(&s, "%s %d %d %d", get_version(), SNAPSHOT_FORMAT_VERSION,
+               (int)sizeof(routerstatus_t), (int)sizeof(microdesc_t));
+  crypto_digest256((char *)out, s, strlen(s), DIGEST_SHA256);
+  tor_free(s);
+}
+
+/* Helpers to encode records. All integers are in network order. */
+
+/** Append the byte <b>v</b> to <b>buf</b>. */
+static void
+put_u8(buf_t *buf, uint8_t v)
+{
+  buf_add(buf, (const char *)&v, 1);
+}
+/** Append the 16-bit integer <b>v</b> to <b>buf</b>. */
+static void
+put_u16(buf_t *buf, uint16_t v)
+{
+  v = tor_htons(v);
+  buf_add(buf, (const char *)&v, 2);
+}
+/** Append the 32-bit integer <b>v</b> to <b>buf</b>. */
+static void
+put_u32(buf_t *buf, uint32_t v)
+{
+  v = tor_htonl(v);
+  buf_add(buf, (const char *)&v, 4);
+}
+/** Append the 64-bit integer <b>v</b> to <b>buf</b>. */
+static void
+put_u64(buf_t *buf, uint64_t v)
+{
+  v = tor_htonll(v);
+  buf_add(buf, (const char *)&v, 8);
+}
+/** Append the <b>len</b>-byte string <b>s</b>, or a marker for a missing
+ * string if <b>s</b> is NULL, to <b>buf</b>. */
+static void
+put_blob(buf_t *buf, const char *s, size_t len)
+{
+  if (!s) {
+    put_u32(buf, SNAPSHOT_NO_STRING);
+    return;
+  }
+  put_u32(buf, (uint32_t)len);
+  buf_add(buf, s, len);
+}
+/** Append the NUL-terminated string <b>s</b>, or a marker for a missing
+ * string if <b>s</b> is NULL, to <b>buf</b>. */
+static void
+put_str(buf_t *buf, const char *s)
+{
+  put_blob(buf, s, s ? strlen(s) : 0);
+}
+
+/** A position in a snapshot that we are decoding. */
+typedef struct snapshot_reader_t {
+  /** The next byte to read. */
+  const uint8_t *cp;
+  /** The end of the snapshot. */
+  const uint8_t *end;
+  /** True iff we have tried to read past the end. */
+  int truncated;
+} snapshot_reader_t;
+
+/** Return a pointer to the next <b>n</b> bytes of <b>r</b>, and advance
+ * past them; or return NULL and mark <b>r</b> as truncated if there aren't
+ * that many. */
+static const uint8_t *
+get_bytes(snapshot_reader_t *r, size_t n)
+{
+  const uint8_t *result = r->cp;
+  if (r->truncated || (size_t)(r->end - r->cp) < n) {
+    r->truncated = 1;
+    return NULL;
+  }
+  r->cp += n;
+  return result;
+}
+/** Read and return a byte from <b>r</b>, or 0 if there is none. */
+static uint8_t
+get_u8(snapshot_reader_t *r)
+{
+  const uint8_t *cp = get_bytes(r, 1);
+  return cp ? *cp : 0;
+}
+/** Read and return a 16-bit integer from <b>r</b>, or 0 if there is none. */
+static uint16_t
+get_u16(snapshot_reader_t *r)
+{
+  const uint8_t *cp = get_bytes(r, 2);
+  return cp ? tor_ntohs(get_uint16(cp)) : 0;
+}
+/** Read and return a 32-bit integer from <b>r</b>, or 0 if there is none. */
+static uint32_t
+get_u32(snapshot_reader_t *r)
+{
+  const uint8_t *cp = get_bytes(r, 4);
+  return cp ? tor_ntohl(get_uint32(cp)) : 0;
+}
+/** Read and return a 64-bit integer from <b>r</b>, or 0 if there is none. */
+static uint64_t
+get_u64(snapshot_reader_t *r)
+{
+  const uint8_t *cp = get_bytes(r, 8);
+  return cp ? tor_ntohll(get_uint64(cp)) : 0;
+}
+/** Copy <b>n</b> bytes from <b>r</b> into <b>out</b>, or zero it if there
+ * aren't that many. */
+static void
+get_into(snapshot_reader_t *r, void *out, size_t n)
+{
+  const uint8_t *cp = get_bytes(r, n);
+  if (cp)
+    memcpy(out, cp, n);
+  else
+    memset(out, 0, n);
+}
+/** Read a string written with put_blob() or put_str() from <b>r</b>, and
+ * return a newly allocated NUL-terminated copy of it, setting *<b>len_out</b>
+ * to its length if <b>len_out</b> is provided.  Return NULL if the string
+ * was missing or truncated. */
+static char *
+get_blob(snapshot_reader_t *r, size_t *len_out)
+{
+  const uint32_t len = get_u32(r);
+  const uint8_t *cp;
+  if (len == SNAPSHOT_NO_STRING)
+    return NULL;
+  if (!(cp = get_bytes(r, len)))
+    return NULL;
+  if (len_out)
+    *len_out = len;
+  return tor_memdup_nulterm(cp, len);
+}
+
+/** Write the snapshot of type <b>kind</b> in <b>body</b>, which holds
+ * <b>n_entries</b> records for consensus flavor <b>flav</b>, made from the
+ * text with digest <b>source_digest</b>, to <b>fname</b>.  Return 0 on
+ * success and -1 on failure. */
+static int
+snapshot_write(const char *fname, int kind, consensus_flavor_t flav,
+               const uint8_t *source_digest, int n_entries, buf_t *body)
+{
+  const size_t len = SNAPSHOT_HEADER_LEN + buf_datalen(body) +
+    SNAPSHOT_MAC_LEN;
+  char *contents = tor_malloc(len);
+  char *cp = contents;
+  int r = -1;
+
+  memcpy(cp, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+  cp += SNAPSHOT_MAGIC_LEN;
+  set_uint32(cp, tor_htonl(SNAPSHOT_FORMAT_VERSION));
+  cp += 4;
+  set_uint32(cp, tor_htonl(kind));
+  cp += 4;
+  snapshot_get_build_digest((uint8_t *)cp);
+  cp += DIGEST256_LEN;
+  memcpy(cp, source_digest, DIGEST256_LEN);
+  cp += DIGEST256_LEN;
+  set_uint32(cp, tor_htonl((uint32_t)flav));
+  cp += 4;
+  set_uint32(cp, tor_htonl((uint32_t)n_entries));
+  cp += 4;
+  tor_assert(cp == contents + SNAPSHOT_HEADER_LEN);
+  buf_get_bytes(body, cp, buf_datalen(body));
+  cp = contents + len - SNAPSHOT_MAC_LEN;
+  if (verified_digests_mac((uint8_t *)cp, contents, cp - contents) < 0) {
+    log_info(LD_DIR, "Not writing snapshot to %s: we have no key to "
+             "authenticate it with.", escaped(fname));
+    goto done;
+  }
+
+  r = write_bytes_to_file(fname, contents, len, 1);
+  if (r < 0)
+    log_info(LD_FS, "Couldn't write snapshot to %s", escaped(fname));
+
+ done:
+  tor_free(contents);
+  return r;
+}
+
+/** Map the snapshot of type <b>kind</b> in <b>fname</b>, and check that
+ * this build of Tor wrote it, that it was made for consensus flavor
+ * <b>flav</b> from the text whose digest is <b>source_digest</b>, and that
+ * its MAC is correct.  On success, return the map, and set <b>r</b> to read
+ * its records and *<b>n_entries_out</b> to the number of records.  On
+ * failure, return NULL. */
+static tor_mmap_t *
+snapshot_open(const char *fname, int kind, consensus_flavor_t flav,
+              const uint8_t *source_digest, snapshot_reader_t *r,
+              int *n_entries_out)
+{
+  tor_mmap_t *map = tor_mmap_file(fname);
+  const uint8_t *header;
+  uint8_t build_digest[DIGEST256_LEN], mac[SNAPSHOT_MAC_LEN];
+  const char *problem = NULL;
+
+  if (!map)
+    return NULL;
+
+  memset(r, 0, sizeof(*r));
+  r->cp = (const uint8_t *)map->data;
+  r->end = r->cp + map->size;
+  snapshot_get_build_digest(build_digest);
+
+  if (map->size < SNAPSHOT_HEADER_LEN + SNAPSHOT_MAC_LEN ||
+      fast_memneq(map->data, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN)) {
+    problem = "not a snapshot";
+    goto err;
+  }
+  /* The records run up to the MAC. */
+  r->end -= SNAPSHOT_MAC_LEN;
+  header = get_bytes(r, SNAPSHOT_HEADER_LEN);
+  r->cp = header + SNAPSHOT_MAGIC_LEN;
+  if (get_u32(r) != SNAPSHOT_FORMAT_VERSION || get_u32(r) != (uint32_t)kind ||
+      fast_memneq(get_bytes(r, DIGEST256_LEN), build_digest, DIGEST256_LEN)) {
+    problem = "written by another version of Tor";
+    goto err;
+  }
+  if (fast_memneq(get_bytes(r, DIGEST256_LEN), source_digest,
+                  DIGEST256_LEN) ||
+      get_u32(r) != (uint32_t)flav) {
+    problem = "out of date";
+    goto err;
+  }
+  *n_entries_out = (int)get_u32(r);
+  if (verified_digests_mac(mac, map->data, map->size - SNAPSHOT_MAC_LEN) < 0) {
+    problem = "we have no key to authenticate it with";
+    goto err;
+  }
+  if (tor_memneq(r->end, mac, SNAPSHOT_MAC_LEN) || *n_entries_out < 0) {
+    problem = "corrupt, or not written by us";
+    goto err;
+  }
+  tor_assert(r->cp == header + SNAPSHOT_HEADER_LEN);
+  return map;
+
+ err:
+  log_info(LD_DIR, "Not using snapshot in %s: %s.", escaped(fname), problem);
+  tor_munmap_file(map);
+  return NULL;
+}
+
+/* Routerstatus snapshots. */
+
+/** Return the flags in <b>rs</b> as a bitfield. */
+static uint32_t
+routerstatus_get_flag_bits(const routerstatus_t *rs)
+{
+  uint32_t bits = 0;
+  bits |= rs->is_authority << 0;
+  bits |= rs->is_exit << 1;
+  bits |= rs->is_stable << 2;
+  bits |= rs->is_fast << 3;
+  bits |= rs->is_flagged_running << 4;
+  bits |= rs->is_named << 5;
+  bits |= rs->is_unnamed << 6;
+  bits |= rs->is_valid << 7;
+  bits |= rs->is_possible_guard << 8;
+  bits |= rs->is_bad_exit << 9;
+  bits |= rs->is_hs_dir << 10;
+  bits |= rs->is_v2_dir << 11;
+  bits |= rs->is_staledesc << 12;
+  bits |= rs->has_bandwidth << 13;
+  bits |= rs->has_exitsummary << 14;
+  bits |= rs->bw_is_unmeasured << 15;
+  bits |= rs->has_guardfraction << 16;
+  return bits;
+}
+
+/** Set the flags in <b>rs</b> from the bitfield <b>bits</b>. */
+static void
+routerstatus_set_flag_bits(routerstatus_t *rs, uint32_t bits)
+{
+  rs->is_authority = (bits >> 0) & 1;
+  rs->is_exit = (bits >> 1) & 1;
+  rs->is_stable = (bits >> 2) & 1;
+  rs->is_fast = (bits >> 3) & 1;
+  rs->is_flagged_running = (bits >> 4) & 1;
+  rs->is_named = (bits >> 5) & 1;
+  rs->is_unnamed = (bits >> 6) & 1;
+  rs->is_valid = (bits >> 7) & 1;
+  rs->is_possible_guard = (bits >> 8) & 1;
+  rs->is_bad_exit = (bits >> 9) & 1;
+  rs->is_hs_dir = (bits >> 10) & 1;
+  rs->is_v2_dir = (bits >> 11) & 1;
+  rs->is_staledesc = (bits >> 12) & 1;
+  rs->has_bandwidth = (bits >> 13) & 1;
+  rs->has_exitsummary = (bits >> 14) & 1;
+  rs->bw_is_unmeasured = (bits >> 15) & 1;
+  rs->has_guardfraction = (bits >> 16) & 1;
+}
+
+/** Return the protocol summary flags in <b>pv</b> as a bitfield. */
+static uint32_t
+protover_summary_get_bits(const protover_summary_flags_t *pv)
+{
+  uint32_t bits = 0;
+  bits |= pv->protocols_known << 0;
+  bits |= pv->supports_extend2_cells << 1;
+  bits |= pv->supports_ed25519_link_handshake_compat << 2;
+  bits |= pv->supports_ed25519_link_handshake_any << 3;
+  bits |= pv->supports_ed25519_hs_intro << 4;
+  bits |= pv->supports_v3_hsdir << 5;
+  bits |= pv->supports_v3_rendezvous_point << 6;
+  bits |= pv->supports_hs_setup_padding << 7;
+  bits |= pv->supports_establish_intro_dos_extension << 8;
+  return bits;
+}
+
+/** Set the protocol summary flags in <b>pv</b> from the bitfield
+ * <b>bits</b>. */
+static void
+protover_summary_set_bits(protover_summary_flags_t *pv, uint32_t bits)
+{
+  pv->protocols_known = (bits >> 0) & 1;
+  pv->supports_extend2_cells = (bits >> 1) & 1;
+  pv->supports_ed25519_link_handshake_compat = (bits >> 2) & 1;
+  pv->supports_ed25519_link_handshake_any = (bits >> 3) & 1;
+  pv->supports_ed25519_hs_intro = (bits >> 4) & 1;
+  pv->supports_v3_hsdir = (bits >> 5) & 1;
+  pv->supports_v3_rendezvous_point = (bits >> 6) & 1;
+  pv->supports_hs_setup_padding = (bits >> 7) & 1;
+  pv->supports_establish_intro_dos_extension = (bits >> 8) & 1;
+}
+
+/** Append a record for the fields of <b>rs</b> that come from the consensus
+ * to <b>buf</b>. */
+static void
+routerstatus_encode(buf_t *buf, const routerstatus_t *rs)
+{
+  const int has_ipv6 = tor_addr_family(&rs->ipv6_addr) == AF_INET6;
+  put_u64(buf, (uint64_t)rs->published_on);
+  put_str(buf, rs->nickname);
+  buf_add(buf, rs->identity_digest, DIGEST_LEN);
+  buf_add(buf, rs->descriptor_digest, DIGEST256_LEN);
+  put_u32(buf, rs->addr);
+  put_u16(buf, rs->or_port);
+  put_u16(buf, rs->dir_port);
+  put_u8(buf, has_ipv6);
+  if (has_ipv6)
+    buf_add(buf, (const char *)tor_addr_to_in6_addr8(&rs->ipv6_addr), 16);
+  put_u16(buf, rs->ipv6_orport);
+  put_u32(buf, routerstatus_get_flag_bits(rs));
+  put_u32(buf, protover_summary_get_bits(&rs->pv));
+  put_u32(buf, rs->bandwidth_kb);
+  put_u32(buf, rs->guardfraction_percentage);
+  put_str(buf, rs->exitsummary);
+}
+
+/** Decode and return a routerstatus_t from <b>r</b>, or return NULL if the
+ * record is malformed. */
+static routerstatus_t *
+routerstatus_decode(snapshot_reader_t *r)
+{
+  routerstatus_t *rs = tor_malloc_zero(sizeof(routerstatus_t));
+  char *nickname;
+
+  rs->published_on = (time_t)get_u64(r);
+  nickname = get_blob(r, NULL);
+  if (nickname)
+    strlcpy(rs->nickname, nickname, sizeof(rs->nickname));
+  tor_free(nickname);
+  get_into(r, rs->identity_digest, DIGEST_LEN);
+  get_into(r, rs->descriptor_digest, DIGEST256_LEN);
+  rs->addr = get_u32(r);
+  rs->or_port = get_u16(r);
+  rs->dir_port = get_u16(r);
+  if (get_u8(r)) {
+    const uint8_t *a = get_bytes(r, 16);
+    if (a)
+      tor_addr_from_ipv6_bytes(&rs->ipv6_addr, a);
+  }
+  rs->ipv6_orport = get_u16(r);
+  routerstatus_set_flag_bits(rs, get_u32(r));
+  protover_summary_set_bits(&rs->pv, get_u32(r));
+  rs->bandwidth_kb = get_u32(r);
+  rs->guardfraction_percentage = get_u32(r);
+  rs->exitsummary = get_blob(r, NULL);
+
+  if (r->truncated) {
+    routerstatus_free(rs);
+    return NULL;
+  }
+  return rs;
+}
+
+/** If we have a snapshot of the routerstatus entries in the consensus of
+ * flavor <b>flav</b> whose signed portion has the SHA256 digest
+ * <b>ns_digest</b>, return a new list of those entries.  Otherwise return
+ * NULL. */
+smartlist_t *
+nodelist_snapshot_get_routerstatuses(consensus_flavor_t flav,
+                                     const uint8_t *ns_digest)
+{
+  char *fname;
+  tor_mmap_t *map;
+  snapshot_reader_t r;
+  smartlist_t *result = NULL;
+  int i, n_entries = 0;
+
+  if (!snapshots_enabled)
+    return NULL;
+
+  fname = nodelist_snapshot_get_fname(SNAPSHOT_KIND_ROUTERSTATUS, flav);
+  map = snapshot_open(fname, SNAPSHOT_KIND_ROUTERSTATUS, flav, ns_digest,
+                      &r, &n_entries);
+  if (!map)
+    goto done;
+
+  result = smartlist_new();
+  for (i = 0; i < n_entries; ++i) {
+    routerstatus_t *rs = routerstatus_decode(&r);
+    if (!rs)
+      break;
+    smartlist_add(result, rs);
+  }
+  if (i < n_entries || r.cp != r.end) {
+    log_warn(LD_BUG, "Snapshot in %s was malformed.", escaped(fname));
+    SMARTLIST_FOREACH(result, routerstatus_t *, rs, routerstatus_free(rs));
+    smartlist_free(result);
+    result = NULL;
+  } else {
+    memcpy(routerstatus_snapshot_digest[flav], ns_digest, DIGEST256_LEN);
+    log_info(LD_DIR, "Loaded %d routerstatus entries from %s.",
+             n_entries, escaped(fname));
+  }
+  tor_munmap_file(map);
+
+ done:
+  tor_free(fname);
+  return result;
+}
+
+/** Write a snapshot of the routerstatus entries in the consensus <b>ns</b>,
+ * unless we already have one.  Return 0 on success and -1 on failure. */
+int
+nodelist_snapshot_save_routerstatuses(const networkstatus_t *ns)
+{
+  const uint8_t *ns_digest = (const uint8_t *)ns->digests.d[DIGEST_SHA256];
+  char *fname;
+  buf_t *buf;
+  int r;
+
+  if (!snapshots_enabled)
+    return 0;
+  tor_assert(ns->type == NS_TYPE_CONSENSUS);
+  if (tor_memeq(routerstatus_snapshot_digest[ns->flavor], ns_digest,
+                DIGEST256_LEN))
+    return 0;
+
+  buf = buf_new();
+  SMARTLIST_FOREACH(ns->routerstatus_list, const routerstatus_t *, rs,
+                    routerstatus_encode(buf, rs));
+  fname = nodelist_snapshot_get_fname(SNAPSHOT_KIND_ROUTERSTATUS,
+                                      ns->flavor);
+  r = snapshot_write(fname, SNAPSHOT_KIND_ROUTERSTATUS, ns->flavor,
+                     ns_digest, smartlist_len(ns->routerstatus_list), buf);
+  if (r == 0)
+    memcpy(routerstatus_snapshot_digest[ns->flavor], ns_digest,
+           DIGEST256_LEN);
+
+  buf_free(buf);
+  tor_free(fname);
+  return r;
+}
+
+/* Microdescriptor snapshots. */
+
+/** Bits for the flags byte in a microdescriptor record. */
+#define MD_HAS_CURVE25519 (1<<0)
+#define MD_HAS_ED25519    (1<<1)
+#define MD_HAS_IPV6       (1<<2)
+#define MD_REJECT_STAR    (1<<3)
+
+/** Append a record for <b>md</b>, which must be in the microdescriptor
+ * cache, to <b>buf</b>. */
+static void
+microdesc_encode(buf_t *buf, const microdesc_t *md)
+{
+  uint8_t flags = 0;
+  char *s;
+
+  if (md->onion_curve25519_pkey)
+    flags |= MD_HAS_CURVE25519;
+  if (md->ed25519_identity_pkey)
+    flags |= MD_HAS_ED25519;
+  if (tor_addr_family(&md->ipv6_addr) == AF_INET6)
+    flags |= MD_HAS_IPV6;
+  if (md->policy_is_reject_star)
+    flags |= MD_REJECT_STAR;
+
+  put_u64(buf, (uint64_t)md->off);
+  put_u32(buf, (uint32_t)md->bodylen);
+  put_u64(buf, (uint64_t)md->last_listed);
+  buf_add(buf, md->digest, DIGEST256_LEN);
+  put_u8(buf, flags);
+  put_blob(buf, md->onion_pkey, md->onion_pkey_len);
+  if (md->onion_curve25519_pkey)
+    buf_add(buf, (const char *)md->onion_curve25519_pkey->public_key,
+            CURVE25519_PUBKEY_LEN);
+  if (md->ed25519_identity_pkey)
+    buf_add(buf, (const char *)md->ed25519_identity_pkey->pubkey,
+            ED25519_PUBKEY_LEN);
+  if (flags & MD_HAS_IPV6)
+    buf_add(buf, (const char *)tor_addr_to_in6_addr8(&md->ipv6_addr), 16);
+  put_u16(buf, md->ipv6_orport);
+
+  s = md->family ? nodefamily_format(md->family) : NULL;
+  put_str(buf, s);
+  tor_free(s);
+  s = md->exit_policy ? write_short_policy(md->exit_policy) : NULL;
+  put_str(buf, s);
+  tor_free(s);
+  s = md->ipv6_exit_policy ? write_short_policy(md->ipv6_exit_policy) : NULL;
+  put_str(buf, s);
+  tor_free(s);
+}
+
+/** Decode and return a microdesc_t from <b>r</b>, whose body is in the
+ * <b>cache_len</b>-byte microdescriptor cache at <b>cache_body</b>.  Return
+ * NULL if the record is malformed. */
+static microdesc_t *
+microdesc_decode(snapshot_reader_t *r, const char *cache_body,
+                 size_t cache_len)
+{
+  microdesc_t *md = tor_malloc_zero(sizeof(microdesc_t));
+  uint64_t off;
+  uint8_t flags;
+  char *s;
+
+  off = get_u64(r);
+  md->bodylen = get_u32(r);
+  md->last_listed = (time_t)get_u64(r);
+  get_into(r, md->digest, DIGEST256_LEN);
+  flags = get_u8(r);
+  md->onion_pkey = get_blob(r, &md->onion_pkey_len);
+  if (flags & MD_HAS_CURVE25519) {
+    md->onion_curve25519_pkey =
+      tor_malloc_zero(sizeof(curve25519_public_key_t));
+    get_into(r, md->onion_curve25519_pkey->public_key,
+             CURVE25519_PUBKEY_LEN);
+  }
+  if (flags & MD_HAS_ED25519) {
+    md->ed25519_identity_pkey = tor_malloc_zero(sizeof(ed25519_public_key_t));
+    get_into(r, md->ed25519_identity_pkey->pubkey, ED25519_PUBKEY_LEN);
+  }
+  if (flags & MD_HAS_IPV6) {
+    const uint8_t *a = get_bytes(r, 16);
+    if (a)
+      tor_addr_from_ipv6_bytes(&md->ipv6_addr, a);
+  }
+  md->ipv6_orport = get_u16(r);
+  md->policy_is_reject_star = !!(flags & MD_REJECT_STAR);
+
+  if ((s = get_blob(r, NULL)))
+    md->family = nodefamily_parse(s, NULL, 0);
+  tor_free(s);
+  if ((s = get_blob(r, NULL)))
+    md->exit_policy = parse_short_policy(s);
+  tor_free(s);
+  if ((s = get_blob(r, NULL)))
+    md->ipv6_exit_policy = parse_short_policy(s);
+  tor_free(s);
+
+  if (r->truncated || !md->onion_pkey || off > cache_len ||
+      md->bodylen > cache_len - off ||
+      md->bodylen < 9 || fast_memneq(cache_body + off, "onion-key", 9)) {
+    microdesc_free(md);
+    return NULL;
+  }
+  md->saved_location = SAVED_IN_CACHE;
+  md->off = (off_t)off;
+  md->body = (char *)cache_body + off;
+  return md;
+}
+
+/** If we have a snapshot of the microdescriptors in the <b>cache_len</b>-byte
+ * microdescriptor cache at <b>cache_body</b>, return a new list of them, with
+ * their bodies pointing into <b>cache_body</b>.  Otherwise return NULL. */
+smartlist_t *
+nodelist_snapshot_get_microdescs(const char *cache_body, size_t cache_len)
+{
+  char *fname;
+  tor_mmap_t *map;
+  snapshot_reader_t r;
+  uint8_t cache_digest[DIGEST256_LEN];
+  smartlist_t *result = NULL;
+  int i, n_entries = 0;
+
+  if (!snapshots_enabled)
+    return NULL;
+
+  fname = nodelist_snapshot_get_fname(SNAPSHOT_KIND_MICRODESC, 0);
+  crypto_digest256((char *)cache_digest, cache_body, cache_len,
+                   DIGEST_SHA256);
+  map = snapshot_open(fname, SNAPSHOT_KIND_MICRODESC, 0, cache_digest,
+                      &r, &n_entries);
+  if (!map)
+    goto done;
+
+  result = smartlist_new();
+  for (i = 0; i < n_entries; ++i) {
+    microdesc_t *md = microdesc_decode(&r, cache_body, cache_len);
+    if (!md)
+      break;
+    smartlist_add(result, md);
+  }
+  if (i < n_entries || r.cp != r.end) {
+    log_warn(LD_BUG, "Snapshot in %s was malformed.", escaped(fname));
+    SMARTLIST_FOREACH(result, microdesc_t *, md, microdesc_free(md));
+    smartlist_free(result);
+    result = NULL;
+  } else {
+    log_info(LD_DIR, "Loaded %d microdescriptors from %s.",
+             n_entries, escaped(fname));
+  }
+  tor_munmap_file(map);
+
+ done:
+  tor_free(fname);
+  return result;
+}
+
+/** Write a snapshot of the microdescriptors in <b>mds</b>, which must be
+ * exactly those in the <b>cache_len</b>-byte microdescriptor cache at
+ * <b>cache_body</b>.  Return 0 on success and -1 on failure. */
+int
+nodelist_snapshot_save_microdescs(const smartlist_t *mds,
+                                  const char *cache_body, size_t cache_len)
+{
+  uint8_t cache_digest[DIGEST256_LEN];
+  char *fname;
+  buf_t *buf;
+  int r;
+
+  if (!snapshots_enabled)
+    return 0;
+
+  crypto_digest256((char *)cache_digest, cache_body, cache_len,
+                   DIGEST_SHA256);
+  buf = buf_new();
+  SMARTLIST_FOREACH_BEGIN(mds, const microdesc_t *, md) {
+    tor_assert(md->saved_location == SAVED_IN_CACHE);
+    microdesc_encode(buf, md);
+  } SMARTLIST_FOREACH_END(md);
+  fname = nodelist_snapshot_get_fname(SNAPSHOT_KIND_MICRODESC, 0);
+  r = snapshot_write(fname, SNAPSHOT_KIND_MICRODESC, 0, cache_digest,
+                     smartlist_len(mds), buf);
+
+  buf_free(buf);
+  tor_free(fname);
+  return r;
+}
+
+/** Stop reading and writing snapshots, and forget what we have written. */
+void
+nodelist_snapshot_free_all(void)
+{
+  snapshots_enabled = 0;
+  memset(routerstatus_snapshot_digest, 0,
+         sizeof(routerstatus_snapshot_digest));
+}
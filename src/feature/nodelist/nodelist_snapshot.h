@@ -0,0 +1,34 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file nodelist_snapshot.h
+ * \brief Header for nodelist_snapshot.c
+ **/
+
+#ifndef TOR_NODELIST_SNAPSHOT_H
+#define TOR_NODELIST_SNAPSHOT_H
+
+void nodelist_snapshot_enable(void);
+int nodelist_snapshot_is_enabled(void);
+
+smartlist_t *nodelist_snapshot_get_routerstatuses(consensus_flavor_t flav,
+                                                  const uint8_t *ns_digest);
+int nodelist_snapshot_save_routerstatuses(const networkstatus_t *ns);
+
+smartlist_t *nodelist_snapshot_get_microdescs(const char *cache_body,
+                                              size_t cache_len);
+int nodelist_snapshot_save_microdescs(const smartlist_t *mds,
+                                      const char *cache_body,
+                                      size_t cache_len);
+
+void nodelist_snapshot_free_all(void);
+
+#ifdef NODELIST_SNAPSHOT_PRIVATE
+STATIC char *nodelist_snapshot_get_fname(int kind, consensus_flavor_t flav);
+/** Kinds of snapshot. */
+#define SNAPSHOT_KIND_ROUTERSTATUS 1
+#define SNAPSHOT_KIND_MICRODESC 2
+#endif
+
+#endif /* !defined(TOR_NODELIST_SNAPSHOT_H) */
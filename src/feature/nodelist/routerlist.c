@@ -88,6 +88,7 @@
 #include "feature/dirparse/routerparse.h"
 #include "feature/nodelist/routerset.h"
 #include "feature/nodelist/torcert.h"
+#include "feature/nodelist/verified_digests.h"
 #include "feature/relay/routermode.h"
 #include "feature/stats/rephist.h"
 #include "lib/crypt_ops/crypto_format.h"
@@ -368,6 +369,10 @@ router_rebuild_store(int flags, desc_store_t *store)
   fname = get_cachedir_fname_suffix(store->fname_base, ".new");
   write_str_to_file(fname, "", 1);
 
+  /* Now that these descriptors are safely on disk, so should be the record
+   * of which ones we have verified. */
+  verified_digests_save();
+
   r = 0;
   store->store_len = (size_t) offset;
   store->journal_len = 0;
@@ -498,6 +503,56 @@ routers_have_same_or_addrs(const routerinfo_t *r1, const routerinfo_t *r2)
     r1->ipv6_orport == r2->ipv6_orport;
 }
 
+/** Helper: return true iff <b>node</b> is suitable for a circuit under the
+ * restrictions of router_add_running_nodes_to_smartlist().  If
+ * <b>check_reach</b> is false, don't check our firewall rules.
+ */
+static int
+node_is_usable_for_circuit_impl(const node_t *node, int need_uptime,
+                                int need_capacity, int need_guard,
+                                int need_desc, int pref_addr,
+                                int direct_conn, int check_reach)
+{
+  if (!node->is_running || !node->is_valid)
+    return 0;
+  if (need_desc && !node_has_preferred_descriptor(node, direct_conn))
+    return 0;
+  if (node->ri && node->ri->purpose != ROUTER_PURPOSE_GENERAL)
+    return 0;
+  if (node_is_unreliable(node, need_uptime, need_capacity, need_guard))
+    return 0;
+  /* Don't choose nodes if we are certain they can't do EXTEND2 cells */
+  if (node->rs && !routerstatus_version_supports_extend2_cells(node->rs, 1))
+    return 0;
+  /* Don't choose nodes if we are certain they can't do ntor. */
+  if ((node->ri || node->md) && !node_has_curve25519_onion_key(node))
+    return 0;
+  /* Choose a node with an OR address that matches the firewall rules */
+  if (direct_conn && check_reach &&
+      !fascist_firewall_allows_node(node,
+                                    FIREWALL_OR_CONNECTION,
+                                    pref_addr))
+    return 0;
+
+  return 1;
+}
+
+/** Return true iff <b>node</b> is one that
+ * router_add_running_nodes_to_smartlist() would add to its list, given the
+ * same arguments. */
+int
+router_node_is_usable_for_circuit(const node_t *node, int need_uptime,
+                                  int need_capacity, int need_guard,
+                                  int need_desc, int pref_addr,
+                                  int direct_conn)
+{
+  const int check_reach = !router_skip_or_reachability(get_options(),
+                                                       pref_addr);
+  return node_is_usable_for_circuit_impl(node, need_uptime, need_capacity,
+                                         need_guard, need_desc, pref_addr,
+                                         direct_conn, check_reach);
+}
+
 /** Add every suitable node from our nodelist to <b>sl</b>, so that
  * we can pick a node for a circuit.
  */
@@ -511,28 +566,10 @@ router_add_running_nodes_to_smartlist(smartlist_t *sl, int need_uptime,
                                                        pref_addr);
   /* XXXX MOVE */
   SMARTLIST_FOREACH_BEGIN(nodelist_get_list(), const node_t *, node) {
-    if (!node->is_running || !node->is_valid)
-      continue;
-    if (need_desc && !node_has_preferred_descriptor(node, direct_conn))
-      continue;
-    if (node->ri && node->ri->purpose != ROUTER_PURPOSE_GENERAL)
-      continue;
-    if (node_is_unreliable(node, need_uptime, need_capacity, need_guard))
-      continue;
-    /* Don't choose nodes if we are certain they can't do EXTEND2 cells */
-    if (node->rs && !routerstatus_version_supports_extend2_cells(node->rs, 1))
-      continue;
-    /* Don't choose nodes if we are certain they can't do ntor. */
-    if ((node->ri || node->md) && !node_has_curve25519_onion_key(node))
-      continue;
-    /* Choose a node with an OR address that matches the firewall rules */
-    if (direct_conn && check_reach &&
-        !fascist_firewall_allows_node(node,
-                                      FIREWALL_OR_CONNECTION,
-                                      pref_addr))
-      continue;
-
-    smartlist_add(sl, (void *)node);
+    if (node_is_usable_for_circuit_impl(node, need_uptime, need_capacity,
+                                        need_guard, need_desc, pref_addr,
+                                        direct_conn, check_reach))
+      smartlist_add(sl, (void *)node);
   } SMARTLIST_FOREACH_END(node);
 }
 
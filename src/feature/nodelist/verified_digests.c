@@ -0,0 +1,372 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file verified_digests.c
+ *
+ * \brief Remember which signed documents we have already verified, so that
+ * we don't have to verify them again when we reload them from our cache.
+ *
+ * When Tor starts, it reloads its cached consensus documents, router
+ * descriptors, and extra-info documents, and checks every signature on them
+ * all over again.  On a directory cache, that RSA and ed25519 work can take
+ * most of the startup time, even though we checked every one of those
+ * signatures before we wrote the documents to disk.
+ *
+ * So we keep a journal of the documents whose signatures we have checked.
+ * Each one is identified by a SHA256 digest over everything that went into
+ * the check: the document's signed text along with its signatures, or for a
+ * consensus signature, the digest it signs and the key that signed it.  If
+ * any part of that changes, so does the digest, and we check the signatures
+ * as usual.  Callers still do every other check on the document: we only
+ * tell them whether its signatures are known to be good.
+ *
+ * The journal is a text file in the cache directory.  Since anyone who can
+ * write to it could otherwise make us accept bad signatures, we protect it
+ * with an HMAC, under a key that we keep in the data directory and never
+ * share.  The journal also names the Tor version that wrote it.  If the MAC
+ * doesn't match, because the journal or the key has changed, or if the
+ * version differs from ours, we throw out the whole journal and start over.
+ *
+ * We forget digests that nobody has looked up for VERIFIED_DIGESTS_MAX_AGE.
+ *
+ * The same key also authenticates the nodelist snapshots: see
+ * verified_digests_mac().
+ *
+ * This module does nothing until verified_digests_load() has been called:
+ * until then, it contains no digests and ignores new ones.
+ **/
+
+#define VERIFIED_DIGESTS_PRIVATE
+
+#include "core/or/or.h"
+#include "app/config/config.h"
+#include "feature/nodelist/verified_digests.h"
+#include "lib/crypt_ops/crypto_digest.h"
+#include "lib/crypt_ops/crypto_rand.h"
+#include "lib/crypt_ops/crypto_util.h"
+#include "lib/encoding/binascii.h"
+#include "lib/fs/files.h"
+#include "lib/version/torversion.h"
+
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
+/** Name of the journal file, in the cache directory. */
+#define VERIFIED_DIGESTS_FNAME "cached-verified-digests"
+/** Name of the file holding our MAC key, in the data directory. */
+#define VERIFIED_DIGESTS_KEY_FNAME "verified-digests-key"
+/** Length of our MAC key, in bytes. */
+#define VERIFIED_DIGESTS_KEY_LEN 32
+/** First line of every journal we write. */
+#define VERIFIED_DIGESTS_HEADER "verified-digests-format 1\n"
+
+/** Map from digest to the last time that we added or looked it up, as
+ * encoded with when_to_ptr(); or NULL if we haven't loaded the journal. */
+static digest256map_t *verified_digests = NULL;
+/** The key we use to authenticate the journal. */
+static uint8_t verified_digests_key[VERIFIED_DIGESTS_KEY_LEN];
+/** True iff we have changed the journal since we last loaded or saved it. */
+static int verified_digests_dirty = 0;
+
+/** Return <b>when</b> in a form that we can store in verified_digests.
+ * We never store NULL, since that would look like a missing entry. */
+static inline void *
+when_to_ptr(time_t when)
+{
+  return (void *)(uintptr_t)(when > 0 ? when : 1);
+}
+
+/** Set <b>digest_out</b> to the DIGEST256_LEN-byte digest that identifies
+ * the <b>body_len</b>-byte signed document at <b>body</b>, of type
+ * <b>kind</b>, in the journal.  <b>body</b> must include the signatures. */
+void
+verified_digests_compute(uint8_t *digest_out, const char *kind,
+                         const char *body, size_t body_len)
+{
+  crypto_digest_t *d = crypto_digest256_new(DIGEST_SHA256);
+  crypto_digest_add_bytes(d, kind, strlen(kind));
+  crypto_digest_add_bytes(d, "\n", 1);
+  crypto_digest_add_bytes(d, body, body_len);
+  crypto_digest_get_digest(d, (char *)digest_out, DIGEST256_LEN);
+  crypto_digest_free(d);
+}
+
+/** Return true iff we have loaded the journal, and will answer lookups. */
+int
+verified_digests_is_loaded(void)
+{
+  return verified_digests != NULL;
+}
+
+/** Return true iff we have already verified the signatures on the document
+ * identified by <b>digest</b>.  If so, remember that we needed it now.
+ *
+ * (A lookup alone doesn't make us rewrite the journal: the new time gets
+ * saved the next time something is added or expires.) */
+int
+verified_digests_contains(const uint8_t *digest)
+{
+  if (!verified_digests)
+    return 0;
+  if (!digest256map_get(verified_digests, digest))
+    return 0;
+  digest256map_set(verified_digests, digest,
+                   when_to_ptr(approx_time()));
+  return 1;
+}
+
+/** Remember that we have verified the signatures on the document identified
+ * by <b>digest</b>. */
+void
+verified_digests_add(const uint8_t *digest)
+{
+  void *old;
+  if (!verified_digests)
+    return;
+  old = digest256map_set(verified_digests, digest,
+                         when_to_ptr(approx_time()));
+  if (!old)
+    verified_digests_dirty = 1;
+}
+
+/** Return the number of digests in the journal. */
+STATIC int
+verified_digests_size(void)
+{
+  return verified_digests ? digest256map_size(verified_digests) : 0;
+}
+
+/** Load our MAC key from disk, or make and save a new one if we don't have
+ * one.  Return 0 on success, -1 on failure. */
+static int
+verified_digests_load_key(void)
+{
+  char *fname = get_datadir_fname(VERIFIED_DIGESTS_KEY_FNAME);
+  struct stat st;
+  char *key = read_file_to_str(fname, RFTS_BIN|RFTS_IGNORE_MISSING, &st);
+  int r = 0;
+
+  if (key && st.st_size == VERIFIED_DIGESTS_KEY_LEN) {
+    memcpy(verified_digests_key, key, VERIFIED_DIGESTS_KEY_LEN);
+  } else {
+    /* Without our old key, we can't trust our old journal: that's okay, since
+     * verified_digests_load() will throw it out when the MAC doesn't match.
+     */
+    crypto_rand((char *)verified_digests_key, VERIFIED_DIGESTS_KEY_LEN);
+    if (write_bytes_to_file(fname, (const char *)verified_digests_key,
+                            VERIFIED_DIGESTS_KEY_LEN, 1) < 0) {
+      log_warn(LD_FS, "Unable to write verified-digest key to %s",
+               escaped(fname));
+      r = -1;
+    }
+  }
+
+  if (key) {
+    memwipe(key, 0, VERIFIED_DIGESTS_KEY_LEN);
+    tor_free(key);
+  }
+  tor_free(fname);
+  return r;
+}
+
+/** Compute the MAC for the <b>len</b> bytes at <b>body</b> under our key,
+ * and write it to the DIGEST256_LEN bytes at <b>mac_out</b>.  Other modules
+ * use this to authenticate their own caches.  Return 0 on success, or -1
+ * if we have not loaded our key. */
+int
+verified_digests_mac(uint8_t *mac_out, const char *body, size_t len)
+{
+  if (!verified_digests)
+    return -1;
+  crypto_hmac_sha256((char *)mac_out, (const char *)verified_digests_key,
+                     VERIFIED_DIGESTS_KEY_LEN, body, len);
+  return 0;
+}
+
+/** Parse the entries in the authenticated journal <b>body</b> into
+ * verified_digests.  Return 0 on success, -1 if the journal is from some
+ * other version of Tor or is otherwise unusable. */
+static int
+verified_digests_parse(const char *body)
+{
+  smartlist_t *lines = smartlist_new();
+  char *expected_version = NULL;
+  int r = -1;
+
+  smartlist_split_string(lines, body, "\n", SPLIT_IGNORE_BLANK, 0);
+  tor_asprintf(&expected_version, "tor-version %s", get_version());
+
+  if (smartlist_len(lines) < 2 ||
+      strcmp(smartlist_get(lines, 0), "verified-digests-format 1") ||
+      strcmp(smartlist_get(lines, 1), expected_version)) {
+    log_info(LD_DIR, "Verified-digest journal is from another version of "
+             "Tor; discarding it.");
+    goto done;
+  }
+
+  SMARTLIST_FOREACH_BEGIN(lines, const char *, line) {
+    uint8_t digest[DIGEST256_LEN];
+    int ok = 0;
+    uint64_t when;
+    if (line_sl_idx < 2)
+      continue;
+    if (strlen(line) < HEX_DIGEST256_LEN + 2 ||
+        line[HEX_DIGEST256_LEN] != ' ' ||
+        base16_decode((char *)digest, sizeof(digest),
+                      line, HEX_DIGEST256_LEN) != DIGEST256_LEN) {
+      log_warn(LD_BUG, "Unparseable line in verified-digest journal");
+      goto done;
+    }
+    when = tor_parse_uint64(line + HEX_DIGEST256_LEN + 1, 10, 1, UINTPTR_MAX,
+                            &ok, NULL);
+    if (!ok) {
+      log_warn(LD_BUG, "Unparseable time in verified-digest journal");
+      goto done;
+    }
+    digest256map_set(verified_digests, digest, when_to_ptr((time_t)when));
+  } SMARTLIST_FOREACH_END(line);
+
+  r = 0;
+ done:
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  tor_free(expected_version);
+  return r;
+}
+
+/** Load the verified-digest journal from disk, and start remembering which
+ * documents we verify.  If the journal is missing, stale, or fails its
+ * authentication check, start with an empty one.  Return 0 on success, or
+ * -1 if we couldn't set up our key. */
+int
+verified_digests_load(void)
+{
+  char *fname = NULL, *body = NULL, *mac_line, *mac_hex;
+  uint8_t mac[DIGEST256_LEN], expected_mac[DIGEST256_LEN];
+  int r = 0;
+
+  verified_digests_free_all();
+  if (verified_digests_load_key() < 0)
+    return -1;
+  verified_digests = digest256map_new();
+
+  fname = get_cachedir_fname(VERIFIED_DIGESTS_FNAME);
+  body = read_file_to_str(fname, RFTS_IGNORE_MISSING, NULL);
+  if (!body)
+    goto done;
+
+  /* The MAC covers everything up to and including the newline before the
+   * final "mac" line. */
+  mac_line = body;
+  if (strcmpstart(body, "mac ")) {
+    mac_line = strstr(body, "\nmac ");
+    if (mac_line)
+      ++mac_line;
+  }
+  if (!mac_line) {
+    log_warn(LD_DIR, "Verified-digest journal has no MAC; discarding it.");
+    goto done;
+  }
+  /* The MAC line must be the last line, and hold exactly one MAC. */
+  mac_hex = mac_line + strlen("mac ");
+  if (strlen(mac_hex) < HEX_DIGEST256_LEN ||
+      strcmp(mac_hex + HEX_DIGEST256_LEN, "\n") ||
+      base16_decode((char *)mac, sizeof(mac),
+                    mac_hex, HEX_DIGEST256_LEN) != DIGEST256_LEN) {
+    log_warn(LD_DIR, "Verified-digest journal has a malformed MAC; "
+             "discarding it.");
+    goto done;
+  }
+  verified_digests_mac(expected_mac, body, mac_line - body);
+  if (tor_memneq(mac, expected_mac, DIGEST256_LEN)) {
+    log_warn(LD_DIR, "Verified-digest journal failed its authentication "
+             "check; discarding it.");
+    goto done;
+  }
+  *mac_line = '\0';
+
+  if (verified_digests_parse(body) < 0) {
+    digest256map_free(verified_digests, NULL);
+    verified_digests = digest256map_new();
+    goto done;
+  }
+  log_info(LD_DIR, "Loaded %d digests from the verified-digest journal.",
+           verified_digests_size());
+
+ done:
+  verified_digests_dirty = 0;
+  tor_free(body);
+  tor_free(fname);
+  return r;
+}
+
+/** If we have loaded the journal, forget every digest we haven't looked up
+ * recently.  Then, if that or anything else has changed the journal since
+ * we loaded or saved it, write the journal to disk.  Return 0
+ * on success and -1 on failure. */
+int
+verified_digests_save(void)
+{
+  smartlist_t *chunks;
+  char *body = NULL, *fname = NULL;
+  uint8_t mac[DIGEST256_LEN];
+  char hexmac[HEX_DIGEST256_LEN+1];
+  const time_t cutoff = approx_time() - VERIFIED_DIGESTS_MAX_AGE;
+  int r;
+
+  if (!verified_digests)
+    return 0;
+
+  DIGEST256MAP_FOREACH_MODIFY(verified_digests, digest, void *, val) {
+    if ((time_t)(uintptr_t)val < cutoff) {
+      MAP_DEL_CURRENT(digest);
+      verified_digests_dirty = 1;
+    }
+  } DIGEST256MAP_FOREACH_END;
+
+  if (!verified_digests_dirty)
+    return 0;
+
+  chunks = smartlist_new();
+  smartlist_add_strdup(chunks, VERIFIED_DIGESTS_HEADER);
+  smartlist_add_asprintf(chunks, "tor-version %s\n", get_version());
+  DIGEST256MAP_FOREACH(verified_digests, digest, void *, val) {
+    const time_t when = (time_t)(uintptr_t)val;
+    char hex[HEX_DIGEST256_LEN+1];
+    base16_encode(hex, sizeof(hex), (const char *)digest, DIGEST256_LEN);
+    smartlist_add_asprintf(chunks, "%s %"PRIu64"\n", hex, (uint64_t)when);
+  } DIGEST256MAP_FOREACH_END;
+  body = smartlist_join_strings(chunks, "", 0, NULL);
+  verified_digests_mac(mac, body, strlen(body));
+  base16_encode(hexmac, sizeof(hexmac), (const char *)mac, sizeof(mac));
+  smartlist_add_asprintf(chunks, "mac %s\n", hexmac);
+  tor_free(body);
+  body = smartlist_join_strings(chunks, "", 0, NULL);
+
+  fname = get_cachedir_fname(VERIFIED_DIGESTS_FNAME);
+  r = write_str_to_file(fname, body, 0);
+  if (r < 0) {
+    log_warn(LD_FS, "Unable to write verified-digest journal to %s",
+             escaped(fname));
+  } else {
+    verified_digests_dirty = 0;
+  }
+
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  tor_free(body);
+  tor_free(fname);
+  return r;
+}
+
+/** Forget every digest we know, and stop remembering new ones, without
+ * saving the journal. */
+void
+verified_digests_free_all(void)
+{
+  digest256map_free(verified_digests, NULL);
+  verified_digests_dirty = 0;
+  memwipe(verified_digests_key, 0, sizeof(verified_digests_key));
+}
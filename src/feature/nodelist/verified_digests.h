@@ -0,0 +1,32 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file verified_digests.h
+ * \brief Header for verified_digests.c
+ **/
+
+#ifndef TOR_VERIFIED_DIGESTS_H
+#define TOR_VERIFIED_DIGESTS_H
+
+#include "lib/cc/torint.h"
+
+/** How long do we remember a digest that nobody has looked up? This is a
+ * little longer than we keep old router descriptors. */
+#define VERIFIED_DIGESTS_MAX_AGE (7*24*60*60)
+
+void verified_digests_compute(uint8_t *digest_out, const char *kind,
+                              const char *body, size_t body_len);
+int verified_digests_is_loaded(void);
+int verified_digests_contains(const uint8_t *digest);
+void verified_digests_add(const uint8_t *digest);
+int verified_digests_mac(uint8_t *mac_out, const char *body, size_t len);
+int verified_digests_load(void);
+int verified_digests_save(void);
+void verified_digests_free_all(void);
+
+#ifdef VERIFIED_DIGESTS_PRIVATE
+STATIC int verified_digests_size(void);
+#endif
+
+#endif /* !defined(TOR_VERIFIED_DIGESTS_H) */
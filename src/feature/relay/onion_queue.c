@@ -21,9 +21,14 @@
  *      them to worker threads.
  *   <li>Expiring onionskins on the relay side if they have waited for
  *     too long.
+ *   <li>Dropping onionskins from the head of a queue, CoDel-style, once
+ *     every onionskin we process has waited too long for a while.
+ *   <li>Keeping a histogram of how long onionskins waited, for the
+ *     heartbeat.
  * </ul>
  **/
 
+#define ONION_QUEUE_PRIVATE
 #include "core/or/or.h"
 
 #include "feature/relay/onion_queue.h"
@@ -33,9 +38,12 @@
 #include "core/or/circuitlist.h"
 #include "core/or/onion.h"
 #include "feature/nodelist/networkstatus.h"
+#include "lib/time/compat_time.h"
 
 #include "core/or/or_circuit_st.h"
 
+#include <math.h>
+
 /** Type for a linked list of circuits that are waiting for a free CPU worker
  * to process a waiting onion handshake. */
 typedef struct onion_queue_t {
@@ -44,6 +52,8 @@ typedef struct onion_queue_t {
   uint16_t handshake_type;
   create_cell_t *onionskin;
   time_t when_added;
+  /** Monotonic time when we queued this onionskin, in usec. */
+  uint64_t when_added_usec;
 } onion_queue_t;
 
 /** 5 seconds on the onion queue til we just send back a destroy */
@@ -63,6 +73,13 @@ static onion_queue_head_t ol_list[MAX_ONION_HANDSHAKE_TYPE+1] =
 /** Number of entries of each type currently in each element of ol_list[]. */
 static int ol_entries[MAX_ONION_HANDSHAKE_TYPE+1];
 
+/** CoDel drop state for each element of ol_list[]. */
+static onion_queue_codel_t ol_codel[MAX_ONION_HANDSHAKE_TYPE+1];
+
+/** Waiting-time statistics for each element of ol_list[], since the last
+ * heartbeat. */
+static onion_queue_stats_t ol_stats[MAX_ONION_HANDSHAKE_TYPE+1];
+
 static int num_ntors_per_tap(void);
 static void onion_queue_entry_remove(onion_queue_t *victim);
 
@@ -158,6 +175,7 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
   tmp->handshake_type = onionskin->handshake_type;
   tmp->onionskin = onionskin;
   tmp->when_added = now;
+  tmp->when_added_usec = monotime_coarse_absolute_usec();
 
   if (!have_room_for_onionskin(onionskin->handshake_type)) {
 #define WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL (60)
@@ -197,6 +215,7 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
     onion_queue_entry_remove(head);
     log_info(LD_CIRC,
              "Circuit create request is too old; canceling due to overload.");
+    ++ol_stats[onionskin->handshake_type].n_expired;
     if (! TO_CIRCUIT(circ)->marked_for_close) {
       circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
     }
@@ -262,6 +281,180 @@ decide_next_handshake_type(void)
   return ONION_HANDSHAKE_TYPE_TAP;
 }
 
+/** Return the index of the onion_queue_stats_t.delay_hist bucket that
+ * counts waits of <b>usec</b> microseconds.
+ *
+ * Every power of two gets four buckets, so that the longest wait in a bucket
+ * is never more than 25% above the shortest. */
+STATIC unsigned
+onion_queue_delay_bucket(uint64_t usec)
+{
+  unsigned bits;
+  if (usec < 4)
+    return (unsigned) usec;
+  if (usec > ONION_QUEUE_MAX_DELAY_USEC)
+    usec = ONION_QUEUE_MAX_DELAY_USEC;
+  bits = tor_log2(usec);
+  return (bits - 1) * 4 + (unsigned) ((usec >> (bits - 2)) & 3);
+}
+
+/** Return the longest wait, in microseconds, that
+ * onion_queue_delay_bucket() puts in bucket <b>idx</b>. */
+STATIC uint64_t
+onion_queue_delay_bucket_max(unsigned idx)
+{
+  unsigned bits;
+  if (idx < 4)
+    return idx;
+  bits = idx / 4 + 1;
+  return ((uint64_t)(4 + idx % 4 + 1) << (bits - 2)) - 1;
+}
+
+/** Return an upper bound, in microseconds, on the <b>pct</b>th percentile
+ * of the waits counted in <b>stats</b>. Return 0 if there are none. */
+STATIC uint64_t
+onion_queue_delay_percentile(const onion_queue_stats_t *stats, double pct)
+{
+  uint64_t rank, seen = 0;
+  unsigned i;
+
+  if (stats->n_processed == 0)
+    return 0;
+  rank = (uint64_t) (stats->n_processed * pct / 100.0);
+  if (rank < stats->n_processed * pct / 100.0)
+    ++rank;
+  if (rank < 1)
+    rank = 1;
+  for (i = 0; i < ONION_QUEUE_N_DELAY_BUCKETS; ++i) {
+    seen += stats->delay_hist[i];
+    if (seen >= rank)
+      return onion_queue_delay_bucket_max(i);
+  }
+  return onion_queue_delay_bucket_max(ONION_QUEUE_N_DELAY_BUCKETS - 1);
+}
+
+/** Return the time at which CoDel should next drop an onionskin, if it
+ * dropped the last one at <b>when_usec</b> and has dropped <b>count</b> in
+ * a row: the drops come faster the longer the queue stays slow. */
+static uint64_t
+onion_queue_codel_control_law(uint64_t when_usec, uint32_t count,
+                              uint64_t interval_usec)
+{
+  const double root = sqrt((double) count);
+  return when_usec + (uint64_t) (interval_usec / root);
+}
+
+/** Update <b>codel</b> for an onionskin that we are about to take from a
+ * queue of <b>n_queued</b> onionskins, after it waited for
+ * <b>sojourn_usec</b>. Return true iff CoDel lets us drop that onionskin
+ * instead, because every onionskin has waited longer than
+ * <b>target_usec</b> for at least <b>interval_usec</b>.
+ *
+ * We never drop the last onionskin in a queue, since there would be nothing
+ * else to give the idle cpuworker. */
+STATIC int
+onion_queue_codel_ok_to_drop(onion_queue_codel_t *codel,
+                             uint64_t sojourn_usec, int n_queued,
+                             uint64_t now_usec, uint64_t target_usec,
+                             uint64_t interval_usec)
+{
+  if (sojourn_usec < target_usec || n_queued <= 1) {
+    codel->above_target = 0;
+    return 0;
+  }
+  if (!codel->above_target) {
+    codel->above_target = 1;
+    codel->first_above_usec = now_usec + interval_usec;
+    return 0;
+  }
+  return now_usec >= codel->first_above_usec;
+}
+
+/** Remove <b>head</b> from its queue and close its circuit, because CoDel
+ * says it has waited too long. */
+static void
+onion_queue_codel_drop(onion_queue_t *head)
+{
+  or_circuit_t *circ = head->circ;
+  ++ol_stats[head->handshake_type].n_dropped;
+  onion_queue_entry_remove(head);
+  log_info(LD_CIRC,
+           "Circuit create requests are waiting too long; canceling one "
+           "due to overload.");
+  if (! TO_CIRCUIT(circ)->marked_for_close) {
+    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
+  }
+}
+
+/** Return the head of the <b>type</b> queue, after dropping any onionskins
+ * that CoDel tells us to drop from in front of it. Return NULL if the queue
+ * is empty.
+ *
+ * This follows the dequeue algorithm in RFC 8289, with onionskins for
+ * packets and a cpuworker for the link. */
+static onion_queue_t *
+onion_queue_codel_head(uint16_t type)
+{
+  const or_options_t *options = get_options();
+  onion_queue_codel_t *codel = &ol_codel[type];
+  const uint64_t target_usec = (uint64_t)options->OnionQueueTargetDelay*1000;
+  const uint64_t interval_usec =
+    (uint64_t)options->OnionQueueDropInterval*1000;
+  onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[type]);
+  uint64_t now_usec;
+  int ok_to_drop;
+
+  if (!head) {
+    codel->above_target = 0;
+    return NULL;
+  }
+  if (target_usec == 0 || interval_usec == 0)
+    return head;
+
+#define OK_TO_DROP(h)                                                   \
+  onion_queue_codel_ok_to_drop(codel, now_usec - (h)->when_added_usec,  \
+                               ol_entries[type], now_usec,              \
+                               target_usec, interval_usec)
+
+  now_usec = monotime_coarse_absolute_usec();
+  ok_to_drop = OK_TO_DROP(head);
+  if (codel->dropping) {
+    if (!ok_to_drop)
+      codel->dropping = 0;
+    while (codel->dropping && now_usec >= codel->drop_next_usec) {
+      onion_queue_codel_drop(head);
+      ++codel->count;
+      head = TOR_TAILQ_FIRST(&ol_list[type]);
+      if (!OK_TO_DROP(head)) {
+        codel->dropping = 0;
+      } else {
+        codel->drop_next_usec = onion_queue_codel_control_law(
+                      codel->drop_next_usec, codel->count, interval_usec);
+      }
+    }
+  } else if (ok_to_drop) {
+    uint32_t delta = codel->count - codel->last_count;
+    onion_queue_codel_drop(head);
+    head = TOR_TAILQ_FIRST(&ol_list[type]);
+    (void) OK_TO_DROP(head);
+    codel->dropping = 1;
+    /* If we were dropping recently, pick up near the rate that we reached
+     * then, rather than starting again from the slowest. */
+    if (delta > 1 &&
+        (int64_t)(now_usec - codel->drop_next_usec) <
+        (int64_t)(16 * interval_usec))
+      codel->count = delta;
+    else
+      codel->count = 1;
+    codel->drop_next_usec = onion_queue_codel_control_law(
+                                     now_usec, codel->count, interval_usec);
+    codel->last_count = codel->count;
+  }
+#undef OK_TO_DROP
+
+  return head;
+}
+
 /** Remove the highest priority item from ol_list[] and return it, or
  * return NULL if the lists are empty.
  */
@@ -270,7 +463,9 @@ onion_next_task(create_cell_t **onionskin_out)
 {
   or_circuit_t *circ;
   uint16_t handshake_to_choose = decide_next_handshake_type();
-  onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[handshake_to_choose]);
+  onion_queue_t *head = onion_queue_codel_head(handshake_to_choose);
+  onion_queue_stats_t *stats;
+  uint64_t waited_usec;
 
   if (!head)
     return NULL; /* no onions pending, we're done */
@@ -283,6 +478,10 @@ onion_next_task(create_cell_t **onionskin_out)
   circ = head->circ;
   if (head->onionskin)
     --ol_entries[head->handshake_type];
+  stats = &ol_stats[head->handshake_type];
+  waited_usec = monotime_coarse_absolute_usec() - head->when_added_usec;
+  ++stats->delay_hist[onion_queue_delay_bucket(waited_usec)];
+  ++stats->n_processed;
   log_info(LD_OR, "Processing create (%s). Queues now ntor=%d and tap=%d.",
     head->handshake_type == ONION_HANDSHAKE_TYPE_NTOR ? "ntor" : "tap",
     ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
@@ -295,6 +494,31 @@ onion_next_task(create_cell_t **onionskin_out)
   return circ;
 }
 
+/** Log how long onionskins have waited in the queues since the last time
+ * we were called, and how many we dropped for waiting too long. */
+void
+onion_queue_log_delay_stats(void)
+{
+  static const uint16_t types[] = {
+    ONION_HANDSHAKE_TYPE_TAP, ONION_HANDSHAKE_TYPE_NTOR };
+  static const char *names[] = { "TAP", "NTor" };
+  unsigned i;
+
+  for (i = 0; i < ARRAY_LENGTH(types); ++i) {
+    const onion_queue_stats_t *stats = &ol_stats[types[i]];
+    log_notice(LD_HEARTBEAT, "%s onionskin queue delays since last time: "
+               "%.1f/%.1f/%.1f msec (50th/90th/99th percentile) for %"PRIu64
+               " processed. %"PRIu64" dropped for waiting over "
+               "OnionQueueTargetDelay; %"PRIu64" expired.",
+               names[i],
+               onion_queue_delay_percentile(stats, 50) / 1000.0,
+               onion_queue_delay_percentile(stats, 90) / 1000.0,
+               onion_queue_delay_percentile(stats, 99) / 1000.0,
+               stats->n_processed, stats->n_dropped, stats->n_expired);
+  }
+  memset(ol_stats, 0, sizeof(ol_stats));
+}
+
 /** Return the number of <b>handshake_type</b>-style create requests pending.
  */
 int
@@ -362,4 +586,6 @@ clear_pending_onions(void)
     tor_assert(TOR_TAILQ_EMPTY(&ol_list[i]));
   }
   memset(ol_entries, 0, sizeof(ol_entries));
+  memset(ol_codel, 0, sizeof(ol_codel));
+  memset(ol_stats, 0, sizeof(ol_stats));
 }
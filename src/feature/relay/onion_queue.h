@@ -19,5 +19,54 @@ or_circuit_t *onion_next_task(struct create_cell_t **onionskin_out);
 int onion_num_pending(uint16_t handshake_type);
 void onion_pending_remove(or_circuit_t *circ);
 void clear_pending_onions(void);
+void onion_queue_log_delay_stats(void);
+
+#ifdef ONION_QUEUE_PRIVATE
+/** Longest wait that we tell apart from longer ones in our histograms. */
+#define ONION_QUEUE_MAX_DELAY_USEC UINT32_MAX
+/** Number of buckets in an onion_queue_stats_t histogram. */
+#define ONION_QUEUE_N_DELAY_BUCKETS 124
+
+/** CoDel state for one onionskin queue. */
+typedef struct onion_queue_codel_t {
+  /** True iff the last onionskin that we took had waited longer than
+   * OnionQueueTargetDelay. */
+  unsigned int above_target : 1;
+  /** True iff we are currently dropping onionskins. */
+  unsigned int dropping : 1;
+  /** If above_target, when the wait will have stayed too long for
+   * OnionQueueDropInterval, so that we may start dropping. */
+  uint64_t first_above_usec;
+  /** When we should drop the next onionskin, if dropping. */
+  uint64_t drop_next_usec;
+  /** How many onionskins we have dropped since we started dropping. */
+  uint32_t count;
+  /** The value of count when we last started dropping. */
+  uint32_t last_count;
+} onion_queue_codel_t;
+
+/** Statistics for one onionskin queue. */
+typedef struct onion_queue_stats_t {
+  /** Histogram of how long processed onionskins waited, bucketed by
+   * onion_queue_delay_bucket(). */
+  uint32_t delay_hist[ONION_QUEUE_N_DELAY_BUCKETS];
+  /** Number of onionskins that we have taken for processing. */
+  uint64_t n_processed;
+  /** Number of onionskins that CoDel dropped. */
+  uint64_t n_dropped;
+  /** Number of onionskins that waited for ONIONQUEUE_WAIT_CUTOFF. */
+  uint64_t n_expired;
+} onion_queue_stats_t;
+
+STATIC unsigned onion_queue_delay_bucket(uint64_t usec);
+STATIC uint64_t onion_queue_delay_bucket_max(unsigned idx);
+STATIC uint64_t onion_queue_delay_percentile(const onion_queue_stats_t *stats,
+                                             double pct);
+STATIC int onion_queue_codel_ok_to_drop(onion_queue_codel_t *codel,
+                                        uint64_t sojourn_usec, int n_queued,
+                                        uint64_t now_usec,
+                                        uint64_t target_usec,
+                                        uint64_t interval_usec);
+#endif /* defined(ONION_QUEUE_PRIVATE) */
 
 #endif /* !defined(TOR_ONION_QUEUE_H) */
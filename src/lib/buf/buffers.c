@@ -125,26 +125,123 @@ chunk_repack(chunk_t *chunk)
 
 /** Keep track of total size of allocated chunks for consistency asserts */
 static size_t total_bytes_allocated_in_chunks = 0;
+
+/* Chunk free-lists.
+ *
+ * Nearly every chunk we allocate is one of a handful of sizes, and a busy
+ * relay allocates and frees thousands of them every second as connections
+ * read and flush.  Rather than handing each one straight back to the
+ * allocator, we keep a free-list for each common size, and reuse chunks from
+ * there when we can.  The total memory held on the free-lists is capped by
+ * buf_set_freelist_cap(); the cap is zero (so that no chunks are kept) until
+ * somebody sets it.
+ */
+
+/** A free-list of unused chunks, all of the same allocation size. */
+typedef struct chunk_freelist_t {
+  size_t alloc_size; /**< What size chunks does this free-list hold? */
+  int cur_length; /**< How many chunks are on the free-list now? */
+  uint64_t n_alloc; /**< How many chunks of this size have we handed out? */
+  uint64_t n_hit; /**< How many of those came from the free-list? */
+  uint64_t n_free; /**< How many chunks of this size have been released? */
+  uint64_t n_cached; /**< How many of those went onto the free-list? */
+  chunk_t *head; /**< First chunk on the free-list. */
+} chunk_freelist_t;
+
+/** Macro to help define freelists. */
+#define FL(a) { a, 0, 0, 0, 0, 0, NULL }
+/** Static array of freelists, sorted by alloc_size, terminated by an entry
+ * with alloc_size of 0. */
+static chunk_freelist_t freelists[] = {
+  FL(4096), FL(8192), FL(16384), FL(0)
+};
+#undef FL
+
+/** Largest number of bytes that we will keep on all free-lists together. */
+static size_t freelist_cap = 0;
+/** Number of bytes currently held on all free-lists together. */
+static size_t total_bytes_in_freelists = 0;
+
+/** Return the free-list to hold free chunks of size <b>alloc</b>, or NULL if
+ * no free-list exists for that size. */
+static inline chunk_freelist_t *
+get_freelist(size_t alloc)
+{
+  int i;
+  for (i = 0; (freelists[i].alloc_size <= alloc &&
+               freelists[i].alloc_size); ++i) {
+    if (freelists[i].alloc_size == alloc) {
+      return &freelists[i];
+    }
+  }
+  return NULL;
+}
+
+/** Take the first chunk off <b>freelist</b>, give it back to the allocator,
+ * and return the number of bytes released. */
+static size_t
+freelist_release_one(chunk_freelist_t *freelist)
+{
+  chunk_t *chunk = freelist->head;
+  tor_assert(chunk);
+  freelist->head = chunk->next;
+  --freelist->cur_length;
+  total_bytes_in_freelists -= freelist->alloc_size;
+  tor_free(chunk);
+  return freelist->alloc_size;
+}
+
 static void
 buf_chunk_free_unchecked(chunk_t *chunk)
 {
+  size_t alloc;
+  chunk_freelist_t *freelist;
   if (!chunk)
     return;
+  if (CHUNK_IS_EXTERNAL(chunk))
+    chunk->external_free_fn(chunk->external_free_arg);
+  alloc = CHUNK_ALLOC_SIZE(chunk->memlen);
 #ifdef DEBUG_CHUNK_ALLOC
-  tor_assert(CHUNK_ALLOC_SIZE(chunk->memlen) == chunk->DBG_alloc);
+  tor_assert(alloc == chunk->DBG_alloc);
 #endif
-  tor_assert(total_bytes_allocated_in_chunks >=
-             CHUNK_ALLOC_SIZE(chunk->memlen));
-  total_bytes_allocated_in_chunks -= CHUNK_ALLOC_SIZE(chunk->memlen);
+  tor_assert(total_bytes_allocated_in_chunks >= alloc);
+  total_bytes_allocated_in_chunks -= alloc;
+  freelist = get_freelist(alloc);
+  if (freelist) {
+    ++freelist->n_free;
+    if (total_bytes_in_freelists + alloc <= freelist_cap) {
+      chunk->next = freelist->head;
+      freelist->head = chunk;
+      ++freelist->cur_length;
+      ++freelist->n_cached;
+      total_bytes_in_freelists += alloc;
+      return;
+    }
+  }
   tor_free(chunk);
 }
 static inline chunk_t *
 chunk_new_with_alloc_size(size_t alloc)
 {
   chunk_t *ch;
-  ch = tor_malloc(alloc);
+  chunk_freelist_t *freelist = get_freelist(alloc);
+
+  if (freelist) {
+    ++freelist->n_alloc;
+  }
+  if (freelist && freelist->head) {
+    ch = freelist->head;
+    freelist->head = ch->next;
+    --freelist->cur_length;
+    ++freelist->n_hit;
+    total_bytes_in_freelists -= alloc;
+  } else {
+    ch = tor_malloc(alloc);
+  }
   ch->next = NULL;
   ch->datalen = 0;
+  ch->external_free_fn = NULL;
+  ch->external_free_arg = NULL;
 #ifdef DEBUG_CHUNK_ALLOC
   ch->DBG_alloc = alloc;
 #endif
@@ -155,6 +252,111 @@ chunk_new_with_alloc_size(size_t alloc)
   return ch;
 }
 
+/** Set the largest number of bytes that we will keep in unused chunks on our
+ * free-lists to <b>cap</b>, and release chunks until we are under the new
+ * cap.  A cap of 0 disables the free-lists. */
+void
+buf_set_freelist_cap(size_t cap)
+{
+  int i;
+  freelist_cap = cap;
+  /* Release the largest chunks first. */
+  for (i = ARRAY_LENGTH(freelists) - 2; i >= 0; --i) {
+    while (total_bytes_in_freelists > freelist_cap && freelists[i].head)
+      freelist_release_one(&freelists[i]);
+  }
+}
+
+/** Give some of the chunks on our free-lists back to the allocator.  If
+ * <b>free_all</b>, release every chunk; otherwise release half of the
+ * chunks on each free-list (rounding up), so that repeated calls under
+ * sustained memory pressure drain the free-lists gradually.  Return the
+ * number of bytes released. */
+size_t
+buf_shrink_freelists(int free_all)
+{
+  size_t freed = 0;
+  int i;
+  for (i = 0; freelists[i].alloc_size; ++i) {
+    int n_to_free = free_all ? freelists[i].cur_length
+      : (freelists[i].cur_length + 1) / 2;
+    while (n_to_free-- > 0)
+      freed += freelist_release_one(&freelists[i]);
+  }
+  return freed;
+}
+
+/** Fill in <b>stats_out</b> with the usage of the free-list for chunks of
+ * <b>alloc_size</b> bytes.  Return 0 on success, or -1 if there is no
+ * free-list for that size. */
+int
+buf_get_freelist_stats(size_t alloc_size, buf_freelist_stats_t *stats_out)
+{
+  const chunk_freelist_t *freelist = get_freelist(alloc_size);
+  tor_assert(stats_out);
+  if (!freelist)
+    return -1;
+  stats_out->alloc_size = freelist->alloc_size;
+  stats_out->cur_length = freelist->cur_length;
+  stats_out->n_alloc = freelist->n_alloc;
+  stats_out->n_hit = freelist->n_hit;
+  stats_out->n_free = freelist->n_free;
+  stats_out->n_cached = freelist->n_cached;
+  return 0;
+}
+
+/** Return the fraction of chunk allocations that <b>freelist</b> has been
+ * able to satisfy, as a percentage. */
+static double
+freelist_hit_rate(const chunk_freelist_t *freelist)
+{
+  if (!freelist->n_alloc)
+    return 0.0;
+  return 100.0 * (double)freelist->n_hit / (double)freelist->n_alloc;
+}
+
+/** Return a newly allocated string describing the state of each chunk
+ * free-list, one line per free-list. */
+char *
+buf_get_freelist_summary(void)
+{
+  buf_t *out = buf_new();
+  char *result;
+  int i;
+  for (i = 0; freelists[i].alloc_size; ++i) {
+    const chunk_freelist_t *fl = &freelists[i];
+    buf_add_printf(out, "%s%"TOR_PRIuSZ" cached=%d alloc=%"PRIu64
+                   " hit=%"PRIu64" free=%"PRIu64" kept=%"PRIu64
+                   " hit-rate=%.2f%%",
+                   i ? "\n" : "", fl->alloc_size, fl->cur_length,
+                   fl->n_alloc, fl->n_hit, fl->n_free, fl->n_cached,
+                   freelist_hit_rate(fl));
+  }
+  result = buf_extract(out, NULL);
+  buf_free(out);
+  return result;
+}
+
+/** Log the current state of the chunk free-lists at log level
+ * <b>severity</b>. */
+void
+buf_dump_freelist_sizes(int severity)
+{
+  int i;
+  tor_log(severity, LD_MM, "====== Buffer freelists:");
+  for (i = 0; freelists[i].alloc_size; ++i) {
+    const chunk_freelist_t *fl = &freelists[i];
+    tor_log(severity, LD_MM,
+            "  %d chunks of size %"TOR_PRIuSZ" on the freelist (%"
+            TOR_PRIuSZ" bytes); %"PRIu64" allocations, %.2f%% from the "
+            "freelist.", fl->cur_length, fl->alloc_size,
+            fl->cur_length * fl->alloc_size, fl->n_alloc,
+            freelist_hit_rate(fl));
+  }
+  tor_log(severity, LD_MM, "  %"TOR_PRIuSZ" bytes on freelists in total "
+          "(cap %"TOR_PRIuSZ").", total_bytes_in_freelists, freelist_cap);
+}
+
 /** Expand <b>chunk</b> until it can hold <b>sz</b> bytes, and return a
  * new pointer to <b>chunk</b>.  Old pointers are no longer valid. */
 static inline chunk_t *
@@ -229,6 +431,22 @@ buf_pullup(buf_t *buf, size_t bytes, const char **head_out, size_t *len_out)
     return;
   }
 
+  if (CHUNK_IS_EXTERNAL(buf->head)) {
+    /* We can't add to memory that we don't own: copy the first chunk's data
+     * into a chunk of our own that is big enough for the rest. */
+    chunk_t *ext = buf->head;
+    chunk_t *newhead =
+      chunk_new_with_alloc_size(buf_preferred_chunk_size(capacity));
+    memcpy(newhead->data, ext->data, ext->datalen);
+    newhead->datalen = ext->datalen;
+    newhead->inserted_time = ext->inserted_time;
+    newhead->next = ext->next;
+    buf->head = newhead;
+    if (buf->tail == ext)
+      buf->tail = newhead;
+    buf_chunk_free_unchecked(ext);
+  }
+
   if (buf->head->memlen >= capacity) {
     /* We don't need to grow the first chunk, but we might need to repack it.*/
     size_t needed = capacity - buf->head->datalen;
@@ -435,6 +653,15 @@ buf_free_(buf_t *buf)
 static chunk_t *
 chunk_copy(const chunk_t *in_chunk)
 {
+  if (CHUNK_IS_EXTERNAL(in_chunk)) {
+    /* The copy gets its own memory, rather than another reference. */
+    chunk_t *newch =
+      chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(in_chunk->datalen));
+    memcpy(newch->data, in_chunk->data, in_chunk->datalen);
+    newch->datalen = in_chunk->datalen;
+    newch->inserted_time = in_chunk->inserted_time;
+    return newch;
+  }
   chunk_t *newch = tor_memdup(in_chunk, CHUNK_ALLOC_SIZE(in_chunk->memlen));
   total_bytes_allocated_in_chunks += CHUNK_ALLOC_SIZE(in_chunk->memlen);
 #ifdef DEBUG_CHUNK_ALLOC
@@ -498,6 +725,26 @@ buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped)
   return chunk;
 }
 
+/** Remove and free every chunk that follows <b>chunk</b> on <b>buf</b>, or
+ * every chunk on <b>buf</b> if <b>chunk</b> is NULL.  The removed chunks
+ * must hold no data. */
+void
+buf_free_empty_chunks_after(buf_t *buf, chunk_t *chunk)
+{
+  chunk_t *victim = chunk ? chunk->next : buf->head;
+  if (chunk)
+    chunk->next = NULL;
+  else
+    buf->head = NULL;
+  buf->tail = chunk;
+  while (victim) {
+    chunk_t *next = victim->next;
+    tor_assert(victim->datalen == 0);
+    buf_chunk_free_unchecked(victim);
+    victim = next;
+  }
+}
+
 /** Return the age of the oldest chunk in the buffer <b>buf</b>, in
  * timestamp units.  Requires the current monotonic timestamp as its
  * input <b>now</b>.
@@ -512,10 +759,12 @@ buf_get_oldest_chunk_timestamp(const buf_t *buf, uint32_t now)
   }
 }
 
+/** Return the number of bytes that buffers have allocated for chunks,
+ * including the unused chunks that we are holding on our free-lists. */
 size_t
 buf_get_total_allocation(void)
 {
-  return total_bytes_allocated_in_chunks;
+  return total_bytes_allocated_in_chunks + total_bytes_in_freelists;
 }
 
 /** Append <b>string_len</b> bytes from <b>string</b> to the end of
@@ -649,15 +898,55 @@ buf_get_bytes(buf_t *buf, char *string, size_t string_len)
   return (int)buf->datalen;
 }
 
+/** Remove the tail chunk of <b>buf</b>, which must hold no data. */
+static void
+buf_drop_empty_tail(buf_t *buf)
+{
+  chunk_t *victim = buf->tail, *ch;
+  tor_assert(victim && victim->datalen == 0);
+  if (buf->head == victim) {
+    buf->head = buf->tail = NULL;
+  } else {
+    for (ch = buf->head; ch->next != victim; ch = ch->next)
+      ;
+    ch->next = NULL;
+    buf->tail = ch;
+  }
+  buf_chunk_free_unchecked(victim);
+}
+
+/** Append <b>chunk</b>, which must not be in any buffer, to the end of
+ * <b>buf</b>, and stamp it with the current time. */
+static void
+buf_append_chunk(buf_t *buf, chunk_t *chunk)
+{
+  chunk->next = NULL;
+  chunk->inserted_time = monotime_coarse_get_stamp();
+  if (buf->tail && buf->tail->datalen == 0) {
+    /* Only the tail may be empty; drop it rather than leave it in the
+     * middle of the list. */
+    buf_drop_empty_tail(buf);
+  }
+  if (buf->tail) {
+    buf->tail->next = chunk;
+  } else {
+    buf->head = chunk;
+  }
+  buf->tail = chunk;
+  buf->datalen += chunk->datalen;
+}
+
 /** Move up to *<b>buf_flushlen</b> bytes from <b>buf_in</b> to
  * <b>buf_out</b>, and modify *<b>buf_flushlen</b> appropriately.
  * Return the number of bytes actually copied.
+ *
+ * Chunks whose data is moved in its entirety are spliced onto the end of
+ * <b>buf_out</b> rather than copied, so only a partial chunk at the end of
+ * the range (or a small one that fits in <b>buf_out</b>'s tail) is copied.
  */
 int
 buf_move_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen)
 {
-  /* We can do way better here, but this doesn't turn up in any profiles. */
-  char b[4096];
   size_t cp, len;
 
   if (BUG(buf_out->datalen > BUF_MAX_LEN || *buf_flushlen > BUF_MAX_LEN))
@@ -672,13 +961,29 @@ buf_move_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen)
   cp = len; /* Remember the number of bytes we intend to copy. */
   tor_assert(cp <= BUF_MAX_LEN);
   while (len) {
-    /* This isn't the most efficient implementation one could imagine, since
-     * it does two copies instead of 1, but I kinda doubt that this will be
-     * critical path. */
-    size_t n = len > sizeof(b) ? sizeof(b) : len;
-    buf_get_bytes(buf_in, b, n);
-    buf_add(buf_out, b, n);
-    len -= n;
+    chunk_t *chunk = buf_in->head;
+    tor_assert(chunk);
+    if (chunk->datalen <= len &&
+        !(buf_out->tail &&
+          CHUNK_REMAINING_CAPACITY(buf_out->tail) >= chunk->datalen)) {
+      /* We're moving all of this chunk's data, and it won't fit in the space
+       * left at the end of buf_out: hand over the chunk itself. */
+      size_t n = chunk->datalen;
+      buf_in->head = chunk->next;
+      if (!buf_in->head)
+        buf_in->tail = NULL;
+      buf_in->datalen -= n;
+      buf_append_chunk(buf_out, chunk);
+      len -= n;
+    } else {
+      /* Copy the part of this chunk that we're moving: either it's the last
+       * piece of what we were asked to move, or it's small enough to fit on
+       * the end of buf_out. */
+      size_t n = len < chunk->datalen ? len : chunk->datalen;
+      buf_add(buf_out, chunk->data, n);
+      buf_drain(buf_in, n);
+      len -= n;
+    }
   }
   *buf_flushlen -= cp;
   return (int)cp;
@@ -710,6 +1015,43 @@ buf_move_all(buf_t *buf_out, buf_t *buf_in)
   buf_in->datalen = 0;
 }
 
+/** Append the <b>len</b> bytes at <b>data</b> to the end of <b>buf</b>
+ * without copying them.  The bytes must stay valid and unchanged until
+ * <b>free_fn</b> is called with <b>free_arg</b>, which happens exactly once:
+ * when the buffer is done with them, or before we return if we fail.
+ *
+ * Return the new length of the buffer on success, -1 on failure.
+ */
+int
+buf_add_external(buf_t *buf, const char *data, size_t len,
+                 buf_external_free_fn_t free_fn, void *free_arg)
+{
+  chunk_t *chunk;
+  tor_assert(free_fn);
+  check();
+
+  if (BUG(buf->datalen > BUF_MAX_LEN) ||
+      BUG(buf->datalen > BUF_MAX_LEN - len)) {
+    free_fn(free_arg);
+    return -1;
+  }
+  if (!len) {
+    free_fn(free_arg);
+    return (int)buf->datalen;
+  }
+
+  chunk = chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(0));
+  chunk->data = (char *)data;
+  chunk->datalen = len;
+  chunk->external_free_fn = free_fn;
+  chunk->external_free_arg = free_arg;
+  buf_append_chunk(buf, chunk);
+
+  check();
+  tor_assert(buf->datalen <= BUF_MAX_LEN);
+  return (int)buf->datalen;
+}
+
 /** Internal structure: represents a position in a buffer. */
 typedef struct buf_pos_t {
   const chunk_t *chunk; /**< Which chunk are we pointing to? */
@@ -914,8 +1256,15 @@ buf_assert_ok(buf_t *buf)
     tor_assert(buf->tail);
     for (ch = buf->head; ch; ch = ch->next) {
       total += ch->datalen;
-      tor_assert(ch->datalen <= ch->memlen);
       tor_assert(ch->datalen <= BUF_MAX_LEN);
+      if (!ch->next)
+        tor_assert(ch == buf->tail);
+      if (CHUNK_IS_EXTERNAL(ch)) {
+        tor_assert(ch->memlen == 0);
+        tor_assert(ch->data);
+        continue;
+      }
+      tor_assert(ch->datalen <= ch->memlen);
       tor_assert(ch->data >= &ch->mem[0]);
       tor_assert(ch->data <= &ch->mem[0]+ch->memlen);
       if (ch->data == &ch->mem[0]+ch->memlen) {
@@ -928,8 +1277,6 @@ buf_assert_ok(buf_t *buf)
         /* LCOV_EXCL_STOP */
       }
       tor_assert(ch->data+ch->datalen <= &ch->mem[0] + ch->memlen);
-      if (!ch->next)
-        tor_assert(ch == buf->tail);
     }
     tor_assert(buf->datalen == total);
   }
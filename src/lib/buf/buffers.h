@@ -18,6 +18,7 @@
 #include "lib/testsupport/testsupport.h"
 
 #include <stdarg.h>
+#include <stddef.h>
 
 typedef struct buf_t buf_t;
 
@@ -39,7 +40,36 @@ size_t buf_slack(const buf_t *buf);
 uint32_t buf_get_oldest_chunk_timestamp(const buf_t *buf, uint32_t now);
 size_t buf_get_total_allocation(void);
 
+/** Usage statistics for one of the buffer chunk free-lists, as reported by
+ * buf_get_freelist_stats(). */
+typedef struct buf_freelist_stats_t {
+  /** Allocation size of the chunks on this free-list. */
+  size_t alloc_size;
+  /** Number of chunks currently on the free-list. */
+  int cur_length;
+  /** Number of chunks of this size that we have handed out. */
+  uint64_t n_alloc;
+  /** Number of those allocations that we satisfied from the free-list. */
+  uint64_t n_hit;
+  /** Number of chunks of this size that have been released. */
+  uint64_t n_free;
+  /** Number of those chunks that we kept on the free-list. */
+  uint64_t n_cached;
+} buf_freelist_stats_t;
+
+void buf_set_freelist_cap(size_t cap);
+size_t buf_shrink_freelists(int free_all);
+int buf_get_freelist_stats(size_t alloc_size,
+                           buf_freelist_stats_t *stats_out);
+char *buf_get_freelist_summary(void);
+void buf_dump_freelist_sizes(int severity);
+
 int buf_add(buf_t *buf, const char *string, size_t string_len);
+/** A function that releases memory added to a buffer with
+ * buf_add_external(), once the buffer no longer needs it. */
+typedef void (*buf_external_free_fn_t)(void *arg);
+int buf_add_external(buf_t *buf, const char *data, size_t len,
+                     buf_external_free_fn_t free_fn, void *free_arg);
 void buf_add_string(buf_t *buf, const char *string);
 void buf_add_printf(buf_t *buf, const char *format, ...)
   CHECK_PRINTF(2, 3);
@@ -80,8 +110,14 @@ typedef struct chunk_t {
 #ifdef DEBUG_CHUNK_ALLOC
   size_t DBG_alloc;
 #endif
-  char *data; /**< A pointer to the first byte of data stored in <b>mem</b>. */
+  char *data; /**< A pointer to the first byte of data stored in <b>mem</b>,
+              * or in memory that we don't own if <b>external_free_fn</b>
+              * is set. */
   uint32_t inserted_time; /**< Timestamp when this chunk was inserted. */
+  /** If this chunk holds data from buf_add_external(), the function that
+   * releases that data.  Such chunks have no <b>mem</b> of their own. */
+  buf_external_free_fn_t external_free_fn;
+  void *external_free_arg; /**< Argument for <b>external_free_fn</b>. */
   char mem[FLEXIBLE_ARRAY_MEMBER]; /**< The actual memory used for storage in
                 * this chunk. */
 } chunk_t;
@@ -100,15 +136,26 @@ struct buf_t {
 };
 
 chunk_t *buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped);
+void buf_free_empty_chunks_after(buf_t *buf, chunk_t *chunk);
 /** If a read onto the end of a chunk would be smaller than this number, then
  * just start a new chunk. */
 #define MIN_READ_LEN 8
 
+/** Return true iff <b>chunk</b> holds memory that it doesn't own, and must
+ * not write to. */
+static inline int
+CHUNK_IS_EXTERNAL(const chunk_t *chunk)
+{
+  return chunk->external_free_fn != NULL;
+}
+
 /** Return the number of bytes that can be written onto <b>chunk</b> without
  * running out of space. */
 static inline size_t
 CHUNK_REMAINING_CAPACITY(const chunk_t *chunk)
 {
+  if (CHUNK_IS_EXTERNAL(chunk))
+    return 0;
   return (chunk->mem + chunk->memlen) - (chunk->data + chunk->datalen);
 }
 
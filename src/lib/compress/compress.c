@@ -279,6 +279,9 @@ tor_uncompress(char **out, size_t *out_len,
 /** Try to tell whether the <b>in_len</b>-byte string in <b>in</b> is likely
  * to be compressed or not.  If it is, return the likeliest compression method.
  * Otherwise, return UNKNOWN_METHOD.
+ *
+ * (We can't tell ZSTD_DICT_METHOD apart from ZSTD_METHOD: a frame that uses
+ * our dictionary has the same header as any other Zstandard frame.)
  */
 compress_method_t
 detect_compression_method(const char *in, size_t in_len)
@@ -311,6 +314,8 @@ tor_compress_supports_method(compress_method_t method)
       return tor_lzma_method_supported();
     case ZSTD_METHOD:
       return tor_zstd_method_supported();
+    case ZSTD_DICT_METHOD:
+      return tor_zstd_dict_method_supported();
     case NO_METHOD:
       return 1;
     case UNKNOWN_METHOD:
@@ -351,6 +356,10 @@ static const struct {
   // lower maximum memory usage on the decoding side.
   { "x-tor-lzma", LZMA_METHOD },
   { "x-zstd" , ZSTD_METHOD },
+  // Frames in this encoding can only be decoded with the dictionary in
+  // zstd_dirdoc_dict.inc. If that dictionary ever changes, the new one needs
+  // a new name.
+  { "x-tor-zstd-dict", ZSTD_DICT_METHOD },
   { "identity", NO_METHOD },
 
   /* Later entries in this table are not canonical; these are recognized but
@@ -381,6 +390,7 @@ static const struct {
   { ZLIB_METHOD, "deflated" },
   { LZMA_METHOD, "LZMA compressed" },
   { ZSTD_METHOD, "Zstandard compressed" },
+  { ZSTD_DICT_METHOD, "Zstandard compressed with a dictionary" },
   { UNKNOWN_METHOD, "unknown encoding" },
 };
 
@@ -423,6 +433,7 @@ tor_compress_version_str(compress_method_t method)
     case LZMA_METHOD:
       return tor_lzma_get_version_str();
     case ZSTD_METHOD:
+    case ZSTD_DICT_METHOD:
       return tor_zstd_get_version_str();
     case NO_METHOD:
     case UNKNOWN_METHOD:
@@ -444,6 +455,7 @@ tor_compress_header_version_str(compress_method_t method)
     case LZMA_METHOD:
       return tor_lzma_get_header_version_str();
     case ZSTD_METHOD:
+    case ZSTD_DICT_METHOD:
       return tor_zstd_get_header_version_str();
     case NO_METHOD:
     case UNKNOWN_METHOD:
@@ -508,7 +520,8 @@ tor_compress_new(int compress, compress_method_t method,
       state->u.lzma_state = lzma_state;
       break;
     }
-    case ZSTD_METHOD: {
+    case ZSTD_METHOD:
+    case ZSTD_DICT_METHOD: {
       tor_zstd_compress_state_t *zstd_state =
         tor_zstd_compress_new(compress, method, compression_level);
 
@@ -576,6 +589,7 @@ tor_compress_process(tor_compress_state_t *state,
                                      finish);
       break;
     case ZSTD_METHOD:
+    case ZSTD_DICT_METHOD:
       rv = tor_zstd_compress_process(state->u.zstd_state,
                                      out, out_len, in, in_len,
                                      finish);
@@ -621,6 +635,7 @@ tor_compress_free_(tor_compress_state_t *state)
       tor_lzma_compress_free(state->u.lzma_state);
       break;
     case ZSTD_METHOD:
+    case ZSTD_DICT_METHOD:
       tor_zstd_compress_free(state->u.zstd_state);
       break;
     case NO_METHOD:
@@ -651,6 +666,7 @@ tor_compress_state_size(const tor_compress_state_t *state)
       size += tor_lzma_compress_state_size(state->u.lzma_state);
       break;
     case ZSTD_METHOD:
+    case ZSTD_DICT_METHOD:
       size += tor_zstd_compress_state_size(state->u.zstd_state);
       break;
     case NO_METHOD:
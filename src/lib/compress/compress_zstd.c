@@ -37,6 +37,16 @@ ENABLE_GCC_WARNING("-Wunused-const-variable")
 #endif
 #endif /* defined(HAVE_ZSTD) */
 
+#if defined(HAVE_ZSTD) && ZSTD_VERSION_NUMBER >= 10400
+/** Defined if we can compress and decompress with a raw-content prefix using
+ * zstd's stable API, which we need for ZSTD_DICT_METHOD.  (These functions
+ * became stable in zstd 1.4.0.) */
+#define HAVE_ZSTD_PREFIX_API
+#include "lib/compress/zstd_dirdoc_dict.inc"
+/** Length of zstd_dirdoc_dict, not counting its NUL. */
+#define ZSTD_DIRDOC_DICT_LEN (sizeof(zstd_dirdoc_dict) - 1)
+#endif /* defined(HAVE_ZSTD) && ZSTD_VERSION_NUMBER >= 10400 */
+
 /** Total number of bytes allocated for Zstandard state. */
 static atomic_counter_t total_zstd_allocation;
 
@@ -66,6 +76,20 @@ tor_zstd_method_supported(void)
 #endif
 }
 
+/** Return 1 if Zstandard compression with our built-in dictionary is
+ * supported; otherwise 0. */
+int
+tor_zstd_dict_method_supported(void)
+{
+#ifdef HAVE_ZSTD_PREFIX_API
+  /* Make sure we aren't running with an older library than we were built
+   * with. */
+  return ZSTD_versionNumber() >= 10400;
+#else
+  return 0;
+#endif
+}
+
 #ifdef HAVE_ZSTD
 /** Format a zstd version number as a string in <b>buf</b>. */
 static void
@@ -240,6 +264,45 @@ tor_zstd_state_size_precalc(int compress, int preset)
 #endif /* defined(ZSTD_STATIC_LINKING_ONLY) */
   return tor_zstd_state_size_precalc_fake(compress, preset);
 }
+
+/** Tell the stream in <b>state</b> to use our built-in dictionary for the
+ * frame it is about to compress (if <b>compress</b>) or decompress.
+ * Return 0 on success, -1 on failure.
+ *
+ * We hand the dictionary to zstd as a raw-content prefix: it's only good for
+ * one frame, but it's just a pointer to our static copy, so it costs nothing
+ * to set up, and every state we make handles a single frame. */
+static int
+tor_zstd_use_dict(tor_zstd_compress_state_t *state, int compress)
+{
+#ifdef HAVE_ZSTD_PREFIX_API
+  size_t retval;
+
+  if (BUG(!tor_zstd_dict_method_supported()))
+    return -1;
+
+  if (compress) {
+    retval = ZSTD_CCtx_refPrefix(state->u.compress_stream,
+                                 zstd_dirdoc_dict, ZSTD_DIRDOC_DICT_LEN);
+  } else {
+    retval = ZSTD_DCtx_refPrefix(state->u.decompress_stream,
+                                 zstd_dirdoc_dict, ZSTD_DIRDOC_DICT_LEN);
+  }
+
+  if (ZSTD_isError(retval)) {
+    // LCOV_EXCL_START
+    log_warn(LD_GENERAL, "Unable to load Zstandard dictionary: %s",
+             ZSTD_getErrorName(retval));
+    return -1;
+    // LCOV_EXCL_STOP
+  }
+  return 0;
+#else /* !defined(HAVE_ZSTD_PREFIX_API) */
+  (void)state;
+  (void)compress;
+  return -1;
+#endif /* defined(HAVE_ZSTD_PREFIX_API) */
+}
 #endif /* defined(HAVE_ZSTD) */
 
 /** Construct and return a tor_zstd_compress_state_t object using
@@ -250,7 +313,7 @@ tor_zstd_compress_new(int compress,
                       compress_method_t method,
                       compression_level_t level)
 {
-  tor_assert(method == ZSTD_METHOD);
+  tor_assert(method == ZSTD_METHOD || method == ZSTD_DICT_METHOD);
 
 #ifdef HAVE_ZSTD
   const int preset = memory_level(level);
@@ -281,6 +344,11 @@ tor_zstd_compress_new(int compress,
       goto err;
       // LCOV_EXCL_STOP
     }
+
+    if (method == ZSTD_DICT_METHOD &&
+        tor_zstd_use_dict(result, compress) < 0) {
+      goto err; // LCOV_EXCL_LINE
+    }
   } else {
     result->u.decompress_stream = ZSTD_createDStream();
 
@@ -301,6 +369,11 @@ tor_zstd_compress_new(int compress,
       goto err;
       // LCOV_EXCL_STOP
     }
+
+    if (method == ZSTD_DICT_METHOD &&
+        tor_zstd_use_dict(result, compress) < 0) {
+      goto err; // LCOV_EXCL_LINE
+    }
   }
 
   atomic_counter_add(&total_zstd_allocation, result->allocation);
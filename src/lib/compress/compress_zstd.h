@@ -12,6 +12,7 @@
 #define TOR_COMPRESS_ZSTD_H
 
 int tor_zstd_method_supported(void);
+int tor_zstd_dict_method_supported(void);
 
 const char *tor_zstd_get_version_str(void);
 
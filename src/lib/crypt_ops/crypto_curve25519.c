@@ -22,10 +22,12 @@
 #endif
 #include "lib/ctime/di_ops.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
+#include "lib/crypt_ops/crypto_curve25519_simd.h"
 #include "lib/crypt_ops/crypto_digest.h"
 #include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
+#include "lib/intmath/cmp.h"
 #include "lib/log/log.h"
 #include "lib/log/util_bug.h"
 
@@ -50,12 +52,25 @@ int curve25519_donna(uint8_t *mypublic,
 #endif /* defined(USE_CURVE25519_NACL) */
 
 static void pick_curve25519_basepoint_impl(void);
+static void pick_curve25519_batch_impl(void);
 
 /** This is set to 1 if we have an optimized Ed25519-based
  * implementation for multiplying a value by the basepoint; to 0 if we
  * don't, and to -1 if we haven't checked. */
 static int curve25519_use_ed = -1;
 
+/** The most scalar multiplications that curve25519_impl_batch() does at
+ * once with a vector implementation: 4 or 8; or 1 if we don't have a
+ * working one; or 0 if we haven't checked. */
+static int curve25519_batch_lanes = 0;
+
+/** The fewest scalar multiplications for which a <b>lanes</b>-lane vector
+ * implementation beats doing them one at a time, with its unused lanes
+ * left idle.  (In "bench onion_ntor", a full four-lane call costs about as
+ * much as two scalar multiplications, and a full eight-lane call about as
+ * much as three.) */
+#define CURVE25519_BATCH_MIN(lanes) ((lanes) / 2 + 1)
+
 /**
  * Helper function: call the most appropriate backend to compute the
  * scalar "secret" times the point "point".  Store the result in
@@ -110,6 +125,56 @@ curve25519_basepoint_impl(uint8_t *output, const uint8_t *secret)
   return r;
 }
 
+/**
+ * Helper function: compute <b>n</b> curve25519 scalar multiplications,
+ * setting each <b>outputs</b>[i] to <b>secrets</b>[i] times
+ * <b>points</b>[i], as curve25519_impl() would.  Use our vector
+ * implementation for as many of them as it is worth using it for.
+ */
+STATIC void
+curve25519_impl_batch(int n, uint8_t *const *outputs,
+                      const uint8_t *const *secrets,
+                      const uint8_t *const *points)
+{
+  if (BUG(curve25519_batch_lanes == 0)) {
+    /* LCOV_EXCL_START - Only reached if we forgot to call curve25519_init() */
+    pick_curve25519_batch_impl();
+    /* LCOV_EXCL_STOP */
+  }
+
+  while (n > 0) {
+    int lanes = curve25519_batch_lanes;
+    while (lanes >= 4 && n < CURVE25519_BATCH_MIN(lanes))
+      lanes /= 2;
+
+    if (lanes >= 4) {
+      uint8_t *outs[CURVE25519_SIMD_MAX_LANES];
+      const uint8_t *secs[CURVE25519_SIMD_MAX_LANES];
+      const uint8_t *pts[CURVE25519_SIMD_MAX_LANES];
+      uint8_t unused[CURVE25519_SIMD_MAX_LANES][CURVE25519_OUTPUT_LEN];
+      const int n_used = MIN(n, lanes);
+      int i;
+      /* Fill any lanes that we have no work for with copies of the first
+       * multiplication, and throw their answers away. */
+      for (i = 0; i < lanes; ++i) {
+        const int src = (i < n_used) ? i : 0;
+        outs[i] = (i < n_used) ? outputs[i] : unused[i];
+        secs[i] = secrets[src];
+        pts[i] = points[src];
+      }
+      curve25519_simd_scalarmult(lanes, outs, secs, pts);
+      memwipe(unused, 0, sizeof(unused));
+      outputs += n_used;
+      secrets += n_used;
+      points += n_used;
+      n -= n_used;
+    } else {
+      curve25519_impl(*outputs++, *secrets++, *points++);
+      --n;
+    }
+  }
+}
+
 /**
  * Override the decision of whether to use the Ed25519-based basepoint
  * multiply function.  Used for testing.
@@ -272,6 +337,58 @@ curve25519_handshake(uint8_t *output,
   curve25519_impl(output, skey->secret_key, pkey->public_key);
 }
 
+/** Perform <b>n</b> curve25519 ECDH handshakes at once: for each i, as
+ * curve25519_handshake(<b>outputs</b>[i], <b>skeys</b>[i],
+ * <b>pkeys</b>[i]).  This is faster than doing them one by one when we
+ * have a vector implementation to share them out across. */
+void
+curve25519_handshake_batch(int n, uint8_t *const *outputs,
+                           const curve25519_secret_key_t *const *skeys,
+                           const curve25519_public_key_t *const *pkeys)
+{
+  const uint8_t *secrets[CURVE25519_SIMD_MAX_LANES];
+  const uint8_t *points[CURVE25519_SIMD_MAX_LANES];
+
+  while (n > 0) {
+    const int n_now = MIN(n, CURVE25519_SIMD_MAX_LANES);
+    int i;
+    for (i = 0; i < n_now; ++i) {
+      secrets[i] = skeys[i]->secret_key;
+      points[i] = pkeys[i]->public_key;
+    }
+    curve25519_impl_batch(n_now, outputs, secrets, points);
+    outputs += n_now;
+    skeys += n_now;
+    pkeys += n_now;
+    n -= n_now;
+  }
+}
+
+/** Make curve25519_handshake_batch() use at most <b>lanes</b> lanes of our
+ * vector implementation at once, or none if <b>lanes</b> is 1.  Return the
+ * number of lanes that it will use, which is less than <b>lanes</b> if this
+ * CPU can't do that many.  Used for testing and benchmarks. */
+int
+curve25519_set_batch_lanes(int lanes)
+{
+  const int max_lanes = curve25519_simd_get_max_lanes();
+  if (lanes >= 8 && max_lanes >= 8)
+    curve25519_batch_lanes = 8;
+  else if (lanes >= 4 && max_lanes >= 4)
+    curve25519_batch_lanes = 4;
+  else
+    curve25519_batch_lanes = 1;
+  return curve25519_batch_lanes;
+}
+
+/** Return the number of lanes that curve25519_handshake_batch() uses at
+ * once, as set by curve25519_set_batch_lanes() or at startup. */
+int
+curve25519_get_batch_lanes(void)
+{
+  return curve25519_batch_lanes;
+}
+
 /** Check whether the ed25519-based curve25519 basepoint optimization seems to
  * be working. If so, return 0; otherwise return -1. */
 static int
@@ -357,10 +474,67 @@ pick_curve25519_basepoint_impl(void)
   /* LCOV_EXCL_STOP */
 }
 
+/** Check whether our <b>lanes</b>-lane vector implementation agrees with
+ * curve25519_impl(). If so, return 0; otherwise return -1. */
+static int
+curve25519_batch_spot_check(int lanes)
+{
+  uint8_t e[CURVE25519_SIMD_MAX_LANES][32] = {{0}};
+  uint8_t k[CURVE25519_SIMD_MAX_LANES][32] = {{0}};
+  uint8_t out[CURVE25519_SIMD_MAX_LANES][32];
+  uint8_t expected[32];
+  uint8_t *outs[CURVE25519_SIMD_MAX_LANES] = { NULL };
+  const uint8_t *secs[CURVE25519_SIMD_MAX_LANES] = { NULL };
+  const uint8_t *pts[CURVE25519_SIMD_MAX_LANES] = { NULL };
+  int i, j, r = 0;
+
+  /* Give every lane a different scalar and point, including a point with
+   * its high bit set, and one that is not reduced mod p. */
+  for (i = 0; i < lanes; ++i) {
+    for (j = 0; j < 32; ++j) {
+      e[i][j] = (uint8_t)(i * 37 + j * 11 + 1);
+      k[i][j] = (uint8_t)(i * 101 + j * 7 + 9);
+    }
+    outs[i] = out[i];
+    secs[i] = e[i];
+    pts[i] = k[i];
+  }
+  memset(k[0], 0xff, 32);
+  k[1][31] |= 0x80;
+  curve25519_simd_scalarmult(lanes, outs, secs, pts);
+
+  for (i = 0; i < lanes; ++i) {
+    r |= curve25519_impl(expected, e[i], k[i]);
+    if (fast_memneq(expected, out[i], 32))
+      r = -1;
+  }
+  return r < 0 ? -1 : 0;
+}
+
+/** Choose how many lanes of our vector curve25519 implementation to use, if
+ * any: the most that this CPU supports and that give the right answers. */
+static void
+pick_curve25519_batch_impl(void)
+{
+  int lanes = curve25519_simd_get_max_lanes();
+
+  for ( ; lanes >= 4; lanes /= 2) {
+    if (curve25519_batch_spot_check(lanes) == 0)
+      break;
+    /* LCOV_EXCL_START
+     * only reachable if our vector implementation is broken */
+    log_warn(LD_BUG|LD_CRYPTO, "Our %d-lane curve25519 implementation "
+             "seems broken; not using it.", lanes);
+    /* LCOV_EXCL_STOP */
+  }
+  curve25519_batch_lanes = (lanes >= 4) ? lanes : 1;
+}
+
 /** Initialize the curve25519 implementations. This is necessary if you're
  * going to use them in a multithreaded setting, and not otherwise. */
 void
 curve25519_init(void)
 {
   pick_curve25519_basepoint_impl();
+  pick_curve25519_batch_impl();
 }
@@ -56,6 +56,9 @@ int curve25519_keypair_generate(curve25519_keypair_t *keypair_out,
 void curve25519_handshake(uint8_t *output,
                           const curve25519_secret_key_t *,
                           const curve25519_public_key_t *);
+void curve25519_handshake_batch(int n, uint8_t *const *outputs,
+                           const curve25519_secret_key_t *const *skeys,
+                           const curve25519_public_key_t *const *pkeys);
 
 int curve25519_keypair_write_to_file(const curve25519_keypair_t *keypair,
                                      const char *fname,
@@ -72,6 +75,9 @@ STATIC int curve25519_impl(uint8_t *output, const uint8_t *secret,
                            const uint8_t *basepoint);
 
 STATIC int curve25519_basepoint_impl(uint8_t *output, const uint8_t *secret);
+STATIC void curve25519_impl_batch(int n, uint8_t *const *outputs,
+                                  const uint8_t *const *secrets,
+                                  const uint8_t *const *points);
 #endif /* defined(CRYPTO_CURVE25519_PRIVATE) */
 
 int curve25519_public_from_base64(curve25519_public_key_t *pkey,
@@ -80,6 +86,8 @@ void curve25519_public_to_base64(char *output,
                                  const curve25519_public_key_t *pkey);
 
 void curve25519_set_impl_params(int use_ed);
+int curve25519_set_batch_lanes(int lanes);
+int curve25519_get_batch_lanes(void);
 void curve25519_init(void);
 
 #endif /* !defined(TOR_CRYPTO_CURVE25519_H) */
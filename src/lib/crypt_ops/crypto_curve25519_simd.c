@@ -0,0 +1,242 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file crypto_curve25519_simd.c
+ *
+ * \brief Curve25519 scalar multiplication in several lanes at once.
+ *
+ * Servers do two curve25519 scalar multiplications for every ntor
+ * handshake, and each one is a long chain of field multiplications that
+ * depend on one another.  When we have several handshakes to answer, we
+ * can instead run their ladders side by side, one handshake per lane of a
+ * vector register: four lanes with AVX2, and eight with AVX-512.
+ *
+ * The arithmetic itself lives in crypto_curve25519_simd.inc, which we
+ * include once per instruction set.  We compile every copy whatever the
+ * compiler flags, and pick one at runtime based on what the CPU supports.
+ * crypto_curve25519.c decides when batching is worth it, and checks our
+ * answers against its scalar implementation before using us.
+ **/
+
+#include "orconfig.h"
+#include "lib/cc/compat_compiler.h"
+#include "lib/crypt_ops/crypto_curve25519_simd.h"
+#include "lib/crypt_ops/crypto_util.h"
+#include "lib/log/util_bug.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CURVE25519_SIMD_X86_64
+#include <immintrin.h>
+#endif
+
+#ifdef CURVE25519_SIMD_X86_64
+
+/** Return the little-endian 32-bit value at <b>in</b>. */
+static inline uint32_t
+load4(const uint8_t *in)
+{
+  return ((uint32_t)in[0]) | (((uint32_t)in[1]) << 8) |
+    (((uint32_t)in[2]) << 16) | (((uint32_t)in[3]) << 24);
+}
+
+/** Unpack the curve25519 u-coordinate in <b>in</b> into the ten limbs
+ * that crypto_curve25519_simd.inc uses, ignoring its high bit. */
+static void
+curve25519_simd_fe_frombytes(uint32_t *h, const uint8_t *in)
+{
+  h[0] = load4(in) & 0x3ffffff;
+  h[1] = (load4(in + 3) >> 2) & 0x1ffffff;
+  h[2] = (load4(in + 6) >> 3) & 0x3ffffff;
+  h[3] = (load4(in + 9) >> 5) & 0x1ffffff;
+  h[4] = (load4(in + 12) >> 6) & 0x3ffffff;
+  h[5] = load4(in + 16) & 0x1ffffff;
+  h[6] = (load4(in + 19) >> 1) & 0x3ffffff;
+  h[7] = (load4(in + 22) >> 3) & 0x1ffffff;
+  h[8] = (load4(in + 25) >> 4) & 0x3ffffff;
+  h[9] = (load4(in + 28) >> 6) & 0x1ffffff;
+}
+
+/** Pack the field element in <b>h</b>, whose limbs are within the bound
+ * that crypto_curve25519_simd.inc documents, into its unique 32-byte
+ * encoding in <b>out</b>. */
+static void
+curve25519_simd_fe_tobytes(uint8_t *out, const uint32_t *h)
+{
+  static const unsigned offset[10] = {
+    0, 26, 51, 77, 102, 128, 153, 179, 204, 230
+  };
+  const uint64_t low63 = (((uint64_t)1) << 63) - 1;
+  uint64_t w[5] = { 0, 0, 0, 0, 0 }, t[4], top, mask;
+  unsigned __int128 c;
+  int i, j, round;
+
+  /* Add up the limbs at their offsets.  The total is below 2^256. */
+  for (i = 0; i < 10; ++i) {
+    const unsigned __int128 v =
+      ((unsigned __int128)h[i]) << (offset[i] % 64);
+    c = 0;
+    for (j = offset[i] / 64; j < 5; ++j) {
+      c += w[j];
+      if (j == (int)(offset[i] / 64))
+        c += (uint64_t)v;
+      else if (j == (int)(offset[i] / 64) + 1)
+        c += (uint64_t)(v >> 64);
+      w[j] = (uint64_t)c;
+      c >>= 64;
+    }
+  }
+
+  /* Fold everything above bit 255 back in, twice, to get below 2^255. */
+  for (round = 0; round < 2; ++round) {
+    top = (w[3] >> 63) | (w[4] << 1);
+    w[3] &= low63;
+    w[4] = 0;
+    c = ((unsigned __int128)top) * 19;
+    for (j = 0; j < 4; ++j) {
+      c += w[j];
+      w[j] = (uint64_t)c;
+      c >>= 64;
+    }
+    w[4] = (uint64_t)c;
+  }
+
+  /* Now subtract p if we are at least p: that is, if adding 19 reaches
+   * 2^255.  Choose without branching. */
+  c = 19;
+  for (j = 0; j < 4; ++j) {
+    c += w[j];
+    t[j] = (uint64_t)c;
+    c >>= 64;
+  }
+  mask = 0 - (t[3] >> 63);
+  t[3] &= low63;
+  for (j = 0; j < 4; ++j)
+    w[j] = (t[j] & mask) | (w[j] & ~mask);
+
+  for (j = 0; j < 32; ++j)
+    out[j] = (uint8_t)(w[j / 8] >> (8 * (j % 8)));
+
+  memwipe(w, 0, sizeof(w));
+  memwipe(t, 0, sizeof(t));
+}
+
+#define CURVE25519_SIMD_UNROLL _Pragma("GCC unroll 10")
+
+/* The four-lane version, for AVX2. */
+#define VEC __m256i
+#define LANES 4
+#define V_ADD(a,b) _mm256_add_epi64((a),(b))
+#define V_SUB(a,b) _mm256_sub_epi64((a),(b))
+#define V_AND(a,b) _mm256_and_si256((a),(b))
+#define V_XOR(a,b) _mm256_xor_si256((a),(b))
+#define V_MUL(a,b) _mm256_mul_epu32((a),(b))
+#define V_SRL(a,n) _mm256_srli_epi64((a),(n))
+#define V_SLL(a,n) _mm256_slli_epi64((a),(n))
+#define V_SET1(x) _mm256_set1_epi64x((long long)(x))
+#define V_ZERO _mm256_setzero_si256()
+#define V_LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define V_STORE(p,v) _mm256_storeu_si256((__m256i *)(p), (v))
+#define TARGET __attribute__((target("avx2")))
+#define FN(name) name ## _avx2
+#include "lib/crypt_ops/crypto_curve25519_simd.inc"
+#undef VEC
+#undef LANES
+#undef V_ADD
+#undef V_SUB
+#undef V_AND
+#undef V_XOR
+#undef V_MUL
+#undef V_SRL
+#undef V_SLL
+#undef V_SET1
+#undef V_ZERO
+#undef V_LOAD
+#undef V_STORE
+#undef TARGET
+#undef FN
+
+/* The eight-lane version, for AVX-512. */
+#define VEC __m512i
+#define LANES 8
+#define V_ADD(a,b) _mm512_add_epi64((a),(b))
+#define V_SUB(a,b) _mm512_sub_epi64((a),(b))
+#define V_AND(a,b) _mm512_and_si512((a),(b))
+#define V_XOR(a,b) _mm512_xor_si512((a),(b))
+#define V_MUL(a,b) _mm512_mul_epu32((a),(b))
+#define V_SRL(a,n) _mm512_srli_epi64((a),(n))
+#define V_SLL(a,n) _mm512_slli_epi64((a),(n))
+#define V_SET1(x) _mm512_set1_epi64((long long)(x))
+#define V_ZERO _mm512_setzero_si512()
+#define V_LOAD(p) _mm512_loadu_si512((const void *)(p))
+#define V_STORE(p,v) _mm512_storeu_si512((void *)(p), (v))
+#define TARGET __attribute__((target("avx512f")))
+#define FN(name) name ## _avx512
+/* Some versions of GCC's avx512fintrin.h make _mm512_mul_epu32() warn about
+ * an uninitialized variable that it means to leave uninitialized. */
+DISABLE_GCC_WARNING("-Wuninitialized")
+DISABLE_GCC_WARNING("-Wmaybe-uninitialized")
+#include "lib/crypt_ops/crypto_curve25519_simd.inc"
+ENABLE_GCC_WARNING("-Wmaybe-uninitialized")
+ENABLE_GCC_WARNING("-Wuninitialized")
+#undef VEC
+#undef LANES
+#undef V_ADD
+#undef V_SUB
+#undef V_AND
+#undef V_XOR
+#undef V_MUL
+#undef V_SRL
+#undef V_SLL
+#undef V_SET1
+#undef V_ZERO
+#undef V_LOAD
+#undef V_STORE
+#undef TARGET
+#undef FN
+
+#endif /* defined(CURVE25519_SIMD_X86_64) */
+
+/** Return the largest number of lanes that curve25519_simd_scalarmult()
+ * can use on this CPU, or 1 if it can't run here at all. */
+int
+curve25519_simd_get_max_lanes(void)
+{
+#ifdef CURVE25519_SIMD_X86_64
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return 8;
+  if (__builtin_cpu_supports("avx2"))
+    return 4;
+#endif /* defined(CURVE25519_SIMD_X86_64) */
+  return 1;
+}
+
+/** Compute exactly <b>lanes</b> curve25519 scalar multiplications, setting
+ * each <b>outputs</b>[i] to <b>secrets</b>[i] times <b>points</b>[i].
+ * <b>lanes</b> must be 4 or 8, and no more than
+ * curve25519_simd_get_max_lanes(). */
+void
+curve25519_simd_scalarmult(int lanes,
+                           uint8_t *const *outputs,
+                           const uint8_t *const *secrets,
+                           const uint8_t *const *points)
+{
+#ifdef CURVE25519_SIMD_X86_64
+  if (lanes == 8) {
+    curve25519_scalarmult_avx512(outputs, secrets, points);
+    return;
+  } else if (lanes == 4) {
+    curve25519_scalarmult_avx2(outputs, secrets, points);
+    return;
+  }
+#else
+  (void)lanes;
+  (void)outputs;
+  (void)secrets;
+  (void)points;
+#endif /* defined(CURVE25519_SIMD_X86_64) */
+  tor_assert_unreached();
+}
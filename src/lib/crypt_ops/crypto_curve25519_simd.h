@@ -0,0 +1,24 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file crypto_curve25519_simd.h
+ * \brief Header for crypto_curve25519_simd.c
+ **/
+
+#ifndef TOR_CRYPTO_CURVE25519_SIMD_H
+#define TOR_CRYPTO_CURVE25519_SIMD_H
+
+#include "lib/cc/torint.h"
+
+/** Largest number of scalar multiplications that any of our vector
+ * implementations does at once. */
+#define CURVE25519_SIMD_MAX_LANES 8
+
+int curve25519_simd_get_max_lanes(void);
+void curve25519_simd_scalarmult(int lanes,
+                                uint8_t *const *outputs,
+                                const uint8_t *const *secrets,
+                                const uint8_t *const *points);
+
+#endif /* !defined(TOR_CRYPTO_CURVE25519_SIMD_H) */
@@ -21,6 +21,7 @@
 #include <sys/stat.h>
 #endif
 
+#include "lib/container/smartlist.h"
 #include "lib/ctime/di_ops.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
 #include "lib/crypt_ops/crypto_digest.h"
@@ -31,6 +32,7 @@
 #include "lib/log/log.h"
 #include "lib/log/util_bug.h"
 #include "lib/encoding/binascii.h"
+#include "lib/intmath/cmp.h"
 #include "lib/string/util_string.h"
 
 #include "ed25519/ref10/ed25519_ref10.h"
@@ -442,6 +444,138 @@ ed25519_checksig_batch,(int *okay_out,
   return res;
 }
 
+/** One signature in an ed25519_batch_t. We keep our own copies of the key
+ * and message, since the documents they came from may not outlive us. */
+typedef struct ed25519_batch_item_t {
+  /** The public key that supposedly generated the signature. */
+  ed25519_public_key_t pubkey;
+  /** The signature to check. */
+  ed25519_signature_t signature;
+  /** The message that the signature is supposed to have been applied to. */
+  uint8_t *msg;
+  /** The length of the message. */
+  size_t len;
+  /** The caller's tag for this signature, as given to
+   * ed25519_batch_add(). */
+  int tag;
+} ed25519_batch_item_t;
+
+/** A set of signatures to verify together: see ed25519_batch_new(). */
+struct ed25519_batch_t {
+  /** A list of ed25519_batch_item_t, in the order they were added. */
+  smartlist_t *items;
+};
+
+/** Return a new, empty ed25519_batch_t.
+ *
+ * Batch verification gets cheaper per signature as the batch grows, up to
+ * ED25519_BATCH_GROUP_SIZE signatures, but most documents only carry two or
+ * three.  When we have many documents to check at once, we can add all of
+ * their signatures to one batch, tagging each signature with the document
+ * it came from, and then learn from ed25519_batch_verify() which documents
+ * had bad ones. */
+ed25519_batch_t *
+ed25519_batch_new(void)
+{
+  ed25519_batch_t *batch = tor_malloc_zero(sizeof(ed25519_batch_t));
+  batch->items = smartlist_new();
+  return batch;
+}
+
+/** Release all storage held in <b>batch</b>. */
+void
+ed25519_batch_free_(ed25519_batch_t *batch)
+{
+  if (!batch)
+    return;
+
+  SMARTLIST_FOREACH_BEGIN(batch->items, ed25519_batch_item_t *, item) {
+    tor_free(item->msg);
+    tor_free(item);
+  } SMARTLIST_FOREACH_END(item);
+  smartlist_free(batch->items);
+  tor_free(batch);
+}
+
+/** Add a copy of the signature in <b>checkable</b> to <b>batch</b>, tagged
+ * with <b>tag</b>, which should be a small nonnegative integer. */
+void
+ed25519_batch_add(ed25519_batch_t *batch,
+                  const ed25519_checkable_t *checkable,
+                  int tag)
+{
+  ed25519_batch_item_t *item;
+
+  tor_assert(batch);
+  tor_assert(checkable);
+  tor_assert(tag >= 0);
+
+  item = tor_malloc_zero(sizeof(ed25519_batch_item_t));
+  ed25519_pubkey_copy(&item->pubkey, checkable->pubkey);
+  memcpy(&item->signature, &checkable->signature, sizeof(item->signature));
+  item->msg = tor_memdup(checkable->msg, checkable->len ? checkable->len : 1);
+  item->len = checkable->len;
+  item->tag = tag;
+  smartlist_add(batch->items, item);
+}
+
+/** Return the number of signatures in <b>batch</b>. */
+int
+ed25519_batch_len(const ed25519_batch_t *batch)
+{
+  tor_assert(batch);
+  return smartlist_len(batch->items);
+}
+
+/** Validate every signature in <b>batch</b>, ED25519_BATCH_GROUP_SIZE at a
+ * time.  For every invalid signature whose tag is below <b>n_tags</b>, set
+ * <b>bad_tags_out</b>[tag] to 1; leave the other elements of
+ * <b>bad_tags_out</b> alone.  Return 0 if every signature was valid.
+ * Otherwise return -N, where N is the number of invalid signatures.
+ *
+ * (When a group fails as a whole, ed25519_checksig_batch() falls back to
+ * checking its signatures one by one, so one bad signature only costs us
+ * the group that it is in.)
+ */
+int
+ed25519_batch_verify(const ed25519_batch_t *batch,
+                     int *bad_tags_out, int n_tags)
+{
+  ed25519_checkable_t checkable[ED25519_BATCH_GROUP_SIZE];
+  int okay[ED25519_BATCH_GROUP_SIZE];
+  const int n_items = smartlist_len(batch->items);
+  int start, i, n_bad = 0;
+
+  for (start = 0; start < n_items; start += ED25519_BATCH_GROUP_SIZE) {
+    const int n = MIN(n_items - start, ED25519_BATCH_GROUP_SIZE);
+
+    for (i = 0; i < n; ++i) {
+      const ed25519_batch_item_t *item =
+        smartlist_get(batch->items, start + i);
+      checkable[i].pubkey = &item->pubkey;
+      memcpy(&checkable[i].signature, &item->signature,
+             sizeof(checkable[i].signature));
+      checkable[i].msg = item->msg;
+      checkable[i].len = item->len;
+    }
+
+    if (ed25519_checksig_batch(okay, checkable, n) == 0)
+      continue;
+
+    for (i = 0; i < n; ++i) {
+      const ed25519_batch_item_t *item =
+        smartlist_get(batch->items, start + i);
+      if (okay[i])
+        continue;
+      ++n_bad;
+      if (item->tag < n_tags)
+        bad_tags_out[item->tag] = 1;
+    }
+  }
+
+  return -n_bad;
+}
+
 /**
  * Given a curve25519 keypair in <b>inp</b>, generate a corresponding
  * ed25519 keypair in <b>out</b>, and set <b>signbit_out</b> to the
@@ -89,6 +89,28 @@ MOCK_DECL(int, ed25519_checksig_batch,(int *okay_out,
                                        const ed25519_checkable_t *checkable,
                                        int n_checkable));
 
+/** How many signatures ed25519_batch_verify() hands to
+ * ed25519_checksig_batch() at a time.  This matches the largest batch that
+ * ed25519-donna verifies at once. */
+#define ED25519_BATCH_GROUP_SIZE 64
+
+/**
+ * A set of Ed25519 signatures, possibly from many different documents, that
+ * we are collecting so that we can verify them all together.
+ */
+typedef struct ed25519_batch_t ed25519_batch_t;
+
+ed25519_batch_t *ed25519_batch_new(void);
+void ed25519_batch_free_(ed25519_batch_t *batch);
+#define ed25519_batch_free(batch) \
+  FREE_AND_NULL(ed25519_batch_t, ed25519_batch_free_, (batch))
+void ed25519_batch_add(ed25519_batch_t *batch,
+                       const ed25519_checkable_t *checkable,
+                       int tag);
+int ed25519_batch_len(const ed25519_batch_t *batch);
+int ed25519_batch_verify(const ed25519_batch_t *batch,
+                         int *bad_tags_out, int n_tags);
+
 int ed25519_keypair_from_curve25519_keypair(ed25519_keypair_t *out,
                                             int *signbit_out,
                                             const curve25519_keypair_t *inp);
@@ -9,13 +9,19 @@
  * for them to send answers back to the main thread.
  *
  * The main structure here is a threadpool_t : it manages a set of worker
- * threads, a queue of pending work, and a reply queue.  Every piece of work
- * is a workqueue_entry_t, containing data to process and a function to
- * process it with.
+ * threads, each with its own queues of pending work, and a reply queue.
+ * Every piece of work is a workqueue_entry_t, containing data to process
+ * and a function to process it with.
  *
- * The main thread informs the worker threads of pending work by using a
- * condition variable.  The workers inform the main process of completed work
- * by using an alert_sockets_t object, as implemented in net/alertsock.c.
+ * The main thread puts each piece of work on the queue of a randomly chosen
+ * thread, and informs that thread by using its condition variable.  A thread
+ * whose queues are empty steals work from the others, preferring the most
+ * urgent work it can find; if there is none, it counts itself as idle and
+ * waits, and the next piece of work queued for a busy thread wakes it up.
+ * The workers inform the main process of completed work by pushing it onto
+ * a lock-free stack in the reply queue, and by using an alert_sockets_t
+ * object, as implemented in net/alertsock.c, to wake the main thread at most
+ * once each time it drains the queue.
  *
  * The main thread can also queue an "update" that will be handled by all the
  * workers.  This is useful for updating state that all the workers share.
@@ -35,6 +41,7 @@
 #include "lib/net/alertsock.h"
 #include "lib/net/socket.h"
 #include "lib/thread/threads.h"
+#include "lib/time/compat_time.h"
 
 #include "ext/tor_queue.h"
 #include <event2/event.h>
@@ -44,20 +51,30 @@
 #define WORKQUEUE_PRIORITY_LAST WQ_PRI_LOW
 #define WORKQUEUE_N_PRIORITIES (((int) WORKQUEUE_PRIORITY_LAST)+1)
 
+/** For half of our threads, choose lower priority queues with probability
+ * 1/N for each of these values. Both are chosen somewhat arbitrarily.  If
+ * CHANCE_PERMISSIVE is too low, then we have a risk of low-priority tasks
+ * stalling forever.  If it's too high, we have a risk of low-priority tasks
+ * grabbing half of the threads. */
+#define CHANCE_PERMISSIVE 37
+#define CHANCE_STRICT INT32_MAX
+
 TOR_TAILQ_HEAD(work_tailq_t, workqueue_entry_t);
 typedef struct work_tailq_t work_tailq_t;
 
 struct threadpool_t {
   /** An array of pointers to workerthread_t: one for each running worker
-   * thread. */
+   * thread.  This array doesn't change once the threads are running, so
+   * the threads can read it without holding any lock. */
   struct workerthread_t **threads;
 
-  /** Condition variable that we wait on when we have no work, and which
-   * gets signaled when our queue becomes nonempty. */
-  tor_cond_t condition;
-  /** Queues of pending work that we have to do. The queue with priority
-   * <b>p</b> is work[p]. */
-  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
+  /** Number of threads that are waiting for work.  When we queue work for
+   * a busy thread and nobody is searching for work to steal, we wake one of
+   * them up to steal it. */
+  atomic_counter_t n_idle;
+  /** Number of threads that are looking through the other threads' queues
+   * for work to steal. */
+  atomic_counter_t n_searching;
 
   /** The current 'update generation' of the threadpool.  Any thread that is
    * at an earlier generation needs to run the update function. */
@@ -71,13 +88,27 @@ struct threadpool_t {
   void **update_args;
   /** Event to notice when another thread has sent a reply. */
   struct event *reply_event;
+  /** Event to finish handling replies that reply_event left unhandled. */
+  mainloop_event_t *reply_continue_event;
   void (*reply_cb)(threadpool_t *);
 
   /** Number of elements in threads. */
   int n_threads;
-  /** Mutex to protect all the above fields. */
+  /** Mutex to protect the update fields above, and the start fields below.
+   * Work queues are protected by the lock of the thread that owns them
+   * instead.  When we hold both, we always take this one first. */
   tor_mutex_t lock;
 
+  /** Condition variable that new threads wait on until we have launched
+   * them all, and that we wait on if they have to exit instead. */
+  tor_cond_t start_cond;
+  /** 0 while we are launching threads; 1 once they may start work; -1 if
+   * we couldn't launch them all, so that they must exit at once. */
+  int start_state;
+  /** Number of threads that we have launched, but that have not yet
+   * noticed that start_state is -1 and exited. */
+  int n_launched;
+
   /** A reply queue to use when constructing new threads. */
   replyqueue_t *reply_queue;
 
@@ -96,10 +127,17 @@ struct workqueue_entry_t {
   /** The next workqueue_entry_t that's pending on the same thread or
    * reply queue. */
   TOR_TAILQ_ENTRY(workqueue_entry_t) next_work;
+  /** The workqueue_entry_t that was pushed onto a reply queue's incoming
+   * stack just before this one. */
+  struct workqueue_entry_t *next_reply;
   /** The threadpool to which this workqueue_entry_t was assigned. This field
    * is set when the workqueue_entry_t is created, and won't be cleared until
    * after it's handled in the main thread. */
   struct threadpool_t *on_pool;
+  /** The worker thread on whose queue we put this entry.  This field is set
+   * before the entry is queued, and never changes: a thread that steals the
+   * entry runs it without moving it to its own queue. */
+  struct workerthread_t *on_thread;
   /** True iff this entry is waiting for a worker to start processing it. */
   uint8_t pending;
   /** Priority of this entry. */
@@ -113,15 +151,46 @@ struct workqueue_entry_t {
 };
 
 struct replyqueue_t {
-  /** Mutex to protect the answers field */
+#ifdef HAVE_WORKING_STDATOMIC
+  /** Stack of answers that the workers have pushed, newest first, linked
+   * by their next_reply fields. */
+  _Atomic(workqueue_entry_t *) incoming;
+#else
+  /** Mutex to protect the incoming field */
   tor_mutex_t lock;
-  /** Doubly-linked list of answers that the reply queue needs to handle. */
-  TOR_TAILQ_HEAD(, workqueue_entry_t) answers;
+  /** Stack of answers that the workers have pushed, newest first, linked
+   * by their next_reply fields. */
+  workqueue_entry_t *incoming;
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
+  /** Nonzero iff some worker has woken up the main thread since it last
+   * took the incoming answers. */
+  atomic_counter_t alert_pending;
+  /** Number of times that a worker has woken up the main thread. */
+  atomic_counter_t n_alerts;
+
+  /** Doubly-linked list of answers that the main thread has taken from
+   * incoming, but not handled yet.  Only the main thread touches this, and
+   * the fields below. */
+  work_tailq_t answers;
+  /** Number of answers that the main thread has handled. */
+  uint64_t n_replies;
+  /** Number of times that the main thread has processed this queue. */
+  uint64_t n_passes;
+  /** Number of those times that it stopped before handling every answer,
+   * so that other events could run. */
+  uint64_t n_deferred;
 
   /** Mechanism to wake up the main thread when it is receiving answers. */
   alert_sockets_t alert;
 };
 
+/** When the main loop processes a reply queue, don't spend more than this
+ * many microseconds in one pass: leave the rest till after the main loop
+ * has checked for I/O. */
+#define REPLYQUEUE_MAX_USEC_PER_PASS (10*1000)
+/** Check the time after handling this many answers. */
+#define REPLYQUEUE_ANSWERS_PER_TIME_CHECK 16
+
 /** A worker thread represents a single thread in a thread pool. */
 typedef struct workerthread_t {
   /** Which thread it this?  In range 0..in_pool->n_threads-1 */
@@ -133,13 +202,31 @@ typedef struct workerthread_t {
   void *state;
   /** Reply queue to which we pass our results. */
   replyqueue_t *reply_queue;
-  /** The current update generation of this thread */
+  /** The current update generation of this thread.  Only this thread
+   * touches this field. */
   unsigned generation;
+  /** The update generation of the pool, as last announced to this
+   * thread. */
+  unsigned pool_generation;
   /** One over the probability of taking work from a lower-priority queue. */
   int32_t lower_priority_chance;
+
+  /** Mutex to protect the fields below, and pool_generation. */
+  tor_mutex_t lock;
+  /** Condition variable that we wait on when we have no work, and which
+   * gets signaled when somebody has work for us. */
+  tor_cond_t condition;
+  /** Queues of pending work that we have to do. The queue with priority
+   * <b>p</b> is work[p]. Other threads may steal from these queues. */
+  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
+  /** True iff this thread has counted itself in its pool's n_idle. */
+  unsigned is_idle : 1;
 } workerthread_t;
 
 static void queue_reply(replyqueue_t *queue, workqueue_entry_t *work);
+static int replyqueue_process_impl(replyqueue_t *queue, int64_t max_usec);
+static void threadpool_wake_idle_thread(threadpool_t *pool,
+                                        const workerthread_t *busy);
 
 /** Allocate and return a new workqueue_entry_t, set up to run the function
  * <b>fn</b> in the worker thread, and <b>reply_fn</b> in the main
@@ -192,14 +279,15 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
 {
   int cancelled = 0;
   void *result = NULL;
-  tor_mutex_acquire(&ent->on_pool->lock);
+  workerthread_t *thread = ent->on_thread;
+  tor_mutex_acquire(&thread->lock);
   workqueue_priority_t prio = ent->priority;
   if (ent->pending) {
-    TOR_TAILQ_REMOVE(&ent->on_pool->work[prio], ent, next_work);
+    TOR_TAILQ_REMOVE(&thread->work[prio], ent, next_work);
     cancelled = 1;
     result = ent->arg;
   }
-  tor_mutex_release(&ent->on_pool->lock);
+  tor_mutex_release(&thread->lock);
 
   if (cancelled) {
     workqueue_entry_free(ent);
@@ -207,36 +295,37 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
   return result;
 }
 
-/**DOCDOC
-
-   must hold lock */
-static int
-worker_thread_has_work(workerthread_t *thread)
+/** Mark <b>thread</b> as no longer idle, and wake it up if it is waiting.
+ *
+ * The caller must hold the thread's lock. */
+static void
+worker_thread_clear_idle(workerthread_t *thread)
 {
-  unsigned i;
-  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    if (!TOR_TAILQ_EMPTY(&thread->in_pool->work[i]))
-        return 1;
-  }
-  return thread->generation != thread->in_pool->generation;
+  if (!thread->is_idle)
+    return;
+  thread->is_idle = 0;
+  atomic_counter_sub(&thread->in_pool->n_idle, 1);
+  tor_cond_signal_one(&thread->condition);
 }
 
-/** Extract the next workqueue_entry_t from the the thread's pool, removing
- * it from the relevant queues and marking it as non-pending.
+/** Extract the next workqueue_entry_t from the queues of <b>thread</b>,
+ * removing it from the relevant queue and marking it as non-pending.  With
+ * probability 1/<b>lower_priority_chance</b> at each nonempty queue, keep
+ * looking for lower-priority work.
  *
- * The caller must hold the lock. */
+ * The caller must hold the thread's lock. */
 static workqueue_entry_t *
-worker_thread_extract_next_work(workerthread_t *thread)
+worker_thread_extract_next_work(workerthread_t *thread,
+                                int32_t lower_priority_chance)
 {
-  threadpool_t *pool = thread->in_pool;
   work_tailq_t *queue = NULL, *this_queue;
   unsigned i;
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    this_queue = &pool->work[i];
+    this_queue = &thread->work[i];
     if (!TOR_TAILQ_EMPTY(this_queue)) {
       queue = this_queue;
       if (! crypto_fast_rng_one_in_n(get_thread_fast_rng(),
-                                     thread->lower_priority_chance)) {
+                                     lower_priority_chance)) {
         /* Usually we'll just break now, so that we can get out of the loop
          * and use the queue where we found work. But with a small
          * probability, we'll keep looking for lower priority work, so that
@@ -255,6 +344,203 @@ worker_thread_extract_next_work(workerthread_t *thread)
   return work;
 }
 
+/** Return the priority of the most urgent work queued on <b>thread</b>, or
+ * WORKQUEUE_N_PRIORITIES if it has none.
+ *
+ * The caller must hold the thread's lock. */
+static unsigned
+worker_thread_best_priority(const workerthread_t *thread)
+{
+  unsigned i;
+  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
+    if (!TOR_TAILQ_EMPTY(&thread->work[i]))
+      return i;
+  }
+  return WORKQUEUE_N_PRIORITIES;
+}
+
+/** Take the most urgent work queued on <b>victim</b>, and return it.  Set
+ * *<b>more_out</b> to true iff <b>victim</b> has more work queued. */
+static workqueue_entry_t *
+worker_thread_steal_from(workerthread_t *victim, int *more_out)
+{
+  workqueue_entry_t *work;
+  tor_mutex_acquire(&victim->lock);
+  work = worker_thread_extract_next_work(victim, CHANCE_STRICT);
+  *more_out = worker_thread_best_priority(victim) < WORKQUEUE_N_PRIORITIES;
+  tor_mutex_release(&victim->lock);
+  return work;
+}
+
+/** Try to take the most urgent work that another thread in our pool has
+ * queued, and return it.  We take high-priority work from the first
+ * thread that has any; failing that, we take from the thread with the
+ * highest-priority work that we saw.  Return NULL if we found nothing.
+ * Set *<b>more_out</b> to true iff the thread we stole from has more. */
+static workqueue_entry_t *
+worker_thread_steal_work(workerthread_t *thread, int *more_out)
+{
+  threadpool_t *pool = thread->in_pool;
+  workerthread_t *victim, *best_victim = NULL;
+  unsigned prio, best_prio = WORKQUEUE_N_PRIORITIES;
+  int i;
+
+  *more_out = 0;
+  for (i = 1; i < pool->n_threads; ++i) {
+    victim = pool->threads[(thread->index + i) % pool->n_threads];
+    tor_mutex_acquire(&victim->lock);
+    prio = worker_thread_best_priority(victim);
+    tor_mutex_release(&victim->lock);
+    if (prio == WORKQUEUE_PRIORITY_FIRST) {
+      best_victim = victim;
+      break;
+    }
+    if (prio < best_prio) {
+      best_prio = prio;
+      best_victim = victim;
+    }
+  }
+
+  /* Somebody may have taken the work in the meantime; if so, we'll look
+   * again on our next pass. */
+  if (best_victim)
+    return worker_thread_steal_from(best_victim, more_out);
+  return NULL;
+}
+
+/** Put <b>work</b>, which we stole but must not run yet, back at the head
+ * of the queue it came from. */
+static void
+worker_thread_return_work(workqueue_entry_t *work)
+{
+  workerthread_t *victim = work->on_thread;
+  tor_mutex_acquire(&victim->lock);
+  TOR_TAILQ_INSERT_HEAD(&victim->work[work->priority], work, next_work);
+  work->pending = 1;
+  worker_thread_clear_idle(victim);
+  tor_mutex_release(&victim->lock);
+}
+
+/** Return true iff the pool has queued an update that <b>thread</b> has not
+ * yet run.
+ *
+ * The caller must hold the thread's lock. */
+static inline int
+worker_thread_update_pending(const workerthread_t *thread)
+{
+  return thread->generation != thread->pool_generation;
+}
+
+/** Return the next work for <b>thread</b> to run, waiting until there is
+ * some: first from its own queues, then from those of the other threads in
+ * its pool.  Return NULL if the thread must run an update first. */
+static workqueue_entry_t *
+worker_thread_wait_for_work(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  workqueue_entry_t *work;
+  int more;
+
+  while (1) {
+    tor_mutex_acquire(&thread->lock);
+    if (worker_thread_update_pending(thread)) {
+      worker_thread_clear_idle(thread);
+      tor_mutex_release(&thread->lock);
+      return NULL;
+    }
+    work = worker_thread_extract_next_work(thread,
+                                           thread->lower_priority_chance);
+    if (work) {
+      worker_thread_clear_idle(thread);
+      tor_mutex_release(&thread->lock);
+      return work;
+    }
+    if (thread->is_idle) {
+      /* Nobody has woken us up yet. */
+      if (tor_cond_wait(&thread->condition, &thread->lock, NULL) < 0) {
+        log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+      }
+      tor_mutex_release(&thread->lock);
+      continue;
+    }
+    tor_mutex_release(&thread->lock);
+
+    atomic_counter_add(&pool->n_searching, 1);
+    work = worker_thread_steal_work(thread, &more);
+    atomic_counter_sub(&pool->n_searching, 1);
+
+    if (work) {
+      tor_mutex_acquire(&thread->lock);
+      if (worker_thread_update_pending(thread)) {
+        /* The update came first: it may tell us not to run this work. */
+        tor_mutex_release(&thread->lock);
+        worker_thread_return_work(work);
+        continue;
+      }
+      tor_mutex_release(&thread->lock);
+      /* If there's more where that came from, and nobody else is looking
+       * for it, wake up somebody else to take it. */
+      if (more && atomic_counter_get(&pool->n_searching) == 0 &&
+          atomic_counter_get(&pool->n_idle) > 0)
+        threadpool_wake_idle_thread(pool, thread);
+      return work;
+    }
+
+    /* There's nothing to steal.  Tell the pool that we're idle, so that
+     * anybody who queues work for us, or for a busy thread while nobody is
+     * searching, will wake us up. */
+    tor_mutex_acquire(&thread->lock);
+    if (!worker_thread_update_pending(thread) &&
+        worker_thread_best_priority(thread) == WORKQUEUE_N_PRIORITIES) {
+      thread->is_idle = 1;
+      atomic_counter_add(&pool->n_idle, 1);
+    }
+    tor_mutex_release(&thread->lock);
+  }
+}
+
+/** Run the update that the pool has queued for <b>thread</b>, and return
+ * its result. */
+static workqueue_reply_t
+worker_thread_run_update(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+
+  tor_mutex_acquire(&pool->lock);
+  void *arg = pool->update_args[thread->index];
+  pool->update_args[thread->index] = NULL;
+  workqueue_reply_t (*update_fn)(void*,void*) = pool->update_fn;
+  thread->generation = pool->generation;
+  tor_mutex_release(&pool->lock);
+
+  return update_fn(thread->state, arg);
+}
+
+/** Wait until <b>thread</b>'s pool has launched all of its threads.
+ * Return true if <b>thread</b> may start work, or false if it must exit
+ * because the pool couldn't launch them all.  In that case, we don't touch
+ * the pool again after we return. */
+static int
+worker_thread_wait_to_start(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  int ok;
+
+  tor_mutex_acquire(&pool->lock);
+  while (pool->start_state == 0) {
+    if (tor_cond_wait(&pool->start_cond, &pool->lock, NULL) < 0) {
+      log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+    }
+  }
+  ok = pool->start_state > 0;
+  if (!ok) {
+    --pool->n_launched;
+    tor_cond_signal_all(&pool->start_cond);
+  }
+  tor_mutex_release(&pool->lock);
+  return ok;
+}
+
 /**
  * Main function for the worker thread.
  */
@@ -262,104 +548,133 @@ static void
 worker_thread_main(void *thread_)
 {
   workerthread_t *thread = thread_;
-  threadpool_t *pool = thread->in_pool;
   workqueue_entry_t *work;
   workqueue_reply_t result;
 
-  tor_mutex_acquire(&pool->lock);
-  while (1) {
-    /* lock must be held at this point. */
-    while (worker_thread_has_work(thread)) {
-      /* lock must be held at this point. */
-      if (thread->in_pool->generation != thread->generation) {
-        void *arg = thread->in_pool->update_args[thread->index];
-        thread->in_pool->update_args[thread->index] = NULL;
-        workqueue_reply_t (*update_fn)(void*,void*) =
-            thread->in_pool->update_fn;
-        thread->generation = thread->in_pool->generation;
-        tor_mutex_release(&pool->lock);
-
-        workqueue_reply_t r = update_fn(thread->state, arg);
-
-        if (r != WQ_RPL_REPLY) {
-          return;
-        }
-
-        tor_mutex_acquire(&pool->lock);
-        continue;
-      }
-      work = worker_thread_extract_next_work(thread);
-      if (BUG(work == NULL))
-        break;
-      tor_mutex_release(&pool->lock);
-
-      /* We run the work function without holding the thread lock. This
-       * is the main thread's first opportunity to give us more work. */
-      result = work->fn(thread->state, work->arg);
+  if (!worker_thread_wait_to_start(thread))
+    return;
 
-      /* Queue the reply for the main thread. */
-      queue_reply(thread->reply_queue, work);
+  while (1) {
+    work = worker_thread_wait_for_work(thread);
 
-      /* We may need to exit the thread. */
-      if (result != WQ_RPL_REPLY) {
+    if (!work) {
+      if (worker_thread_run_update(thread) != WQ_RPL_REPLY)
         return;
-      }
-      tor_mutex_acquire(&pool->lock);
+      continue;
     }
-    /* At this point the lock is held, and there is no work in this thread's
-     * queue. */
 
-    /* TODO: support an idle-function */
+    /* We run the work function without holding any lock. */
+    result = work->fn(thread->state, work->arg);
 
-    /* Okay. Now, wait till somebody has work for us. */
-    if (tor_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
-      log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+    /* Queue the reply for the main thread. */
+    queue_reply(thread->reply_queue, work);
+
+    /* We may need to exit the thread. */
+    if (result != WQ_RPL_REPLY) {
+      return;
     }
   }
 }
 
 /** Put a reply on the reply queue.  The reply must not currently be on
- * any thread's work queue. */
+ * any thread's work queue.  Wake up the main thread, unless some other
+ * worker has done so since it last took the replies. */
 static void
 queue_reply(replyqueue_t *queue, workqueue_entry_t *work)
 {
-  int was_empty;
+#ifdef HAVE_WORKING_STDATOMIC
+  workqueue_entry_t *head = atomic_load(&queue->incoming);
+  do {
+    work->next_reply = head;
+  } while (!atomic_compare_exchange_weak(&queue->incoming, &head, work));
+#else
   tor_mutex_acquire(&queue->lock);
-  was_empty = TOR_TAILQ_EMPTY(&queue->answers);
-  TOR_TAILQ_INSERT_TAIL(&queue->answers, work, next_work);
+  work->next_reply = queue->incoming;
+  queue->incoming = work;
   tor_mutex_release(&queue->lock);
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
 
-  if (was_empty) {
+  if (atomic_counter_exchange(&queue->alert_pending, 1) == 0) {
+    atomic_counter_add(&queue->n_alerts, 1);
     if (queue->alert.alert_fn(queue->alert.write_fd) < 0) {
       /* XXXX complain! */
     }
   }
 }
 
-/** Allocate and start a new worker thread to use state object <b>state</b>,
- * and send responses to <b>replyqueue</b>. */
+/** Allocate a new worker thread to use state object <b>state</b>, and send
+ * responses to <b>replyqueue</b>.  Don't start it yet. */
 static workerthread_t *
 workerthread_new(int32_t lower_priority_chance,
                  void *state, threadpool_t *pool, replyqueue_t *replyqueue)
 {
   workerthread_t *thr = tor_malloc_zero(sizeof(workerthread_t));
+  unsigned i;
   thr->state = state;
   thr->reply_queue = replyqueue;
   thr->in_pool = pool;
   thr->lower_priority_chance = lower_priority_chance;
-
-  if (spawn_func(worker_thread_main, thr) < 0) {
-    //LCOV_EXCL_START
-    tor_assert_nonfatal_unreached();
-    log_err(LD_GENERAL, "Can't launch worker thread.");
-    tor_free(thr);
-    return NULL;
-    //LCOV_EXCL_STOP
+  thr->generation = thr->pool_generation = pool->generation;
+  tor_mutex_init_nonrecursive(&thr->lock);
+  tor_cond_init(&thr->condition);
+  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
+    TOR_TAILQ_INIT(&thr->work[i]);
   }
 
   return thr;
 }
 
+/** Release all storage held by <b>thr</b>, which is in <b>pool</b>, and
+ * whose thread isn't running. */
+static void
+workerthread_free(threadpool_t *pool, workerthread_t *thr)
+{
+  if (pool->free_thread_state_fn)
+    pool->free_thread_state_fn(thr->state);
+  tor_cond_uninit(&thr->condition);
+  tor_mutex_uninit(&thr->lock);
+  tor_free(thr);
+}
+
+/** Choose a thread in <b>pool</b> to queue work of priority <b>prio</b>
+ * on.  We pick at random, so that no one thread's lock sees all the
+ * traffic; idle threads will steal from whichever thread gets too much.
+ * Lower-priority work goes only to the threads that are permissive about
+ * running it, so that it can't get stuck behind a stream of high-priority
+ * work on a strict thread. */
+static workerthread_t *
+threadpool_choose_thread(threadpool_t *pool, workqueue_priority_t prio)
+{
+  crypto_fast_rng_t *rng = get_thread_fast_rng();
+  unsigned idx;
+  if (prio == WQ_PRI_HIGH) {
+    idx = crypto_fast_rng_get_uint(rng, pool->n_threads);
+  } else {
+    /* The permissive threads are the ones with even indices. */
+    idx = 2 * crypto_fast_rng_get_uint(rng, (pool->n_threads + 1) / 2);
+  }
+  return pool->threads[idx];
+}
+
+/** Wake up one idle thread in <b>pool</b>, other than <b>busy</b>, so that
+ * it can steal the work that <b>busy</b> has queued. */
+static void
+threadpool_wake_idle_thread(threadpool_t *pool, const workerthread_t *busy)
+{
+  int i;
+  for (i = 1; i < pool->n_threads; ++i) {
+    workerthread_t *thr =
+      pool->threads[(busy->index + i) % pool->n_threads];
+    tor_mutex_acquire(&thr->lock);
+    if (thr->is_idle) {
+      worker_thread_clear_idle(thr);
+      tor_mutex_release(&thr->lock);
+      return;
+    }
+    tor_mutex_release(&thr->lock);
+  }
+}
+
 /**
  * Queue an item of work for a thread in a thread pool.  The function
  * <b>fn</b> will be run in a worker thread, and will receive as arguments the
@@ -376,8 +691,9 @@ workerthread_new(int32_t lower_priority_chance,
  * currently possible, but callers should check anyway.)
  *
  * Items are executed in a loose priority order -- each thread will usually
- * take from the queued work with the highest prioirity, but will occasionally
- * visit lower-priority queues to keep them from starving completely.
+ * take from its queued work with the highest prioirity, but will occasionally
+ * visit lower-priority queues to keep them from starving completely.  Idle
+ * threads steal the highest-priority work they can find from the others.
  *
  * Note that because of priorities and thread behavior, work items may not
  * be executed strictly in order.
@@ -392,18 +708,28 @@ threadpool_queue_work_priority(threadpool_t *pool,
   tor_assert(((int)prio) >= WORKQUEUE_PRIORITY_FIRST &&
              ((int)prio) <= WORKQUEUE_PRIORITY_LAST);
 
+  workerthread_t *thr = threadpool_choose_thread(pool, prio);
   workqueue_entry_t *ent = workqueue_entry_new(fn, reply_fn, arg);
+  int woke;
   ent->on_pool = pool;
+  ent->on_thread = thr;
   ent->pending = 1;
   ent->priority = prio;
 
-  tor_mutex_acquire(&pool->lock);
+  tor_mutex_acquire(&thr->lock);
 
-  TOR_TAILQ_INSERT_TAIL(&pool->work[prio], ent, next_work);
+  TOR_TAILQ_INSERT_TAIL(&thr->work[prio], ent, next_work);
 
-  tor_cond_signal_one(&pool->condition);
+  woke = thr->is_idle;
+  worker_thread_clear_idle(thr);
 
-  tor_mutex_release(&pool->lock);
+  tor_mutex_release(&thr->lock);
+
+  /* If that thread was busy, and nobody is already looking for work to
+   * steal, let an idle one take the work instead. */
+  if (!woke && atomic_counter_get(&pool->n_searching) == 0 &&
+      atomic_counter_get(&pool->n_idle) > 0)
+    threadpool_wake_idle_thread(pool, thr);
 
   return ent;
 }
@@ -463,7 +789,13 @@ threadpool_queue_update(threadpool_t *pool,
   pool->update_fn = fn;
   ++pool->generation;
 
-  tor_cond_signal_all(&pool->condition);
+  for (i = 0; i < n_threads; ++i) {
+    workerthread_t *thr = pool->threads[i];
+    tor_mutex_acquire(&thr->lock);
+    thr->pool_generation = pool->generation;
+    worker_thread_clear_idle(thr);
+    tor_mutex_release(&thr->lock);
+  }
 
   tor_mutex_release(&pool->lock);
 
@@ -481,18 +813,12 @@ threadpool_queue_update(threadpool_t *pool,
 /** Don't have more than this many threads per pool. */
 #define MAX_THREADS 1024
 
-/** For half of our threads, choose lower priority queues with probability
- * 1/N for each of these values. Both are chosen somewhat arbitrarily.  If
- * CHANCE_PERMISSIVE is too low, then we have a risk of low-priority tasks
- * stalling forever.  If it's too high, we have a risk of low-priority tasks
- * grabbing half of the threads. */
-#define CHANCE_PERMISSIVE 37
-#define CHANCE_STRICT INT32_MAX
-
-/** Launch threads until we have <b>n</b>. */
+/** Launch <b>n</b> threads in <b>pool</b>, which must have none yet. */
 static int
 threadpool_start_threads(threadpool_t *pool, int n)
 {
+  int i;
+
   if (BUG(n < 0))
     return -1; // LCOV_EXCL_LINE
   if (n > MAX_THREADS)
@@ -500,9 +826,16 @@ threadpool_start_threads(threadpool_t *pool, int n)
 
   tor_mutex_acquire(&pool->lock);
 
-  if (pool->n_threads < n)
-    pool->threads = tor_reallocarray(pool->threads,
-                                     sizeof(workerthread_t*), n);
+  /* The threads steal from one another without taking the pool lock, so
+   * the set of threads can't change once they are running.  We build them
+   * all before launching any of them, and they wait until we've launched
+   * the last one before they do anything. */
+  if (BUG(pool->n_threads > 0)) {
+    tor_mutex_release(&pool->lock); // LCOV_EXCL_LINE
+    return -1; // LCOV_EXCL_LINE
+  }
+
+  pool->threads = tor_calloc(n, sizeof(workerthread_t*));
 
   while (pool->n_threads < n) {
     /* For half of our threads, we'll choose lower priorities permissively;
@@ -513,18 +846,36 @@ threadpool_start_threads(threadpool_t *pool, int n)
     void *state = pool->new_thread_state_fn(pool->new_thread_state_arg);
     workerthread_t *thr = workerthread_new(chance,
                                            state, pool, pool->reply_queue);
-
-    if (!thr) {
-      //LCOV_EXCL_START
-      tor_assert_nonfatal_unreached();
-      pool->free_thread_state_fn(state);
-      tor_mutex_release(&pool->lock);
-      return -1;
-      //LCOV_EXCL_STOP
-    }
     thr->index = pool->n_threads;
     pool->threads[pool->n_threads++] = thr;
   }
+
+  for (i = 0; i < n; ++i) {
+    if (spawn_func(worker_thread_main, pool->threads[i]) < 0)
+      break;
+    ++pool->n_launched;
+  }
+
+  if (i < n) {
+    log_err(LD_GENERAL, "Can't launch worker thread.");
+    /* Tell the threads we did launch to exit, and wait till they have. */
+    pool->start_state = -1;
+    tor_cond_signal_all(&pool->start_cond);
+    while (pool->n_launched > 0) {
+      if (tor_cond_wait(&pool->start_cond, &pool->lock, NULL) < 0) {
+        log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+      }
+    }
+    for (i = 0; i < pool->n_threads; ++i)
+      workerthread_free(pool, pool->threads[i]);
+    tor_free(pool->threads);
+    pool->n_threads = 0;
+    tor_mutex_release(&pool->lock);
+    return -1;
+  }
+
+  pool->start_state = 1;
+  tor_cond_signal_all(&pool->start_cond);
   tor_mutex_release(&pool->lock);
 
   return 0;
@@ -547,11 +898,9 @@ threadpool_new(int n_threads,
   threadpool_t *pool;
   pool = tor_malloc_zero(sizeof(threadpool_t));
   tor_mutex_init_nonrecursive(&pool->lock);
-  tor_cond_init(&pool->condition);
-  unsigned i;
-  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    TOR_TAILQ_INIT(&pool->work[i]);
-  }
+  tor_cond_init(&pool->start_cond);
+  atomic_counter_init(&pool->n_idle);
+  atomic_counter_init(&pool->n_searching);
 
   pool->new_thread_state_fn = new_thread_state_fn;
   pool->new_thread_state_arg = arg;
@@ -559,13 +908,13 @@ threadpool_new(int n_threads,
   pool->reply_queue = replyqueue;
 
   if (threadpool_start_threads(pool, n_threads) < 0) {
-    //LCOV_EXCL_START
-    tor_assert_nonfatal_unreached();
-    tor_cond_uninit(&pool->condition);
+    /* None of the pool's threads is running now. */
+    atomic_counter_destroy(&pool->n_idle);
+    atomic_counter_destroy(&pool->n_searching);
+    tor_cond_uninit(&pool->start_cond);
     tor_mutex_uninit(&pool->lock);
     tor_free(pool);
     return NULL;
-    //LCOV_EXCL_STOP
   }
 
   return pool;
@@ -595,23 +944,50 @@ replyqueue_new(uint32_t alertsocks_flags)
     //LCOV_EXCL_STOP
   }
 
+#ifndef HAVE_WORKING_STDATOMIC
   tor_mutex_init(&rq->lock);
+#endif
+  atomic_counter_init(&rq->alert_pending);
+  atomic_counter_init(&rq->n_alerts);
   TOR_TAILQ_INIT(&rq->answers);
 
   return rq;
 }
 
+/** Internal: Handle the answers on <b>tp</b>'s reply queue for a while, and
+ * run its reply callback.  If any answers remain, schedule
+ * reply_continue_event to handle them once the main loop has checked for
+ * I/O. */
+static void
+threadpool_handle_replies(threadpool_t *tp)
+{
+  int more = replyqueue_process_impl(tp->reply_queue,
+                                     REPLYQUEUE_MAX_USEC_PER_PASS);
+  if (tp->reply_cb)
+    tp->reply_cb(tp);
+  if (more) {
+    const struct timeval no_delay = { 0, 0 };
+    mainloop_event_schedule(tp->reply_continue_event, &no_delay);
+  }
+}
+
 /** Internal: Run from the libevent mainloop when there is work to handle in
  * the reply queue handler. */
 static void
 reply_event_cb(evutil_socket_t sock, short events, void *arg)
 {
-  threadpool_t *tp = arg;
   (void) sock;
   (void) events;
-  replyqueue_process(tp->reply_queue);
-  if (tp->reply_cb)
-    tp->reply_cb(tp);
+  threadpool_handle_replies(arg);
+}
+
+/** Internal: Run from the libevent mainloop when reply_event_cb() has left
+ * some work unhandled. */
+static void
+reply_continue_cb(mainloop_event_t *ev, void *arg)
+{
+  (void) ev;
+  threadpool_handle_replies(arg);
 }
 
 /** Register the threadpool <b>tp</b>'s reply queue with Tor's global
@@ -634,18 +1010,52 @@ threadpool_register_reply_event(threadpool_t *tp,
                                   reply_event_cb,
                                   tp);
   tor_assert(tp->reply_event);
+  if (!tp->reply_continue_event)
+    tp->reply_continue_event = mainloop_event_new(reply_continue_cb, tp);
   tp->reply_cb = cb;
   return event_add(tp->reply_event, NULL);
 }
 
-/**
- * Process all pending replies on a reply queue. The main thread should call
- * this function every time the socket returned by replyqueue_get_socket() is
- * readable.
- */
-void
-replyqueue_process(replyqueue_t *queue)
+/** Take every answer that the workers have pushed onto <b>queue</b>, and
+ * add them to the end of its answers list, oldest first. */
+static void
+replyqueue_take_incoming(replyqueue_t *queue)
+{
+  workqueue_entry_t *work, *next, *last;
+
+  /* Clear alert_pending first: a worker that pushes an answer after we take
+   * the stack must wake us again. */
+  atomic_counter_exchange(&queue->alert_pending, 0);
+#ifdef HAVE_WORKING_STDATOMIC
+  work = atomic_exchange(&queue->incoming, NULL);
+#else
+  tor_mutex_acquire(&queue->lock);
+  work = queue->incoming;
+  queue->incoming = NULL;
+  tor_mutex_release(&queue->lock);
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
+
+  /* The stack is newest-first; inserting each answer right after the old
+   * end of the list puts them back in order. */
+  last = TOR_TAILQ_LAST(&queue->answers, work_tailq_t);
+  for (; work; work = next) {
+    next = work->next_reply;
+    work->next_reply = NULL;
+    if (last)
+      TOR_TAILQ_INSERT_AFTER(&queue->answers, last, work, next_work);
+    else
+      TOR_TAILQ_INSERT_HEAD(&queue->answers, work, next_work);
+  }
+}
+
+/** Process the pending replies on <b>queue</b>.  If <b>max_usec</b> is
+ * nonzero, stop once we have spent about that many microseconds.  Return
+ * true iff some replies remain. */
+static int
+replyqueue_process_impl(replyqueue_t *queue, int64_t max_usec)
 {
+  monotime_t start, now;
+  unsigned n = 0;
   int r = queue->alert.drain_fn(queue->alert.read_fd);
   if (r < 0) {
     //LCOV_EXCL_START
@@ -656,19 +1066,51 @@ replyqueue_process(replyqueue_t *queue)
     //LCOV_EXCL_STOP
   }
 
-  tor_mutex_acquire(&queue->lock);
+  ++queue->n_passes;
+  replyqueue_take_incoming(queue);
+  if (max_usec)
+    monotime_get(&start);
+
   while (!TOR_TAILQ_EMPTY(&queue->answers)) {
-    /* lock must be held at this point.*/
     workqueue_entry_t *work = TOR_TAILQ_FIRST(&queue->answers);
     TOR_TAILQ_REMOVE(&queue->answers, work, next_work);
-    tor_mutex_release(&queue->lock);
     work->on_pool = NULL;
 
     work->reply_fn(work->arg);
     workqueue_entry_free(work);
+    ++queue->n_replies;
 
-    tor_mutex_acquire(&queue->lock);
+    if (max_usec && ++n % REPLYQUEUE_ANSWERS_PER_TIME_CHECK == 0 &&
+        !TOR_TAILQ_EMPTY(&queue->answers)) {
+      monotime_get(&now);
+      if (monotime_diff_usec(&start, &now) >= max_usec) {
+        ++queue->n_deferred;
+        return 1;
+      }
+    }
   }
 
-  tor_mutex_release(&queue->lock);
+  return 0;
+}
+
+/**
+ * Process all pending replies on a reply queue. The main thread should call
+ * this function every time the socket returned by replyqueue_get_socket() is
+ * readable.
+ */
+void
+replyqueue_process(replyqueue_t *queue)
+{
+  replyqueue_process_impl(queue, 0);
+}
+
+/** Fill in *<b>stats_out</b> with counts of the work that <b>queue</b> has
+ * done.  Call only from the main thread. */
+void
+replyqueue_get_stats(replyqueue_t *queue, replyqueue_stats_t *stats_out)
+{
+  stats_out->n_replies = queue->n_replies;
+  stats_out->n_passes = queue->n_passes;
+  stats_out->n_alerts = atomic_counter_get(&queue->n_alerts);
+  stats_out->n_deferred = queue->n_deferred;
 }
@@ -60,8 +60,23 @@ threadpool_t *threadpool_new(int n_threads,
                              void *arg);
 replyqueue_t *threadpool_get_replyqueue(threadpool_t *tp);
 
+/** Counts of the work that a reply queue has done, as reported by
+ * replyqueue_get_stats(). */
+typedef struct replyqueue_stats_t {
+  /** Number of replies that the main thread has handled. */
+  uint64_t n_replies;
+  /** Number of times that the main thread has processed the queue. */
+  uint64_t n_passes;
+  /** Number of times that a worker has woken up the main thread. */
+  uint64_t n_alerts;
+  /** Number of times that the main thread stopped processing the queue
+   * early, so that other events could run. */
+  uint64_t n_deferred;
+} replyqueue_stats_t;
+
 replyqueue_t *replyqueue_new(uint32_t alertsocks_flags);
 void replyqueue_process(replyqueue_t *queue);
+void replyqueue_get_stats(replyqueue_t *queue, replyqueue_stats_t *stats_out);
 
 int threadpool_register_reply_event(threadpool_t *tp,
                                     void (*cb)(threadpool_t *tp));
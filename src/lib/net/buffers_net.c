@@ -10,7 +10,9 @@
  **/
 
 #define BUFFERS_PRIVATE
+#define BUFFERS_NET_PRIVATE
 #include "lib/net/buffers_net.h"
+#include "lib/net/buffers_uring.h"
 #include "lib/buf/buffers.h"
 #include "lib/log/log.h"
 #include "lib/log/util_bug.h"
@@ -21,11 +23,43 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
 
+/** Number of system calls we have made to read and write buffers, and the
+ * number of bytes they moved. */
+static buf_net_stats_t buf_net_stats;
+
+#ifdef USE_SCATTER_GATHER
+/** True iff we should use readv() and writev() where we can. */
+static bool use_scatter_gather = true;
+#endif
+
+/** Enable or disable the use of readv() and writev() to transfer several
+ * chunks in one system call, on platforms that support them.  (They are
+ * enabled by default; this is mainly useful for benchmarking.) */
+void
+buf_net_set_scatter_gather(bool enabled)
+{
+#ifdef USE_SCATTER_GATHER
+  use_scatter_gather = enabled;
+#else
+  (void) enabled;
+#endif
+}
+
+/** Copy the system call statistics for reading and writing buffers into
+ * <b>stats_out</b>. */
+void
+buf_net_get_stats(buf_net_stats_t *stats_out)
+{
+  tor_assert(stats_out);
+  memcpy(stats_out, &buf_net_stats, sizeof(buf_net_stats));
+}
+
 #ifdef PARANOIA
 /** Helper: If PARANOIA is defined, assert that the buffer in local variable
  * <b>buf</b> is well-formed. */
@@ -52,6 +86,7 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
     read_result = tor_socket_recv(fd, CHUNK_WRITE_PTR(chunk), at_most, 0);
   else
     read_result = read(fd, CHUNK_WRITE_PTR(chunk), at_most);
+  ++buf_net_stats.n_read_calls;
 
   if (read_result < 0) {
     int e = is_socket ? tor_socket_errno(fd) : errno;
@@ -72,6 +107,7 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
     *reached_eof = 1;
     return 0;
   } else { /* actually got bytes. */
+    buf_net_stats.n_bytes_read += read_result;
     buf->datalen += read_result;
     chunk->datalen += read_result;
     log_debug(LD_NET,"Read %ld bytes. %d on inbuf.", (long)read_result,
@@ -81,6 +117,151 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
   }
 }
 
+#ifdef USE_SCATTER_GATHER
+/** Get ready to read up to <b>at_most</b> bytes onto the end of <b>buf</b>
+ * with a single scatter read, filling the free space in the current tail
+ * chunk and as many new chunks as we need, up to <b>max_iov</b> chunks in
+ * all.  Describe the space in <b>iov</b>, and record which chunk each entry
+ * belongs to in <b>chunks</b>.  Set *<b>planned_out</b> to the number of
+ * bytes of space described, and return the number of entries used.
+ *
+ * Until the caller passes the same arrays to buf_finish_read_iov(), the
+ * new chunks are on <b>buf</b> but empty, and nothing else may touch
+ * <b>buf</b>.
+ */
+int
+buf_plan_read_iov(buf_t *buf, size_t at_most, struct iovec *iov,
+                  chunk_t **chunks, int max_iov, size_t *planned_out)
+{
+  size_t planned = 0;
+  int n = 0;
+
+  if (buf->tail && CHUNK_REMAINING_CAPACITY(buf->tail) >= MIN_READ_LEN) {
+    size_t len = CHUNK_REMAINING_CAPACITY(buf->tail);
+    if (len > at_most)
+      len = at_most;
+    chunks[n] = buf->tail;
+    iov[n].iov_base = CHUNK_WRITE_PTR(buf->tail);
+    iov[n].iov_len = len;
+    planned += len;
+    ++n;
+  }
+  while (planned < at_most && n < max_iov) {
+    chunk_t *chunk = buf_add_chunk_with_capacity(buf, at_most - planned, 1);
+    size_t len = chunk->memlen;
+    if (len > at_most - planned)
+      len = at_most - planned;
+    chunks[n] = chunk;
+    iov[n].iov_base = chunk->data;
+    iov[n].iov_len = len;
+    planned += len;
+    ++n;
+  }
+  *planned_out = planned;
+  return n;
+}
+
+/** Finish a read that was set up with buf_plan_read_iov() on <b>buf</b>,
+ * whose tail chunk was <b>old_tail</b> beforehand, and which brought in
+ * <b>n_read</b> bytes: hand the bytes out to the chunks in order, and free
+ * any new chunks that didn't get any. */
+void
+buf_finish_read_iov(buf_t *buf, const struct iovec *iov, chunk_t **chunks,
+                    int n_iov, chunk_t *old_tail, size_t n_read)
+{
+  size_t remaining = n_read;
+  int i;
+
+  if (!n_read) {
+    buf_free_empty_chunks_after(buf, old_tail);
+    return;
+  }
+
+  buf->datalen += n_read;
+  for (i = 0; i < n_iov && remaining; ++i) {
+    size_t len = iov[i].iov_len < remaining ? iov[i].iov_len : remaining;
+    chunks[i]->datalen += len;
+    remaining -= len;
+  }
+  /* chunks[i-1] is the last chunk that got any data; anything after it that
+   * we added is still empty. */
+  buf_free_empty_chunks_after(buf, chunks[i-1]);
+}
+
+/** Describe, in up to <b>max_iov</b> entries of <b>iov</b>, the first
+ * <b>sz</b> bytes of data on <b>buf</b>, for writing with a single gather
+ * write.  Set *<b>planned_out</b> to the number of bytes described (which
+ * is less than <b>sz</b> if we ran out of entries), and return the number
+ * of entries used. */
+int
+buf_plan_flush_iov(const buf_t *buf, size_t sz, struct iovec *iov,
+                   int max_iov, size_t *planned_out)
+{
+  const chunk_t *chunk;
+  size_t planned = 0;
+  int n = 0;
+
+  for (chunk = buf->head; chunk && planned < sz && n < max_iov;
+       chunk = chunk->next) {
+    size_t len = chunk->datalen;
+    if (len > sz - planned)
+      len = sz - planned;
+    iov[n].iov_base = chunk->data;
+    iov[n].iov_len = len;
+    planned += len;
+    ++n;
+  }
+  *planned_out = planned;
+  return n;
+}
+
+/** Helper for buf_read_from_fd(): read up to <b>at_most</b> bytes from
+ * <b>fd</b> onto the end of <b>buf</b> with a single readv() call.  Return
+ * values are as for read_to_chunk(); *<b>attempted_out</b> is set to the
+ * number of bytes we asked for.
+ */
+static int
+read_to_chunks(buf_t *buf, tor_socket_t fd, size_t at_most,
+               int *reached_eof, int *error, size_t *attempted_out)
+{
+  struct iovec iov[BUF_IOV_MAX];
+  chunk_t *chunks[BUF_IOV_MAX];
+  chunk_t *old_tail = buf->tail;
+  ssize_t read_result;
+  int n;
+
+  n = buf_plan_read_iov(buf, at_most, iov, chunks, BUF_IOV_MAX,
+                        attempted_out);
+
+  read_result = readv(fd, iov, n);
+  ++buf_net_stats.n_read_calls;
+
+  if (read_result < 0) {
+    int e = errno;
+    buf_finish_read_iov(buf, iov, chunks, n, old_tail, 0);
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      if (error)
+        *error = e;
+      return -1;
+    }
+    return 0; /* would block. */
+  } else if (read_result == 0) {
+    buf_finish_read_iov(buf, iov, chunks, n, old_tail, 0);
+    log_debug(LD_NET,"Encountered eof on fd %d", (int)fd);
+    *reached_eof = 1;
+    return 0;
+  }
+
+  /* Actually got bytes. */
+  buf_net_stats.n_bytes_read += read_result;
+  buf_finish_read_iov(buf, iov, chunks, n, old_tail, read_result);
+  log_debug(LD_NET,"Read %ld bytes. %d on inbuf.", (long)read_result,
+            (int)buf->datalen);
+  tor_assert(read_result <= BUF_MAX_LEN);
+  return (int)read_result;
+}
+#endif /* defined(USE_SCATTER_GATHER) */
+
 /** Read from file descriptor <b>fd</b>, writing onto end of <b>buf</b>.  Read
  * at most <b>at_most</b> bytes, growing the buffer as necessary.  If recv()
  * returns 0 (because of EOF), set *<b>reached_eof</b> to 1 and return 0.
@@ -111,6 +292,21 @@ buf_read_from_fd(buf_t *buf, int fd, size_t at_most,
   while (at_most > total_read) {
     size_t readlen = at_most - total_read;
     chunk_t *chunk;
+#ifdef USE_SCATTER_GATHER
+    if (use_scatter_gather) {
+      r = read_to_chunks(buf, fd, readlen, reached_eof, socket_error,
+                         &readlen);
+      check();
+      if (r < 0)
+        return r; /* Error */
+      tor_assert(total_read+r <= BUF_MAX_LEN);
+      total_read += r;
+      if ((size_t)r < readlen) { /* eof, block, or no more to read. */
+        break;
+      }
+      continue;
+    }
+#endif /* defined(USE_SCATTER_GATHER) */
     if (!buf->tail || CHUNK_REMAINING_CAPACITY(buf->tail) < MIN_READ_LEN) {
       chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
       if (readlen > chunk->memlen)
@@ -154,6 +350,7 @@ flush_chunk(tor_socket_t fd, buf_t *buf, chunk_t *chunk, size_t sz,
     write_result = tor_socket_send(fd, chunk->data, sz, 0);
   else
     write_result = write(fd, chunk->data, sz);
+  ++buf_net_stats.n_write_calls;
 
   if (write_result < 0) {
     int e = is_socket ? tor_socket_errno(fd) : errno;
@@ -168,12 +365,51 @@ flush_chunk(tor_socket_t fd, buf_t *buf, chunk_t *chunk, size_t sz,
     log_debug(LD_NET,"write() would block, returning.");
     return 0;
   } else {
+    buf_net_stats.n_bytes_written += write_result;
+    *buf_flushlen -= write_result;
+    buf_drain(buf, write_result);
+    tor_assert(write_result <= BUF_MAX_LEN);
+    return (int)write_result;
+  }
+}
+
+#ifdef USE_SCATTER_GATHER
+/** Helper for buf_flush_to_fd(): try to write up to <b>sz</b> bytes from
+ * the first chunks of <b>buf</b> onto <b>fd</b> with a single writev()
+ * call.  On success, deduct the bytes written from *<b>buf_flushlen</b>.
+ * Set *<b>attempted_out</b> to the number of bytes we tried to write.
+ * Return the number of bytes written on success, 0 on blocking, -1 on
+ * failure.
+ */
+static int
+flush_chunks(tor_socket_t fd, buf_t *buf, size_t sz, size_t *buf_flushlen,
+             size_t *attempted_out)
+{
+  struct iovec iov[BUF_IOV_MAX];
+  ssize_t write_result;
+  int n;
+
+  n = buf_plan_flush_iov(buf, sz, iov, BUF_IOV_MAX, attempted_out);
+
+  write_result = writev(fd, iov, n);
+  ++buf_net_stats.n_write_calls;
+
+  if (write_result < 0) {
+    int e = errno;
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      return -1;
+    }
+    log_debug(LD_NET,"write() would block, returning.");
+    return 0;
+  } else {
+    buf_net_stats.n_bytes_written += write_result;
     *buf_flushlen -= write_result;
     buf_drain(buf, write_result);
     tor_assert(write_result <= BUF_MAX_LEN);
     return (int)write_result;
   }
 }
+#endif /* defined(USE_SCATTER_GATHER) */
 
 /** Write data from <b>buf</b> to the file descriptor <b>fd</b>.  Write at most
  * <b>sz</b> bytes, decrement *<b>buf_flushlen</b> by
@@ -203,12 +439,19 @@ buf_flush_to_fd(buf_t *buf, int fd, size_t sz,
   while (sz) {
     size_t flushlen0;
     tor_assert(buf->head);
-    if (buf->head->datalen >= sz)
-      flushlen0 = sz;
-    else
-      flushlen0 = buf->head->datalen;
+#ifdef USE_SCATTER_GATHER
+    if (use_scatter_gather) {
+      r = flush_chunks(fd, buf, sz, buf_flushlen, &flushlen0);
+    } else
+#endif
+    {
+      if (buf->head->datalen >= sz)
+        flushlen0 = sz;
+      else
+        flushlen0 = buf->head->datalen;
 
-    r = flush_chunk(fd, buf, buf->head, flushlen0, buf_flushlen, is_socket);
+      r = flush_chunk(fd, buf, buf->head, flushlen0, buf_flushlen, is_socket);
+    }
     check();
     if (r < 0)
       return r;
@@ -231,6 +474,11 @@ int
 buf_flush_to_socket(buf_t *buf, tor_socket_t s, size_t sz,
                     size_t *buf_flushlen)
 {
+  int r;
+  /* If the main loop already wrote this buffer in an io_uring batch, that
+   * write was this one. */
+  if (buf_uring_take_flush_result(buf, s, &r))
+    return r;
   return buf_flush_to_fd(buf, s, sz, buf_flushlen, true);
 }
 
@@ -244,6 +492,11 @@ buf_read_from_socket(buf_t *buf, tor_socket_t s, size_t at_most,
                      int *reached_eof,
                      int *socket_error)
 {
+  int r;
+  /* If the main loop already read into this buffer in an io_uring batch,
+   * that read was this one. */
+  if (buf_uring_take_read_result(buf, s, reached_eof, socket_error, &r))
+    return r;
   return buf_read_from_fd(buf, s, at_most, reached_eof, socket_error, true);
 }
 
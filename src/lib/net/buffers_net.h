@@ -14,6 +14,7 @@
 #define TOR_BUFFERS_NET_H
 
 #include <stddef.h>
+#include "lib/cc/torint.h"
 #include "lib/net/socket.h"
 
 struct buf_t;
@@ -31,4 +32,50 @@ int buf_read_from_pipe(struct buf_t *buf, int fd, size_t at_most,
 int buf_flush_to_pipe(struct buf_t *buf, int fd, size_t sz,
                       size_t *buf_flushlen);
 
+/** Counts of the system calls we have made to move data between buffers and
+ * sockets or pipes, as reported by buf_net_get_stats(). */
+typedef struct buf_net_stats_t {
+  /** Number of read-side calls (recv, read, or readv). */
+  uint64_t n_read_calls;
+  /** Total bytes returned by those calls. */
+  uint64_t n_bytes_read;
+  /** Number of write-side calls (send, write, or writev). */
+  uint64_t n_write_calls;
+  /** Total bytes accepted by those calls. */
+  uint64_t n_bytes_written;
+} buf_net_stats_t;
+
+void buf_net_get_stats(buf_net_stats_t *stats_out);
+void buf_net_set_scatter_gather(bool enabled);
+
+#ifdef BUFFERS_NET_PRIVATE
+#include "orconfig.h"
+#if defined(HAVE_SYS_UIO_H) && defined(HAVE_READV) && defined(HAVE_WRITEV)
+#include <sys/uio.h>
+#include <limits.h>
+/** Defined if we can read into, and write from, several chunks with one
+ * readv() or writev() call. */
+#define USE_SCATTER_GATHER
+/** Largest number of chunks that we hand to a single readv() or writev()
+ * call.  We don't need anything close to IOV_MAX on most systems: a few
+ * dozen chunks is more than a socket will take at once. */
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define BUF_IOV_MAX IOV_MAX
+#else
+#define BUF_IOV_MAX 64
+#endif
+
+struct chunk_t;
+int buf_plan_read_iov(struct buf_t *buf, size_t at_most,
+                      struct iovec *iov, struct chunk_t **chunks,
+                      int max_iov, size_t *planned_out);
+void buf_finish_read_iov(struct buf_t *buf, const struct iovec *iov,
+                         struct chunk_t **chunks, int n_iov,
+                         struct chunk_t *old_tail, size_t n_read);
+int buf_plan_flush_iov(const struct buf_t *buf, size_t sz,
+                       struct iovec *iov, int max_iov,
+                       size_t *planned_out);
+#endif /* defined(HAVE_SYS_UIO_H) && ... */
+#endif /* defined(BUFFERS_NET_PRIVATE) */
+
 #endif /* !defined(TOR_BUFFERS_NET_H) */
@@ -0,0 +1,545 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file buffers_uring.c
+ * \brief Read and write many buf_t objects with one system call, using
+ *   Linux's io_uring interface.
+ *
+ * Ordinarily, every socket that Libevent reports as readable or writable
+ * costs us at least one recv() or send() call of its own.  On a busy relay,
+ * with thousands of connections, those system calls are a large part of
+ * the main thread's time.  Here, the main loop instead describes the
+ * reads and writes that it is about to make, with buf_uring_prepare_read()
+ * and buf_uring_prepare_flush(), and buf_uring_submit() hands all of them to
+ * the kernel with a single io_uring_enter() call.
+ *
+ * Every operation is submitted with MSG_DONTWAIT, so the kernel completes
+ * each of them before io_uring_enter() returns: a socket that has nothing
+ * for us fails with EAGAIN rather than staying queued.  That way, no
+ * kernel operation outlives the batch, and the buffers never have memory
+ * that the kernel might still write to.
+ *
+ * Once the batch is done, its effects are already on the buffers.  The
+ * results wait here until the ordinary buf_read_from_socket() and
+ * buf_flush_to_socket() calls for the same buffer and socket collect them
+ * instead of making a system call, so that all the usual bookkeeping in
+ * the connection layer happens as before.  Anything uncollected is thrown
+ * away by buf_uring_clear_results().
+ *
+ * We talk to the kernel directly rather than through liburing, since we
+ * need only a tiny part of it.
+ **/
+
+#define BUFFERS_PRIVATE
+#define BUFFERS_NET_PRIVATE
+#include "lib/net/buffers_uring.h"
+
+#ifdef HAVE_BUF_URING
+#include "lib/net/buffers_net.h"
+#include "lib/buf/buffers.h"
+#include "lib/log/log.h"
+#include "lib/log/util_bug.h"
+#include "lib/malloc/malloc.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/** Largest number of chunks that one batched read or write may touch.  We
+ * keep this small, since every pending operation carries its own arrays. */
+#define BUF_URING_IOV_MAX 8
+
+/** What kind of operation is a buf_uring_op_t? */
+typedef enum {
+  BUF_URING_OP_READ, BUF_URING_OP_FLUSH,
+} buf_uring_op_type_t;
+
+/** A read or write that we have prepared, or completed, in this batch. */
+typedef struct buf_uring_op_t {
+  buf_uring_op_type_t type;
+  /** The buffer that we are reading into or writing from; NULL if this
+   * result has been collected or forgotten. */
+  struct buf_t *buf;
+  /** The socket that we are reading from or writing to. */
+  tor_socket_t sock;
+  /** For writes: the caller's count of bytes left to flush, which we
+   * decrease by the number of bytes written. */
+  size_t *buf_flushlen;
+  /** For reads: the buffer's tail chunk before we added space to it. */
+  struct chunk_t *old_tail;
+  /** For reads: the chunk that each entry in <b>iov</b> belongs to. */
+  struct chunk_t *chunks[BUF_URING_IOV_MAX];
+  struct iovec iov[BUF_URING_IOV_MAX];
+  int n_iov;
+  struct msghdr msg;
+  /** The completion result from the kernel: a byte count, or a negated
+   * errno value. */
+  int res;
+} buf_uring_op_t;
+
+/** The mapped submission and completion rings of our io_uring instance. */
+typedef struct buf_uring_t {
+  int fd;
+  unsigned sq_entries;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  size_t sq_ring_len;
+  void *cq_ring;
+  size_t cq_ring_len;
+  size_t sqes_len;
+} buf_uring_t;
+
+/** Our io_uring instance, if we have one. */
+static buf_uring_t *the_uring = NULL;
+
+/** Operations in the current batch, in the order they were prepared. */
+static buf_uring_op_t *ops = NULL;
+/** Number of entries in <b>ops</b> that are in use. */
+static int n_ops = 0;
+/** Number of entries allocated for <b>ops</b>. */
+static int ops_capacity = 0;
+/** Number of entries at the start of <b>ops</b> that have been submitted. */
+static int n_submitted = 0;
+/** Where we expect the next lookup to succeed: the main loop collects
+ * results in the order it prepared them, so this is nearly always a hit. */
+static int lookup_cursor = 0;
+
+/** Totals for buf_uring_get_stats(). */
+static buf_uring_stats_t buf_uring_stats;
+
+/** Release all the resources held by <b>ring</b>. */
+static void
+buf_uring_free_ring(buf_uring_t *ring)
+{
+  if (!ring)
+    return;
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_len);
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_len);
+  if (ring->sq_ring)
+    munmap(ring->sq_ring, ring->sq_ring_len);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  tor_free(ring);
+}
+
+/** Map one region of the io_uring instance <b>fd</b>.  Return NULL on
+ * failure. */
+static void *
+buf_uring_map(int fd, size_t len, off_t offset)
+{
+  void *p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                 fd, offset);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+/** Set up an io_uring instance with room for <b>entries</b> submissions at
+ * a time, and start using it for batched socket I/O.  Return 0 on success,
+ * or -1 if this kernel won't give us one. */
+int
+buf_uring_init(unsigned entries)
+{
+  struct io_uring_params p;
+  buf_uring_t *ring;
+  int fd;
+
+  if (the_uring)
+    return 0;
+
+  memset(&p, 0, sizeof(p));
+  fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+  if (fd < 0) {
+    log_info(LD_NET, "Unable to set up io_uring: %s", strerror(errno));
+    return -1;
+  }
+
+  ring = tor_malloc_zero(sizeof(*ring));
+  ring->fd = fd;
+  ring->sq_entries = p.sq_entries;
+  ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_ring_len = p.cq_off.cqes +
+    p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_len > ring->sq_ring_len)
+      ring->sq_ring_len = ring->cq_ring_len;
+    ring->cq_ring_len = ring->sq_ring_len;
+  }
+  ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_ring = buf_uring_map(fd, ring->sq_ring_len, IORING_OFF_SQ_RING);
+  if (!ring->sq_ring)
+    goto err;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ring = ring->sq_ring;
+  else
+    ring->cq_ring = buf_uring_map(fd, ring->cq_ring_len, IORING_OFF_CQ_RING);
+  if (!ring->cq_ring)
+    goto err;
+  ring->sqes = buf_uring_map(fd, ring->sqes_len, IORING_OFF_SQES);
+  if (!ring->sqes)
+    goto err;
+
+  ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+  ring->sq_mask = *(unsigned *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+  ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+  ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+  ring->cq_mask = *(unsigned *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)
+    ((char *)ring->cq_ring + p.cq_off.cqes);
+
+  the_uring = ring;
+  log_info(LD_NET, "Using io_uring with %u submission entries for "
+           "socket I/O.", ring->sq_entries);
+  return 0;
+
+ err:
+  log_info(LD_NET, "Unable to map io_uring rings: %s", strerror(errno));
+  buf_uring_free_ring(ring);
+  return -1;
+}
+
+/** Return true iff we have an io_uring instance to batch socket I/O. */
+bool
+buf_uring_enabled(void)
+{
+  return the_uring != NULL;
+}
+
+/** Add a new operation of type <b>type</b> on <b>buf</b> and <b>s</b> to
+ * the current batch, and return it. */
+static buf_uring_op_t *
+buf_uring_new_op(buf_uring_op_type_t type, struct buf_t *buf,
+                 tor_socket_t s)
+{
+  buf_uring_op_t *op;
+  if (n_ops == ops_capacity) {
+    ops_capacity = ops_capacity ? ops_capacity * 2 : 64;
+    ops = tor_reallocarray(ops, ops_capacity, sizeof(buf_uring_op_t));
+  }
+  op = &ops[n_ops++];
+  memset(op, 0, sizeof(*op));
+  op->type = type;
+  op->buf = buf;
+  op->sock = s;
+  op->res = -EAGAIN;
+  return op;
+}
+
+/** Add to the current batch a read of up to <b>at_most</b> bytes from
+ * <b>s</b> onto the end of <b>buf</b>.  Until the batch is submitted,
+ * nothing else may touch <b>buf</b>. */
+void
+buf_uring_prepare_read(struct buf_t *buf, tor_socket_t s, size_t at_most)
+{
+  buf_uring_op_t *op;
+  size_t planned;
+
+  tor_assert(the_uring);
+  if (BUG(buf->datalen > BUF_MAX_LEN - at_most))
+    return;
+  if (at_most == 0)
+    return;
+
+  op = buf_uring_new_op(BUF_URING_OP_READ, buf, s);
+  op->old_tail = buf->tail;
+  op->n_iov = buf_plan_read_iov(buf, at_most, op->iov, op->chunks,
+                                BUF_URING_IOV_MAX, &planned);
+}
+
+/** Add to the current batch a write of up to <b>sz</b> bytes from the front
+ * of <b>buf</b> onto <b>s</b>.  When the batch is submitted, the bytes
+ * written are drained from <b>buf</b> and deducted from
+ * *<b>buf_flushlen</b>, as buf_flush_to_socket() would do.  Until then,
+ * nothing else may touch <b>buf</b> or *<b>buf_flushlen</b>. */
+void
+buf_uring_prepare_flush(struct buf_t *buf, tor_socket_t s, size_t sz,
+                        size_t *buf_flushlen)
+{
+  buf_uring_op_t *op;
+  size_t planned;
+
+  tor_assert(the_uring);
+  tor_assert(buf_flushlen);
+  if (sz > *buf_flushlen)
+    sz = *buf_flushlen;
+  if (sz > buf->datalen)
+    sz = buf->datalen;
+  if (sz == 0)
+    return;
+
+  op = buf_uring_new_op(BUF_URING_OP_FLUSH, buf, s);
+  op->buf_flushlen = buf_flushlen;
+  op->n_iov = buf_plan_flush_iov(buf, sz, op->iov, BUF_URING_IOV_MAX,
+                                 &planned);
+}
+
+/** Apply the kernel's result for <b>op</b> to its buffer. */
+static void
+buf_uring_finish_op(buf_uring_op_t *op)
+{
+  if (op->type == BUF_URING_OP_READ) {
+    size_t n_read = op->res > 0 ? (size_t)op->res : 0;
+    buf_finish_read_iov(op->buf, op->iov, op->chunks, op->n_iov,
+                        op->old_tail, n_read);
+    buf_uring_stats.n_bytes_read += n_read;
+  } else if (op->res > 0) {
+    *op->buf_flushlen -= op->res;
+    buf_drain(op->buf, op->res);
+    buf_uring_stats.n_bytes_written += op->res;
+  }
+  /* We're done with this; don't let anybody use it by accident. */
+  op->buf_flushlen = NULL;
+}
+
+/** Queue submissions for ops[<b>first</b>] up to but not including
+ * ops[<b>last</b>] on our ring. */
+static void
+buf_uring_queue(int first, int last)
+{
+  buf_uring_t *ring = the_uring;
+  unsigned tail = *ring->sq_tail;
+  int i;
+
+  for (i = first; i < last; ++i) {
+    buf_uring_op_t *op = &ops[i];
+    unsigned idx = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+    op->msg.msg_iov = op->iov;
+    op->msg.msg_iovlen = op->n_iov;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = op->sock;
+    sqe->addr = (uint64_t)(uintptr_t) &op->msg;
+    sqe->len = 1;
+    sqe->user_data = (uint64_t) i;
+    if (op->type == BUF_URING_OP_READ) {
+      sqe->opcode = IORING_OP_RECVMSG;
+      sqe->msg_flags = MSG_DONTWAIT;
+      ++buf_uring_stats.n_reads;
+    } else {
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->msg_flags = MSG_DONTWAIT|MSG_NOSIGNAL;
+      ++buf_uring_stats.n_writes;
+    }
+    ring->sq_array[idx] = idx;
+    ++tail;
+  }
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+}
+
+/** Collect every completion that the kernel has posted, and store each
+ * result with its operation.  Return the number collected. */
+static int
+buf_uring_reap(void)
+{
+  buf_uring_t *ring = the_uring;
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  int n = 0;
+
+  while (head != tail) {
+    const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    if (! BUG(cqe->user_data >= (uint64_t)n_ops))
+      ops[cqe->user_data].res = cqe->res;
+    ++head;
+    ++n;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+/** Hand every operation that we have prepared since the last call to the
+ * kernel, wait for them all to complete, and apply their results to their
+ * buffers.  Return 0 on success, or -1 if io_uring itself failed.  In that
+ * case we stop using io_uring, and any operation that the kernel didn't
+ * run reports that it would have blocked, so that its caller will try
+ * again later with an ordinary system call. */
+int
+buf_uring_submit(void)
+{
+  int first = n_submitted;
+  int result = 0;
+
+  if (!the_uring || first == n_ops)
+    return 0;
+
+  while (n_submitted < n_ops && result == 0) {
+    int n = n_ops - n_submitted;
+    int to_submit, completed = 0;
+    if (n > (int)the_uring->sq_entries)
+      n = (int)the_uring->sq_entries;
+    to_submit = n;
+
+    buf_uring_queue(n_submitted, n_submitted + n);
+    /* Since every operation is non-blocking, the kernel completes each one
+     * while submitting it: this loop should run once. */
+    while (completed < n) {
+      int r = (int) syscall(__NR_io_uring_enter, the_uring->fd,
+                            to_submit, n - completed,
+                            IORING_ENTER_GETEVENTS, NULL, 0);
+      ++buf_uring_stats.n_enter_calls;
+      if (r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        log_warn(LD_NET, "io_uring_enter() failed: %s. Falling back to "
+                 "ordinary socket calls.", strerror(errno));
+        result = -1;
+        break;
+      }
+      if (r > 0)
+        to_submit -= r;
+      completed += buf_uring_reap();
+    }
+    n_submitted += n;
+  }
+
+  if (result < 0) {
+    /* Anything we didn't get to still holds its initial "would block"
+     * result. */
+    n_submitted = n_ops;
+    buf_uring_free_ring(the_uring);
+    the_uring = NULL;
+  }
+  for (int i = first; i < n_ops; ++i)
+    buf_uring_finish_op(&ops[i]);
+  return result;
+}
+
+/** Return the submitted, uncollected operation of type <b>type</b> on
+ * <b>buf</b> and <b>s</b>, or NULL if there is none. */
+static buf_uring_op_t *
+buf_uring_find(buf_uring_op_type_t type, const struct buf_t *buf,
+               tor_socket_t s)
+{
+  int i;
+  for (i = lookup_cursor; i < n_submitted; ++i) {
+    if (ops[i].buf == buf && ops[i].type == type && ops[i].sock == s)
+      goto found;
+  }
+  for (i = 0; i < lookup_cursor && i < n_submitted; ++i) {
+    if (ops[i].buf == buf && ops[i].type == type && ops[i].sock == s)
+      goto found;
+  }
+  return NULL;
+ found:
+  lookup_cursor = i + 1;
+  return &ops[i];
+}
+
+/** If the current batch included a read on <b>buf</b> and <b>s</b>, collect
+ * its result and return true.  The result is reported just as
+ * buf_read_from_socket() would report it: *<b>result_out</b> gets the
+ * number of bytes read, or -1 on error, in which case *<b>socket_error</b>
+ * is set; and *<b>reached_eof</b> is set on EOF.  Otherwise return false.
+ */
+bool
+buf_uring_take_read_result(struct buf_t *buf, tor_socket_t s,
+                           int *reached_eof, int *socket_error,
+                           int *result_out)
+{
+  buf_uring_op_t *op;
+  if (!n_submitted)
+    return false;
+  op = buf_uring_find(BUF_URING_OP_READ, buf, s);
+  if (!op)
+    return false;
+  op->buf = NULL;
+
+  if (op->res > 0) {
+    *result_out = op->res;
+  } else if (op->res == 0) {
+    log_debug(LD_NET,"Encountered eof on fd %d", (int)s);
+    *reached_eof = 1;
+    *result_out = 0;
+  } else if (ERRNO_IS_EAGAIN(-op->res)) {
+    *result_out = 0;
+  } else {
+    if (socket_error)
+      *socket_error = -op->res;
+    *result_out = -1;
+  }
+  return true;
+}
+
+/** If the current batch included a write from <b>buf</b> to <b>s</b>,
+ * collect its result and return true.  *<b>result_out</b> gets the number
+ * of bytes written (which have already been drained and deducted), or -1
+ * on error, as buf_flush_to_socket() would return.  Otherwise return
+ * false. */
+bool
+buf_uring_take_flush_result(struct buf_t *buf, tor_socket_t s,
+                            int *result_out)
+{
+  buf_uring_op_t *op;
+  if (!n_submitted)
+    return false;
+  op = buf_uring_find(BUF_URING_OP_FLUSH, buf, s);
+  if (!op)
+    return false;
+  op->buf = NULL;
+
+  if (op->res >= 0) {
+    *result_out = op->res;
+  } else if (ERRNO_IS_EAGAIN(-op->res)) {
+    log_debug(LD_NET,"write() would block, returning.");
+    *result_out = 0;
+  } else {
+    errno = -op->res;
+    *result_out = -1;
+  }
+  return true;
+}
+
+/** Discard any uncollected results for <b>buf</b>, which is about to be
+ * freed. */
+void
+buf_uring_forget(const struct buf_t *buf)
+{
+  if (!buf)
+    return;
+  for (int i = 0; i < n_ops; ++i) {
+    if (ops[i].buf == buf) {
+      tor_assert_nonfatal(i < n_submitted);
+      ops[i].buf = NULL;
+    }
+  }
+}
+
+/** Discard every uncollected result from the current batch, and get ready
+ * to prepare a new one.  Their effects on the buffers remain. */
+void
+buf_uring_clear_results(void)
+{
+  tor_assert_nonfatal(n_submitted == n_ops);
+  n_ops = n_submitted = lookup_cursor = 0;
+}
+
+/** Copy our io_uring statistics into <b>stats_out</b>. */
+void
+buf_uring_get_stats(buf_uring_stats_t *stats_out)
+{
+  tor_assert(stats_out);
+  memcpy(stats_out, &buf_uring_stats, sizeof(buf_uring_stats));
+}
+
+/** Stop using io_uring, and release all storage held for it. */
+void
+buf_uring_free_all(void)
+{
+  buf_uring_free_ring(the_uring);
+  the_uring = NULL;
+  tor_free(ops);
+  n_ops = ops_capacity = n_submitted = lookup_cursor = 0;
+}
+#endif /* defined(HAVE_BUF_URING) */
@@ -0,0 +1,136 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file buffers_uring.h
+ * \brief Header file for buffers_uring.c.
+ **/
+
+#ifndef TOR_BUFFERS_URING_H
+#define TOR_BUFFERS_URING_H
+
+#include "orconfig.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "lib/net/nettypes.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_SYSCALL_H)
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && \
+  defined(HAVE_SYS_UIO_H) && defined(HAVE_READV) && defined(HAVE_WRITEV)
+/** Defined if we can batch socket reads and writes through io_uring. */
+#define HAVE_BUF_URING
+#endif
+#endif /* defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_SYSCALL_H) */
+
+struct buf_t;
+
+/** Counts of the work that we have handed to io_uring, as reported by
+ * buf_uring_get_stats(). */
+typedef struct buf_uring_stats_t {
+  /** Number of io_uring_enter() calls we have made. */
+  uint64_t n_enter_calls;
+  /** Number of reads we have submitted. */
+  uint64_t n_reads;
+  /** Number of writes we have submitted. */
+  uint64_t n_writes;
+  /** Number of bytes that our submitted reads have brought in. */
+  uint64_t n_bytes_read;
+  /** Number of bytes that our submitted writes have sent. */
+  uint64_t n_bytes_written;
+} buf_uring_stats_t;
+
+#ifdef HAVE_BUF_URING
+int buf_uring_init(unsigned entries);
+bool buf_uring_enabled(void);
+void buf_uring_prepare_read(struct buf_t *buf, tor_socket_t s,
+                            size_t at_most);
+void buf_uring_prepare_flush(struct buf_t *buf, tor_socket_t s, size_t sz,
+                             size_t *buf_flushlen);
+int buf_uring_submit(void);
+bool buf_uring_take_read_result(struct buf_t *buf, tor_socket_t s,
+                                int *reached_eof, int *socket_error,
+                                int *result_out);
+bool buf_uring_take_flush_result(struct buf_t *buf, tor_socket_t s,
+                                 int *result_out);
+void buf_uring_forget(const struct buf_t *buf);
+void buf_uring_clear_results(void);
+void buf_uring_get_stats(buf_uring_stats_t *stats_out);
+void buf_uring_free_all(void);
+#else /* !defined(HAVE_BUF_URING) */
+static inline int
+buf_uring_init(unsigned entries)
+{
+  (void)entries;
+  return -1;
+}
+static inline bool
+buf_uring_enabled(void)
+{
+  return false;
+}
+static inline void
+buf_uring_prepare_read(struct buf_t *buf, tor_socket_t s, size_t at_most)
+{
+  (void)buf;
+  (void)s;
+  (void)at_most;
+}
+static inline void
+buf_uring_prepare_flush(struct buf_t *buf, tor_socket_t s, size_t sz,
+                        size_t *buf_flushlen)
+{
+  (void)buf;
+  (void)s;
+  (void)sz;
+  (void)buf_flushlen;
+}
+static inline int
+buf_uring_submit(void)
+{
+  return 0;
+}
+static inline bool
+buf_uring_take_read_result(struct buf_t *buf, tor_socket_t s,
+                           int *reached_eof, int *socket_error,
+                           int *result_out)
+{
+  (void)buf;
+  (void)s;
+  (void)reached_eof;
+  (void)socket_error;
+  (void)result_out;
+  return false;
+}
+static inline bool
+buf_uring_take_flush_result(struct buf_t *buf, tor_socket_t s,
+                            int *result_out)
+{
+  (void)buf;
+  (void)s;
+  (void)result_out;
+  return false;
+}
+static inline void
+buf_uring_forget(const struct buf_t *buf)
+{
+  (void)buf;
+}
+static inline void
+buf_uring_clear_results(void)
+{
+}
+static inline void
+buf_uring_get_stats(buf_uring_stats_t *stats_out)
+{
+  memset(stats_out, 0, sizeof(*stats_out));
+}
+static inline void
+buf_uring_free_all(void)
+{
+}
+#endif /* defined(HAVE_BUF_URING) */
+
+#endif /* !defined(TOR_BUFFERS_URING_H) */
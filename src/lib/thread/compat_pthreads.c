@@ -68,8 +68,8 @@ static int threads_initialized = 0;
  * the caller's stack will still be around when the called function is
  * running.
  */
-int
-spawn_func(void (*func)(void *), void *data)
+MOCK_IMPL(int,
+spawn_func, (void (*func)(void *), void *data))
 {
   pthread_t thread;
   tor_pthread_data_t *d;
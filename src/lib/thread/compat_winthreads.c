@@ -31,8 +31,8 @@
  * the caller's stack will still be around when the called function is
  * running.
  */
-int
-spawn_func(void (*func)(void *), void *data)
+MOCK_IMPL(int,
+spawn_func, (void (*func)(void *), void *data))
 {
   int rv;
   rv = (int)_beginthread(func, 0, data);
@@ -26,7 +26,7 @@
 
 struct timeval;
 
-int spawn_func(void (*func)(void *), void *data);
+MOCK_DECL(int, spawn_func, (void (*func)(void *), void *data));
 void spawn_exit(void) ATTR_NORETURN;
 
 unsigned long tor_get_thread_id(void);
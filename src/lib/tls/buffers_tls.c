@@ -14,6 +14,7 @@
 #include <stddef.h>
 #include "lib/buf/buffers.h"
 #include "lib/tls/buffers_tls.h"
+#include "lib/tls/tls_dataplane.h"
 #include "lib/cc/torint.h"
 #include "lib/log/log.h"
 #include "lib/log/util_bug.h"
@@ -66,6 +67,9 @@ buf_read_from_tls(buf_t *buf, tor_tls_t *tls, size_t at_most)
   int r = 0;
   size_t total_read = 0;
 
+  if (tls_dataplane_take_read_result(buf, tls, &r))
+    return r;
+
   check_no_tls_errors();
 
   IF_BUG_ONCE(buf->datalen > BUF_MAX_LEN)
@@ -146,6 +150,8 @@ buf_flush_to_tls(buf_t *buf, tor_tls_t *tls, size_t flushlen,
   size_t flushed = 0;
   ssize_t sz;
   tor_assert(buf_flushlen);
+  if (tls_dataplane_take_flush_result(buf, tls, buf_flushlen, &r))
+    return r;
   IF_BUG_ONCE(*buf_flushlen > buf->datalen) {
     *buf_flushlen = buf->datalen;
   }
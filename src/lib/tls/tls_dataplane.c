@@ -0,0 +1,548 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file tls_dataplane.c
+ * \brief Run TLS reads and writes for many connections at once, on a pool of
+ *   data-plane threads.
+ *
+ * On a busy relay, most of the main thread's time goes to encrypting and
+ * decrypting TLS records, and to the system calls that move them.  None of
+ * that work depends on any state outside the TLS object and the buffer
+ * involved, so we can do it for many connections in parallel.
+ *
+ * Every pass through the main loop, the connection layer describes the TLS
+ * reads and writes that it is about to make, with
+ * tls_dataplane_prepare_read() and tls_dataplane_prepare_flush().  Each
+ * operation carries a shard number, which pins its connection to one of our
+ * threads: every TLS object is only ever used by one thread at a time, and
+ * by the same thread from batch to batch.  tls_dataplane_start() wakes the
+ * threads, and tls_dataplane_finish() waits until all of them are done, so
+ * the threads never run while the main thread is doing anything else.
+ *
+ * The threads only call tor_tls_read() and tor_tls_write().  They never
+ * change a buf_t: reads go into a separate buffer whose chunk we allocated
+ * beforehand, and writes only look at the data in the connection's
+ * outbuf.  The results wait here until the ordinary buf_read_from_tls()
+ * and buf_flush_to_tls() calls for the same buffer and TLS object collect
+ * them, on the main thread; that is when we add the bytes we read to the
+ * inbuf, or drain the bytes we wrote from the outbuf.  Thus all the usual
+ * bookkeeping in the connection layer happens as before.  Anything
+ * uncollected is applied by tls_dataplane_clear_results().
+ *
+ * Cells, circuits, and everything else stay on the main thread.
+ **/
+
+#define BUFFERS_PRIVATE
+#include "orconfig.h"
+#include "lib/tls/tls_dataplane.h"
+#include "lib/buf/buffers.h"
+#include "lib/lock/compat_mutex.h"
+#include "lib/log/log.h"
+#include "lib/log/util_bug.h"
+#include "lib/malloc/malloc.h"
+#include "lib/thread/threads.h"
+#include "lib/tls/tortls.h"
+
+#include <string.h>
+
+/** Batches with fewer operations than this are run on the main thread:
+ * waking the threads would cost more than it saves. */
+#define TLS_DATAPLANE_MIN_PARALLEL_OPS 8
+
+/** What kind of operation is a tls_dataplane_op_t? */
+typedef enum {
+  TLS_DATAPLANE_OP_READ, TLS_DATAPLANE_OP_FLUSH,
+} tls_dataplane_op_type_t;
+
+/** A TLS read or write that we have prepared, or completed, in this
+ * batch. */
+typedef struct tls_dataplane_op_t {
+  tls_dataplane_op_type_t type;
+  /** The buffer that we are reading into or writing from; NULL if this
+   * result has been collected or forgotten. */
+  struct buf_t *buf;
+  /** The TLS object that we are reading from or writing to. */
+  struct tor_tls_t *tls;
+  /** For writes: the caller's count of bytes left to flush. */
+  size_t *buf_flushlen;
+  /** The thread that runs this operation. */
+  unsigned shard;
+  /** For reads: a buffer with one empty chunk, for the data we read.  */
+  struct buf_t *read_buf;
+  /** The number of bytes that we may read or write. */
+  size_t len;
+  /** For writes: the number of bytes that we wrote. */
+  size_t n_written;
+  /** A TOR_TLS_* code if the operation failed or blocked; otherwise, the
+   * number of bytes read or written. */
+  int result;
+} tls_dataplane_op_t;
+
+/** Operations in the current batch, in the order they were prepared. */
+static tls_dataplane_op_t *ops = NULL;
+/** Number of entries in <b>ops</b> that are in use. */
+static int n_ops = 0;
+/** Number of entries allocated for <b>ops</b>. */
+static int ops_capacity = 0;
+/** True iff the operations in <b>ops</b> have been run. */
+static int batch_done = 0;
+/** Where we expect the next lookup to succeed: the main loop collects
+ * results in the order it prepared them, so this is nearly always a hit. */
+static int lookup_cursor = 0;
+
+/** Number of data-plane threads that we have launched, or 0 if we are not
+ * using the data plane. */
+static int n_threads = 0;
+/** True iff tls_dataplane_init() has succeeded. */
+static int dataplane_enabled = 0;
+/** Protects all the fields below. */
+static tor_mutex_t *dataplane_lock = NULL;
+/** Signaled when there is a new batch for the threads to run, or when they
+ * should exit. */
+static tor_cond_t work_cond;
+/** Signaled when a thread has finished its share of a batch, or exited. */
+static tor_cond_t done_cond;
+/** Incremented for every batch that we hand to the threads. */
+static unsigned batch_generation = 0;
+/** Number of threads that have not yet finished the current batch. */
+static int n_threads_running = 0;
+/** Number of threads that have not yet exited. */
+static int n_threads_alive = 0;
+/** True iff the threads should exit. */
+static int threads_should_exit = 0;
+
+/** Totals for tls_dataplane_get_stats(). */
+static tls_dataplane_stats_t dataplane_stats;
+
+/** Run the read <b>op</b>.  Unlike buf_read_from_tls(), we don't stop at
+ * the end of a TLS record: we keep reading until TLS runs out of data or
+ * our one chunk is full, since the next chance to read may be a whole pass
+ * through the main loop away. */
+static void
+tls_dataplane_run_read(tls_dataplane_op_t *op)
+{
+  chunk_t *chunk = op->read_buf->tail;
+  int r = 0;
+
+  while (op->read_buf->datalen < op->len &&
+         CHUNK_REMAINING_CAPACITY(chunk)) {
+    size_t readlen = op->len - op->read_buf->datalen;
+    if (readlen > CHUNK_REMAINING_CAPACITY(chunk))
+      readlen = CHUNK_REMAINING_CAPACITY(chunk);
+    r = tor_tls_read(op->tls, CHUNK_WRITE_PTR(chunk), readlen);
+    if (r < 0)
+      break;
+    chunk->datalen += r;
+    op->read_buf->datalen += r;
+  }
+
+  if (r < 0 && (r != TOR_TLS_WANTREAD || op->read_buf->datalen == 0))
+    op->result = r;
+  else
+    op->result = (int)op->read_buf->datalen;
+}
+
+/** Run the write <b>op</b>, writing from the front of its buffer as
+ * buf_flush_to_tls() would, but without draining anything. */
+static void
+tls_dataplane_run_flush(tls_dataplane_op_t *op)
+{
+  const chunk_t *chunk = op->buf->head;
+  size_t offset = 0;
+  ssize_t sz = (ssize_t) op->len;
+  int r;
+
+  /* As in buf_flush_to_tls(), we write even if we have nothing to write,
+   * since TLS might have a partial record pending. */
+  do {
+    size_t flushlen0 = 0, forced;
+    const char *data = NULL;
+    while (chunk && offset == chunk->datalen) {
+      chunk = chunk->next;
+      offset = 0;
+    }
+    if (chunk) {
+      flushlen0 = chunk->datalen - offset;
+      if ((ssize_t)flushlen0 > sz)
+        flushlen0 = sz;
+      data = chunk->data + offset;
+    }
+    forced = tor_tls_get_forced_write_size(op->tls);
+    if (forced > flushlen0)
+      flushlen0 = forced;
+    tor_assert(chunk ? offset + flushlen0 <= chunk->datalen : flushlen0 == 0);
+
+    r = tor_tls_write(op->tls, data, flushlen0);
+    if (r < 0)
+      break;
+    op->n_written += r;
+    offset += r;
+    sz -= r;
+    if (r == 0) /* Can't flush any more now. */
+      break;
+  } while (sz > 0);
+
+  op->result = r < 0 ? r : (int)op->n_written;
+}
+
+/** Run every operation in the current batch whose shard belongs to thread
+ * <b>idx</b>, out of <b>n</b> threads. */
+static void
+tls_dataplane_run_shard(int idx, int n)
+{
+  for (int i = 0; i < n_ops; ++i) {
+    tls_dataplane_op_t *op = &ops[i];
+    if ((int)(op->shard % (unsigned)n) != idx)
+      continue;
+    if (op->type == TLS_DATAPLANE_OP_READ)
+      tls_dataplane_run_read(op);
+    else
+      tls_dataplane_run_flush(op);
+  }
+}
+
+/** Main function for data-plane thread number <b>arg</b>: run our share of
+ * each batch until we are told to exit. */
+static void
+tls_dataplane_thread_main(void *arg)
+{
+  const int idx = (int)(intptr_t) arg;
+  unsigned seen_generation = 0;
+
+  tor_mutex_acquire(dataplane_lock);
+  for (;;) {
+    while (batch_generation == seen_generation && !threads_should_exit)
+      tor_cond_wait(&work_cond, dataplane_lock, NULL);
+    if (threads_should_exit)
+      break;
+    seen_generation = batch_generation;
+    tor_mutex_release(dataplane_lock);
+
+    tls_dataplane_run_shard(idx, n_threads);
+
+    tor_mutex_acquire(dataplane_lock);
+    if (--n_threads_running == 0)
+      tor_cond_signal_one(&done_cond);
+  }
+  --n_threads_alive;
+  tor_cond_signal_one(&done_cond);
+  tor_mutex_release(dataplane_lock);
+}
+
+/** Start using the data plane, with <b>threads</b> threads.  If
+ * <b>threads</b> is 0, run every batch on the main thread.  Return 0 on
+ * success and -1 on failure. */
+int
+tls_dataplane_init(int threads)
+{
+  if (dataplane_enabled)
+    return 0;
+  if (threads < 0 || threads > TLS_DATAPLANE_MAX_THREADS)
+    return -1;
+
+  dataplane_lock = tor_mutex_new_nonrecursive();
+  tor_cond_init(&work_cond);
+  tor_cond_init(&done_cond);
+  threads_should_exit = 0;
+  batch_generation = 0;
+  dataplane_enabled = 1;
+
+  for (int i = 0; i < threads; ++i) {
+    tor_mutex_acquire(dataplane_lock);
+    ++n_threads_alive;
+    tor_mutex_release(dataplane_lock);
+    if (spawn_func(tls_dataplane_thread_main, (void*)(intptr_t) i) < 0) {
+      log_warn(LD_GENERAL, "Couldn't launch data-plane thread %d.", i);
+      tor_mutex_acquire(dataplane_lock);
+      --n_threads_alive;
+      tor_mutex_release(dataplane_lock);
+      n_threads = i;
+      tls_dataplane_free_all();
+      return -1;
+    }
+  }
+  n_threads = threads;
+  return 0;
+}
+
+/** Return true iff we are using the data plane. */
+int
+tls_dataplane_enabled(void)
+{
+  return dataplane_enabled;
+}
+
+/** Return the number of data-plane threads that we are running. */
+int
+tls_dataplane_get_n_threads(void)
+{
+  return n_threads;
+}
+
+/** Add a new operation of type <b>type</b> on <b>buf</b> and <b>tls</b> to
+ * the current batch, and return it. */
+static tls_dataplane_op_t *
+tls_dataplane_new_op(tls_dataplane_op_type_t type, struct buf_t *buf,
+                     struct tor_tls_t *tls, unsigned shard)
+{
+  tls_dataplane_op_t *op;
+  tor_assert(!batch_done);
+  if (n_ops == ops_capacity) {
+    ops_capacity = ops_capacity ? ops_capacity * 2 : 64;
+    ops = tor_reallocarray(ops, ops_capacity, sizeof(tls_dataplane_op_t));
+  }
+  op = &ops[n_ops++];
+  memset(op, 0, sizeof(*op));
+  op->type = type;
+  op->buf = buf;
+  op->tls = tls;
+  op->shard = shard;
+  op->result = TOR_TLS_WANTREAD;
+  return op;
+}
+
+/** Add to the current batch a TLS read of up to <b>at_most</b> bytes from
+ * <b>tls</b> onto the end of <b>buf</b>, to be run by the thread for
+ * <b>shard</b>.  Until the batch is finished, nothing else may use
+ * <b>tls</b>. */
+void
+tls_dataplane_prepare_read(struct buf_t *buf, struct tor_tls_t *tls,
+                           size_t at_most, unsigned shard)
+{
+  tls_dataplane_op_t *op;
+
+  tor_assert(dataplane_enabled);
+  if (BUG(buf->datalen > BUF_MAX_LEN - at_most))
+    return;
+  if (at_most == 0)
+    return;
+
+  op = tls_dataplane_new_op(TLS_DATAPLANE_OP_READ, buf, tls, shard);
+  /* Allocate the chunk here, since chunk allocation isn't thread-safe. */
+  op->len = at_most;
+  op->read_buf = buf_new();
+  buf_add_chunk_with_capacity(op->read_buf, at_most, 1);
+}
+
+/** Add to the current batch a TLS write of up to <b>sz</b> bytes from the
+ * front of <b>buf</b> onto <b>tls</b>, to be run by the thread for
+ * <b>shard</b>.  Until the batch is finished, nothing else may use
+ * <b>tls</b> or change <b>buf</b>. */
+void
+tls_dataplane_prepare_flush(struct buf_t *buf, struct tor_tls_t *tls,
+                            size_t sz, size_t *buf_flushlen, unsigned shard)
+{
+  tls_dataplane_op_t *op;
+
+  tor_assert(dataplane_enabled);
+  tor_assert(buf_flushlen);
+  if (sz > *buf_flushlen)
+    sz = *buf_flushlen;
+  if (sz > buf->datalen)
+    sz = buf->datalen;
+
+  op = tls_dataplane_new_op(TLS_DATAPLANE_OP_FLUSH, buf, tls, shard);
+  op->buf_flushlen = buf_flushlen;
+  op->len = sz;
+}
+
+/** Begin running the current batch. */
+void
+tls_dataplane_start(void)
+{
+  if (!dataplane_enabled || batch_done)
+    return;
+  if (n_threads == 0 || n_ops < TLS_DATAPLANE_MIN_PARALLEL_OPS)
+    return;
+
+  tor_mutex_acquire(dataplane_lock);
+  ++batch_generation;
+  n_threads_running = n_threads;
+  tor_cond_signal_all(&work_cond);
+  tor_mutex_release(dataplane_lock);
+  ++dataplane_stats.n_parallel_batches;
+}
+
+/** Wait until every operation in the current batch has run, running them
+ * here if tls_dataplane_start() did not hand them to the threads. */
+void
+tls_dataplane_finish(void)
+{
+  if (!dataplane_enabled || batch_done)
+    return;
+
+  if (n_threads == 0 || n_ops < TLS_DATAPLANE_MIN_PARALLEL_OPS) {
+    tls_dataplane_run_shard(0, 1);
+  } else {
+    tor_mutex_acquire(dataplane_lock);
+    while (n_threads_running > 0)
+      tor_cond_wait(&done_cond, dataplane_lock, NULL);
+    tor_mutex_release(dataplane_lock);
+  }
+  batch_done = 1;
+
+  if (n_ops)
+    ++dataplane_stats.n_batches;
+  for (int i = 0; i < n_ops; ++i) {
+    if (ops[i].type == TLS_DATAPLANE_OP_READ) {
+      ++dataplane_stats.n_reads;
+      dataplane_stats.n_bytes_read += buf_datalen(ops[i].read_buf);
+    } else {
+      ++dataplane_stats.n_writes;
+      dataplane_stats.n_bytes_written += ops[i].n_written;
+      tor_tls_note_bytes_written_over_tls(ops[i].n_written);
+    }
+  }
+}
+
+/** Return the finished, uncollected operation of type <b>type</b> on
+ * <b>buf</b> and <b>tls</b>, or NULL if there is none. */
+static tls_dataplane_op_t *
+tls_dataplane_find(tls_dataplane_op_type_t type, const struct buf_t *buf,
+                   const struct tor_tls_t *tls)
+{
+  int i;
+  for (i = lookup_cursor; i < n_ops; ++i) {
+    if (ops[i].buf == buf && ops[i].type == type && ops[i].tls == tls)
+      goto found;
+  }
+  for (i = 0; i < lookup_cursor && i < n_ops; ++i) {
+    if (ops[i].buf == buf && ops[i].type == type && ops[i].tls == tls)
+      goto found;
+  }
+  return NULL;
+ found:
+  lookup_cursor = i + 1;
+  return &ops[i];
+}
+
+/** Add the data that <b>op</b> read to its buffer, and mark it
+ * collected. */
+static void
+tls_dataplane_apply_read(tls_dataplane_op_t *op)
+{
+  size_t n = buf_datalen(op->read_buf);
+  if (n)
+    buf_move_to_buf(op->buf, op->read_buf, &n);
+  buf_free(op->read_buf);
+  op->read_buf = NULL;
+  op->buf = NULL;
+}
+
+/** Drain the data that <b>op</b> wrote from its buffer, deduct it from
+ * *<b>buf_flushlen</b>, and mark <b>op</b> collected. */
+static void
+tls_dataplane_apply_flush(tls_dataplane_op_t *op, size_t *buf_flushlen)
+{
+  if (*buf_flushlen > op->n_written)
+    *buf_flushlen -= op->n_written;
+  else
+    *buf_flushlen = 0;
+  buf_drain(op->buf, op->n_written);
+  op->buf = NULL;
+}
+
+/** If the current batch included a read on <b>buf</b> and <b>tls</b>,
+ * add the data it read to <b>buf</b>, set *<b>result_out</b> to what
+ * buf_read_from_tls() would have returned, and return true.  Otherwise
+ * return false. */
+int
+tls_dataplane_take_read_result(struct buf_t *buf, struct tor_tls_t *tls,
+                               int *result_out)
+{
+  tls_dataplane_op_t *op;
+  if (!batch_done)
+    return 0;
+  op = tls_dataplane_find(TLS_DATAPLANE_OP_READ, buf, tls);
+  if (!op)
+    return 0;
+  *result_out = op->result;
+  tls_dataplane_apply_read(op);
+  return 1;
+}
+
+/** If the current batch included a write on <b>buf</b> and <b>tls</b>,
+ * drain the data it wrote from <b>buf</b> and from *<b>buf_flushlen</b>,
+ * set *<b>result_out</b> to what buf_flush_to_tls() would have returned,
+ * and return true.  Otherwise return false. */
+int
+tls_dataplane_take_flush_result(struct buf_t *buf, struct tor_tls_t *tls,
+                                size_t *buf_flushlen, int *result_out)
+{
+  tls_dataplane_op_t *op;
+  if (!batch_done)
+    return 0;
+  op = tls_dataplane_find(TLS_DATAPLANE_OP_FLUSH, buf, tls);
+  if (!op)
+    return 0;
+  *result_out = op->result;
+  tls_dataplane_apply_flush(op, buf_flushlen);
+  return 1;
+}
+
+/** Discard any uncollected results for <b>buf</b>, which is about to be
+ * freed. */
+void
+tls_dataplane_forget(const struct buf_t *buf)
+{
+  if (!buf)
+    return;
+  for (int i = 0; i < n_ops; ++i) {
+    if (ops[i].buf == buf) {
+      tor_assert_nonfatal(batch_done);
+      ops[i].buf = NULL;
+    }
+  }
+}
+
+/** Apply the effects of every uncollected result from the current batch,
+ * and get ready to prepare a new one. */
+void
+tls_dataplane_clear_results(void)
+{
+  tor_assert_nonfatal(batch_done || n_ops == 0);
+  for (int i = 0; i < n_ops; ++i) {
+    tls_dataplane_op_t *op = &ops[i];
+    if (op->buf && op->type == TLS_DATAPLANE_OP_READ)
+      tls_dataplane_apply_read(op);
+    else if (op->buf)
+      tls_dataplane_apply_flush(op, op->buf_flushlen);
+    buf_free(op->read_buf);
+  }
+  n_ops = lookup_cursor = batch_done = 0;
+}
+
+/** Copy our data-plane statistics into <b>stats_out</b>. */
+void
+tls_dataplane_get_stats(tls_dataplane_stats_t *stats_out)
+{
+  tor_assert(stats_out);
+  memcpy(stats_out, &dataplane_stats, sizeof(dataplane_stats));
+}
+
+/** Stop the data-plane threads, and release all storage held for the data
+ * plane. */
+void
+tls_dataplane_free_all(void)
+{
+  if (!dataplane_enabled)
+    return;
+
+  tor_mutex_acquire(dataplane_lock);
+  threads_should_exit = 1;
+  tor_cond_signal_all(&work_cond);
+  while (n_threads_alive > 0)
+    tor_cond_wait(&done_cond, dataplane_lock, NULL);
+  tor_mutex_release(dataplane_lock);
+
+  for (int i = 0; i < n_ops; ++i)
+    buf_free(ops[i].read_buf);
+  tor_free(ops);
+  n_ops = ops_capacity = lookup_cursor = batch_done = 0;
+  n_threads = 0;
+  tor_cond_uninit(&work_cond);
+  tor_cond_uninit(&done_cond);
+  tor_mutex_free(dataplane_lock);
+  dataplane_enabled = 0;
+}
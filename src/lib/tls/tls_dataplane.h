@@ -0,0 +1,57 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file tls_dataplane.h
+ * \brief Header file for tls_dataplane.c.
+ **/
+
+#ifndef TOR_TLS_DATAPLANE_H
+#define TOR_TLS_DATAPLANE_H
+
+#include "lib/cc/torint.h"
+#include "lib/testsupport/testsupport.h"
+
+struct buf_t;
+struct tor_tls_t;
+
+/** Largest number of data-plane threads that we will run. */
+#define TLS_DATAPLANE_MAX_THREADS 64
+
+/** Counts of the work that we have handed to the data plane, as reported by
+ * tls_dataplane_get_stats(). */
+typedef struct tls_dataplane_stats_t {
+  /** Number of batches that we have run. */
+  uint64_t n_batches;
+  /** Number of those batches that we split across our threads. */
+  uint64_t n_parallel_batches;
+  /** Number of TLS reads that we have run. */
+  uint64_t n_reads;
+  /** Number of TLS writes that we have run. */
+  uint64_t n_writes;
+  /** Number of plaintext bytes that our reads have brought in. */
+  uint64_t n_bytes_read;
+  /** Number of plaintext bytes that our writes have sent. */
+  uint64_t n_bytes_written;
+} tls_dataplane_stats_t;
+
+int tls_dataplane_init(int n_threads);
+int tls_dataplane_enabled(void);
+int tls_dataplane_get_n_threads(void);
+void tls_dataplane_prepare_read(struct buf_t *buf, struct tor_tls_t *tls,
+                                size_t at_most, unsigned shard);
+void tls_dataplane_prepare_flush(struct buf_t *buf, struct tor_tls_t *tls,
+                                 size_t sz, size_t *buf_flushlen,
+                                 unsigned shard);
+void tls_dataplane_start(void);
+void tls_dataplane_finish(void);
+int tls_dataplane_take_read_result(struct buf_t *buf, struct tor_tls_t *tls,
+                                   int *result_out);
+int tls_dataplane_take_flush_result(struct buf_t *buf, struct tor_tls_t *tls,
+                                    size_t *buf_flushlen, int *result_out);
+void tls_dataplane_forget(const struct buf_t *buf);
+void tls_dataplane_clear_results(void);
+void tls_dataplane_get_stats(tls_dataplane_stats_t *stats_out);
+void tls_dataplane_free_all(void);
+
+#endif /* !defined(TOR_TLS_DATAPLANE_H) */
@@ -77,6 +77,7 @@ void tor_tls_free_all(void);
 #define TOR_TLS_CTX_IS_PUBLIC_SERVER (1u<<0)
 #define TOR_TLS_CTX_USE_ECDHE_P256   (1u<<1)
 #define TOR_TLS_CTX_USE_ECDHE_P224   (1u<<2)
+#define TOR_TLS_CTX_USE_KTLS         (1u<<3)
 
 void tor_tls_init(void);
 void tls_log_errors(tor_tls_t *tls, int severity, int domain,
@@ -114,10 +115,12 @@ size_t tor_tls_get_forced_write_size(tor_tls_t *tls);
 void tor_tls_get_n_raw_bytes(tor_tls_t *tls,
                              size_t *n_read, size_t *n_written);
 
+int tor_tls_get_kernel_offload(tor_tls_t *tls, int *tx_out, int *rx_out);
 int tor_tls_get_buffer_sizes(tor_tls_t *tls,
                               size_t *rbuf_capacity, size_t *rbuf_bytes,
                               size_t *wbuf_capacity, size_t *wbuf_bytes);
 
+void tor_tls_note_bytes_written_over_tls(size_t n);
 MOCK_DECL(double, tls_get_write_overhead_ratio, (void));
 
 int tor_tls_used_v1_handshake(tor_tls_t *tls);
@@ -685,6 +685,25 @@ tor_tls_get_buffer_sizes(tor_tls_t *tls,
   return -1;
 }
 
+int
+tor_tls_get_kernel_offload(tor_tls_t *tls, int *tx_out, int *rx_out)
+{
+  tor_assert(tls);
+  tor_assert(tx_out);
+  tor_assert(rx_out);
+
+  /* NSS doesn't know how to hand its record layer to the kernel. */
+  *tx_out = *rx_out = 0;
+  return -1;
+}
+
+void
+tor_tls_note_bytes_written_over_tls(size_t n)
+{
+  /* We don't track the write overhead with NSS; see below. */
+  (void)n;
+}
+
 MOCK_IMPL(double,
 tls_get_write_overhead_ratio, (void))
 {
@@ -65,6 +65,7 @@ ENABLE_GCC_WARNING("-Wredundant-decls")
 #include "lib/string/compat_string.h"
 #include "lib/string/printf.h"
 #include "lib/net/socket.h"
+#include "lib/thread/threads.h"
 #include "lib/intmath/cmp.h"
 #include "lib/ctime/di_ops.h"
 #include "lib/encoding/time_fmt.h"
@@ -99,6 +100,11 @@ ENABLE_GCC_WARNING("-Wredundant-decls")
 #define SSL3_FLAGS_ALLOW_UNSAFE_LEGACY_RENEGOTIATION 0x0010
 #endif
 
+/* Defined if this OpenSSL can hand TLS record encryption to the kernel. */
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define TOR_TLS_HAVE_KTLS
+#endif
+
 /** Set to true iff openssl bug 7712 has been detected. */
 static int openssl_bug_7712_is_present = 0;
 
@@ -610,6 +616,19 @@ tor_tls_context_new(crypto_pk_t *identity, unsigned int key_lifetime,
 #endif
 #endif /* OPENSSL_VERSION_NUMBER < OPENSSL_V_SERIES(1,1,0) */
 
+  /* If we've been asked to, let OpenSSL hand the record-layer crypto over
+   * to the kernel once each handshake is done.  OpenSSL quietly keeps doing
+   * the work itself on any connection where the kernel, the negotiated
+   * cipher, or the socket can't support offload. */
+  if (flags & TOR_TLS_CTX_USE_KTLS) {
+#ifdef TOR_TLS_HAVE_KTLS
+    SSL_CTX_set_options(result->ctx, SSL_OP_ENABLE_KTLS);
+#else
+    log_info(LD_NET, "Kernel TLS offload was requested, but our OpenSSL "
+             "can't do it.  Doing all TLS encryption in userspace.");
+#endif
+  }
+
 #ifdef SSL_MODE_RELEASE_BUFFERS
   SSL_CTX_set_mode(result->ctx, SSL_MODE_RELEASE_BUFFERS);
 #endif
@@ -1260,6 +1279,14 @@ STATIC uint64_t total_bytes_written_over_tls = 0;
  * track TLS overhead. */
 STATIC uint64_t total_bytes_written_by_tls = 0;
 
+/** Count <b>n</b> bytes that we wrote with tor_tls_write() outside the main
+ * thread. */
+void
+tor_tls_note_bytes_written_over_tls(size_t n)
+{
+  total_bytes_written_over_tls += n;
+}
+
 /** Underlying function for TLS writing.  Write up to <b>n</b>
  * characters from <b>cp</b> onto <b>tls</b>.  On success, returns the
  * number of characters written.  On failure, returns TOR_TLS_ERROR,
@@ -1286,7 +1313,10 @@ tor_tls_write(tor_tls_t *tls, const char *cp, size_t n)
   r = SSL_write(tls->ssl, cp, (int)n);
   err = tor_tls_get_error(tls, r, 0, "writing", LOG_INFO, LD_NET);
   if (err == TOR_TLS_DONE) {
-    total_bytes_written_over_tls += r;
+    /* Data-plane threads report their writes with
+     * tor_tls_note_bytes_written_over_tls() instead. */
+    if (in_main_thread())
+      total_bytes_written_over_tls += r;
     return r;
   }
   if (err == TOR_TLS_WANTWRITE || err == TOR_TLS_WANTREAD) {
@@ -1770,6 +1800,28 @@ tor_tls_get_buffer_sizes(tor_tls_t *tls,
 #endif /* OPENSSL_VERSION_NUMBER >= OPENSSL_V_SERIES(1,1,0) */
 }
 
+/** Set *<b>tx_out</b> to true iff the kernel is encrypting the records that
+ * we send on <b>tls</b>, and *<b>rx_out</b> to true iff it is decrypting the
+ * records that we receive.
+ *
+ * Return 0 on success, or -1 if our TLS library can't offload to the kernel
+ * at all. */
+int
+tor_tls_get_kernel_offload(tor_tls_t *tls, int *tx_out, int *rx_out)
+{
+  tor_assert(tls);
+  tor_assert(tx_out);
+  tor_assert(rx_out);
+#ifdef TOR_TLS_HAVE_KTLS
+  *tx_out = BIO_get_ktls_send(SSL_get_wbio(tls->ssl)) ? 1 : 0;
+  *rx_out = BIO_get_ktls_recv(SSL_get_rbio(tls->ssl)) ? 1 : 0;
+  return 0;
+#else
+  *tx_out = *rx_out = 0;
+  return -1;
+#endif /* defined(TOR_TLS_HAVE_KTLS) */
+}
+
 /** Check whether the ECC group requested is supported by the current OpenSSL
  * library instance.  Return 1 if the group is supported, and 0 if not.
  */
@@ -8,6 +8,7 @@
  * \brief Benchmarks for lower level Tor modules.
  **/
 
+#define CHANNEL_OBJECT_PRIVATE
 #include "orconfig.h"
 
 #include "core/or/or.h"
@@ -24,26 +25,60 @@
 #include <openssl/obj_mac.h>
 #endif /* defined(ENABLE_OPENSSL) */
 
+#include "core/mainloop/cpuworker.h"
+#include "core/or/cellpool.h"
+#include "core/or/channel.h"
 #include "core/or/circuitlist.h"
+#include "core/or/circuitmux.h"
+#include "core/or/circuitmux_ewma.h"
+#include "core/or/connection_or.h"
+#include "core/or/relay.h"
 #include "app/config/config.h"
 #include "app/main/subsysmgr.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
+#include "lib/crypt_ops/crypto_curve25519_simd.h"
 #include "lib/crypt_ops/crypto_dh.h"
 #include "core/crypto/onion_ntor.h"
 #include "lib/crypt_ops/crypto_ed25519.h"
+#include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "feature/dircommon/consdiff.h"
+#include "lib/buf/buffers.h"
+#include "lib/net/buffers_net.h"
+#include "lib/net/buffers_uring.h"
+#include "lib/tls/tls_dataplane.h"
+#include "lib/tls/tortls.h"
 #include "lib/compress/compress.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/workqueue.h"
+#include "lib/thread/numcpus.h"
+#include "lib/time/compat_time.h"
+#include "core/proto/proto_cell.h"
 
 #include "core/or/cell_st.h"
+#include "core/or/cell_queue_st.h"
 #include "core/or/or_circuit_st.h"
 
 #include "lib/crypt_ops/digestset.h"
 #include "lib/crypt_ops/crypto_init.h"
 
 #include "feature/dirparse/microdesc_parse.h"
+#include "feature/dirparse/ns_parse.h"
+#include "feature/dirparse/routerparse.h"
+#include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/networkstatus_st.h"
+#include "feature/nodelist/nodelist_snapshot.h"
+#include "feature/nodelist/routerinfo_st.h"
+#include "feature/nodelist/routerlist.h"
+#include "feature/nodelist/torcert.h"
+#include "feature/nodelist/verified_digests.h"
+#include "feature/relay/router.h"
 #include "feature/nodelist/microdesc.h"
 
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
 static inline uint64_t
@@ -254,6 +289,60 @@ bench_onion_ntor_impl(void)
   dimap_free(keymap, NULL);
 }
 
+static void
+bench_onion_ntor_batch_impl(void)
+{
+  const int iters = 1<<10;
+  static const int lane_counts[] = { 1, 4, 8 };
+  static const int batch_sizes[] = { 1, 2, 4, 8, 16 };
+  curve25519_keypair_t keypair;
+  uint64_t start, end;
+  uint8_t os[NTOR_ONIONSKIN_LEN];
+  uint8_t or[16][NTOR_REPLY_LEN];
+  uint8_t key_out[16][CPATH_KEY_MATERIAL_LEN];
+  const uint8_t *onion_skins[16];
+  uint8_t *replies[16], *keys[16];
+  int results[16];
+  ntor_handshake_state_t *state = NULL;
+  uint8_t nodeid[DIGEST_LEN];
+  di_digest256_map_t *keymap = NULL;
+  int i, j, k, max_lanes;
+
+  curve25519_keypair_generate(&keypair, 0);
+  dimap_add_entry(&keymap, keypair.pubkey.public_key, &keypair);
+  crypto_rand((char *)nodeid, sizeof(nodeid));
+  onion_skin_ntor_create(nodeid, &keypair.pubkey, &state, os);
+  for (i = 0; i < 16; ++i) {
+    onion_skins[i] = os;
+    replies[i] = or[i];
+    keys[i] = key_out[i];
+  }
+
+  max_lanes = curve25519_set_batch_lanes(CURVE25519_SIMD_MAX_LANES);
+  for (j = 0; j < (int)ARRAY_LENGTH(lane_counts); ++j) {
+    if (curve25519_set_batch_lanes(lane_counts[j]) != lane_counts[j])
+      continue;
+    for (k = 0; k < (int)ARRAY_LENGTH(batch_sizes); ++k) {
+      const int batch = batch_sizes[k];
+      start = perftime();
+      for (i = 0; i < iters; i += batch) {
+        onion_skin_ntor_server_handshake_batch(batch, onion_skins, keymap,
+                                               NULL, nodeid, replies, keys,
+                                               CPATH_KEY_MATERIAL_LEN,
+                                               results);
+      }
+      end = perftime();
+      printf("Server-side, %d-lane curve25519, batches of %2d: "
+             "%f usec per handshake.\n", lane_counts[j], batch,
+             NANOCOUNT(start, end, iters)/1e3);
+    }
+  }
+  curve25519_set_batch_lanes(max_lanes);
+
+  ntor_handshake_state_free(state);
+  dimap_free(keymap, NULL);
+}
+
 static void
 bench_onion_ntor(void)
 {
@@ -265,6 +354,7 @@ bench_onion_ntor(void)
     curve25519_set_impl_params(ed);
     bench_onion_ntor_impl();
   }
+  bench_onion_ntor_batch_impl();
 }
 
 static void
@@ -425,6 +515,65 @@ bench_cell_aes(void)
   tor_free(b);
 }
 
+/** Compare encrypting cell payloads one at a time with encrypting them in
+ * batches using relay_crypt_payloads(). */
+static void
+bench_cell_aes_batch(void)
+{
+  const int batch_sizes[] = { 1, 2, 4, 8, 16, 32, 64, 0 };
+  const int total = 1<<16;
+  cell_t *cells = tor_calloc(64, sizeof(cell_t));
+  uint8_t *payloads[64];
+  uint8_t *buf = tor_malloc_zero(64 * CELL_PAYLOAD_SIZE);
+  crypto_cipher_t *c;
+  char key[CIPHER_KEY_LEN];
+  uint64_t start, end;
+  int i, j, k;
+
+  crypto_rand(key, sizeof(key));
+  c = crypto_cipher_new(key);
+  for (i = 0; i < 64; ++i) {
+    crypto_rand((char *) cells[i].payload, CELL_PAYLOAD_SIZE);
+    payloads[i] = cells[i].payload;
+  }
+
+  reset_perftime();
+  for (k = 0; batch_sizes[k]; ++k) {
+    const int batch = batch_sizes[k];
+    const int rounds = total / batch;
+
+    start = perftime();
+    for (i = 0; i < rounds; ++i) {
+      for (j = 0; j < batch; ++j)
+        relay_crypt_one_payload(c, payloads[j]);
+    }
+    end = perftime();
+    printf("%2d cells, one at a time: %.2f nsec per cell\n",
+           batch, NANOCOUNT(start, end, total));
+
+    start = perftime();
+    for (i = 0; i < rounds; ++i) {
+      relay_crypt_payloads(c, payloads, batch);
+    }
+    end = perftime();
+    printf("%2d cells, batched:       %.2f nsec per cell\n",
+           batch, NANOCOUNT(start, end, total));
+
+    start = perftime();
+    for (i = 0; i < rounds; ++i) {
+      crypto_cipher_crypt_inplace(c, (char *) buf,
+                                  batch * CELL_PAYLOAD_SIZE);
+    }
+    end = perftime();
+    printf("%2d cells, contiguous:    %.2f nsec per cell\n",
+           batch, NANOCOUNT(start, end, total));
+  }
+
+  crypto_cipher_free(c);
+  tor_free(cells);
+  tor_free(buf);
+}
+
 /** Run digestmap_t performance benchmarks. */
 static void
 bench_dmap(void)
@@ -616,6 +765,879 @@ bench_cell_ops(void)
   tor_free(cell);
 }
 
+/** Run benchmarks for moving data between buffers with buf_move_to_buf(),
+ * as linked connections do. */
+/** Parse every cell out of <b>buf</b>, either one at a time through a
+ * copy, or in batches straight from the buffer's chunks, the way
+ * connection_or_process_cells_from_inbuf() does.  Return the number of
+ * cells parsed. */
+static int
+bench_parse_inbuf(buf_t *buf, int batch)
+{
+  const size_t cell_network_size = get_cell_network_size(1);
+  char tmp[CELL_MAX_NETWORK_SIZE];
+  cell_t cells[16];
+  int n = 0, k;
+
+  while (buf_datalen(buf) >= cell_network_size) {
+    if (batch && (k = fetch_cells_from_buf(buf, cells, 16, 4)) > 0) {
+      n += k;
+      continue;
+    }
+    buf_get_bytes(buf, tmp, cell_network_size);
+    cells[0].circ_id = ntohl(get_uint32(tmp));
+    cells[0].command = get_uint8(tmp + 4);
+    memcpy(cells[0].payload, tmp + 5, CELL_PAYLOAD_SIZE);
+    ++n;
+  }
+  return n;
+}
+
+static void
+bench_cell_inbuf(void)
+{
+  const int iters = 1<<14;
+  const int cells_per_read = 32;
+  const size_t read_len = cells_per_read * get_cell_network_size(1);
+  char *data = tor_malloc_zero(read_len);
+  buf_t *buf = buf_new();
+  uint64_t start, end, total;
+  int batch, i, n;
+
+  reset_perftime();
+  for (batch = 0; batch <= 1; ++batch) {
+    total = 0;
+    n = 0;
+    for (i = 0; i < iters; ++i) {
+      buf_add(buf, data, read_len);
+      start = perftime();
+      n += bench_parse_inbuf(buf, batch);
+      end = perftime();
+      total += end - start;
+    }
+    printf("%s: %.2f nsec per cell\n",
+           batch ? "Batched from chunks" : "One cell at a time ",
+           NANOCOUNT(0, total, n));
+  }
+
+  buf_free(buf);
+  tor_free(data);
+}
+
+static void
+bench_buf_move(void)
+{
+  const size_t flush_sizes[] = { 498, 4096, 16384, 65536, 0 };
+  const size_t total = 1<<24;
+  char *data = tor_malloc_zero(65536);
+  buf_t *buf_in = buf_new();
+  buf_t *buf_out = buf_new();
+  uint64_t start, end;
+  int k;
+
+  reset_perftime();
+  for (k = 0; flush_sizes[k]; ++k) {
+    const size_t flush = flush_sizes[k];
+    size_t moved = 0;
+    start = perftime();
+    while (moved < total) {
+      size_t n = flush;
+      buf_add(buf_in, data, flush);
+      buf_move_to_buf(buf_out, buf_in, &n);
+      buf_drain(buf_out, flush);
+      moved += flush;
+    }
+    end = perftime();
+    printf("Moving %5u bytes at a time: %.3f nsec per byte\n",
+           (unsigned)flush, NANOCOUNT(start, end, moved));
+  }
+
+  buf_free(buf_in);
+  buf_free(buf_out);
+  tor_free(data);
+}
+
+#ifndef _WIN32
+/** Open a connected pair of TCP sockets on the loopback interface, and store
+ * them in <b>fds</b>.  Return 0 on success, -1 on failure. */
+static int
+bench_loopback_pair(tor_socket_t fds[2])
+{
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  tor_socket_t listener;
+
+  fds[0] = fds[1] = TOR_INVALID_SOCKET;
+  listener = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (!SOCKET_OK(listener))
+    return -1;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(listener, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+      listen(listener, 1) < 0 ||
+      getsockname(listener, (struct sockaddr *)&sin, &len) < 0)
+    goto err;
+  fds[0] = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (!SOCKET_OK(fds[0]) ||
+      connect(fds[0], (struct sockaddr *)&sin, sizeof(sin)) < 0)
+    goto err;
+  fds[1] = tor_accept_socket(listener, NULL, NULL);
+  if (!SOCKET_OK(fds[1]))
+    goto err;
+  tor_close_socket(listener);
+  set_socket_nonblocking(fds[0]);
+  set_socket_nonblocking(fds[1]);
+  return 0;
+ err:
+  tor_close_socket(listener);
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  return -1;
+}
+
+/** Run benchmarks for pushing data through a loopback TCP connection with
+ * buf_flush_to_socket() and buf_read_from_socket(), counting the system
+ * calls it takes with and without readv() and writev(). */
+static void
+bench_buf_socket(void)
+{
+  const size_t total = 1<<26;
+  const size_t batch = 1<<16;
+  char *data = tor_malloc_zero(batch);
+  int sg;
+
+  for (sg = 0; sg <= 1; ++sg) {
+    tor_socket_t fds[2];
+    buf_t *out = buf_new(), *in = buf_new();
+    buf_net_stats_t st0, st;
+    size_t sent = 0, received = 0, i;
+    uint64_t start, end;
+
+    if (bench_loopback_pair(fds) < 0) {
+      puts("Couldn't open loopback connection");
+      buf_free(out);
+      buf_free(in);
+      break;
+    }
+    buf_net_set_scatter_gather(sg);
+    buf_net_get_stats(&st0);
+    reset_perftime();
+    start = perftime();
+    while (received < total) {
+      int eof = 0, err = 0, r;
+      if (sent < total && buf_datalen(out) < batch) {
+        /* Queue the data a cell's worth at a time, as relays do. */
+        for (i = 0; i < batch; i += 512)
+          buf_add(out, data + i, 512);
+        sent += batch;
+      }
+      if (buf_datalen(out)) {
+        size_t flushlen = buf_datalen(out);
+        if (buf_flush_to_socket(out, fds[0], flushlen, &flushlen) < 0)
+          break;
+      }
+      r = buf_read_from_socket(in, fds[1], batch * 4, &eof, &err);
+      if (r < 0 || eof)
+        break;
+      received += r;
+      buf_drain(in, buf_datalen(in));
+    }
+    end = perftime();
+    buf_net_get_stats(&st);
+    printf("%-18s %.2f writes/MB, %.2f reads/MB, %.3f nsec per byte\n",
+           sg ? "readv/writev:" : "send/recv:",
+           (st.n_write_calls - st0.n_write_calls) / (total / 1048576.0),
+           (st.n_read_calls - st0.n_read_calls) / (total / 1048576.0),
+           NANOCOUNT(start, end, total));
+
+    tor_close_socket(fds[0]);
+    tor_close_socket(fds[1]);
+    buf_free(out);
+    buf_free(in);
+  }
+  buf_net_set_scatter_gather(true);
+  tor_free(data);
+}
+
+/** Release function for bench_buf_spool(): the body outlives the run. */
+static void
+bench_spool_release(void *arg)
+{
+  (void)arg;
+}
+
+/** Run benchmarks for serving one cached, precompressed consensus to many
+ * clients at once over loopback TCP, as a directory cache does: each
+ * connection's outbuf is topped up from the cached body 8 KB at a time
+ * whenever it drops below 16 KB.  Compare copying the body onto the outbufs
+ * with adding it by reference. */
+static void
+bench_buf_spool(void)
+{
+  const int n_pairs = 300;
+  const size_t body_len = 1<<21;
+  const size_t piece = 8192, low_water = 16384;
+  char *body = tor_malloc(body_len);
+  tor_socket_t *fds = tor_calloc(2 * n_pairs, sizeof(tor_socket_t));
+  buf_t **out = tor_calloc(n_pairs, sizeof(buf_t *));
+  buf_t **in = tor_calloc(n_pairs, sizeof(buf_t *));
+  size_t *offset = tor_calloc(n_pairs, sizeof(size_t));
+  size_t *received = tor_calloc(n_pairs, sizeof(size_t));
+  const int old_max_sockets = get_max_sockets();
+  int i, n_open = 0, by_ref;
+
+  memset(body, 'x', body_len);
+  /* Each pair needs three sockets while we open it. */
+  set_max_sockets(2 * n_pairs + 64);
+  for (n_open = 0; n_open < n_pairs; ++n_open) {
+    if (bench_loopback_pair(&fds[2*n_open]) < 0) {
+      puts("Couldn't open loopback connections");
+      goto done;
+    }
+    out[n_open] = buf_new();
+    in[n_open] = buf_new();
+  }
+
+  for (by_ref = 0; by_ref <= 1; ++by_ref) {
+    uint64_t start, end;
+    size_t peak = 0;
+    int n_done = 0;
+
+    memset(offset, 0, n_pairs * sizeof(size_t));
+    memset(received, 0, n_pairs * sizeof(size_t));
+    reset_perftime();
+    start = perftime();
+    while (n_done < n_pairs) {
+      size_t alloc = 0;
+      for (i = 0; i < n_pairs; ++i) {
+        size_t flushlen;
+        while (buf_datalen(out[i]) < low_water && offset[i] < body_len) {
+          size_t n = MIN(piece, body_len - offset[i]);
+          if (by_ref)
+            buf_add_external(out[i], body + offset[i], n,
+                             bench_spool_release, NULL);
+          else
+            buf_add(out[i], body + offset[i], n);
+          offset[i] += n;
+        }
+        alloc += buf_allocation(out[i]);
+        flushlen = buf_datalen(out[i]);
+        if (flushlen)
+          buf_flush_to_socket(out[i], fds[2*i], flushlen, &flushlen);
+      }
+      if (alloc > peak)
+        peak = alloc;
+      for (i = 0; i < n_pairs; ++i) {
+        int eof = 0, err = 0, r;
+        if (received[i] == body_len)
+          continue;
+        r = buf_read_from_socket(in[i], fds[2*i+1], 1<<16, &eof, &err);
+        if (r < 0 || eof) {
+          puts("Loopback connection failed");
+          goto done;
+        }
+        received[i] += r;
+        buf_drain(in[i], buf_datalen(in[i]));
+        if (received[i] == body_len)
+          ++n_done;
+      }
+    }
+    end = perftime();
+    printf("%-13s %d downloads: %.3f nsec per byte, "
+           "at most %"TOR_PRIuSZ" KB on outbufs\n",
+           by_ref ? "By reference:" : "Copied:", n_pairs,
+           NANOCOUNT(start, end, (uint64_t)n_pairs * body_len),
+           peak / 1024);
+  }
+
+ done:
+  for (i = 0; i < n_open; ++i) {
+    tor_close_socket(fds[2*i]);
+    tor_close_socket(fds[2*i+1]);
+    buf_free(out[i]);
+    buf_free(in[i]);
+  }
+  set_max_sockets(old_max_sockets);
+  tor_free(fds);
+  tor_free(out);
+  tor_free(in);
+  tor_free(offset);
+  tor_free(received);
+  tor_free(body);
+}
+
+#ifdef HAVE_BUF_URING
+/** Run benchmarks for moving data across many loopback TCP connections at
+ * once, as a busy relay's main loop does, with one readv() or writev() per
+ * connection and with a single io_uring batch for all of them. */
+static void
+bench_buf_uring(void)
+{
+  const int n_pairs = 2000;
+  const int rounds = 100;
+  const size_t per_round = 4096;
+  char *data = tor_malloc_zero(per_round);
+  tor_socket_t *fds = tor_calloc(2 * n_pairs, sizeof(tor_socket_t));
+  buf_t **out = tor_calloc(n_pairs, sizeof(buf_t *));
+  buf_t **in = tor_calloc(n_pairs, sizeof(buf_t *));
+  size_t *flushlen = tor_calloc(n_pairs, sizeof(size_t));
+  const int old_max_sockets = get_max_sockets();
+  int i, n_open = 0, use_uring;
+
+  /* Each pair needs three sockets while we open it. */
+  set_max_sockets(2 * n_pairs + 64);
+  if (buf_uring_init(1024) < 0) {
+    puts("io_uring is not available");
+    goto done;
+  }
+  for (n_open = 0; n_open < n_pairs; ++n_open) {
+    if (bench_loopback_pair(&fds[2*n_open]) < 0) {
+      puts("Couldn't open loopback connections");
+      goto done;
+    }
+    out[n_open] = buf_new();
+    in[n_open] = buf_new();
+  }
+
+  for (use_uring = 0; use_uring <= 1; ++use_uring) {
+    buf_net_stats_t st0, st;
+    buf_uring_stats_t ust0, ust;
+    uint64_t start, end, moved = 0;
+    int round;
+
+    buf_net_get_stats(&st0);
+    buf_uring_get_stats(&ust0);
+    reset_perftime();
+    start = perftime();
+    for (round = 0; round < rounds; ++round) {
+      for (i = 0; i < n_pairs; ++i) {
+        buf_add(out[i], data, per_round);
+        flushlen[i] = buf_datalen(out[i]);
+      }
+      if (use_uring) {
+        for (i = 0; i < n_pairs; ++i)
+          buf_uring_prepare_flush(out[i], fds[2*i], flushlen[i],
+                                  &flushlen[i]);
+        buf_uring_submit();
+        buf_uring_clear_results();
+        for (i = 0; i < n_pairs; ++i)
+          buf_uring_prepare_read(in[i], fds[2*i+1], per_round * 4);
+        buf_uring_submit();
+        buf_uring_clear_results();
+      } else {
+        int eof = 0, err = 0;
+        for (i = 0; i < n_pairs; ++i)
+          buf_flush_to_socket(out[i], fds[2*i], flushlen[i], &flushlen[i]);
+        for (i = 0; i < n_pairs; ++i)
+          buf_read_from_socket(in[i], fds[2*i+1], per_round * 4, &eof, &err);
+      }
+      for (i = 0; i < n_pairs; ++i) {
+        moved += buf_datalen(in[i]);
+        buf_drain(in[i], buf_datalen(in[i]));
+      }
+    }
+    end = perftime();
+    buf_net_get_stats(&st);
+    buf_uring_get_stats(&ust);
+    printf("%-14s %d connections: %.2f syscalls/round, "
+           "%.3f nsec per byte\n",
+           use_uring ? "io_uring:" : "readv/writev:", n_pairs,
+           (double)(st.n_read_calls - st0.n_read_calls +
+                    st.n_write_calls - st0.n_write_calls +
+                    ust.n_enter_calls - ust0.n_enter_calls) / rounds,
+           NANOCOUNT(start, end, moved));
+  }
+
+ done:
+  for (i = 0; i < n_open; ++i) {
+    tor_close_socket(fds[2*i]);
+    tor_close_socket(fds[2*i+1]);
+    buf_free(out[i]);
+    buf_free(in[i]);
+  }
+  buf_uring_free_all();
+  set_max_sockets(old_max_sockets);
+  tor_free(fds);
+  tor_free(out);
+  tor_free(in);
+  tor_free(flushlen);
+  tor_free(data);
+}
+#endif /* defined(HAVE_BUF_URING) */
+
+/** Open a connected pair of TLS objects over loopback TCP, and finish
+ * their handshake.  Return 0 on success, -1 on failure. */
+static int
+bench_tls_pair(tor_tls_t **client_out, tor_tls_t **server_out)
+{
+  tor_socket_t fds[2];
+  int client_done = 0, server_done = 0, i, r;
+
+  *client_out = *server_out = NULL;
+  if (bench_loopback_pair(fds) < 0)
+    return -1;
+  *client_out = tor_tls_new(fds[0], 0);
+  *server_out = tor_tls_new(fds[1], 1);
+  if (!*client_out || !*server_out)
+    return -1;
+  for (i = 0; i < 1000 && !(client_done && server_done); ++i) {
+    if (!client_done) {
+      r = tor_tls_handshake(*client_out);
+      if (TOR_TLS_IS_ERROR(r))
+        return -1;
+      client_done = (r == TOR_TLS_DONE);
+    }
+    if (!server_done) {
+      r = tor_tls_handshake(*server_out);
+      if (TOR_TLS_IS_ERROR(r))
+        return -1;
+      server_done = (r == TOR_TLS_DONE);
+    }
+  }
+  return (client_done && server_done) ? 0 : -1;
+}
+
+/** Run benchmarks for moving data across many loopback TLS connections at
+ * once, as a busy relay's main loop does, with the TLS work spread over
+ * different numbers of data-plane threads. */
+static void
+bench_tls_dataplane(void)
+{
+  const int n_pairs = 256;
+  const int rounds = 50;
+  const size_t per_round = 16384;
+  const int thread_counts[] = { 0, 1, 2, 4, -1 };
+  char *data = tor_malloc_zero(per_round);
+  tor_tls_t **client = tor_calloc(n_pairs, sizeof(tor_tls_t *));
+  tor_tls_t **server = tor_calloc(n_pairs, sizeof(tor_tls_t *));
+  buf_t **out = tor_calloc(n_pairs, sizeof(buf_t *));
+  buf_t **in = tor_calloc(n_pairs, sizeof(buf_t *));
+  size_t *flushlen = tor_calloc(n_pairs, sizeof(size_t));
+  crypto_pk_t *pk1 = crypto_pk_new(), *pk2 = crypto_pk_new();
+  int i, k, n_open = 0;
+
+  if (crypto_pk_generate_key(pk1) < 0 || crypto_pk_generate_key(pk2) < 0 ||
+      tor_tls_context_init(TOR_TLS_CTX_IS_PUBLIC_SERVER, pk1, pk2,
+                           86400) < 0) {
+    puts("Couldn't set up TLS");
+    goto done;
+  }
+  for (n_open = 0; n_open < n_pairs; ++n_open) {
+    out[n_open] = buf_new();
+    in[n_open] = buf_new();
+    if (bench_tls_pair(&client[n_open], &server[n_open]) < 0) {
+      puts("Couldn't open TLS connections");
+      ++n_open;
+      goto done;
+    }
+  }
+
+  for (k = 0; thread_counts[k] >= 0; ++k) {
+    uint64_t start, end, moved = 0;
+    int round;
+
+    if (tls_dataplane_init(thread_counts[k]) < 0) {
+      puts("Couldn't start the data plane");
+      goto done;
+    }
+    reset_perftime();
+    start = perftime();
+    for (round = 0; round < rounds; ++round) {
+      for (i = 0; i < n_pairs; ++i) {
+        buf_add(out[i], data, per_round);
+        flushlen[i] = buf_datalen(out[i]);
+        tls_dataplane_prepare_flush(out[i], client[i], flushlen[i],
+                                    &flushlen[i], i);
+      }
+      tls_dataplane_start();
+      tls_dataplane_finish();
+      tls_dataplane_clear_results();
+      for (i = 0; i < n_pairs; ++i)
+        tls_dataplane_prepare_read(in[i], server[i], per_round * 4, i);
+      tls_dataplane_start();
+      tls_dataplane_finish();
+      tls_dataplane_clear_results();
+      for (i = 0; i < n_pairs; ++i) {
+        moved += buf_datalen(in[i]);
+        buf_drain(in[i], buf_datalen(in[i]));
+      }
+    }
+    end = perftime();
+    tls_dataplane_free_all();
+    printf("%d data-plane threads, %d connections: %.3f nsec per byte\n",
+           thread_counts[k], n_pairs, NANOCOUNT(start, end, moved));
+  }
+
+ done:
+  for (i = 0; i < n_open; ++i) {
+    tor_tls_free(client[i]);
+    tor_tls_free(server[i]);
+    buf_free(out[i]);
+    buf_free(in[i]);
+  }
+  crypto_pk_free(pk1);
+  crypto_pk_free(pk2);
+  tor_free(client);
+  tor_free(server);
+  tor_free(out);
+  tor_free(in);
+  tor_free(flushlen);
+  tor_free(data);
+}
+#endif /* !defined(_WIN32) */
+
+/** Number of replies that bench_workqueue() has processed so far, and the
+ * number that it is waiting for. */
+static int bench_wq_n_replies = 0;
+static int bench_wq_n_items = 0;
+
+/** Work function for bench_workqueue(): a small piece of hashing, so that
+ * the cost of handing out the work is visible. */
+static workqueue_reply_t
+bench_wq_work(void *state, void *arg)
+{
+  uint8_t *data = arg;
+  (void)state;
+  crypto_digest256((char*)data, (const char*)data, 64, DIGEST_SHA256);
+  return WQ_RPL_REPLY;
+}
+
+static void
+bench_wq_reply(void *arg)
+{
+  tor_free(arg);
+  ++bench_wq_n_replies;
+}
+
+static void
+bench_wq_replies_processed(threadpool_t *tp)
+{
+  (void)tp;
+  if (bench_wq_n_replies >= bench_wq_n_items)
+    tor_libevent_exit_loop_after_callback(tor_libevent_get_base());
+}
+
+static workqueue_reply_t
+bench_wq_shutdown(void *state, void *arg)
+{
+  (void)state;
+  (void)arg;
+  return WQ_RPL_SHUTDOWN;
+}
+
+static void *
+bench_wq_new_state(void *arg)
+{
+  return arg;
+}
+
+static void
+bench_wq_free_state(void *arg)
+{
+  (void)arg;
+}
+
+/** Return a new argument for bench_wq_work(). */
+static void *
+bench_wq_new_small_arg(int i)
+{
+  (void)i;
+  return tor_malloc_zero(DIGEST256_LEN * 2);
+}
+
+/** Queue <b>n_items</b> pieces of work, running <b>fn</b> on the argument
+ * that <b>new_arg</b> returns for each, on a new pool of <b>n_threads</b>
+ * threads, and wait for all the replies.  One in eight pieces of work is
+ * low-priority.  Return the number of nanoseconds that took, and fill in
+ * *<b>stats_out</b>; or return -1 if we couldn't make the pool. */
+static int64_t
+bench_wq_run(int n_threads, int n_items,
+             workqueue_reply_t (*fn)(void *, void *),
+             void *(*new_arg)(int), replyqueue_stats_t *stats_out)
+{
+  replyqueue_t *rq = replyqueue_new(0);
+  threadpool_t *tp;
+  monotime_t start, end;
+  int i;
+
+  if (!tor_libevent_is_initialized()) {
+    tor_libevent_cfg_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    tor_libevent_initialize(&cfg);
+  }
+  if (!rq)
+    return -1;
+  tp = threadpool_new(n_threads, rq,
+                      bench_wq_new_state, bench_wq_free_state, NULL);
+  if (!tp ||
+      threadpool_register_reply_event(tp, bench_wq_replies_processed) < 0)
+    return -1;
+
+  bench_wq_n_items = n_items;
+  bench_wq_n_replies = 0;
+  monotime_get(&start);
+  for (i = 0; i < n_items; ++i) {
+    threadpool_queue_work_priority(tp, (i & 7) ? WQ_PRI_HIGH : WQ_PRI_LOW,
+                                   fn, bench_wq_reply, new_arg(i));
+  }
+  tor_libevent_run_event_loop(tor_libevent_get_base(), 0);
+  monotime_get(&end);
+  replyqueue_get_stats(rq, stats_out);
+
+  /* There's no way to free a threadpool; just stop its threads. */
+  threadpool_queue_update(tp, NULL, bench_wq_shutdown, NULL, NULL);
+  return monotime_diff_nsec(&start, &end);
+}
+
+/** Run benchmarks of threadpool throughput, as we add worker threads. */
+static void
+bench_workqueue(void)
+{
+  const int n_items = 100000;
+  const int thread_counts[] = { 1, 2, 4, 8, 16, -1 };
+  int k;
+
+  for (k = 0; thread_counts[k] > 0; ++k) {
+    replyqueue_stats_t stats;
+    int64_t nsec = bench_wq_run(thread_counts[k], n_items, bench_wq_work,
+                                bench_wq_new_small_arg, &stats);
+    if (nsec < 0) {
+      puts("Couldn't make a threadpool");
+      return;
+    }
+    printf("%d threads: %.2f usec per work item (wall clock); "
+           "%.4f wakeups per reply\n",
+           thread_counts[k], nsec / 1000.0 / n_items,
+           ((double)stats.n_alerts) / stats.n_replies);
+  }
+}
+
+/** A CPU-bound job for bench_workqueue_scaling(). */
+typedef struct bench_wq_job_t {
+  /** Data to hash. */
+  uint8_t data[DIGEST256_LEN * 2];
+  /** Number of times to hash it. */
+  int rounds;
+} bench_wq_job_t;
+
+/** Work function for bench_workqueue_scaling(): hash a buffer over and
+ * over, to stand in for a job like an onion-skin handshake. */
+static workqueue_reply_t
+bench_wq_heavy_work(void *state, void *arg)
+{
+  bench_wq_job_t *job = arg;
+  int i;
+  (void)state;
+  for (i = 0; i < job->rounds; ++i) {
+    crypto_digest256((char*)job->data, (const char*)job->data,
+                     sizeof(job->data), DIGEST_SHA256);
+  }
+  return WQ_RPL_REPLY;
+}
+
+/** Return a job of the average size for bench_workqueue_scaling(). */
+static void *
+bench_wq_new_uniform_job(int i)
+{
+  bench_wq_job_t *job = tor_malloc_zero(sizeof(bench_wq_job_t));
+  (void)i;
+  job->rounds = 128;
+  return job;
+}
+
+/** Return a job for bench_workqueue_scaling(), where one job in eight is
+ * nine times as big as the others, and the average is the same as for
+ * bench_wq_new_uniform_job(). */
+static void *
+bench_wq_new_skewed_job(int i)
+{
+  bench_wq_job_t *job = tor_malloc_zero(sizeof(bench_wq_job_t));
+  job->rounds = (i % 8 == 3) ? 576 : 64;
+  return job;
+}
+
+/** Run benchmarks of how threadpool throughput for CPU-bound jobs scales
+ * with the number of threads, when every job is the same size, and when
+ * a few are much bigger than the rest.  Work is queued on threads at
+ * random, so with big jobs some threads would fall behind while others
+ * went idle, if idle threads didn't steal from busy ones.  On a machine
+ * with enough cores, the speedup should track the number of threads in
+ * both cases. */
+static void
+bench_workqueue_scaling(void)
+{
+  const int n_items = 10000;
+  int n_cpus = compute_num_cpus();
+  const struct {
+    const char *name;
+    void *(*new_job)(int);
+  } shapes[] = {
+    { "uniform", bench_wq_new_uniform_job },
+    { "skewed", bench_wq_new_skewed_job },
+    { NULL, NULL },
+  };
+  int k, n_threads;
+
+  if (n_cpus < 1)
+    n_cpus = 1;
+  printf("%d CPUs\n", n_cpus);
+  for (k = 0; shapes[k].name; ++k) {
+    int64_t base_nsec = 0;
+    for (n_threads = 1; n_threads <= 16; n_threads *= 2) {
+      replyqueue_stats_t stats;
+      const int64_t nsec = bench_wq_run(n_threads, n_items,
+                                        bench_wq_heavy_work,
+                                        shapes[k].new_job, &stats);
+      double speedup;
+      if (nsec < 0) {
+        puts("Couldn't make a threadpool");
+        return;
+      }
+      if (n_threads == 1)
+        base_nsec = nsec;
+      speedup = ((double)base_nsec) / nsec;
+      printf("%-7s jobs, %2d threads: %8.0f jobs/sec; speedup %.2f; "
+             "efficiency %.2f\n",
+             shapes[k].name, n_threads, n_items * 1e9 / nsec, speedup,
+             speedup / MIN(n_threads, n_cpus));
+    }
+  }
+}
+
+/** Run benchmarks comparing the cell pool with plain malloc and free for
+ * packed_cell_t allocation.  Each cell is packed after it is allocated, as
+ * packed_cell_copy() does: malloc has to hand out a zeroed cell, but the
+ * pool leaves that to cell_pack(). */
+static void
+bench_cell_pool(void)
+{
+  const int batch_sizes[] = { 1, 64, 1024, 16384, 0 };
+  const int total = 1<<21;
+  packed_cell_t **cells = tor_calloc(16384, sizeof(packed_cell_t *));
+  cell_t cell;
+  uint64_t start, end;
+  int i, j, k;
+
+  memset(&cell, 0, sizeof(cell));
+  cell.command = CELL_RELAY;
+  crypto_rand((char*)cell.payload, sizeof(cell.payload));
+
+  reset_perftime();
+  for (k = 0; batch_sizes[k]; ++k) {
+    const int batch = batch_sizes[k];
+    const int rounds = total / batch;
+
+    start = perftime();
+    for (i = 0; i < rounds; ++i) {
+      for (j = 0; j < batch; ++j) {
+        cells[j] = tor_malloc_zero(sizeof(packed_cell_t));
+        cell_pack(cells[j], &cell, 1);
+      }
+      for (j = 0; j < batch; ++j)
+        tor_free(cells[j]);
+    }
+    end = perftime();
+    printf("malloc, %5d cells at a time: %.2f ns per alloc/free\n",
+           batch, NANOCOUNT(start, end, total));
+
+    start = perftime();
+    for (i = 0; i < rounds; ++i) {
+      for (j = 0; j < batch; ++j) {
+        cells[j] = cell_pool_alloc();
+        cell_pack(cells[j], &cell, 1);
+      }
+      for (j = 0; j < batch; ++j)
+        cell_pool_release(cells[j]);
+    }
+    end = perftime();
+    printf("pool,   %5d cells at a time: %.2f ns per alloc/free\n",
+           batch, NANOCOUNT(start, end, total));
+  }
+
+  cell_pool_free_all();
+  tor_free(cells);
+}
+
+/** Channel write_packed_cell() method for bench_cmux_flush(): accept and
+ * discard every cell. */
+static int
+bench_write_packed_cell(channel_t *chan, packed_cell_t *cell)
+{
+  (void)chan;
+  (void)cell;
+  return 0;
+}
+
+/** Benchmark queueing cells on many circuits and flushing them onto a
+ * channel through its circuitmux. */
+static void
+bench_cmux_flush(void)
+{
+  const int n_circs = 100;
+  const int cells_per_circ = 1000;
+  const int rounds = 16;
+  const int n_cells = n_circs * cells_per_circ;
+  or_circuit_t **circs = tor_calloc(n_circs, sizeof(or_circuit_t *));
+  channel_t *chan = tor_malloc_zero(sizeof(channel_t));
+  uint64_t start, end, append_ns = 0, flush_ns = 0;
+  cell_t cell;
+  int i, j, r, n_flushed;
+
+  channel_init(chan);
+  chan->state = CHANNEL_STATE_OPEN;
+  chan->write_packed_cell = bench_write_packed_cell;
+  chan->cmux = circuitmux_alloc();
+  circuitmux_set_policy(chan->cmux, &ewma_policy);
+
+  for (i = 0; i < n_circs; ++i) {
+    circs[i] = or_circuit_new(0, NULL);
+    circuit_set_n_circid_chan(TO_CIRCUIT(circs[i]), i + 1, chan);
+  }
+
+  memset(&cell, 0, sizeof(cell));
+  cell.command = CELL_RELAY;
+  crypto_rand((char*)cell.payload, sizeof(cell.payload));
+
+  reset_perftime();
+  for (r = 0; r < rounds; ++r) {
+    start = perftime();
+    for (i = 0; i < n_circs; ++i) {
+      circuit_t *circ = TO_CIRCUIT(circs[i]);
+      for (j = 0; j < cells_per_circ; ++j) {
+        cell_queue_append_packed_copy(circ, &circ->n_chan_cells, 1, &cell,
+                                      1, 0);
+      }
+      update_circuit_on_cmux(circ, CELL_DIRECTION_OUT);
+    }
+    end = perftime();
+    append_ns += end - start;
+
+    start = perftime();
+    n_flushed = 0;
+    while (n_flushed < n_cells) {
+      int n = channel_flush_from_first_active_circuit(chan, 1000);
+      if (n <= 0)
+        break;
+      n_flushed += n;
+    }
+    end = perftime();
+    flush_ns += end - start;
+    tor_assert(n_flushed == n_cells);
+  }
+
+  printf("Queue %d cells on each of %d circuits: %.2f ns per cell\n",
+         cells_per_circ, n_circs,
+         NANOCOUNT(0, append_ns, (uint64_t)n_cells * rounds));
+  printf("Flush them through the circuitmux: %.2f ns per cell\n",
+         NANOCOUNT(0, flush_ns, (uint64_t)n_cells * rounds));
+
+  circuit_free_all();
+  circuitmux_free(chan->cmux);
+  tor_free(chan);
+  tor_free(circs);
+}
+
 static void
 bench_dh(void)
 {
@@ -738,6 +1760,593 @@ bench_md_parse(void)
   printf("Microdesc parse: %f nsec\n", NANOCOUNT(start, end, N));
 }
 
+/** Return a new, signed router descriptor, with its own ed25519 and ntor
+ * keys, but with the RSA keys in <b>identity_key</b> and
+ * <b>onion_key</b>. */
+static char *
+make_bench_routerdesc(int idx, crypto_pk_t *identity_key,
+                      crypto_pk_t *onion_key)
+{
+  routerinfo_t *ri = tor_malloc_zero(sizeof(routerinfo_t));
+  ed25519_keypair_t id_kp, signing_kp;
+  curve25519_keypair_t ntor_kp;
+  const time_t now = time(NULL);
+  char *desc;
+
+  ed25519_keypair_generate(&id_kp, 0);
+  ed25519_keypair_generate(&signing_kp, 0);
+  curve25519_keypair_generate(&ntor_kp, 0);
+
+  tor_asprintf(&ri->nickname, "bench%d", idx);
+  ri->platform = tor_strdup("Tor 0.4.4.0-alpha-dev on Linux");
+  ri->addr = 0x0a000000u + idx;
+  ri->or_port = 9001;
+  ri->bandwidthrate = ri->bandwidthburst = ri->bandwidthcapacity = 1 << 20;
+  ri->cache_info.published_on = now;
+  ri->identity_pkey = crypto_pk_dup_key(identity_key);
+  router_set_rsa_onion_pkey(onion_key, &ri->onion_pkey, &ri->onion_pkey_len);
+  ri->onion_curve25519_pkey = tor_memdup(&ntor_kp.pubkey,
+                                         sizeof(curve25519_public_key_t));
+  ri->cache_info.signing_key_cert =
+    tor_cert_create(&id_kp, CERT_TYPE_ID_SIGNING, &signing_kp.pubkey,
+                    now, 86400, CERT_FLAG_INCLUDE_SIGNING_KEY);
+
+  desc = router_dump_router_to_string(ri, identity_key, onion_key,
+                                      &ntor_kp, &signing_kp);
+  routerinfo_free(ri);
+  return desc;
+}
+
+static void
+bench_routerdesc_parse(void)
+{
+  const int n_descs = 2000;
+  crypto_pk_t *identity_key = crypto_pk_new(), *onion_key = crypto_pk_new();
+  smartlist_t *descs = smartlist_new();
+  smartlist_t *parsed = smartlist_new();
+  uint64_t start, end;
+  char *all;
+  const char *cp;
+  int i;
+
+  crypto_pk_generate_key(identity_key);
+  crypto_pk_generate_key(onion_key);
+  for (i = 0; i < n_descs; ++i) {
+    char *desc = make_bench_routerdesc(i, identity_key, onion_key);
+    tor_assert(desc);
+    smartlist_add(descs, desc);
+  }
+  all = smartlist_join_strings(descs, "", 0, NULL);
+
+  reset_perftime();
+  start = perftime();
+  SMARTLIST_FOREACH_BEGIN(descs, const char *, desc) {
+    routerinfo_t *ri = router_parse_entry_from_string(desc, NULL, 0, 0,
+                                                      NULL, NULL);
+    tor_assert(ri);
+    routerinfo_free(ri);
+  } SMARTLIST_FOREACH_END(desc);
+  end = perftime();
+  printf("Router descriptor parse, one at a time: %.2f usec/desc\n",
+         NANOCOUNT(start, end, n_descs) / 1e3);
+
+  start = perftime();
+  cp = all;
+  router_parse_list_from_string(&cp, NULL, parsed, SAVED_NOWHERE, 0, 0,
+                                NULL, NULL);
+  end = perftime();
+  tor_assert(smartlist_len(parsed) == n_descs);
+  printf("Router descriptor parse, %d at once: %.2f usec/desc\n",
+         n_descs, NANOCOUNT(start, end, n_descs) / 1e3);
+  SMARTLIST_FOREACH(parsed, routerinfo_t *, ri, routerinfo_free(ri));
+  smartlist_clear(parsed);
+
+#ifndef _WIN32
+  {
+    /* Now do it again the way we would when reloading our cache, with every
+     * descriptor already in the verified-digest journal. */
+    or_options_t *options = get_options_mutable();
+    char dir[] = "/tmp/tor-bench-XXXXXX";
+    char *old_datadir = options->DataDirectory;
+    char *old_cachedir = options->CacheDirectory;
+    char *fname;
+    tor_assert(mkdtemp(dir));
+    options->DataDirectory = options->CacheDirectory = dir;
+    tor_assert(verified_digests_load() == 0);
+    cp = all;
+    router_parse_list_from_string(&cp, NULL, parsed, SAVED_NOWHERE, 0, 0,
+                                  NULL, NULL);
+    SMARTLIST_FOREACH(parsed, routerinfo_t *, ri, routerinfo_free(ri));
+    smartlist_clear(parsed);
+
+    start = perftime();
+    cp = all;
+    router_parse_list_from_string(&cp, NULL, parsed, SAVED_NOWHERE, 0, 0,
+                                  NULL, NULL);
+    end = perftime();
+    tor_assert(smartlist_len(parsed) == n_descs);
+    printf("Router descriptor parse, %d at once, already verified: "
+           "%.2f usec/desc\n",
+           n_descs, NANOCOUNT(start, end, n_descs) / 1e3);
+    SMARTLIST_FOREACH(parsed, routerinfo_t *, ri, routerinfo_free(ri));
+    smartlist_clear(parsed);
+
+    verified_digests_free_all();
+    fname = get_datadir_fname("verified-digests-key");
+    unlink(fname);
+    tor_free(fname);
+    rmdir(dir);
+    options->DataDirectory = old_datadir;
+    options->CacheDirectory = old_cachedir;
+  }
+#endif /* !defined(_WIN32) */
+
+  smartlist_free(parsed);
+  SMARTLIST_FOREACH(descs, char *, desc, tor_free(desc));
+  smartlist_free(descs);
+  tor_free(all);
+  crypto_pk_free(identity_key);
+  crypto_pk_free(onion_key);
+}
+
+#ifndef _WIN32
+/** Return the text of an unsigned microdescriptor consensus listing
+ * <b>n</b> routers. */
+static char *
+make_bench_consensus(int n)
+{
+  smartlist_t *chunks = smartlist_new();
+  const time_t now = time(NULL);
+  char published[ISO_TIME_LEN+1], fresh_until[ISO_TIME_LEN+1];
+  char valid_until[ISO_TIME_LEN+1], id[DIGEST_LEN], md[DIGEST256_LEN];
+  char id64[BASE64_DIGEST_LEN+1], md64[BASE64_DIGEST256_LEN+1];
+  char sig[256], sig64[512];
+  char *result;
+  int i;
+
+  crypto_rand(sig, sizeof(sig));
+  base64_encode(sig64, sizeof(sig64), sig, sizeof(sig),
+                BASE64_ENCODE_MULTILINE);
+
+  format_iso_time(published, now);
+  format_iso_time(fresh_until, now + 3600);
+  format_iso_time(valid_until, now + 3*3600);
+  smartlist_add_asprintf(chunks,
+      "network-status-version 3 microdesc\n"
+      "vote-status consensus\n"
+      "consensus-method 28\n"
+      "valid-after %s\nfresh-until %s\nvalid-until %s\n"
+      "voting-delay 300 300\n"
+      "known-flags Exit Fast Guard HSDir Running Stable V2Dir Valid\n"
+      "dir-source bench %s 127.0.0.1 127.0.0.1 9030 9001\n"
+      "contact nobody\n"
+      "vote-digest %s\n",
+      published, fresh_until, valid_until,
+      "0123456789ABCDEF0123456789ABCDEF01234567",
+      "0123456789ABCDEF0123456789ABCDEF01234567");
+  for (i = 0; i < n; ++i) {
+    crypto_rand(md, sizeof(md));
+    memset(id, 0, sizeof(id));
+    set_uint32(id, htonl(i));
+    digest_to_base64(id64, id);
+    digest256_to_base64(md64, md);
+    smartlist_add_asprintf(chunks,
+        "r bench%d %s %s 10.%d.%d.%d 9001 0\n"
+        "a [2001:db8::%x]:9001\n"
+        "m %s\n"
+        "s Fast Guard Running Stable Valid\n"
+        "v Tor 0.4.3.5\n"
+        "pr Cons=1-2 Desc=1-2 DirCache=1-2 HSDir=1-2 HSIntro=3-5 "
+        "HSRend=1-2 Link=1-5 LinkAuth=1,3 Microdesc=1-2 Relay=1-2\n"
+        "w Bandwidth=%d\n",
+        i, id64, published, (i >> 16) & 255, (i >> 8) & 255, i & 255,
+        i, md64, 1000 + i);
+  }
+  smartlist_add_asprintf(chunks,
+      "directory-footer\n"
+      "directory-signature sha256 %s %s\n"
+      "-----BEGIN SIGNATURE-----\n"
+      "%s"
+      "-----END SIGNATURE-----\n",
+      "0123456789ABCDEF0123456789ABCDEF01234567",
+      "0123456789ABCDEF0123456789ABCDEF01234567", sig64);
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+/** Return the text of <b>n</b> different microdescriptors. */
+static char *
+make_bench_microdescs(int n)
+{
+  smartlist_t *chunks = smartlist_new();
+  char *result;
+  int i;
+  for (i = 0; i < n; ++i) {
+    smartlist_add_asprintf(chunks,
+      "onion-key\n"
+      "-----BEGIN RSA PUBLIC KEY-----\n"
+      "MIGJAoGBAMHkZeXNDX/49JqM2BVLmh1Fnb5iMVnatvZZTLJyedqDLkbXZ1WKP5oh\n"
+      "7ec14dj/k3ntpwHD4s2o3Lb6nfagWbug4+F/rNJ7JuFru/PSyOvDyHGNAuegOXph\n"
+      "3gTGjdDpv/yPoiadGebbVe8E7n6hO+XxM2W/4dqheKimF0/s9B7HAgMBAAE=\n"
+      "-----END RSA PUBLIC KEY-----\n"
+      "ntor-onion-key QgF/EjqlNG1wRHLIop/nCekEH+ETGZSgYOhu26eiTF4=\n"
+      "family $00E9A86E7733240E60D8435A7BBD634A23894098 "
+      "$329BD7545DEEEBBDC8C4285F243916F248972102\n"
+      "p accept 53,80,443,%d\n"
+      "id ed25519 BzffzY99z6Q8KltcFlUTLWjNTBU7yKK+uQhyi1Ivb3A\n",
+      1024 + i);
+  }
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+static void
+bench_nodelist_snapshot(void)
+{
+  const int n = 7000;
+  or_options_t *options = get_options_mutable();
+  char dir[] = "/tmp/tor-bench-XXXXXX";
+  char *old_datadir = options->DataDirectory;
+  char *old_cachedir = options->CacheDirectory;
+  char *consensus = make_bench_consensus(n);
+  char *mds = make_bench_microdescs(n);
+  const char *files[] = { "cached-microdesc-consensus.snapshot",
+                          "cached-microdescs", "cached-microdescs.new",
+                          "cached-microdescs.snapshot",
+                          "verified-digests-key", NULL };
+  microdesc_cache_t *cache;
+  smartlist_t *added;
+  networkstatus_t *ns;
+  uint64_t start, end;
+  int i, pass;
+
+  tor_assert(mkdtemp(dir));
+  options->DataDirectory = options->CacheDirectory = dir;
+
+  /* Save snapshots of everything. */
+  tor_assert(verified_digests_load() == 0);
+  nodelist_snapshot_enable();
+  ns = networkstatus_parse_vote_from_string(consensus, strlen(consensus),
+                                            NULL, NS_TYPE_CONSENSUS);
+  tor_assert(ns && smartlist_len(ns->routerstatus_list) == n);
+  tor_assert(nodelist_snapshot_save_routerstatuses(ns) == 0);
+  networkstatus_vote_free(ns);
+  cache = get_microdesc_cache();
+  added = microdescs_add_to_cache(cache, mds, NULL, SAVED_NOWHERE, 0,
+                                  time(NULL), NULL);
+  tor_assert(smartlist_len(added) == n);
+  smartlist_free(added);
+  tor_assert(microdesc_cache_rebuild(cache, 1) == 0);
+
+  for (pass = 0; pass < 2; ++pass) {
+    const char *how = pass ? "from snapshot" : "from text";
+    if (pass)
+      nodelist_snapshot_enable();
+    else
+      nodelist_snapshot_free_all();
+
+    reset_perftime();
+    start = perftime();
+    ns = networkstatus_parse_vote_from_string(consensus, strlen(consensus),
+                                              NULL, NS_TYPE_CONSENSUS);
+    end = perftime();
+    tor_assert(ns && smartlist_len(ns->routerstatus_list) == n);
+    networkstatus_vote_free(ns);
+    printf("Load %d-entry consensus %s: %.2f msec\n",
+           n, how, NANOCOUNT(start, end, 1) / 1e6);
+
+    start = perftime();
+    tor_assert(microdesc_cache_reload(cache) == 0);
+    end = perftime();
+    printf("Load %d microdescriptors %s: %.2f msec\n",
+           n, how, NANOCOUNT(start, end, 1) / 1e6);
+  }
+
+  nodelist_snapshot_free_all();
+  verified_digests_free_all();
+  microdesc_free_all();
+  for (i = 0; files[i]; ++i) {
+    char *fname = get_cachedir_fname(files[i]);
+    unlink(fname);
+    tor_free(fname);
+  }
+  rmdir(dir);
+  options->DataDirectory = old_datadir;
+  options->CacheDirectory = old_cachedir;
+  tor_free(consensus);
+  tor_free(mds);
+}
+
+static void
+bench_consensus_parse(void)
+{
+  const int n = 7000, iters = 10;
+  char *consensus = make_bench_consensus(n);
+  networkstatus_t *ns;
+  uint64_t start, end;
+  int i, pass;
+
+  if (!tor_libevent_is_initialized()) {
+    tor_libevent_cfg_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    tor_libevent_initialize(&cfg);
+  }
+
+  for (pass = 0; pass < 2; ++pass) {
+    if (pass) {
+      /* Pretend to have more CPUs than we may really have, so that we
+       * measure the overhead of splitting the work up too. */
+      if (get_num_cpus(get_options()) < 4)
+        get_options_mutable()->NumCPUs = 4;
+      tor_assert(init_keys_client() == 0);
+      cpu_init();
+    }
+    reset_perftime();
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      ns = networkstatus_parse_vote_from_string(consensus, strlen(consensus),
+                                                NULL, NS_TYPE_CONSENSUS);
+      tor_assert(ns && smartlist_len(ns->routerstatus_list) == n);
+      networkstatus_vote_free(ns);
+    }
+    end = perftime();
+    printf("Parse %d-entry consensus with %d worker threads: %.2f msec\n",
+           n, cpuworker_get_n_threads(),
+           NANOCOUNT(start, end, iters) / 1e6);
+  }
+
+  tor_free(consensus);
+}
+
+/** Helper for bench_dirparse: report how fast we parsed <b>len</b> bytes
+ * of <b>what</b>, <b>iters</b> times between <b>start</b> and
+ * <b>end</b>. */
+static void
+report_parse_throughput(const char *what, size_t len, int iters,
+                        uint64_t start, uint64_t end)
+{
+  double nsec = NANOCOUNT(start, end, iters);
+  printf("%-20s %8.2f msec  %7.1f MB/s\n",
+         what, nsec / 1e6, len / nsec * 1e3);
+}
+
+static void
+bench_dirparse(void)
+{
+  const int n = 7000, iters = 10;
+  char *consensus = make_bench_consensus(n);
+  char *mds = make_bench_microdescs(n);
+  uint64_t start, end;
+  int i;
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    networkstatus_t *ns = networkstatus_parse_vote_from_string(consensus,
+                                  strlen(consensus), NULL, NS_TYPE_CONSENSUS);
+    tor_assert(ns && smartlist_len(ns->routerstatus_list) == n);
+    networkstatus_vote_free(ns);
+  }
+  end = perftime();
+  report_parse_throughput("Consensus:", strlen(consensus), iters,
+                          start, end);
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    smartlist_t *parsed = microdescs_parse_from_string(mds, NULL, 1,
+                                                       SAVED_NOWHERE, NULL);
+    tor_assert(smartlist_len(parsed) == n);
+    SMARTLIST_FOREACH(parsed, microdesc_t *, md, microdesc_free(md));
+    smartlist_free(parsed);
+  }
+  end = perftime();
+  report_parse_throughput("Microdescriptors:", strlen(mds), iters,
+                          start, end);
+
+  tor_free(consensus);
+  tor_free(mds);
+}
+
+/** Remove from <b>cons</b>, as made by make_bench_consensus(), the entries
+ * for the routers from <b>lo</b> up to <b>hi</b> whose number has the same
+ * parity as <b>parity</b>. */
+static void
+remove_bench_routers(char *cons, int lo, int hi, int parity)
+{
+  char needle[64];
+  int i;
+  for (i = lo; i < hi; ++i) {
+    if ((i & 1) != parity)
+      continue;
+    tor_snprintf(needle, sizeof(needle), "\nr bench%d ", i);
+    char *entry = strstr(cons, needle);
+    tor_assert(entry);
+    char *next = strstr(entry + 1, "\nr ");
+    if (!next)
+      next = strstr(entry + 1, "\ndirectory-footer");
+    tor_assert(next);
+    memmove(entry, next, strlen(next) + 1);
+  }
+}
+
+static void
+bench_consdiff(void)
+{
+  const int n = 7000, iters = 10;
+  char *cons1 = make_bench_consensus(n);
+  char *cons2 = make_bench_consensus(n);
+  char *diff = NULL, *applied;
+  uint64_t start, end;
+  int i;
+
+  /* Every "m" line differs between these two, so there is one change in
+   * each router entry. */
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    tor_free(diff);
+    diff = consensus_diff_generate(cons1, strlen(cons1),
+                                   cons2, strlen(cons2));
+    tor_assert(diff);
+  }
+  end = perftime();
+  printf("Generate: %.2f msec for a %d-byte diff\n",
+         NANOCOUNT(start, end, iters) / 1e6, (int)strlen(diff));
+
+  applied = consensus_diff_apply(cons1, strlen(cons1), diff, strlen(diff));
+  tor_assert(applied && !strcmp(applied, cons2));
+
+  /* Now also make the two consensuses list different routers over a long
+   * run, so that there's no router entry in common to anchor the diff. */
+  remove_bench_routers(cons1, 2000, 2600, 1);
+  remove_bench_routers(cons2, 2000, 2600, 0);
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    tor_free(diff);
+    diff = consensus_diff_generate(cons1, strlen(cons1),
+                                   cons2, strlen(cons2));
+    tor_assert(diff);
+  }
+  end = perftime();
+  printf("Generate, with churn: %.2f msec for a %d-byte diff\n",
+         NANOCOUNT(start, end, iters) / 1e6, (int)strlen(diff));
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    tor_free(applied);
+    applied = consensus_diff_apply(cons1, strlen(cons1),
+                                   diff, strlen(diff));
+    tor_assert(applied);
+  }
+  end = perftime();
+  printf("Apply, with churn: %.2f msec for a %d-byte consensus\n",
+         NANOCOUNT(start, end, iters) / 1e6, (int)strlen(applied));
+  tor_assert(!strcmp(applied, cons2));
+
+  tor_free(applied);
+  tor_free(diff);
+  tor_free(cons1);
+  tor_free(cons2);
+}
+
+/** Return the text of <b>n</b> microdescriptors, each with its own random
+ * keys, so that they compress about as well as real ones. */
+static char *
+make_bench_random_microdescs(int n)
+{
+  smartlist_t *chunks = smartlist_new();
+  char rsa[140], ntor[32], ed[32], fam[DIGEST_LEN];
+  char rsa64[256], ntor64[64], ed64[64], fam16[HEX_DIGEST_LEN+1];
+  char *result;
+  int i;
+  for (i = 0; i < n; ++i) {
+    crypto_rand(rsa, sizeof(rsa));
+    crypto_rand(ntor, sizeof(ntor));
+    crypto_rand(ed, sizeof(ed));
+    crypto_rand(fam, sizeof(fam));
+    base64_encode(rsa64, sizeof(rsa64), rsa, sizeof(rsa),
+                  BASE64_ENCODE_MULTILINE);
+    base64_encode(ntor64, sizeof(ntor64), ntor, sizeof(ntor), 0);
+    base64_encode_nopad(ed64, sizeof(ed64), (uint8_t*)ed, sizeof(ed));
+    base16_encode(fam16, sizeof(fam16), fam, sizeof(fam));
+    smartlist_add_asprintf(chunks,
+      "onion-key\n"
+      "-----BEGIN RSA PUBLIC KEY-----\n"
+      "%s"
+      "-----END RSA PUBLIC KEY-----\n"
+      "ntor-onion-key %s\n"
+      "%s%s%s"
+      "p %s\n"
+      "id ed25519 %s\n",
+      rsa64, ntor64,
+      (i % 4) ? "" : "family $", (i % 4) ? "" : fam16, (i % 4) ? "" : "\n",
+      (i % 3) ? "reject 1-65535" : "accept 80,443", ed64);
+  }
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+/** Compress <b>doc</b> with every method we support, and report how big
+ * and how slow each one is. */
+static void
+bench_compress_one_doc(const char *name, const char *doc)
+{
+  const compress_method_t methods[] = {
+    ZLIB_METHOD, LZMA_METHOD, ZSTD_METHOD, ZSTD_DICT_METHOD
+  };
+  const size_t len = strlen(doc);
+  const int iters = (len < 100000) ? 200 : 5;
+  unsigned u;
+  int i;
+
+  printf("%s (%d bytes):\n", name, (int)len);
+  for (u = 0; u < ARRAY_LENGTH(methods); ++u) {
+    const compress_method_t method = methods[u];
+    char *out = NULL, *back = NULL;
+    size_t out_len = 0, back_len = 0;
+    uint64_t start, end;
+    if (!tor_compress_supports_method(method))
+      continue;
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      tor_free(out);
+      tor_assert(!tor_compress(&out, &out_len, doc, len, method));
+    }
+    end = perftime();
+    tor_assert(!tor_uncompress(&back, &back_len, out, out_len, method,
+                               1, LOG_WARN));
+    tor_assert(back_len == len && fast_memeq(back, doc, len));
+    printf("  %-38s %8d bytes  %9.1f usec\n",
+           compression_method_get_human_name(method), (int)out_len,
+           NANOCOUNT(start, end, iters) / 1e3);
+    tor_free(out);
+    tor_free(back);
+  }
+}
+
+static void
+bench_compress_dirdoc(void)
+{
+  char *cons1 = make_bench_consensus(7000);
+  char *cons2 = make_bench_consensus(7000);
+  char *diff, *mds;
+
+  reset_perftime();
+  bench_compress_one_doc("Consensus", cons1);
+
+  remove_bench_routers(cons1, 2000, 2100, 1);
+  remove_bench_routers(cons2, 2000, 2100, 0);
+  diff = consensus_diff_generate(cons1, strlen(cons1), cons2, strlen(cons2));
+  tor_assert(diff);
+  bench_compress_one_doc("Consensus diff", diff);
+  tor_free(diff);
+
+  /* Clients ask for at most 90 microdescriptors at a time, or 500 over a
+   * tunneled connection. */
+  mds = make_bench_random_microdescs(500);
+  bench_compress_one_doc("500 microdescriptors", mds);
+  tor_free(mds);
+  mds = make_bench_random_microdescs(90);
+  bench_compress_one_doc("90 microdescriptors", mds);
+  tor_free(mds);
+  mds = make_bench_random_microdescs(10);
+  bench_compress_one_doc("10 microdescriptors", mds);
+  tor_free(mds);
+  mds = make_bench_random_microdescs(1);
+  bench_compress_one_doc("1 microdescriptor", mds);
+  tor_free(mds);
+
+  tor_free(cons1);
+  tor_free(cons2);
+}
+#endif /* !defined(_WIN32) */
+
 typedef void (*bench_fn)(void);
 
 typedef struct benchmark_t {
@@ -759,7 +2368,24 @@ static struct benchmark_t benchmarks[] = {
   ENT(rand),
 
   ENT(cell_aes),
+  ENT(cell_aes_batch),
   ENT(cell_ops),
+  ENT(cell_pool),
+  ENT(cell_inbuf),
+  ENT(buf_move),
+#ifndef _WIN32
+  ENT(buf_socket),
+  ENT(buf_spool),
+#endif
+#if !defined(_WIN32) && defined(HAVE_BUF_URING)
+  ENT(buf_uring),
+#endif
+#ifndef _WIN32
+  ENT(tls_dataplane),
+#endif
+  ENT(workqueue),
+  ENT(workqueue_scaling),
+  ENT(cmux_flush),
   ENT(dh),
 
 #ifdef ENABLE_OPENSSL
@@ -768,6 +2394,14 @@ static struct benchmark_t benchmarks[] = {
 #endif
 
   ENT(md_parse),
+  ENT(routerdesc_parse),
+#ifndef _WIN32
+  ENT(nodelist_snapshot),
+  ENT(consensus_parse),
+  ENT(dirparse),
+  ENT(consdiff),
+  ENT(compress_dirdoc),
+#endif
   {NULL,NULL,0}
 };
 
@@ -853,6 +2487,8 @@ main(int argc, const char **argv)
     tor_free(errmsg);
     return 1;
   }
+  /* As in tor_init(): index the tokenizer's tables. */
+  routerparse_init();
 
   for (benchmark_t *b = benchmarks; b->name; ++b) {
     if (b->enabled || n_enabled == 0) {
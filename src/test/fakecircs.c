@@ -13,6 +13,7 @@
 #include "core/or/or.h"
 
 #include "core/crypto/relay_crypto.h"
+#include "core/or/cell_queue.h"
 #include "core/or/channel.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
@@ -19,11 +19,20 @@ mock_consensus_compute_digest_(const char *c, size_t len,
   return 0;
 }
 
+static int
+mock_consensus_digest_eq_(const uint8_t *a, const uint8_t *b)
+{
+  (void)a;
+  (void)b;
+  return 1;
+}
+
 int
 fuzz_init(void)
 {
   MOCK(consensus_compute_digest, mock_consensus_compute_digest_);
   MOCK(consensus_compute_digest_as_signed, mock_consensus_compute_digest_);
+  MOCK(consensus_digest_eq, mock_consensus_digest_eq_);
   return 0;
 }
 
@@ -32,6 +41,7 @@ fuzz_cleanup(void)
 {
   UNMOCK(consensus_compute_digest);
   UNMOCK(consensus_compute_digest_as_signed);
+  UNMOCK(consensus_digest_eq);
   return 0;
 }
 
@@ -35,6 +35,8 @@
 #define CIRCUITLIST_PRIVATE
 #define MAINLOOP_PRIVATE
 #define STATEFILE_PRIVATE
+#define CPUWORKER_PRIVATE
+#define ONION_QUEUE_PRIVATE
 
 #include "core/or/or.h"
 #include "lib/err/backtrace.h"
@@ -49,6 +51,7 @@
 #include "feature/rend/rendparse.h"
 #include "test/test.h"
 #include "core/mainloop/mainloop.h"
+#include "core/mainloop/cpuworker.h"
 #include "lib/memarea/memarea.h"
 #include "core/or/onion.h"
 #include "core/crypto/onion_ntor.h"
@@ -64,6 +67,7 @@
 #include "feature/rend/rend_intro_point_st.h"
 #include "feature/rend/rend_service_descriptor_st.h"
 #include "feature/relay/onion_queue.h"
+#include "feature/relay/router.h"
 
 /** Run unit tests for the onion handshake code. */
 static void
@@ -270,6 +274,71 @@ test_ntor_handshake(void *arg)
   dimap_free(s_keymap, NULL);
 }
 
+/** Run unit tests for answering several ntor handshakes at once. */
+static void
+test_ntor_handshake_batch(void *arg)
+{
+#define N_BATCH 11
+  ntor_handshake_state_t *c_states[N_BATCH];
+  uint8_t c_bufs[N_BATCH][NTOR_ONIONSKIN_LEN];
+  uint8_t c_keys[400];
+  const uint8_t *onion_skins[N_BATCH];
+
+  di_digest256_map_t *s_keymap=NULL;
+  curve25519_keypair_t s_keypair, other_keypair;
+  uint8_t s_bufs[N_BATCH][NTOR_REPLY_LEN];
+  uint8_t s_keys[N_BATCH][400];
+  uint8_t *replies[N_BATCH], *keys[N_BATCH];
+  int results[N_BATCH];
+
+  uint8_t node_id[20] = "abcdefghijklmnopqrst";
+  int i;
+
+  (void) arg;
+  memset(c_states, 0, sizeof(c_states));
+
+  curve25519_keypair_generate(&s_keypair, 0);
+  curve25519_keypair_generate(&other_keypair, 0);
+  dimap_add_entry(&s_keymap, s_keypair.pubkey.public_key, &s_keypair);
+
+  for (i = 0; i < N_BATCH; ++i) {
+    /* Handshake 3 is for a key we don't have; handshake 7 is for someone
+     * else's identity. */
+    tt_int_op(0, OP_EQ, onion_skin_ntor_create(node_id,
+                          i == 3 ? &other_keypair.pubkey : &s_keypair.pubkey,
+                          &c_states[i], c_bufs[i]));
+    if (i == 7)
+      c_bufs[i][0] ^= 1;
+    onion_skins[i] = c_bufs[i];
+    replies[i] = s_bufs[i];
+    keys[i] = s_keys[i];
+  }
+
+  onion_skin_ntor_server_handshake_batch(N_BATCH, onion_skins, s_keymap,
+                                         NULL, node_id, replies, keys,
+                                         400, results);
+
+  for (i = 0; i < N_BATCH; ++i) {
+    if (i == 3 || i == 7) {
+      tt_int_op(-1, OP_EQ, results[i]);
+      continue;
+    }
+    tt_int_op(0, OP_EQ, results[i]);
+    memset(c_keys, 0, sizeof(c_keys));
+    tt_int_op(0, OP_EQ, onion_skin_ntor_client_handshake(c_states[i],
+                                       s_bufs[i], c_keys, 400, NULL));
+    tt_mem_op(c_keys, OP_EQ, s_keys[i], 400);
+  }
+  /* Every handshake got its own keys. */
+  tt_mem_op(s_keys[0], OP_NE, s_keys[1], 400);
+
+ done:
+  for (i = 0; i < N_BATCH; ++i)
+    ntor_handshake_state_free(c_states[i]);
+  dimap_free(s_keymap, NULL);
+#undef N_BATCH
+}
+
 static void
 test_fast_handshake(void *arg)
 {
@@ -354,6 +423,230 @@ test_onion_queues(void *arg)
   tor_free(onionskin);
 }
 
+/** Run unit tests for the histogram of onion queue delays. */
+static void
+test_onion_queue_delay_hist(void *arg)
+{
+  onion_queue_stats_t *stats = tor_malloc_zero(sizeof(*stats));
+  uint64_t v;
+  unsigned i;
+  (void)arg;
+
+  /* Tiny waits get a bucket each. */
+  for (i = 0; i < 8; ++i) {
+    tt_uint_op(i,OP_EQ, onion_queue_delay_bucket(i));
+    tt_u64_op(i,OP_EQ, onion_queue_delay_bucket_max(i));
+  }
+  tt_uint_op(8,OP_EQ, onion_queue_delay_bucket(8));
+  tt_uint_op(8,OP_EQ, onion_queue_delay_bucket(9));
+  tt_uint_op(9,OP_EQ, onion_queue_delay_bucket(10));
+  tt_u64_op(9,OP_EQ, onion_queue_delay_bucket_max(8));
+
+  /* Every wait lands in a bucket whose bounds hold it, and which is
+   * never more than 25% wide. */
+  for (v = 4; v < UINT32_MAX; v = v * 5 / 4 + 1) {
+    i = onion_queue_delay_bucket(v);
+    tt_u64_op(v,OP_LE, onion_queue_delay_bucket_max(i));
+    tt_u64_op(v,OP_GT, onion_queue_delay_bucket_max(i - 1));
+    tt_u64_op(onion_queue_delay_bucket_max(i),OP_LE,
+              (onion_queue_delay_bucket_max(i - 1) + 1) * 5 / 4);
+  }
+  tt_uint_op(ONION_QUEUE_N_DELAY_BUCKETS - 1,OP_EQ,
+             onion_queue_delay_bucket(UINT64_MAX));
+
+  /* No waits, no percentiles. */
+  tt_u64_op(0,OP_EQ, onion_queue_delay_percentile(stats, 50));
+
+  /* 90 short waits and 10 long ones. */
+  stats->delay_hist[onion_queue_delay_bucket(1000)] = 90;
+  stats->delay_hist[onion_queue_delay_bucket(300000)] = 10;
+  stats->n_processed = 100;
+  v = onion_queue_delay_percentile(stats, 50);
+  tt_u64_op(v,OP_GE, 1000);
+  tt_u64_op(v,OP_LT, 1250);
+  tt_u64_op(v,OP_EQ, onion_queue_delay_percentile(stats, 90));
+  v = onion_queue_delay_percentile(stats, 91);
+  tt_u64_op(v,OP_GE, 300000);
+  tt_u64_op(v,OP_LT, 375000);
+  tt_u64_op(v,OP_EQ, onion_queue_delay_percentile(stats, 100));
+
+ done:
+  tor_free(stats);
+}
+
+/** Run unit tests for the CoDel decision on the onion queues. */
+static void
+test_onion_queue_codel(void *arg)
+{
+  onion_queue_codel_t codel;
+  const uint64_t target = 100000, interval = 1000000;
+  (void)arg;
+
+  memset(&codel, 0, sizeof(codel));
+
+  /* Short waits are always fine. */
+  tt_int_op(0,OP_EQ, onion_queue_codel_ok_to_drop(&codel, 1000, 100,
+                                                   0, target, interval));
+  tt_int_op(0,OP_EQ, codel.above_target);
+
+  /* A long wait starts the clock... */
+  tt_int_op(0,OP_EQ, onion_queue_codel_ok_to_drop(&codel, 200000, 100,
+                                                   10, target, interval));
+  tt_int_op(1,OP_EQ, codel.above_target);
+  tt_u64_op(10 + interval,OP_EQ, codel.first_above_usec);
+  tt_int_op(0,OP_EQ, onion_queue_codel_ok_to_drop(&codel, 200000, 100,
+                                                   interval, target,
+                                                   interval));
+  /* ...and if the waits stay long for an interval, we may drop. */
+  tt_int_op(1,OP_EQ, onion_queue_codel_ok_to_drop(&codel, 200000, 100,
+                                                   interval + 10, target,
+                                                   interval));
+  /* But never the last onionskin in the queue. */
+  tt_int_op(0,OP_EQ, onion_queue_codel_ok_to_drop(&codel, 200000, 1,
+                                                   interval + 20, target,
+                                                   interval));
+  tt_int_op(0,OP_EQ, codel.above_target);
+
+  /* One short wait resets the clock. */
+  tt_int_op(0,OP_EQ, onion_queue_codel_ok_to_drop(&codel, 200000, 100,
+                                                   interval * 2, target,
+                                                   interval));
+  tt_int_op(0,OP_EQ, onion_queue_codel_ok_to_drop(&codel, 1000, 100,
+                                                   interval * 3, target,
+                                                   interval));
+  tt_int_op(0,OP_EQ, onion_queue_codel_ok_to_drop(&codel, 200000, 100,
+                                                   interval * 4, target,
+                                                   interval));
+
+ done:
+  ;
+}
+
+/** Make sure that the onion queues drop stale onionskins from their heads
+ * once they have stayed slow for a while. */
+static void
+test_onion_queue_codel_drops(void *arg)
+{
+  uint8_t buf[NTOR_ONIONSKIN_LEN] = {0};
+  or_circuit_t *circs[4];
+  create_cell_t *onionskin = NULL;
+  or_options_t *options = get_options_mutable();
+  int i;
+  (void)arg;
+
+  options->OnionQueueTargetDelay = 100;
+  options->OnionQueueDropInterval = 1000;
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(1000*1000*1000);
+
+  for (i = 0; i < 4; ++i) {
+    create_cell_t *create = tor_malloc_zero(sizeof(create_cell_t));
+    create_cell_init(create, CELL_CREATE, ONION_HANDSHAKE_TYPE_NTOR,
+                     NTOR_ONIONSKIN_LEN, buf);
+    circs[i] = or_circuit_new(0, NULL);
+    circs[i]->base_.purpose = CIRCUIT_PURPOSE_OR;
+    tt_int_op(0,OP_EQ, onion_pending_add(circs[i], create));
+  }
+
+  /* The first slow onionskin only starts the clock. */
+  monotime_coarse_set_mock_time_nsec(INT64_C(1200)*1000*1000);
+  tt_ptr_op(circs[0],OP_EQ, onion_next_task(&onionskin));
+  tor_free(onionskin);
+  tt_int_op(3,OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+
+  /* A drop interval later, we drop one and move on to the next. */
+  monotime_coarse_set_mock_time_nsec(INT64_C(2300)*1000*1000);
+  tt_ptr_op(circs[2],OP_EQ, onion_next_task(&onionskin));
+  tor_free(onionskin);
+  tt_assert(TO_CIRCUIT(circs[1])->marked_for_close);
+  tt_ptr_op(NULL,OP_EQ, circs[1]->onionqueue_entry);
+  tt_int_op(0,OP_EQ, TO_CIRCUIT(circs[2])->marked_for_close);
+
+  /* We never drop the last one. */
+  monotime_coarse_set_mock_time_nsec(INT64_C(9000)*1000*1000);
+  tt_ptr_op(circs[3],OP_EQ, onion_next_task(&onionskin));
+  tor_free(onionskin);
+  tt_int_op(0,OP_EQ, TO_CIRCUIT(circs[3])->marked_for_close);
+  tt_int_op(0,OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+
+ done:
+  clear_pending_onions();
+  monotime_disable_test_mocking();
+  tor_free(onionskin);
+  circuit_free_all();
+}
+
+/** Run unit tests for sizing batches of cpuworker onionskins. */
+static void
+test_cpuworker_batch_size(void *arg)
+{
+  (void)arg;
+
+  /* A short queue gets handed out one onionskin at a time. */
+  tt_int_op(1,OP_EQ, cpuworker_get_batch_size(0, 2));
+  tt_int_op(1,OP_EQ, cpuworker_get_batch_size(1, 2));
+  tt_int_op(1,OP_EQ, cpuworker_get_batch_size(7, 4));
+
+  /* A longer one is shared out, two jobs per thread. */
+  tt_int_op(2,OP_EQ, cpuworker_get_batch_size(8, 2));
+  tt_int_op(5,OP_EQ, cpuworker_get_batch_size(43, 4));
+  tt_int_op(10,OP_EQ, cpuworker_get_batch_size(20, 0));
+
+  /* But no job is ever bigger than CPUWORKER_MAX_BATCH. */
+  tt_int_op(CPUWORKER_MAX_BATCH,OP_EQ, cpuworker_get_batch_size(10000, 2));
+  tt_int_op(CPUWORKER_MAX_BATCH,OP_EQ,
+            cpuworker_get_batch_size(4 * CPUWORKER_MAX_BATCH, 2));
+
+ done:
+  ;
+}
+
+/** Helper for test_cpuworker_run_parallel: count a call in the int at
+ * <b>arg</b>. */
+static void
+count_parallel_call(void *arg)
+{
+  int *count = arg;
+  ++*count;
+}
+
+/** Run unit tests for running jobs in parallel on the cpuworkers. */
+static void
+test_cpuworker_run_parallel(void *arg)
+{
+  int counts[64];
+  void *args[64];
+  int i, round;
+  (void)arg;
+
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i < 64; ++i)
+    args[i] = &counts[i];
+
+  /* Without a threadpool, we make every call ourselves. */
+  tt_int_op(0,OP_EQ, cpuworker_get_n_threads());
+  cpuworker_run_parallel(count_parallel_call, args, 64);
+  for (i = 0; i < 64; ++i)
+    tt_int_op(1,OP_EQ, counts[i]);
+
+  /* With one, every call still happens exactly once before we return,
+   * however the work gets shared out. */
+  tt_int_op(0,OP_EQ, init_keys_client());
+  cpu_init();
+  tt_int_op(cpuworker_get_n_threads(),OP_GE, 2);
+  for (round = 0; round < 50; ++round)
+    cpuworker_run_parallel(count_parallel_call, args, 1 + round % 64);
+  for (i = 0; i < 64; ++i) {
+    int expected = 1;
+    for (round = 0; round < 50; ++round)
+      expected += (i < 1 + round % 64);
+    tt_int_op(expected,OP_EQ, counts[i]);
+  }
+
+ done:
+  ;
+}
+
 static void
 test_circuit_timeout(void *arg)
 {
@@ -647,7 +940,13 @@ static struct testcase_t test_array[] = {
   ENT(onion_handshake),
   { "bad_onion_handshake", test_bad_onion_handshake, 0, NULL, NULL },
   ENT(onion_queues),
+  ENT(onion_queue_delay_hist),
+  ENT(onion_queue_codel),
+  FORK(onion_queue_codel_drops),
+  ENT(cpuworker_batch_size),
+  FORK(cpuworker_run_parallel),
   { "ntor_handshake", test_ntor_handshake, 0, NULL, NULL },
+  { "ntor_handshake_batch", test_ntor_handshake_batch, 0, NULL, NULL },
   { "fast_handshake", test_fast_handshake, 0, NULL, NULL },
   FORK(circuit_timeout),
   FORK(rend_fns),
@@ -730,6 +1029,7 @@ struct testgroup_t testgroups[] = {
   { "mainloop/", mainloop_tests },
   { "netinfo/", netinfo_tests },
   { "nodelist/", nodelist_tests },
+  { "nodelist/snapshot/", nodelist_snapshot_tests },
   { "oom/", oom_tests },
   { "oos/", oos_tests },
   { "options/", options_tests },
@@ -775,5 +1075,6 @@ struct testgroup_t testgroups[] = {
   { "util/logging/", logging_tests },
   { "util/process/", util_process_tests },
   { "util/thread/", thread_tests },
+  { "verified_digests/", verified_digests_tests },
   END_OF_GROUPS
 };
@@ -7,6 +7,8 @@
 #define PROTO_HTTP_PRIVATE
 #include "core/or/or.h"
 #include "lib/buf/buffers.h"
+#include "lib/net/buffers_net.h"
+#include "lib/net/buffers_uring.h"
 #include "lib/tls/buffers_tls.h"
 #include "lib/tls/tortls.h"
 #include "lib/compress/compress.h"
@@ -209,6 +211,8 @@ test_buffer_pullup(void *arg)
   const char *cp;
   size_t sz;
   (void)arg;
+  /* Freed chunks must really be freed for the totals below to add up. */
+  buf_set_freelist_cap(0);
   stuff = tor_malloc(16384);
   tmp = tor_malloc(16384);
 
@@ -375,6 +379,8 @@ test_buffer_allocation_tracking(void *arg)
   int i;
 
   (void)arg;
+  /* Freed chunks must really be freed for the totals below to add up. */
+  buf_set_freelist_cap(0);
 
   crypto_rand(junk, 16384);
   tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
@@ -435,6 +441,471 @@ test_buffer_allocation_tracking(void *arg)
   tor_free(junk);
 }
 
+static void
+test_buffer_move_splice(void *arg)
+{
+  char *data = tor_malloc(40000);
+  char *out = tor_malloc(40000);
+  buf_t *buf_in = NULL, *buf_out = NULL;
+  chunk_t *moved;
+  size_t r, alloc;
+  int i;
+
+  (void)arg;
+  buf_set_freelist_cap(0);
+  crypto_rand(data, 40000);
+
+  buf_in = buf_new();
+  buf_out = buf_new();
+  /* Ten full 4k chunks on buf_in, and a nearly-full chunk on buf_out. */
+  for (i = 0; i < 10; ++i)
+    buf_add(buf_in, data + i*4000, 4000);
+  tt_int_op(buf_allocation(buf_in), OP_EQ, 10*4096);
+  buf_add(buf_out, data, 4000);
+  alloc = buf_get_total_allocation();
+
+  /* Move the first two chunks and part of a third.  The whole chunks are
+   * spliced over, not copied. */
+  moved = buf_in->head;
+  r = 9000;
+  tt_int_op(buf_move_to_buf(buf_out, buf_in, &r), OP_EQ, 9000);
+  tt_int_op(r, OP_EQ, 0);
+  tt_ptr_op(buf_out->head->next, OP_EQ, moved);
+  tt_int_op(buf_datalen(buf_in), OP_EQ, 31000);
+  tt_int_op(buf_datalen(buf_out), OP_EQ, 13000);
+  buf_assert_ok(buf_in);
+  buf_assert_ok(buf_out);
+  /* Only the 1000-byte tail needed a new chunk. */
+  tt_int_op(buf_get_total_allocation(), OP_EQ, alloc + 4096);
+
+  /* A small move lands in the space at the end of buf_out. */
+  r = 1000;
+  tt_int_op(buf_move_to_buf(buf_out, buf_in, &r), OP_EQ, 1000);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, alloc + 4096);
+
+  /* Move everything else. */
+  r = 100000;
+  tt_int_op(buf_move_to_buf(buf_out, buf_in, &r), OP_EQ, 30000);
+  tt_int_op(r, OP_EQ, 70000);
+  tt_int_op(buf_datalen(buf_in), OP_EQ, 0);
+  tt_ptr_op(buf_in->head, OP_EQ, NULL);
+  tt_ptr_op(buf_in->tail, OP_EQ, NULL);
+  buf_assert_ok(buf_in);
+  buf_assert_ok(buf_out);
+
+  tt_int_op(buf_get_bytes(buf_out, out, 4000), OP_EQ, 40000);
+  tt_mem_op(out, OP_EQ, data, 4000);
+  tt_int_op(buf_get_bytes(buf_out, out, 40000), OP_EQ, 0);
+  tt_mem_op(out, OP_EQ, data, 40000);
+
+  /* An empty tail on buf_out is dropped, not left mid-list. */
+  buf_free(buf_in);
+  buf_in = buf_new_with_capacity(16000);
+  buf_add(buf_in, data, 16000);
+  tt_int_op(buf_allocation(buf_in), OP_EQ, 16384);
+  buf_add_chunk_with_capacity(buf_out, 100, 1);
+  tt_int_op(buf_out->tail->datalen, OP_EQ, 0);
+  moved = buf_in->head;
+  r = 16000;
+  tt_int_op(buf_move_to_buf(buf_out, buf_in, &r), OP_EQ, 16000);
+  tt_ptr_op(buf_out->head, OP_EQ, moved);
+  tt_ptr_op(buf_out->tail, OP_EQ, moved);
+  buf_assert_ok(buf_out);
+  tt_int_op(buf_get_bytes(buf_out, out, 16000), OP_EQ, 0);
+  tt_mem_op(out, OP_EQ, data, 16000);
+
+ done:
+  buf_free(buf_in);
+  buf_free(buf_out);
+  tor_free(data);
+  tor_free(out);
+}
+
+/** Release function for test_buffer_external(): count the calls. */
+static void
+count_external_free(void *arg)
+{
+  ++*(int *)arg;
+}
+
+static void
+test_buffer_external(void *arg)
+{
+  char *data = tor_malloc(20000);
+  char *out = tor_malloc(20000);
+  buf_t *buf = NULL, *buf2 = NULL, *copy = NULL;
+  const char *head;
+  size_t len, r, alloc0;
+  int n_freed = 0;
+
+  (void)arg;
+  buf_set_freelist_cap(0);
+  crypto_rand(data, 20000);
+  alloc0 = buf_get_total_allocation();
+
+  /* Some ordinary data, then 16000 bytes by reference, then more ordinary
+   * data, which can't go into the referenced chunk. */
+  buf = buf_new();
+  buf_add(buf, data, 1000);
+  tt_int_op(buf_add_external(buf, data + 1000, 16000,
+                             count_external_free, &n_freed), OP_EQ, 17000);
+  tt_assert(CHUNK_IS_EXTERNAL(buf->tail));
+  tt_ptr_op(buf->tail->data, OP_EQ, data + 1000);
+  tt_int_op(buf_slack(buf), OP_EQ, 0);
+  buf_add(buf, data + 17000, 3000);
+  tt_int_op(buf_datalen(buf), OP_EQ, 20000);
+  buf_assert_ok(buf);
+  /* The referenced bytes cost only a chunk header. */
+  tt_int_op(buf_allocation(buf), OP_LT, 2*4096 + 100);
+  tt_int_op(buf_get_total_allocation(), OP_EQ,
+            alloc0 + buf_allocation(buf));
+
+  /* Adding nothing by reference releases the reference right away. */
+  tt_int_op(buf_add_external(buf, data, 0, count_external_free, &n_freed),
+            OP_EQ, 20000);
+  tt_int_op(n_freed, OP_EQ, 1);
+  n_freed = 0;
+
+  /* A copy gets its own memory. */
+  copy = buf_copy(buf);
+  buf_assert_ok(copy);
+  tt_assert(! CHUNK_IS_EXTERNAL(copy->head->next));
+  tt_int_op(buf_get_bytes(copy, out, 20000), OP_EQ, 0);
+  tt_mem_op(out, OP_EQ, data, 20000);
+
+  /* Draining part of the referenced chunk keeps it. */
+  tt_int_op(buf_get_bytes(buf, out, 5000), OP_EQ, 15000);
+  tt_mem_op(out, OP_EQ, data, 5000);
+  tt_assert(CHUNK_IS_EXTERNAL(buf->head));
+  tt_int_op(n_freed, OP_EQ, 0);
+
+  /* Moving the whole chunk hands over the reference, not the bytes. */
+  buf2 = buf_new();
+  r = 12000;
+  tt_int_op(buf_move_to_buf(buf2, buf, &r), OP_EQ, 12000);
+  tt_assert(CHUNK_IS_EXTERNAL(buf2->head));
+  tt_ptr_op(buf2->head->data, OP_EQ, data + 5000);
+  tt_int_op(n_freed, OP_EQ, 0);
+  buf_assert_ok(buf);
+  buf_assert_ok(buf2);
+
+  /* Pulling up across it copies into a chunk of our own, and releases the
+   * reference. */
+  buf_add(buf2, data + 17000, 100);
+  buf_pullup(buf2, 12050, &head, &len);
+  tt_int_op(len, OP_EQ, 12050);
+  tt_mem_op(head, OP_EQ, data + 5000, 12050);
+  tt_assert(! CHUNK_IS_EXTERNAL(buf2->head));
+  tt_int_op(n_freed, OP_EQ, 1);
+  buf_assert_ok(buf2);
+
+  /* Freeing a buffer releases its references. */
+  buf_clear(buf2);
+  buf_add_external(buf2, data, 100, count_external_free, &n_freed);
+  buf_add_external(buf2, data, 100, count_external_free, &n_freed);
+  buf_free(buf2);
+  tt_int_op(n_freed, OP_EQ, 3);
+
+  buf_free(buf);
+  buf_free(copy);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, alloc0);
+
+ done:
+  buf_free(buf);
+  buf_free(buf2);
+  buf_free(copy);
+  tor_free(data);
+  tor_free(out);
+}
+
+#if defined(HAVE_SYS_UIO_H) && defined(HAVE_READV) && defined(HAVE_WRITEV)
+#define HAVE_SCATTER_GATHER
+#endif
+
+/* Move data through a socketpair with buf_flush_to_socket() and
+ * buf_read_from_socket(), with or without readv()/writev(). */
+static void
+test_buffer_socket_io(void *arg)
+{
+  const int scatter_gather = !strcmp(arg, "sg");
+  tor_socket_t fds[2] = {TOR_INVALID_SOCKET, TOR_INVALID_SOCKET};
+  char *data = tor_malloc(40000);
+  char *out = tor_malloc(40000);
+  buf_t *buf = NULL, *buf2 = NULL;
+  buf_net_stats_t st0, st;
+  size_t flushlen, alloc;
+  int eof = 0, err = 0, i;
+
+  buf_set_freelist_cap(0);
+  buf_net_set_scatter_gather(scatter_gather);
+  crypto_rand(data, 40000);
+  tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(fds[0]), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(fds[1]), OP_EQ, 0);
+
+  /* Flush ten chunks' worth of data. */
+  buf = buf_new();
+  for (i = 0; i < 10; ++i)
+    buf_add(buf, data + i*4000, 4000);
+  tt_int_op(buf_allocation(buf), OP_EQ, 10*4096);
+  flushlen = 40000;
+  buf_net_get_stats(&st0);
+  tt_int_op(buf_flush_to_socket(buf, fds[0], 40000, &flushlen),
+            OP_EQ, 40000);
+  tt_int_op(flushlen, OP_EQ, 0);
+  tt_int_op(buf_datalen(buf), OP_EQ, 0);
+  buf_net_get_stats(&st);
+  tt_u64_op(st.n_bytes_written - st0.n_bytes_written, OP_EQ, 40000);
+#ifdef HAVE_SCATTER_GATHER
+  tt_u64_op(st.n_write_calls - st0.n_write_calls, OP_EQ,
+            scatter_gather ? 1 : 10);
+#endif
+
+  /* Read it back onto a buffer whose tail chunk is partly full. */
+  buf2 = buf_new();
+  buf_add(buf2, "x", 1);
+  buf_net_get_stats(&st0);
+  tt_int_op(buf_read_from_socket(buf2, fds[1], 8000, &eof, &err),
+            OP_EQ, 8000);
+  buf_net_get_stats(&st);
+  tt_u64_op(st.n_bytes_read - st0.n_bytes_read, OP_EQ, 8000);
+#ifdef HAVE_SCATTER_GATHER
+  tt_u64_op(st.n_read_calls - st0.n_read_calls, OP_EQ,
+            scatter_gather ? 1 : 2);
+#endif
+  tt_int_op(buf_read_from_socket(buf2, fds[1], 40000, &eof, &err),
+            OP_EQ, 32000);
+  tt_int_op(eof, OP_EQ, 0);
+  buf_assert_ok(buf2);
+  tt_int_op(buf_get_bytes(buf2, out, 1), OP_EQ, 40000);
+  tt_int_op(out[0], OP_EQ, 'x');
+  tt_int_op(buf_get_bytes(buf2, out, 40000), OP_EQ, 0);
+  tt_mem_op(out, OP_EQ, data, 40000);
+
+  /* Nothing more to read: no data, and no stray chunks left behind. */
+  buf_add(buf2, "x", 1);
+  alloc = buf_allocation(buf2);
+  tt_int_op(buf_read_from_socket(buf2, fds[1], 40000, &eof, &err),
+            OP_EQ, 0);
+  tt_int_op(eof, OP_EQ, 0);
+  tt_int_op(buf_datalen(buf2), OP_EQ, 1);
+  tt_int_op(buf_allocation(buf2), OP_EQ, alloc);
+  buf_assert_ok(buf2);
+
+  /* EOF. */
+  tor_close_socket(fds[0]);
+  fds[0] = TOR_INVALID_SOCKET;
+  tt_int_op(buf_read_from_socket(buf2, fds[1], 40000, &eof, &err),
+            OP_EQ, 0);
+  tt_int_op(eof, OP_EQ, 1);
+  tt_int_op(buf_allocation(buf2), OP_EQ, alloc);
+
+ done:
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  buf_net_set_scatter_gather(true);
+  buf_free(buf);
+  buf_free(buf2);
+  tor_free(data);
+  tor_free(out);
+}
+
+/* Read and write several buffers with a single io_uring batch, and collect
+ * the results through buf_read_from_socket() and buf_flush_to_socket(). */
+static void
+test_buffer_uring(void *arg)
+{
+  tor_socket_t a[2] = {TOR_INVALID_SOCKET, TOR_INVALID_SOCKET};
+  tor_socket_t b[2] = {TOR_INVALID_SOCKET, TOR_INVALID_SOCKET};
+  char *data = tor_malloc(40000);
+  char *out = tor_malloc(40000);
+  buf_t *buf = NULL, *buf2 = NULL, *buf3 = NULL;
+  buf_uring_stats_t st0, st;
+  buf_net_stats_t nst0, nst;
+  size_t flushlen, alloc, written;
+  int eof = 0, err = 0, i;
+  (void)arg;
+
+  if (buf_uring_init(64) < 0)
+    tt_skip();
+  crypto_rand(data, 40000);
+  tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, a), OP_EQ, 0);
+  tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, b), OP_EQ, 0);
+  for (i = 0; i < 2; ++i) {
+    tt_int_op(set_socket_nonblocking(a[i]), OP_EQ, 0);
+    tt_int_op(set_socket_nonblocking(b[i]), OP_EQ, 0);
+  }
+
+  /* One batch: a write of ten chunks, which gets as many of them as one
+   * operation may touch, and a read from an idle socket. */
+  buf = buf_new();
+  for (i = 0; i < 10; ++i)
+    buf_add(buf, data + i*4000, 4000);
+  buf2 = buf_new();
+  buf_add(buf2, "x", 1);
+  alloc = buf_allocation(buf2);
+  flushlen = 40000;
+  buf_uring_get_stats(&st0);
+  buf_net_get_stats(&nst0);
+  buf_uring_prepare_flush(buf, a[0], 40000, &flushlen);
+  buf_uring_prepare_read(buf2, b[1], 40000);
+  tt_int_op(buf_uring_submit(), OP_EQ, 0);
+  buf_uring_get_stats(&st);
+  tt_u64_op(st.n_enter_calls - st0.n_enter_calls, OP_EQ, 1);
+  written = (size_t)(st.n_bytes_written - st0.n_bytes_written);
+  tt_u64_op(written, OP_GT, 0);
+  tt_u64_op(written, OP_LT, 40000);
+  tt_int_op(flushlen, OP_EQ, 40000 - written);
+  tt_int_op(buf_datalen(buf), OP_EQ, 40000 - written);
+  tt_int_op(buf_allocation(buf2), OP_EQ, alloc);
+  buf_assert_ok(buf);
+  buf_assert_ok(buf2);
+
+  /* Collecting the results costs no system calls. */
+  tt_int_op(buf_flush_to_socket(buf, a[0], 40000, &flushlen), OP_EQ, written);
+  tt_int_op(flushlen, OP_EQ, 40000 - written);
+  tt_int_op(buf_read_from_socket(buf2, b[1], 40000, &eof, &err), OP_EQ, 0);
+  tt_int_op(eof, OP_EQ, 0);
+  buf_net_get_stats(&nst);
+  tt_u64_op(nst.n_write_calls, OP_EQ, nst0.n_write_calls);
+  tt_u64_op(nst.n_read_calls, OP_EQ, nst0.n_read_calls);
+  /* Each result can only be collected once. */
+  tt_int_op(buf_flush_to_socket(buf, a[0], flushlen, &flushlen),
+            OP_EQ, 40000 - written);
+  tt_int_op(flushlen, OP_EQ, 0);
+  buf_uring_clear_results();
+
+  /* Read everything back, and see EOF on the other pair. */
+  tor_close_socket(b[0]);
+  b[0] = TOR_INVALID_SOCKET;
+  buf3 = buf_new();
+  buf_uring_prepare_read(buf3, a[1], 40000);
+  buf_uring_prepare_read(buf2, b[1], 40000);
+  tt_int_op(buf_uring_submit(), OP_EQ, 0);
+  tt_int_op(buf_datalen(buf3), OP_EQ, 40000);
+  tt_int_op(buf_read_from_socket(buf2, b[1], 40000, &eof, &err), OP_EQ, 0);
+  tt_int_op(eof, OP_EQ, 1);
+  tt_int_op(buf_read_from_socket(buf3, a[1], 40000, &eof, &err),
+            OP_EQ, 40000);
+  buf_assert_ok(buf3);
+  tt_int_op(buf_get_bytes(buf3, out, 40000), OP_EQ, 0);
+  tt_mem_op(out, OP_EQ, data, 40000);
+  buf_uring_clear_results();
+
+  /* A forgotten result is never collected; the data stays on the buffer. */
+  buf_add(buf, "hello", 5);
+  flushlen = 5;
+  buf_uring_prepare_flush(buf, a[0], 5, &flushlen);
+  tt_int_op(buf_uring_submit(), OP_EQ, 0);
+  tt_int_op(flushlen, OP_EQ, 0);
+  buf_uring_forget(buf);
+  buf_uring_prepare_read(buf3, a[1], 40000);
+  tt_int_op(buf_uring_submit(), OP_EQ, 0);
+  tt_int_op(buf_flush_to_socket(buf, a[0], 0, &flushlen), OP_EQ, 0);
+  tt_int_op(buf_read_from_socket(buf3, a[1], 40000, &eof, &err), OP_EQ, 5);
+  tt_int_op(buf_get_bytes(buf3, out, 5), OP_EQ, 0);
+  tt_mem_op(out, OP_EQ, "hello", 5);
+  buf_uring_clear_results();
+
+ done:
+  buf_uring_free_all();
+  for (i = 0; i < 2; ++i) {
+    if (SOCKET_OK(a[i]))
+      tor_close_socket(a[i]);
+    if (SOCKET_OK(b[i]))
+      tor_close_socket(b[i]);
+  }
+  buf_free(buf);
+  buf_free(buf2);
+  buf_free(buf3);
+  tor_free(data);
+  tor_free(out);
+}
+
+static void
+test_buffer_freelists(void *arg)
+{
+  char *junk = tor_malloc_zero(4000);
+  char *summary = NULL, *expected = NULL;
+  buf_t *buf = NULL;
+  buf_freelist_stats_t st0, st;
+  int i;
+
+  (void)arg;
+
+  buf_set_freelist_cap(0);
+  tt_int_op(buf_get_freelist_stats(1234, &st0), OP_EQ, -1);
+  /* Other code may have used buffers already: count from here. */
+  tt_int_op(buf_get_freelist_stats(4096, &st0), OP_EQ, 0);
+  tt_int_op(st0.cur_length, OP_EQ, 0);
+
+  /* Room for three 4k chunks. */
+  buf_set_freelist_cap(3*4096);
+
+  buf = buf_new();
+  for (i = 0; i < 4; ++i)
+    buf_add(buf, junk, 4000);
+  tt_int_op(buf_allocation(buf), OP_EQ, 4*4096);
+  buf_free(buf);
+
+  /* Three chunks were kept; the fourth went over the cap. */
+  tt_int_op(buf_get_freelist_stats(4096, &st), OP_EQ, 0);
+  tt_int_op(st.cur_length, OP_EQ, 3);
+  tt_u64_op(st.n_alloc - st0.n_alloc, OP_EQ, 4);
+  tt_u64_op(st.n_hit - st0.n_hit, OP_EQ, 0);
+  tt_u64_op(st.n_free - st0.n_free, OP_EQ, 4);
+  tt_u64_op(st.n_cached - st0.n_cached, OP_EQ, 3);
+  /* Cached chunks count towards the total. */
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 3*4096);
+
+  /* New chunks come from the free-list. */
+  buf = buf_new();
+  buf_add(buf, junk, 4000);
+  buf_add(buf, junk, 4000);
+  tt_int_op(buf_get_freelist_stats(4096, &st), OP_EQ, 0);
+  tt_int_op(st.cur_length, OP_EQ, 1);
+  tt_u64_op(st.n_alloc - st0.n_alloc, OP_EQ, 6);
+  tt_u64_op(st.n_hit - st0.n_hit, OP_EQ, 2);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 3*4096);
+
+  summary = buf_get_freelist_summary();
+  tor_asprintf(&expected, "4096 cached=1 alloc=%"PRIu64" hit=%"PRIu64" ",
+               st.n_alloc, st.n_hit);
+  tt_assert(!strcmpstart(summary, expected));
+  tt_assert(strstr(summary, " hit-rate="));
+  tt_assert(strstr(summary, "\n8192 cached=0 "));
+  tt_assert(strstr(summary, "\n16384 cached=0 "));
+  buf_free(buf);
+
+  /* Shrinking releases half of each free-list at a time. */
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 3*4096);
+  tt_int_op(buf_shrink_freelists(0), OP_EQ, 2*4096);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 4096);
+  tt_int_op(buf_shrink_freelists(0), OP_EQ, 4096);
+  tt_int_op(buf_shrink_freelists(0), OP_EQ, 0);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+
+  /* Lowering the cap releases chunks right away. */
+  buf = buf_new();
+  for (i = 0; i < 3; ++i)
+    buf_add(buf, junk, 4000);
+  buf_free(buf);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 3*4096);
+  buf_set_freelist_cap(4096);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 4096);
+  buf_set_freelist_cap(0);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  buf_free(buf);
+  buf_set_freelist_cap(0);
+  tor_free(summary);
+  tor_free(expected);
+  tor_free(junk);
+}
+
 static void
 test_buffer_time_tracking(void *arg)
 {
@@ -802,6 +1273,14 @@ struct testcase_t buffer_tests[] = {
   { "startswith", test_buffer_peek_startswith, 0, NULL, NULL },
   { "allocation_tracking", test_buffer_allocation_tracking, TT_FORK,
     NULL, NULL },
+  { "move_splice", test_buffer_move_splice, TT_FORK, NULL, NULL },
+  { "external", test_buffer_external, TT_FORK, NULL, NULL },
+  { "freelists", test_buffer_freelists, TT_FORK, NULL, NULL },
+  { "socket_io/sg", test_buffer_socket_io, TT_FORK,
+    &passthrough_setup, (char*)"sg" },
+  { "socket_io/plain", test_buffer_socket_io, TT_FORK,
+    &passthrough_setup, (char*)"plain" },
+  { "uring", test_buffer_uring, TT_FORK, NULL, NULL },
   { "time_tracking", test_buffer_time_tracking, TT_FORK, NULL, NULL },
   { "tls_read_mocked", test_buffers_tls_read_mocked, 0,
     NULL, NULL },
@@ -814,6 +1293,8 @@ struct testcase_t buffer_tests[] = {
     &passthrough_setup, (char*)"gzip" },
   { "compress/zstd", test_buffers_compress, TT_FORK,
     &passthrough_setup, (char*)"x-zstd" },
+  { "compress/zstd_dict", test_buffers_compress, TT_FORK,
+    &passthrough_setup, (char*)"x-tor-zstd-dict" },
   { "compress/lzma", test_buffers_compress, TT_FORK,
     &passthrough_setup, (char*)"x-tor-lzma" },
   { "compress/none", test_buffers_compress, TT_FORK,
@@ -4,6 +4,8 @@
 #define CIRCUITLIST_PRIVATE
 #define RELAY_PRIVATE
 #include "core/or/or.h"
+#include "core/or/cell_queue.h"
+#include "core/or/cellpool.h"
 #include "core/or/circuitlist.h"
 #include "core/or/relay.h"
 #include "test/test.h"
@@ -139,9 +141,217 @@ test_circuit_n_cells(void *arg)
   circuit_free_(TO_CIRCUIT(origin_c));
 }
 
+static void
+test_cq_ring(void *arg)
+{
+  packed_cell_t *pcs[100];
+  cell_queue_t cq;
+  int i, j;
+  (void) arg;
+
+  memset(pcs, 0, sizeof(pcs));
+  cell_queue_init(&cq);
+  tt_int_op(cq.capacity, OP_EQ, 0);
+  tt_ptr_op(cell_queue_peek(&cq), OP_EQ, NULL);
+
+  for (i = 0; i < 100; ++i) {
+    pcs[i] = packed_cell_new();
+    set_uint32(pcs[i]->body, i);
+  }
+
+  /* Push the head partway around the ring, then make it grow while the
+   * cells wrap around its end. */
+  cell_queue_append(&cq, pcs[0]);
+  tt_int_op(cq.capacity, OP_EQ, 16);
+  for (i = 1; i < 12; ++i)
+    cell_queue_append(&cq, pcs[i]);
+  for (i = 0; i < 10; ++i)
+    tt_ptr_op(cell_queue_pop(&cq), OP_EQ, pcs[i]);
+  tt_int_op(cq.n, OP_EQ, 2);
+  tt_int_op(cq.head, OP_EQ, 10);
+  for (i = 12; i < 60; ++i)
+    cell_queue_append(&cq, pcs[i]);
+  tt_int_op(cq.n, OP_EQ, 50);
+  tt_int_op(cq.capacity, OP_EQ, 64);
+  tt_ptr_op(cell_queue_peek(&cq), OP_EQ, pcs[10]);
+
+  /* Everything comes out in order. */
+  for (i = 10; i < 60; ++i) {
+    packed_cell_t *pc = cell_queue_pop(&cq);
+    tt_ptr_op(pc, OP_EQ, pcs[i]);
+    tt_int_op(get_uint32(pc->body), OP_EQ, i);
+  }
+  tt_int_op(cq.n, OP_EQ, 0);
+  tt_ptr_op(cell_queue_pop(&cq), OP_EQ, NULL);
+  /* The grown ring is kept for the next burst... */
+  tt_int_op(cq.capacity, OP_EQ, 64);
+  tt_int_op(cq.head, OP_EQ, 0);
+
+  /* ...until somebody asks us to shrink it. */
+  cell_queue_append(&cq, pcs[0]);
+  tt_uint_op(cell_queue_shrink(&cq), OP_EQ, 0);
+  tt_ptr_op(cell_queue_pop(&cq), OP_EQ, pcs[0]);
+  tt_uint_op(cell_queue_shrink(&cq), OP_EQ, 64 * sizeof(packed_cell_t *));
+  tt_int_op(cq.capacity, OP_EQ, 0);
+  tt_ptr_op(cq.cells, OP_EQ, NULL);
+
+  /* A small one is always kept. */
+  cell_queue_append(&cq, pcs[0]);
+  tt_ptr_op(cell_queue_pop(&cq), OP_EQ, pcs[0]);
+  tt_uint_op(cell_queue_shrink(&cq), OP_EQ, 0);
+  tt_int_op(cq.capacity, OP_EQ, 16);
+  tt_int_op(cq.head, OP_EQ, 0);
+
+  /* Clearing a wrapped queue frees every cell and the ring. */
+  for (i = 0; i < 10; ++i)
+    cell_queue_append(&cq, pcs[i]);
+  for (i = 0; i < 8; ++i)
+    tt_ptr_op(cell_queue_pop(&cq), OP_EQ, pcs[i]);
+  for (i = 10; i < 20; ++i)
+    cell_queue_append(&cq, pcs[i]);
+  tt_int_op(cq.n, OP_EQ, 12);
+  cell_queue_clear(&cq);
+  for (j = 8; j < 20; ++j)
+    pcs[j] = NULL; /* prevent double-free */
+  tt_int_op(cq.n, OP_EQ, 0);
+  tt_int_op(cq.capacity, OP_EQ, 0);
+  tt_ptr_op(cq.cells, OP_EQ, NULL);
+
+ done:
+  for (i = 0; i < 100; ++i)
+    packed_cell_free(pcs[i]);
+  tor_free(cq.cells);
+}
+
+static void
+test_cq_shrink_idle(void *arg)
+{
+  or_circuit_t *or_c = NULL;
+  int i;
+  (void) arg;
+
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(INT64_C(1000)*1000*1000);
+
+  or_c = or_circuit_new(0, NULL);
+  for (i = 0; i < 20; ++i) {
+    cell_queue_append(&or_c->p_chan_cells, packed_cell_new());
+    cell_queue_append(&or_c->base_.n_chan_cells, packed_cell_new());
+  }
+  for (i = 0; i < 20; ++i)
+    packed_cell_free_(cell_queue_pop(&or_c->p_chan_cells));
+  tt_int_op(or_c->p_chan_cells.capacity, OP_EQ, 32);
+
+  /* Not idle for long enough yet. */
+  monotime_coarse_set_mock_time_nsec(INT64_C(1500)*1000*1000);
+  tt_uint_op(cell_queues_shrink_idle(1000), OP_EQ, 0);
+  tt_int_op(or_c->p_chan_cells.capacity, OP_EQ, 32);
+
+  /* Now it is; the queue that still holds cells keeps its ring. */
+  monotime_coarse_set_mock_time_nsec(INT64_C(2500)*1000*1000);
+  tt_uint_op(cell_queues_shrink_idle(1000), OP_EQ,
+             32 * sizeof(packed_cell_t *));
+  tt_int_op(or_c->p_chan_cells.capacity, OP_EQ, 0);
+  tt_int_op(or_c->base_.n_chan_cells.capacity, OP_EQ, 32);
+  tt_int_op(or_c->base_.n_chan_cells.n, OP_EQ, 20);
+
+ done:
+  circuit_free_(TO_CIRCUIT(or_c));
+  monotime_disable_test_mocking();
+}
+
+static void
+test_cell_pool(void *arg)
+{
+  packed_cell_t *cells[CELL_POOL_CELLS_PER_SLAB + 1];
+  packed_cell_t *tmp;
+  cell_pool_stats_t st;
+  int i;
+  (void)arg;
+
+  memset(cells, 0, sizeof(cells));
+  cell_pool_free_all();
+  cell_pool_get_stats(&st);
+  tt_int_op(st.n_cells_allocated, OP_EQ, 0);
+  tt_int_op(st.n_slabs, OP_EQ, 0);
+
+  /* Fill one slab exactly, then spill into a second. */
+  for (i = 0; i < CELL_POOL_CELLS_PER_SLAB + 1; ++i) {
+    cells[i] = packed_cell_new();
+    tt_assert(cells[i]);
+    tt_assert(fast_mem_is_zero(cells[i]->body, sizeof(cells[i]->body)));
+    memset(cells[i]->body, 'x', sizeof(cells[i]->body));
+  }
+  cell_pool_get_stats(&st);
+  tt_int_op(st.n_cells_allocated, OP_EQ, CELL_POOL_CELLS_PER_SLAB + 1);
+  tt_int_op(st.n_slabs, OP_EQ, 2);
+  tt_int_op(st.n_empty_slabs, OP_EQ, 0);
+  tt_int_op(st.n_fragmented_cells, OP_EQ, CELL_POOL_CELLS_PER_SLAB - 1);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
+            (CELL_POOL_CELLS_PER_SLAB + 1) * packed_cell_mem_cost());
+
+  /* A released cell gets handed out again right away, zeroed. */
+  tmp = cells[3];
+  packed_cell_free(cells[3]);
+  cells[3] = packed_cell_new();
+  tt_ptr_op(cells[3], OP_EQ, tmp);
+  tt_assert(fast_mem_is_zero(cells[3]->body, sizeof(cells[3]->body)));
+  cell_pool_get_stats(&st);
+  tt_int_op(st.n_slabs, OP_EQ, 2);
+
+  /* Emptying the second slab keeps it around: it is still the one we
+   * allocate from. */
+  packed_cell_free(cells[CELL_POOL_CELLS_PER_SLAB]);
+  cells[CELL_POOL_CELLS_PER_SLAB] = NULL;
+  cell_pool_get_stats(&st);
+  tt_int_op(st.n_cells_allocated, OP_EQ, CELL_POOL_CELLS_PER_SLAB);
+  tt_int_op(st.n_slabs, OP_EQ, 2);
+  tt_int_op(st.n_empty_slabs, OP_EQ, 0);
+  tt_int_op(cell_pool_get_idle_allocation(), OP_EQ, 0);
+
+  /* Once the first slab has room again, the empty one is set aside as an
+   * idle slab.  (The most recently released cell is held back for the next
+   * allocation, so it takes two releases to get a cell back to its slab.) */
+  packed_cell_free(cells[0]);
+  packed_cell_free(cells[1]);
+  cells[1] = packed_cell_new();
+  cells[0] = packed_cell_new();
+  cell_pool_get_stats(&st);
+  tt_int_op(st.n_cells_allocated, OP_EQ, CELL_POOL_CELLS_PER_SLAB);
+  tt_int_op(st.n_slabs, OP_EQ, 2);
+  tt_int_op(st.n_empty_slabs, OP_EQ, 1);
+  tt_int_op(st.n_fragmented_cells, OP_EQ, 0);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
+            CELL_POOL_CELLS_PER_SLAB * packed_cell_mem_cost() +
+            cell_pool_get_idle_allocation());
+  tt_u64_op(cell_pool_get_idle_allocation(), OP_GT, 0);
+
+  /* Cleaning gives it back. */
+  tt_u64_op(cell_pool_clean(0), OP_GT, 0);
+  cell_pool_get_stats(&st);
+  tt_int_op(st.n_slabs, OP_EQ, 1);
+  tt_int_op(st.n_empty_slabs, OP_EQ, 0);
+  tt_int_op(cell_pool_get_idle_allocation(), OP_EQ, 0);
+
+  for (i = 0; i < CELL_POOL_CELLS_PER_SLAB; ++i) {
+    packed_cell_free(cells[i]);
+  }
+  cell_pool_get_stats(&st);
+  tt_int_op(st.n_cells_allocated, OP_EQ, 0);
+  tt_int_op(st.n_slabs, OP_EQ, 1);
+  tt_int_op(st.n_cells_allocated_max, OP_EQ, CELL_POOL_CELLS_PER_SLAB + 1);
+  tt_int_op(st.n_slabs_max, OP_EQ, 2);
+
+ done:
+  cell_pool_free_all();
+}
+
 struct testcase_t cell_queue_tests[] = {
   { "basic", test_cq_manip, TT_FORK, NULL, NULL, },
   { "circ_n_cells", test_circuit_n_cells, TT_FORK, NULL, NULL },
+  { "ring", test_cq_ring, TT_FORK, NULL, NULL },
+  { "shrink_idle", test_cq_shrink_idle, TT_FORK, NULL, NULL },
+  { "pool", test_cell_pool, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
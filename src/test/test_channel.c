@@ -4,6 +4,7 @@
 #define CHANNEL_OBJECT_PRIVATE
 #define CHANNEL_FILE_PRIVATE
 #include "core/or/or.h"
+#include "core/or/cell_queue.h"
 #include "core/or/channel.h"
 /* For channel_note_destroy_not_pending */
 #define CIRCUITLIST_PRIVATE
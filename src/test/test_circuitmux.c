@@ -7,6 +7,7 @@
 #define RELAY_PRIVATE
 
 #include "core/or/or.h"
+#include "core/or/cell_queue.h"
 #include "core/or/channel.h"
 #include "core/or/circuitmux.h"
 #include "core/or/circuitmux_ewma.h"
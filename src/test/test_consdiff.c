@@ -8,6 +8,8 @@
 #include "test/test.h"
 
 #include "feature/dircommon/consdiff.h"
+#include "lib/crypt_ops/crypto_digest.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/memarea/memarea.h"
 #include "test/log_test_helpers.h"
 
@@ -106,41 +108,6 @@ test_consdiff_smartlist_slice_string_pos(void *arg)
   memarea_drop_all(area);
 }
 
-static void
-test_consdiff_lcs_lengths(void *arg)
-{
-  smartlist_t *sl1 = smartlist_new();
-  smartlist_t *sl2 = smartlist_new();
-  smartlist_slice_t *sls1, *sls2;
-  int *lengths1, *lengths2;
-  memarea_t *area = memarea_new();
-
-  /* Expected lcs lengths in regular and reverse order. */
-  int e_lengths1[] = { 0, 1, 2, 3, 3, 4 };
-  int e_lengths2[] = { 0, 1, 1, 2, 3, 4 };
-
-  (void)arg;
-  consensus_split_lines_(sl1, "a\nb\nc\nd\ne\n", area);
-  consensus_split_lines_(sl2, "a\nc\nd\ni\ne\n", area);
-
-  sls1 = smartlist_slice(sl1, 0, -1);
-  sls2 = smartlist_slice(sl2, 0, -1);
-
-  lengths1 = lcs_lengths(sls1, sls2, 1);
-  lengths2 = lcs_lengths(sls1, sls2, -1);
-  tt_mem_op(e_lengths1, OP_EQ, lengths1, sizeof(int) * 6);
-  tt_mem_op(e_lengths2, OP_EQ, lengths2, sizeof(int) * 6);
-
- done:
-  tor_free(lengths1);
-  tor_free(lengths2);
-  tor_free(sls1);
-  tor_free(sls2);
-  smartlist_free(sl1);
-  smartlist_free(sl2);
-  memarea_drop_all(area);
-}
-
 static void
 test_consdiff_trim_slices(void *arg)
 {
@@ -343,6 +310,191 @@ test_consdiff_calc_changes(void *arg)
   memarea_drop_all(area);
 }
 
+/** Return the length of the longest common subsequence of <b>sls1</b> and
+ * <b>sls2</b>, the slow and obvious way. */
+static int
+lcs_length_slow(const smartlist_slice_t *sls1, const smartlist_slice_t *sls2)
+{
+  const int len1 = sls1->len, len2 = sls2->len;
+  int *lens = tor_calloc((len1+1) * (len2+1), sizeof(int));
+  int i, j, result;
+#define LENS(i,j) lens[(i)*(len2+1)+(j)]
+  for (i = 1; i <= len1; ++i) {
+    for (j = 1; j <= len2; ++j) {
+      if (lines_eq(smartlist_get(sls1->list, sls1->offset+i-1),
+                   smartlist_get(sls2->list, sls2->offset+j-1)))
+        LENS(i,j) = LENS(i-1,j-1) + 1;
+      else
+        LENS(i,j) = MAX(LENS(i-1,j), LENS(i,j-1));
+    }
+  }
+  result = LENS(len1,len2);
+#undef LENS
+  tor_free(lens);
+  return result;
+}
+
+/** Return true iff splitting <b>sls1</b> after <b>x</b> lines and
+ * <b>sls2</b> after <b>y</b> lines keeps a longest common subsequence
+ * intact, and actually divides the problem. */
+static int
+is_good_split(const smartlist_slice_t *sls1, const smartlist_slice_t *sls2,
+              int x, int y)
+{
+  smartlist_slice_t *top, *bot, *left, *right;
+  int ok;
+  if (x < 0 || x > sls1->len || y < 0 || y > sls2->len)
+    return 0;
+  if (x + y == 0 || x + y == sls1->len + sls2->len)
+    return 0;
+  top = smartlist_slice(sls1->list, sls1->offset, sls1->offset + x);
+  bot = smartlist_slice(sls1->list, sls1->offset + x,
+                        sls1->offset + sls1->len);
+  left = smartlist_slice(sls2->list, sls2->offset, sls2->offset + y);
+  right = smartlist_slice(sls2->list, sls2->offset + y,
+                          sls2->offset + sls2->len);
+  ok = lcs_length_slow(top, left) + lcs_length_slow(bot, right) ==
+    lcs_length_slow(sls1, sls2);
+  tor_free(top);
+  tor_free(bot);
+  tor_free(left);
+  tor_free(right);
+  return ok;
+}
+
+static void
+test_consdiff_find_middle_snake(void *arg)
+{
+  smartlist_t *sl1 = smartlist_new();
+  smartlist_t *sl2 = smartlist_new();
+  smartlist_slice_t *sls1 = NULL, *sls2 = NULL;
+  memarea_t *area = memarea_new();
+  int x = -1, y = -1;
+
+  (void)arg;
+  consensus_split_lines_(sl1, "b\nc\nd\ne\n", area);
+  consensus_split_lines_(sl2, "c\nd\ni\nf\n", area);
+  sls1 = smartlist_slice(sl1, 0, -1);
+  sls2 = smartlist_slice(sl2, 0, -1);
+
+  find_middle_snake(sls1, sls2, &x, &y);
+  tt_assert(is_good_split(sls1, sls2, x, y));
+
+  /* Nothing in common: we must still split somewhere in the middle. */
+  smartlist_clear(sl2);
+  consensus_split_lines_(sl2, "v\nw\nx\ny\nz\n", area);
+  tor_free(sls2);
+  sls2 = smartlist_slice(sl2, 0, -1);
+  find_middle_snake(sls1, sls2, &x, &y);
+  tt_assert(is_good_split(sls1, sls2, x, y));
+
+  /* Lots in common, with the lengths differing by an odd number. */
+  smartlist_clear(sl2);
+  consensus_split_lines_(sl2, "c\nb\nc\nd\nb\nd\nc\n", area);
+  tor_free(sls2);
+  sls2 = smartlist_slice(sl2, 0, -1);
+  find_middle_snake(sls1, sls2, &x, &y);
+  tt_assert(is_good_split(sls1, sls2, x, y));
+
+ done:
+  tor_free(sls1);
+  tor_free(sls2);
+  smartlist_free(sl1);
+  smartlist_free(sl2);
+  memarea_drop_all(area);
+}
+
+/** Return a newly allocated string of up to <b>max_lines</b> random lines.
+ * Most are drawn from a small set, so that there will be plenty in common;
+ * the rest are probably unique. */
+static char *
+random_lines(int max_lines)
+{
+  static const char *choices[] = { "a", "b", "c", "dd", "e", NULL };
+  smartlist_t *chunks = smartlist_new();
+  char *result;
+  int i, n = crypto_rand_int(max_lines + 1);
+  for (i = 0; i < n; ++i) {
+    const char *line = choices[crypto_rand_int(ARRAY_LENGTH(choices))];
+    if (line)
+      smartlist_add_asprintf(chunks, "%s\n", line);
+    else
+      smartlist_add_asprintf(chunks, "x%d\n", crypto_rand_int(1000));
+  }
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+static void
+test_consdiff_calc_changes_minimal(void *arg)
+{
+  smartlist_t *sl1 = smartlist_new();
+  smartlist_t *sl2 = smartlist_new();
+  smartlist_t *kept1 = smartlist_new();
+  smartlist_t *kept2 = smartlist_new();
+  smartlist_slice_t *sls1 = NULL, *sls2 = NULL;
+  bitarray_t *changed1 = NULL, *changed2 = NULL;
+  char *s1 = NULL, *s2 = NULL;
+  memarea_t *area = memarea_new();
+  int iter, i, expected;
+
+  (void)arg;
+  for (iter = 0; iter < 500; ++iter) {
+    s1 = random_lines(60);
+    s2 = random_lines(60);
+    consensus_split_lines_(sl1, s1, area);
+    consensus_split_lines_(sl2, s2, area);
+    changed1 = bitarray_init_zero(smartlist_len(sl1));
+    changed2 = bitarray_init_zero(smartlist_len(sl2));
+    sls1 = smartlist_slice(sl1, 0, -1);
+    sls2 = smartlist_slice(sl2, 0, -1);
+    expected = lcs_length_slow(sls1, sls2);
+    calc_changes(sls1, sls2, changed1, changed2);
+
+    /* The lines we keep must be the same on both sides, and there must be
+     * as many of them as there can be. */
+    for (i = 0; i < smartlist_len(sl1); ++i) {
+      if (!bitarray_is_set(changed1, i))
+        smartlist_add(kept1, smartlist_get(sl1, i));
+    }
+    for (i = 0; i < smartlist_len(sl2); ++i) {
+      if (!bitarray_is_set(changed2, i))
+        smartlist_add(kept2, smartlist_get(sl2, i));
+    }
+    tt_int_op(smartlist_len(kept1), OP_EQ, smartlist_len(kept2));
+    for (i = 0; i < smartlist_len(kept1); ++i) {
+      tt_assert(lines_eq(smartlist_get(kept1, i), smartlist_get(kept2, i)));
+    }
+    tt_int_op(smartlist_len(kept1), OP_EQ, expected);
+
+    smartlist_clear(sl1);
+    smartlist_clear(sl2);
+    smartlist_clear(kept1);
+    smartlist_clear(kept2);
+    bitarray_free(changed1);
+    bitarray_free(changed2);
+    tor_free(sls1);
+    tor_free(sls2);
+    tor_free(s1);
+    tor_free(s2);
+  }
+
+ done:
+  bitarray_free(changed1);
+  bitarray_free(changed2);
+  tor_free(sls1);
+  tor_free(sls2);
+  tor_free(s1);
+  tor_free(s2);
+  smartlist_free(sl1);
+  smartlist_free(sl2);
+  smartlist_free(kept1);
+  smartlist_free(kept2);
+  memarea_drop_all(area);
+}
+
 static void
 test_consdiff_get_id_hash(void *arg)
 {
@@ -923,6 +1075,92 @@ test_consdiff_apply_ed_diff(void *arg)
   memarea_drop_all(area);
 }
 
+static void
+test_consdiff_apply_ed_diff_str(void *arg)
+{
+  /* Every diff here is applied both to a line smartlist with
+   * apply_ed_diff() and to the flat string with apply_ed_diff_str(); the
+   * two must agree, and the running digest must match the output. */
+  static const char *diffs[] = {
+    "5a\nX\n.\n3,4c\nY\nZ\n.\n1d\n",
+    "3,$d\n",
+    "1,$d\n",
+    "0a\nX\nY\n.\n",
+    "0c\nX\n.\n",
+    "2a\nR\n.\n2c\nQ\n.\n",
+    "4c\nT\nX\n.\n2d\n0a\nM\n.\n",
+    "5d\n4d\n3d\n",
+    "5a\n.\n",
+    /* Invalid: out of range, misordered, unterminated. */
+    "6d\n",
+    "2d\n3d\n",
+    "1a\nX\n",
+    NULL
+  };
+  const char *cons1_str = "A\nB\nC\nD\nE\n";
+  smartlist_t *cons1 = smartlist_new(), *diff = smartlist_new();
+  smartlist_t *cons2 = NULL;
+  memarea_t *area = memarea_new();
+  crypto_digest_t *digest = NULL;
+  char *expected = NULL, *result = NULL;
+  size_t len = 0;
+  (void)arg;
+
+  setup_capture_of_logs(LOG_WARN);
+  consensus_split_lines_(cons1, cons1_str, area);
+
+  for (int i = 0; diffs[i]; ++i) {
+    uint8_t d1[DIGEST256_LEN], d2[DIGEST256_LEN];
+    smartlist_clear(diff);
+    consensus_split_lines_(diff, diffs[i], area);
+    cons2 = apply_ed_diff(cons1, diff, 0);
+    digest = crypto_digest256_new(DIGEST_SHA3_256);
+    result = apply_ed_diff_str(cons1_str, strlen(cons1_str), diff, 0,
+                               digest, &len);
+    if (cons2 == NULL) {
+      tt_ptr_op(result, OP_EQ, NULL);
+    } else {
+      smartlist_t *strs = smartlist_new();
+      SMARTLIST_FOREACH(cons2, const cdline_t *, line,
+        smartlist_add_asprintf(strs, "%.*s\n", (int)line->len, line->s));
+      expected = smartlist_join_strings(strs, "", 0, NULL);
+      SMARTLIST_FOREACH(strs, char *, cp, tor_free(cp));
+      smartlist_free(strs);
+
+      tt_ptr_op(result, OP_NE, NULL);
+      tt_str_op(result, OP_EQ, expected);
+      tt_u64_op(len, OP_EQ, strlen(expected));
+
+      crypto_digest_get_digest(digest, (char *)d1, sizeof(d1));
+      crypto_digest256((char *)d2, result, len, DIGEST_SHA3_256);
+      tt_mem_op(d1, OP_EQ, d2, DIGEST256_LEN);
+    }
+    smartlist_free(cons2);
+    crypto_digest_free(digest);
+    tor_free(expected);
+    tor_free(result);
+  }
+
+  /* A base document without a trailing newline is rejected. */
+  mock_clean_saved_logs();
+  smartlist_clear(diff);
+  consensus_split_lines_(diff, "1d\n", area);
+  digest = crypto_digest256_new(DIGEST_SHA3_256);
+  result = apply_ed_diff_str("A\nB", 3, diff, 0, digest, &len);
+  tt_ptr_op(result, OP_EQ, NULL);
+  expect_single_log_msg_containing("not made of complete lines");
+
+ done:
+  teardown_capture_of_logs();
+  crypto_digest_free(digest);
+  tor_free(expected);
+  tor_free(result);
+  smartlist_free(cons1);
+  smartlist_free(cons2);
+  smartlist_free(diff);
+  memarea_drop_all(area);
+}
+
 static void
 test_consdiff_gen_diff(void *arg)
 {
@@ -1008,12 +1246,11 @@ test_consdiff_gen_diff(void *arg)
 static void
 test_consdiff_apply_diff(void *arg)
 {
-  smartlist_t *cons1=NULL, *diff=NULL;
+  smartlist_t *diff=NULL;
   char *cons1_str=NULL, *cons2 = NULL;
   consensus_digest_t digests1;
   (void)arg;
   memarea_t *area = memarea_new();
-  cons1 = smartlist_new();
   diff = smartlist_new();
   setup_capture_of_logs(LOG_INFO);
 
@@ -1025,10 +1262,10 @@ test_consdiff_apply_diff(void *arg)
       );
   tt_int_op(0, OP_EQ,
       consensus_compute_digest_(cons1_str, &digests1));
-  consensus_split_lines_(cons1, cons1_str, area);
 
   /* diff doesn't have enough lines. */
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("too short");
 
@@ -1036,7 +1273,8 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "foo-bar");
   smartlist_add_linecpy(diff, area, "header-line");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("format is not known");
 
@@ -1046,7 +1284,8 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "word a b");
   smartlist_add_linecpy(diff, area, "x");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("does not include the necessary digests");
 
@@ -1055,7 +1294,8 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "network-status-diff-version 1");
   smartlist_add_linecpy(diff, area, "hash a b c");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("does not include the necessary digests");
 
@@ -1064,7 +1304,8 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "network-status-diff-version 1");
   smartlist_add_linecpy(diff, area, "hash aaa bbb");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("includes base16-encoded digests of "
                                    "incorrect size");
@@ -1076,7 +1317,8 @@ test_consdiff_apply_diff(void *arg)
       " ????????????????????????????????????????????????????????????????"
       " ----------------------------------------------------------------");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("includes malformed digests");
 
@@ -1092,7 +1334,8 @@ test_consdiff_apply_diff(void *arg)
       " 635D34593020C08E5ECD865F9986E29D50028EFA62843766A8197AD228A7F6AA");
   smartlist_add_linecpy(diff, area, "foobar");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("because an ed command was missing a line "
                                    "number");
@@ -1106,7 +1349,8 @@ test_consdiff_apply_diff(void *arg)
       /* sha256 of cons2. */
       " 635D34593020C08E5ECD865F9986E29D50028EFA62843766A8197AD228A7F6AA");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_log_msg_containing("base consensus doesn't match the digest "
                             "as found");
@@ -1120,7 +1364,8 @@ test_consdiff_apply_diff(void *arg)
       /* bogus sha3. */
       " 3333333333333333333333333333333333333333333333333333333333333333");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_log_msg_containing("resulting consensus doesn't match the "
                             "digest as found");
@@ -1137,7 +1382,8 @@ test_consdiff_apply_diff(void *arg)
       " 3333333333333333333333333333333333333333333333333333333333333333");
   smartlist_add_linecpy(diff, area, "1,2d"); // remove starting line
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_log_msg_containing("Could not compute digests of the consensus "
                             "resulting from applying a consensus diff.");
@@ -1154,7 +1400,8 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "3c");
   smartlist_add_linecpy(diff, area, "sample");
   smartlist_add_linecpy(diff, area, ".");
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_NE, cons2);
   tt_str_op(
       "network-status-version foo\n"
@@ -1175,7 +1422,8 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "3c");
   smartlist_add_linecpy(diff, area, "sample");
   smartlist_add_linecpy(diff, area, ".");
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_NE, cons2);
   tt_str_op(
       "network-status-version foo\n"
@@ -1190,7 +1438,6 @@ test_consdiff_apply_diff(void *arg)
  done:
   teardown_capture_of_logs();
   tor_free(cons1_str);
-  smartlist_free(cons1);
   smartlist_free(diff);
   memarea_drop_all(area);
 }
@@ -1201,16 +1448,18 @@ test_consdiff_apply_diff(void *arg)
 struct testcase_t consdiff_tests[] = {
   CONSDIFF_LEGACY(smartlist_slice),
   CONSDIFF_LEGACY(smartlist_slice_string_pos),
-  CONSDIFF_LEGACY(lcs_lengths),
   CONSDIFF_LEGACY(trim_slices),
   CONSDIFF_LEGACY(set_changed),
+  CONSDIFF_LEGACY(find_middle_snake),
   CONSDIFF_LEGACY(calc_changes),
+  CONSDIFF_LEGACY(calc_changes_minimal),
   CONSDIFF_LEGACY(get_id_hash),
   CONSDIFF_LEGACY(is_valid_router_entry),
   CONSDIFF_LEGACY(next_router),
   CONSDIFF_LEGACY(base64cmp),
   CONSDIFF_LEGACY(gen_ed_diff),
   CONSDIFF_LEGACY(apply_ed_diff),
+  CONSDIFF_LEGACY(apply_ed_diff_str),
   CONSDIFF_LEGACY(gen_diff),
   CONSDIFF_LEGACY(apply_diff),
   END_OF_TESTCASES
@@ -2077,6 +2077,83 @@ test_crypto_curve25519_testvec(void *arg)
   tor_free(mem_op_hex_tmp);
 }
 
+static void
+test_crypto_curve25519_batch(void *arg)
+{
+  /* From RFC 7748, section 5.2 */
+  static const char *vectors[][3] = {
+    { "a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4",
+      "e6db6867583030db3594c1a424b15f7c726624ec26b3353b10a903a6d0ab1c4c",
+      "c3da55379de9c6908e94ea4df28d084f32eccf03491c71f754b4075577a28552" },
+    { "4b66e9d4d1b4673c5ad22691957d6af5c11b6421e0ea01d42ca4169e7918ba0d",
+      "e5210f12786811d3f4b7959d0538ae2c31dbe7106fc03c3efc4cd549c715a493",
+      "95cbde9476e8907d7aade45cb4b873f88b595a68799fa152e6f8f7647aac7957" },
+  };
+  static const int lane_counts[] = { 1, 4, 8 };
+#define N_MULTS 19
+  uint8_t secrets[N_MULTS][32], points[N_MULTS][32];
+  uint8_t expected[N_MULTS][32], out[N_MULTS][32];
+  uint8_t *outs[N_MULTS];
+  const uint8_t *secs[N_MULTS], *pts[N_MULTS];
+  int i, j, n, n_tried = 0;
+  const int old_lanes = curve25519_get_batch_lanes();
+  char *mem_op_hex_tmp = NULL;
+  (void)arg;
+
+  crypto_rand((char*)secrets, sizeof(secrets));
+  crypto_rand((char*)points, sizeof(points));
+  for (i = 0; i < 2; ++i) {
+    base16_decode((char*)secrets[i], 32, vectors[i][0], 64);
+    base16_decode((char*)points[i], 32, vectors[i][1], 64);
+  }
+  /* Points that stress the edges of the field: 0, 1, p-1, p, p+1, and
+   * 2^256-1, which is p+18 once we drop its high bit. */
+  memset(points[2], 0, 32);
+  memset(points[3], 0, 32);
+  points[3][0] = 1;
+  for (i = 4; i < 7; ++i) {
+    memset(points[i], 0xff, 32);
+    points[i][31] = 0x7f;
+  }
+  points[4][0] = 0xec;
+  points[5][0] = 0xed;
+  points[6][0] = 0xee;
+  memset(points[7], 0xff, 32);
+  /* And scalars at their edges. */
+  memset(secrets[8], 0, 32);
+  memset(secrets[9], 0xff, 32);
+
+  for (i = 0; i < N_MULTS; ++i) {
+    tt_int_op(0, OP_EQ, curve25519_impl(expected[i], secrets[i], points[i]));
+    outs[i] = out[i];
+    secs[i] = secrets[i];
+    pts[i] = points[i];
+  }
+  for (i = 0; i < 2; ++i)
+    test_memeq_hex(expected[i], vectors[i][2]);
+
+  for (j = 0; j < (int)ARRAY_LENGTH(lane_counts); ++j) {
+    if (curve25519_set_batch_lanes(lane_counts[j]) != lane_counts[j])
+      continue; /* This CPU can't do that many. */
+    ++n_tried;
+    /* Every batch size, so that we try every way of filling the lanes. */
+    for (n = 1; n <= N_MULTS; ++n) {
+      memset(out, 0, sizeof(out));
+      curve25519_impl_batch(n, outs, secs, pts);
+      for (i = 0; i < n; ++i)
+        tt_mem_op(out[i], OP_EQ, expected[i], 32);
+      for ( ; i < N_MULTS; ++i)
+        tt_assert(fast_mem_is_zero((char*)out[i], 32));
+    }
+  }
+  tt_int_op(n_tried, OP_GE, 1);
+
+ done:
+  curve25519_set_batch_lanes(old_lanes);
+  tor_free(mem_op_hex_tmp);
+#undef N_MULTS
+}
+
 static void
 test_crypto_curve25519_wrappers(void *arg)
 {
@@ -2925,6 +3002,58 @@ crypto_rand_check_failure_mode_predict(void)
 
 #undef FAILURE_MODE_BUFFER_SIZE
 
+static void
+test_crypto_ed25519_batch(void *arg)
+{
+  /* Enough signatures for three groups, the last one partial. */
+  const int n_sigs = ED25519_BATCH_GROUP_SIZE * 2 + 10;
+  const int n_tags = 40;
+  ed25519_keypair_t kp[4];
+  ed25519_batch_t *batch = NULL;
+  int bad_tags[41];
+  uint8_t msg[32];
+  int i;
+  (void)arg;
+
+  for (i = 0; i < 4; ++i)
+    tt_int_op(0, OP_EQ, ed25519_keypair_generate(&kp[i], 0));
+
+  batch = ed25519_batch_new();
+  for (i = 0; i < n_sigs; ++i) {
+    ed25519_checkable_t ch;
+    memset(msg, i, sizeof(msg));
+    ch.pubkey = &kp[i % 4].pubkey;
+    ch.msg = msg;
+    ch.len = sizeof(msg);
+    tt_int_op(0, OP_EQ, ed25519_sign(&ch.signature, msg, sizeof(msg),
+                                     &kp[i % 4]));
+    /* Break the first signature, one in the middle of the second group, and
+     * one whose tag is too high to report. */
+    if (i == 0 || i == ED25519_BATCH_GROUP_SIZE + 7 || i == n_sigs - 1)
+      ch.signature.sig[3] ^= 0x40;
+    ed25519_batch_add(batch, &ch, (i == n_sigs - 1) ? n_tags : i % n_tags);
+  }
+  /* The batch made its own copy of every message. */
+  memset(msg, 0xff, sizeof(msg));
+  tt_int_op(ed25519_batch_len(batch), OP_EQ, n_sigs);
+
+  memset(bad_tags, 0, sizeof(bad_tags));
+  tt_int_op(-3, OP_EQ, ed25519_batch_verify(batch, bad_tags, n_tags));
+  for (i = 0; i <= n_tags; ++i) {
+    const int expect_bad =
+      (i == 0 || i == (ED25519_BATCH_GROUP_SIZE + 7) % n_tags);
+    tt_int_op(bad_tags[i], OP_EQ, expect_bad);
+  }
+  ed25519_batch_free(batch);
+
+  /* An empty batch is fine. */
+  batch = ed25519_batch_new();
+  tt_int_op(0, OP_EQ, ed25519_batch_verify(batch, NULL, 0));
+
+ done:
+  ed25519_batch_free(batch);
+}
+
 /** Test that our ed25519 validation function rejects evil public keys and
  *  accepts good ones. */
 static void
@@ -3060,6 +3189,7 @@ struct testcase_t crypto_tests[] = {
   { "curve25516_testvec", test_crypto_curve25519_testvec, 0, NULL, NULL },
   { "curve25519_basepoint",
     test_crypto_curve25519_basepoint, TT_FORK, NULL, NULL },
+  { "curve25519_batch", test_crypto_curve25519_batch, TT_FORK, NULL, NULL },
   { "curve25519_wrappers", test_crypto_curve25519_wrappers, 0, NULL, NULL },
   { "curve25519_encode", test_crypto_curve25519_encode, 0, NULL, NULL },
   { "curve25519_persist", test_crypto_curve25519_persist, 0, NULL, NULL },
@@ -3071,6 +3201,7 @@ struct testcase_t crypto_tests[] = {
   ED25519_TEST(blinding_fail, 0),
   ED25519_TEST(testvectors, 0),
   ED25519_TEST(validation, 0),
+  ED25519_TEST(batch, 0),
   { "ed25519_storage", test_crypto_ed25519_storage, 0, NULL, NULL },
   { "siphash", test_crypto_siphash, 0, NULL, NULL },
   { "failure_modes", test_crypto_failure_modes, TT_FORK, NULL, NULL },
@@ -28,6 +28,7 @@
 #include "app/config/config.h"
 #include "lib/confmgt/confmgt.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/relay.h"
 #include "core/or/versions.h"
 #include "feature/client/bridges.h"
@@ -55,6 +56,7 @@
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nickname.h"
 #include "feature/nodelist/node_select.h"
+#include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/dirparse/authcert_parse.h"
 #include "feature/dirparse/ns_parse.h"
@@ -62,6 +64,7 @@
 #include "feature/dirparse/unparseable.h"
 #include "feature/nodelist/routerset.h"
 #include "feature/nodelist/torcert.h"
+#include "feature/nodelist/verified_digests.h"
 #include "feature/relay/router.h"
 #include "feature/relay/routerkeys.h"
 #include "feature/relay/routermode.h"
@@ -86,6 +89,7 @@
 #include "feature/nodelist/networkstatus_st.h"
 #include "feature/nodelist/networkstatus_voter_info_st.h"
 #include "feature/dirauth/ns_detached_signatures_st.h"
+#include "feature/nodelist/node_st.h"
 #include "core/or/port_cfg_st.h"
 #include "feature/nodelist/routerinfo_st.h"
 #include "feature/nodelist/routerlist_st.h"
@@ -100,6 +104,16 @@
 #include <unistd.h>
 #endif
 
+#ifdef HAVE_CFLAG_WOVERLENGTH_STRINGS
+DISABLE_GCC_WARNING("-Woverlength-strings")
+/* We allow huge string constants in the unit tests, but not in the code
+ * at large. */
+#endif
+#include "vote_descriptors.inc"
+#ifdef HAVE_CFLAG_WOVERLENGTH_STRINGS
+ENABLE_GCC_WARNING("-Woverlength-strings")
+#endif
+
 static networkstatus_t *
 networkstatus_parse_vote_from_string_(const char *s,
                                       const char **eos_out,
@@ -1523,6 +1537,148 @@ test_dir_parse_router_list(void *arg)
 #undef ADD
 }
 
+/* Check that deferring ed25519 signature checks to the end of
+ * router_parse_list_from_string() rejects the same descriptors, and marks
+ * the same ones as not worth downloading again, as checking each one as we
+ * parse it. */
+static void
+test_dir_parse_router_list_ed_batch(void *arg)
+{
+  static const char *bad_descs[] = {
+    EX_RI_ED_BAD_SIG1, EX_RI_ED_BAD_SIG2, EX_RI_ED_BAD_SIG3,
+    EX_RI_ED_BAD_SIG4, EX_RI_ED_BAD_CROSSCERT1, EX_RI_ED_BAD_CROSSCERT3,
+    EX_RI_ED_BAD_CROSSCERT4, EX_RI_ED_BAD_CROSSCERT5,
+    EX_RI_ED_BAD_CROSSCERT6, EX_RI_ED_BAD_CROSSCERT7, EX_RI_ED_BAD_CERT1,
+    EX_RI_ED_BAD_CERT2, EX_RI_ED_BAD_CERT3,
+  };
+  smartlist_t *invalid = smartlist_new();
+  smartlist_t *dest = smartlist_new();
+  routerinfo_t *ri = NULL;
+  char *list = NULL;
+  const char *cp;
+  char d[DIGEST_LEN], good_digest[DIGEST_LEN];
+  unsigned i;
+  (void) arg;
+
+  tt_int_op(0, OP_EQ, router_get_router_hash(EX_RI_MINIMAL_ED,
+                                             strlen(EX_RI_MINIMAL_ED),
+                                             good_digest));
+
+  for (i = 0; i < ARRAY_LENGTH(bad_descs); ++i) {
+    int dl_again = -1;
+    ri = router_parse_entry_from_string(bad_descs[i], NULL, 0, 0, NULL,
+                                        &dl_again);
+    tt_ptr_op(ri, OP_EQ, NULL);
+
+    /* Put the bad one between two good ones. */
+    tor_asprintf(&list, "%s%s%s", EX_RI_MINIMAL_ED, bad_descs[i],
+                 EX_RI_MINIMAL_ED);
+    cp = list;
+    tt_int_op(0, OP_EQ,
+              router_parse_list_from_string(&cp, NULL, dest, SAVED_NOWHERE,
+                                            0, 0, NULL, invalid));
+    tt_int_op(2, OP_EQ, smartlist_len(dest));
+    SMARTLIST_FOREACH(dest, routerinfo_t *, r, {
+      tt_mem_op(r->cache_info.signed_descriptor_digest, OP_EQ,
+                good_digest, DIGEST_LEN);
+    });
+    if (dl_again) {
+      tt_int_op(0, OP_EQ, smartlist_len(invalid));
+    } else {
+      tt_int_op(1, OP_EQ, smartlist_len(invalid));
+      tt_int_op(0, OP_EQ, router_get_router_hash(bad_descs[i],
+                                                 strlen(bad_descs[i]), d));
+      tt_mem_op(smartlist_get(invalid, 0), OP_EQ, d, DIGEST_LEN);
+    }
+
+    SMARTLIST_FOREACH(dest, routerinfo_t *, r, routerinfo_free(r));
+    SMARTLIST_FOREACH(invalid, uint8_t *, dig, tor_free(dig));
+    smartlist_clear(dest);
+    smartlist_clear(invalid);
+    tor_free(list);
+  }
+
+ done:
+  tor_free(list);
+  routerinfo_free(ri);
+  SMARTLIST_FOREACH(dest, routerinfo_t *, r, routerinfo_free(r));
+  smartlist_free(dest);
+  SMARTLIST_FOREACH(invalid, uint8_t *, dig, tor_free(dig));
+  smartlist_free(invalid);
+}
+
+/** Set <b>digest_out</b> to the digest that identifies the router
+ * descriptor <b>desc</b> in the verified-digest journal. */
+static void
+get_desc_verified_digest(uint8_t *digest_out, const char *desc)
+{
+  const char *end = strstr(desc, "\n-----END SIGNATURE-----\n");
+  tor_assert(end);
+  end += strlen("\n-----END SIGNATURE-----\n");
+  verified_digests_compute(digest_out, "router", desc, end - desc);
+}
+
+static void
+test_dir_parse_router_list_verified_digests(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  smartlist_t *dest = smartlist_new();
+  char *list = NULL;
+  const char *cp;
+  uint8_t vd_good[DIGEST256_LEN], vd_bad_ed[DIGEST256_LEN];
+  uint8_t vd_bad_rsa[DIGEST256_LEN], vd_bad_ports[DIGEST256_LEN];
+  (void) arg;
+
+  tor_free(options->DataDirectory);
+  tor_free(options->CacheDirectory);
+  options->DataDirectory = tor_strdup(get_fname("vd_parse"));
+  options->CacheDirectory = tor_strdup(options->DataDirectory);
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory, 0700));
+#endif
+  tt_int_op(0, OP_EQ, verified_digests_load());
+
+  get_desc_verified_digest(vd_good, EX_RI_MINIMAL_ED);
+  get_desc_verified_digest(vd_bad_ed, EX_RI_ED_BAD_SIG1);
+  get_desc_verified_digest(vd_bad_rsa, EX_RI_BAD_SIG1);
+  get_desc_verified_digest(vd_bad_ports, EX_RI_BAD_PORTS);
+
+  /* With nothing in the journal, we check every signature, and remember
+   * the descriptors whose signatures were good. */
+  tor_asprintf(&list, "@source fred\n%s%s%s%s", EX_RI_MINIMAL_ED,
+               EX_RI_ED_BAD_SIG1, EX_RI_BAD_SIG1, EX_RI_BAD_PORTS);
+  cp = list;
+  tt_int_op(0, OP_EQ,
+            router_parse_list_from_string(&cp, NULL, dest, SAVED_NOWHERE,
+                                          0, 1, NULL, NULL));
+  tt_int_op(1, OP_EQ, smartlist_len(dest));
+  tt_assert(verified_digests_contains(vd_good));
+  tt_assert(!verified_digests_contains(vd_bad_ed));
+  tt_assert(!verified_digests_contains(vd_bad_rsa));
+  tt_assert(!verified_digests_contains(vd_bad_ports));
+  SMARTLIST_FOREACH(dest, routerinfo_t *, r, routerinfo_free(r));
+  smartlist_clear(dest);
+
+  /* Now pretend that we've already checked all of them.  We should skip
+   * the signature checks, but still reject the descriptor with bad ports. */
+  verified_digests_add(vd_bad_ed);
+  verified_digests_add(vd_bad_rsa);
+  verified_digests_add(vd_bad_ports);
+  cp = list;
+  tt_int_op(0, OP_EQ,
+            router_parse_list_from_string(&cp, NULL, dest, SAVED_NOWHERE,
+                                          0, 1, NULL, NULL));
+  tt_int_op(3, OP_EQ, smartlist_len(dest));
+
+ done:
+  tor_free(list);
+  SMARTLIST_FOREACH(dest, routerinfo_t *, r, routerinfo_free(r));
+  smartlist_free(dest);
+  verified_digests_free_all();
+}
+
 static download_status_t dls_minimal;
 static download_status_t dls_maximal;
 static download_status_t dls_bad_fingerprint;
@@ -4120,6 +4276,199 @@ test_dir_random_weighted(void *testdata)
   ;
 }
 
+static void
+test_dir_alias_table(void *testdata)
+{
+  int histogram[10];
+  double vals[10] = {3,1,2,4,6,0,7,5,8,9}, total=45;
+  alias_table_t *table = NULL;
+  int i, j, choice;
+  const int n = 50000;
+  double max_sq_error;
+  (void) testdata;
+
+  /* Try a ten-element array with values from 0 through 10. The values are
+   * in a scrambled order to make sure we don't depend on order. */
+  table = alias_table_new(vals, 10);
+  tt_int_op(table->n_entries, OP_EQ, 10);
+  tt_u64_op(table->total, OP_GT, 0);
+
+  /* Every entry should own just its share of the table. */
+  for (i = 0; i < 10; ++i) {
+    uint64_t owned = table->cutoff[i];
+    tt_int_op(table->alias[i], OP_GE, 0);
+    tt_int_op(table->alias[i], OP_LT, 10);
+    tt_u64_op(table->cutoff[i], OP_LE, table->total);
+    for (j = 0; j < 10; ++j) {
+      if (j != i && table->alias[j] == i)
+        owned += table->total - table->cutoff[j];
+    }
+    if (i == 5) /* The entry with weight 0 */
+      tt_u64_op(owned, OP_EQ, 0);
+    tt_double_op(fabs(owned / (10.0 * table->total) - vals[i] / total),
+                 OP_LT, 1e-9);
+  }
+
+  memset(histogram,0,sizeof(histogram));
+  for (i=0; i<n; ++i) {
+    choice = alias_table_choose(table);
+    tt_int_op(choice, OP_GE, 0);
+    tt_int_op(choice, OP_LT, 10);
+    histogram[choice]++;
+  }
+
+  /* Now see if we chose things about frequently enough. */
+  max_sq_error = 0;
+  for (i=0; i<10; ++i) {
+    int expected = (int)(n*vals[i]/total);
+    double frac_diff = 0, sq;
+    TT_BLATHER(("  %d : %5d vs %5d\n", (int)vals[i], histogram[i], expected));
+    if (expected)
+      frac_diff = (histogram[i] - expected) / ((double)expected);
+    else
+      tt_int_op(histogram[i], OP_EQ, 0);
+
+    sq = frac_diff * frac_diff;
+    if (sq > max_sq_error)
+      max_sq_error = sq;
+  }
+  tt_double_op(max_sq_error, OP_LT, .05);
+  alias_table_free(table);
+
+  /* Now try a singleton; do we choose it? */
+  table = alias_table_new(vals, 1);
+  for (i = 0; i < 100; ++i) {
+    choice = alias_table_choose(table);
+    tt_int_op(choice, OP_EQ, 0);
+  }
+  alias_table_free(table);
+
+  /* Now try an array of zeros.  We should choose randomly. */
+  memset(histogram,0,sizeof(histogram));
+  for (i = 0; i < 5; ++i)
+    vals[i] = 0;
+  table = alias_table_new(vals, 5);
+  tt_u64_op(table->total, OP_EQ, 0);
+  for (i = 0; i < n; ++i) {
+    choice = alias_table_choose(table);
+    tt_int_op(choice, OP_GE, 0);
+    tt_int_op(choice, OP_LT, 5);
+    histogram[choice]++;
+  }
+  max_sq_error = 0;
+  for (i=0; i<5; ++i) {
+    int expected = n/5;
+    double frac_diff = 0, sq;
+    frac_diff = (histogram[i] - expected) / ((double)expected);
+    sq = frac_diff * frac_diff;
+    if (sq > max_sq_error)
+      max_sq_error = sq;
+  }
+  tt_double_op(max_sq_error, OP_LT, .05);
+
+ done:
+  alias_table_free(table);
+}
+
+static smartlist_t *crn_mock_nodes = NULL;
+
+static const smartlist_t *
+crn_mock_nodelist_get_list(void)
+{
+  return crn_mock_nodes;
+}
+
+/* Check that router_choose_random_node() chooses usable nodes in proportion
+ * to their bandwidths, whether or not its cached weight tables find one. */
+static void
+test_dir_choose_random_node_weighted(void *testdata)
+{
+  const int n_nodes = 20;
+  int histogram[20];
+  smartlist_t *excluded = smartlist_new();
+  const node_t *choice;
+  double total = 0;
+  int i;
+  const int n = 50000;
+  double max_sq_error;
+  (void) testdata;
+
+  crn_mock_nodes = smartlist_new();
+  for (i = 0; i < n_nodes; ++i) {
+    node_t *node = tor_malloc_zero(sizeof(node_t));
+    node->rs = tor_malloc_zero(sizeof(routerstatus_t));
+    node->rs->has_bandwidth = 1;
+    node->rs->bandwidth_kb = 10 * (i + 1);
+    node->is_running = node->is_valid = 1;
+    node->nodelist_idx = i;
+    smartlist_add(crn_mock_nodes, node);
+  }
+  MOCK(nodelist_get_list, crn_mock_nodelist_get_list);
+  node_select_invalidate_weight_tables();
+
+  /* Make a few nodes unusable. */
+  ((node_t *)smartlist_get(crn_mock_nodes, 3))->is_running = 0;
+  ((node_t *)smartlist_get(crn_mock_nodes, 7))->is_valid = 0;
+  smartlist_add(excluded, smartlist_get(crn_mock_nodes, 11));
+  smartlist_add(excluded, smartlist_get(crn_mock_nodes, 19));
+
+  memset(histogram,0,sizeof(histogram));
+  for (i = 0; i < n; ++i) {
+    choice = router_choose_random_node(excluded, NULL, 0);
+    tt_assert(choice);
+    histogram[choice->nodelist_idx]++;
+  }
+
+  for (i = 0; i < n_nodes; ++i) {
+    if (i != 3 && i != 7 && i != 11 && i != 19)
+      total += i + 1;
+  }
+  max_sq_error = 0;
+  for (i = 0; i < n_nodes; ++i) {
+    int expected = 0;
+    double frac_diff = 0, sq;
+    if (i != 3 && i != 7 && i != 11 && i != 19)
+      expected = (int)(n * (i + 1) / total);
+    TT_BLATHER(("  %d : %5d vs %5d\n", i, histogram[i], expected));
+    if (expected)
+      frac_diff = (histogram[i] - expected) / ((double)expected);
+    else
+      tt_int_op(histogram[i], OP_EQ, 0);
+
+    sq = frac_diff * frac_diff;
+    if (sq > max_sq_error)
+      max_sq_error = sq;
+  }
+  tt_double_op(max_sq_error, OP_LT, .05);
+
+  /* Now exclude all but the two lightest usable nodes.  Most draws from the
+   * weight table will fail, so we'll often need the full list too. */
+  smartlist_clear(excluded);
+  for (i = 2; i < n_nodes; ++i)
+    smartlist_add(excluded, smartlist_get(crn_mock_nodes, i));
+  memset(histogram,0,sizeof(histogram));
+  for (i = 0; i < n; ++i) {
+    choice = router_choose_random_node(excluded, NULL, 0);
+    tt_assert(choice);
+    tt_int_op(choice->nodelist_idx, OP_LT, 2);
+    histogram[choice->nodelist_idx]++;
+  }
+  TT_BLATHER(("  %d vs %d\n", histogram[0], histogram[1]));
+  tt_double_op(fabs(histogram[0] / (double)n - 1.0/3), OP_LT, .02);
+
+ done:
+  UNMOCK(nodelist_get_list);
+  node_select_invalidate_weight_tables();
+  if (crn_mock_nodes) {
+    SMARTLIST_FOREACH(crn_mock_nodes, node_t *, node, {
+      tor_free(node->rs);
+      tor_free(node);
+    });
+    smartlist_free(crn_mock_nodes);
+  }
+  smartlist_free(excluded);
+}
+
 /* Function pointers for test_dir_clip_unmeasured_bw_kb() */
 
 static uint32_t alternate_clip_bw = 0;
@@ -5691,6 +6040,35 @@ test_dir_choose_compression_level(void* data)
   done: ;
 }
 
+static void
+test_dir_choose_compression_method_for_size(void *data)
+{
+  (void)data;
+  const unsigned all = (1u<<NO_METHOD) | (1u<<GZIP_METHOD) |
+    (1u<<ZLIB_METHOD) | (1u<<ZSTD_METHOD) | (1u<<ZSTD_DICT_METHOD);
+
+  /* Small responses use the dictionary, if the client supports it. */
+  tt_int_op(ZSTD_DICT_METHOD, OP_EQ,
+            choose_compression_method_for_size(all, 0));
+  tt_int_op(ZSTD_DICT_METHOD, OP_EQ,
+            choose_compression_method_for_size(all, 8192));
+  tt_int_op(ZSTD_METHOD, OP_EQ,
+            choose_compression_method_for_size(
+                                  all & ~(1u<<ZSTD_DICT_METHOD), 100));
+
+  /* Large ones never do. */
+  tt_int_op(ZSTD_METHOD, OP_EQ,
+            choose_compression_method_for_size(all, 8193));
+  tt_int_op(ZLIB_METHOD, OP_EQ,
+            choose_compression_method_for_size(
+                           all & ~(1u<<ZSTD_METHOD), 1<<20));
+  tt_int_op(NO_METHOD, OP_EQ,
+            choose_compression_method_for_size(
+                           (1u<<NO_METHOD)|(1u<<ZSTD_DICT_METHOD), 1<<20));
+
+ done: ;
+}
+
 /*
  * Mock check_private_dir(), and always succeed - no need to actually
  * look at or create anything on the filesystem.
@@ -6999,6 +7377,210 @@ test_dir_assumed_flags(void *arg)
   routerstatus_free(rs);
 }
 
+static int n_parallel_calls = 0;
+
+static int
+mock_cpuworker_get_n_threads(void)
+{
+  return 3;
+}
+
+/** Run the jobs in reverse order, to make sure that the order in which our
+ * workers finish doesn't matter. */
+static void
+mock_cpuworker_run_parallel(void (*fn)(void *), void **args, int n)
+{
+  ++n_parallel_calls;
+  while (n-- > 0)
+    fn(args[n]);
+}
+
+/** Assert that the routerstatus entries <b>a</b> and <b>b</b> are the
+ * same. */
+static void
+assert_same_routerstatus(const routerstatus_t *a, const routerstatus_t *b)
+{
+  tt_str_op(a->nickname, OP_EQ, b->nickname);
+  tt_mem_op(a->identity_digest, OP_EQ, b->identity_digest, DIGEST_LEN);
+  tt_mem_op(a->descriptor_digest, OP_EQ, b->descriptor_digest,
+            DIGEST256_LEN);
+  tt_int_op(a->published_on, OP_EQ, b->published_on);
+  tt_int_op(a->addr, OP_EQ, b->addr);
+  tt_int_op(a->or_port, OP_EQ, b->or_port);
+  tt_int_op(a->dir_port, OP_EQ, b->dir_port);
+  tt_int_op(a->ipv6_orport, OP_EQ, b->ipv6_orport);
+  tt_int_op(a->is_exit, OP_EQ, b->is_exit);
+  tt_int_op(a->is_possible_guard, OP_EQ, b->is_possible_guard);
+  tt_int_op(a->bandwidth_kb, OP_EQ, b->bandwidth_kb);
+  tt_str_op(a->exitsummary, OP_EQ, b->exitsummary);
+  tt_mem_op(&a->pv, OP_EQ, &b->pv, sizeof(a->pv));
+ done:
+  ;
+}
+
+/** Assert that the networkstatus documents <b>a</b> and <b>b</b> have the
+ * same routerstatus entries. */
+static void
+assert_same_routerstatuses(const networkstatus_t *a, const networkstatus_t *b)
+{
+  int i;
+  tt_int_op(smartlist_len(a->routerstatus_list), OP_EQ,
+            smartlist_len(b->routerstatus_list));
+  tt_int_op(a->has_measured_bws, OP_EQ, b->has_measured_bws);
+  for (i = 0; i < smartlist_len(a->routerstatus_list); ++i) {
+    if (a->type == NS_TYPE_CONSENSUS) {
+      assert_same_routerstatus(smartlist_get(a->routerstatus_list, i),
+                               smartlist_get(b->routerstatus_list, i));
+    } else {
+      const vote_routerstatus_t *va = smartlist_get(a->routerstatus_list, i);
+      const vote_routerstatus_t *vb = smartlist_get(b->routerstatus_list, i);
+      assert_same_routerstatus(&va->status, &vb->status);
+      tt_u64_op(va->flags, OP_EQ, vb->flags);
+      tt_int_op(va->has_measured_bw, OP_EQ, vb->has_measured_bw);
+      tt_int_op(va->measured_bw_kb, OP_EQ, vb->measured_bw_kb);
+      tt_str_op(va->version, OP_EQ, vb->version);
+      tt_str_op(va->microdesc->microdesc_hash_line, OP_EQ,
+                vb->microdesc->microdesc_hash_line);
+    }
+  }
+ done:
+  ;
+}
+
+/** Return the text of a consensus made from three test votes. */
+static char *
+make_test_consensus(time_t now)
+{
+  authority_cert_t *cert1=NULL, *cert2=NULL, *cert3=NULL;
+  crypto_pk_t *sign_skey_1=NULL, *sign_skey_2=NULL, *sign_skey_3=NULL;
+  networkstatus_t *vote = NULL, *v1 = NULL, *v2 = NULL, *v3 = NULL;
+  smartlist_t *votes = smartlist_new();
+  char *consensus = NULL;
+  int n_vrs;
+
+  MOCK(get_my_v3_authority_cert, get_my_v3_authority_cert_m);
+  tt_assert(!dir_common_authority_pk_init(&cert1, &cert2, &cert3,
+                                          &sign_skey_1, &sign_skey_2,
+                                          &sign_skey_3));
+  mock_cert = cert1;
+  dirauth_sched_recalculate_timing(get_options(), now);
+  sr_state_init(0, 0);
+
+  tt_assert(!dir_common_construct_vote_1(&vote, cert1, sign_skey_1,
+                                 &dir_common_gen_routerstatus_for_v3ns,
+                                 &v1, &n_vrs, now, 1));
+  networkstatus_vote_free(vote);
+  tt_assert(!dir_common_construct_vote_2(&vote, cert2, sign_skey_2,
+                                 &dir_common_gen_routerstatus_for_v3ns,
+                                 &v2, &n_vrs, now, 1));
+  networkstatus_vote_free(vote);
+  tt_assert(!dir_common_construct_vote_3(&vote, cert3, sign_skey_3,
+                                 &dir_common_gen_routerstatus_for_v3ns,
+                                 &v3, &n_vrs, now, 1));
+  networkstatus_vote_free(vote);
+  smartlist_add(votes, v1);
+  smartlist_add(votes, v2);
+  smartlist_add(votes, v3);
+
+  consensus = networkstatus_compute_consensus(votes, 3, cert1->identity_key,
+                                              sign_skey_1,
+                                              "AAAAAAAAAAAAAAAAAAAA",
+                                              NULL, FLAV_NS);
+
+ done:
+  UNMOCK(get_my_v3_authority_cert);
+  SMARTLIST_FOREACH(votes, networkstatus_t *, v, networkstatus_vote_free(v));
+  smartlist_free(votes);
+  authority_cert_free(cert1);
+  authority_cert_free(cert2);
+  authority_cert_free(cert3);
+  crypto_pk_free(sign_skey_1);
+  crypto_pk_free(sign_skey_2);
+  crypto_pk_free(sign_skey_3);
+  return consensus;
+}
+
+static void
+test_dir_parse_routerstatus_parallel(void *arg)
+{
+  networkstatus_t *seq = NULL, *par = NULL;
+  char *consensus = NULL, *broken = NULL;
+  const char *cp;
+  (void)arg;
+
+  consensus = make_test_consensus(time(NULL));
+  tt_assert(consensus);
+  get_options_mutable()->NumCPUs = 4;
+  MOCK(cpuworker_get_n_threads, mock_cpuworker_get_n_threads);
+  MOCK(cpuworker_run_parallel, mock_cpuworker_run_parallel);
+
+  /* With only four entries in this vote, we don't bother the workers. */
+  seq = networkstatus_parse_vote_from_string(VOTE_BODY_V3,
+                                             strlen(VOTE_BODY_V3), NULL,
+                                             NS_TYPE_VOTE);
+  tt_assert(seq);
+  tt_int_op(smartlist_len(seq->routerstatus_list), OP_EQ, 4);
+  tt_int_op(n_parallel_calls, OP_EQ, 0);
+
+  /* Once we do, we get the same entries in the same order. */
+  ns_parse_min_rs_per_chunk = 1;
+  par = networkstatus_parse_vote_from_string(VOTE_BODY_V3,
+                                             strlen(VOTE_BODY_V3), NULL,
+                                             NS_TYPE_VOTE);
+  tt_assert(par);
+  tt_int_op(n_parallel_calls, OP_EQ, 1);
+  assert_same_routerstatuses(seq, par);
+  networkstatus_vote_free(seq);
+  networkstatus_vote_free(par);
+  seq = par = NULL;
+
+  /* Likewise for a consensus. */
+  ns_parse_min_rs_per_chunk = 0;
+  seq = networkstatus_parse_vote_from_string(consensus, strlen(consensus),
+                                             NULL, NS_TYPE_CONSENSUS);
+  tt_assert(seq);
+  tt_int_op(smartlist_len(seq->routerstatus_list), OP_EQ, 3);
+  ns_parse_min_rs_per_chunk = 1;
+  par = networkstatus_parse_vote_from_string(consensus, strlen(consensus),
+                                             NULL, NS_TYPE_CONSENSUS);
+  tt_assert(par);
+  tt_int_op(n_parallel_calls, OP_EQ, 2);
+  assert_same_routerstatuses(seq, par);
+  networkstatus_vote_free(seq);
+  networkstatus_vote_free(par);
+  seq = par = NULL;
+
+  /* An entry that doesn't tokenize gets skipped and logged, as before. */
+  cp = strstr(consensus, "\nr ");
+  tt_assert(cp);
+  cp = strstr(cp + 1, "\ns ");
+  tt_assert(cp);
+  tor_asprintf(&broken, "%.*s\ns Fast%s",
+               (int)(cp - consensus), consensus, cp);
+  ns_parse_min_rs_per_chunk = 0;
+  seq = networkstatus_parse_vote_from_string(broken, strlen(broken), NULL,
+                                             NS_TYPE_CONSENSUS);
+  tt_assert(seq);
+  tt_int_op(smartlist_len(seq->routerstatus_list), OP_EQ, 2);
+  ns_parse_min_rs_per_chunk = 1;
+  setup_capture_of_logs(LOG_WARN);
+  par = networkstatus_parse_vote_from_string(broken, strlen(broken), NULL,
+                                             NS_TYPE_CONSENSUS);
+  tt_assert(par);
+  tt_int_op(n_parallel_calls, OP_EQ, 3);
+  expect_log_msg_containing("Error tokenizing router status");
+  assert_same_routerstatuses(seq, par);
+
+ done:
+  teardown_capture_of_logs();
+  UNMOCK(cpuworker_get_n_threads);
+  UNMOCK(cpuworker_run_parallel);
+  networkstatus_vote_free(seq);
+  networkstatus_vote_free(par);
+  tor_free(consensus);
+  tor_free(broken);
+}
+
 static void
 test_dir_post_parsing(void *arg)
 {
@@ -7461,6 +8043,8 @@ struct testcase_t dir_tests[] = {
   DIR(routerinfo_parsing, 0),
   DIR(extrainfo_parsing, 0),
   DIR(parse_router_list, TT_FORK),
+  DIR(parse_router_list_ed_batch, TT_FORK),
+  DIR(parse_router_list_verified_digests, TT_FORK),
   DIR(load_routers, TT_FORK),
   DIR(load_extrainfo, TT_FORK),
   DIR(getinfo_extra, 0),
@@ -7476,6 +8060,8 @@ struct testcase_t dir_tests[] = {
   DIR(param_voting_lookup, 0),
   DIR_LEGACY(v3_networkstatus),
   DIR(random_weighted, 0),
+  DIR(alias_table, 0),
+  DIR(choose_random_node_weighted, 0),
   DIR(scale_bw, 0),
   DIR_LEGACY(clip_unmeasured_bw_kb),
   DIR_LEGACY(clip_unmeasured_bw_kb_alt),
@@ -7500,6 +8086,7 @@ struct testcase_t dir_tests[] = {
   DIR(should_not_init_request_to_dir_auths_without_v3_info, 0),
   DIR(should_init_request_to_dir_auths, 0),
   DIR(choose_compression_level, 0),
+  DIR(choose_compression_method_for_size, 0),
   DIR(dump_unparseable_descriptors, 0),
   DIR(populate_dump_desc_fifo, 0),
   DIR(populate_dump_desc_fifo_2, 0),
@@ -7512,6 +8099,7 @@ struct testcase_t dir_tests[] = {
   DIR_ARG(find_dl_min_delay, TT_FORK, "cfr"),
   DIR_ARG(find_dl_min_delay, TT_FORK, "car"),
   DIR(assumed_flags, 0),
+  DIR(parse_routerstatus_parallel, TT_FORK),
   DIR(matching_flags, 0),
   DIR(networkstatus_compute_bw_weights_v10, 0),
   DIR(platform_str, 0),
@@ -9,6 +9,7 @@
 #define CONFIG_PRIVATE
 #define RENDCACHE_PRIVATE
 #define DIRCACHE_PRIVATE
+#define BUFFERS_PRIVATE
 
 #include "core/or/or.h"
 #include "app/config/config.h"
@@ -18,6 +19,7 @@
 #include "feature/dircache/dircache.h"
 #include "test/test.h"
 #include "lib/compress/compress.h"
+#include "lib/buf/buffers.h"
 #include "feature/rend/rendcommon.h"
 #include "feature/rend/rendcache.h"
 #include "feature/relay/relay_config.h"
@@ -1914,6 +1916,58 @@ test_dir_handle_get_status_vote_current_consensus_ns(void* data)
     clear_geoip_db();
 }
 
+static void
+test_dir_handle_get_status_vote_current_consensus_ns_zero_copy(void *data)
+{
+  dir_connection_t *conn = NULL;
+  char *header = NULL, *body = NULL, *plain = NULL;
+  size_t body_len = 0, plain_len = 0;
+  const chunk_t *ch;
+  int n_external = 0;
+  (void) data;
+
+  MOCK(get_options, mock_get_options);
+  init_mock_options();
+
+  networkstatus_t *ns = tor_malloc_zero(sizeof(networkstatus_t));
+  ns->type = NS_TYPE_CONSENSUS;
+  ns->flavor = FLAV_NS;
+  ns->valid_after = time(NULL) - 1800;
+  ns->fresh_until = time(NULL) - 900;
+  ns->valid_until = time(NULL) - 60;
+  consdiffmgr_add_consensus(NETWORK_STATUS, ns);
+  networkstatus_vote_free(ns);
+
+  conn = new_dir_conn();
+  tt_int_op(0, OP_EQ, directory_handle_command_get(conn,
+    "GET /tor/status-vote/current/consensus-ns HTTP/1.0\r\n"
+    "Accept-Encoding: deflate\r\n\r\n", NULL, 0));
+
+  /* The precompressed body goes onto the outbuf by reference, straight from
+   * the cache entry. */
+  for (ch = TO_CONN(conn)->outbuf->head; ch; ch = ch->next)
+    n_external += CHUNK_IS_EXTERNAL(ch);
+  tt_int_op(n_external, OP_EQ, 1);
+  buf_assert_ok(TO_CONN(conn)->outbuf);
+
+  fetch_from_buf_http(TO_CONN(conn)->outbuf, &header, MAX_HEADERS_SIZE,
+                      &body, &body_len, 1024, 0);
+  tt_assert(header);
+  tt_ptr_op(strstr(header, "HTTP/1.0 200 OK\r\n"), OP_EQ, header);
+  tt_assert(strstr(header, "Content-Encoding: deflate\r\n"));
+  tt_int_op(0, OP_EQ, tor_uncompress(&plain, &plain_len, body, body_len,
+                                     ZLIB_METHOD, 1, LOG_WARN));
+  tt_str_op(NETWORK_STATUS, OP_EQ, plain);
+
+ done:
+  UNMOCK(get_options);
+  connection_free_minimal(TO_CONN(conn));
+  tor_free(header);
+  tor_free(body);
+  tor_free(plain);
+  or_options_free(mock_options); mock_options = NULL;
+}
+
 static void
 test_dir_handle_get_status_vote_current_consensus_ns_busy(void* data)
 {
@@ -2844,6 +2898,7 @@ test_dir_handle_get_parse_accept_encoding(void *arg)
   const unsigned B_GZIP = 1u << GZIP_METHOD;
   const unsigned B_LZMA = 1u << LZMA_METHOD;
   const unsigned B_ZSTD = 1u << ZSTD_METHOD;
+  const unsigned B_ZSTD_DICT = 1u << ZSTD_DICT_METHOD;
 
   unsigned encodings;
 
@@ -2878,6 +2933,9 @@ test_dir_handle_get_parse_accept_encoding(void *arg)
   encodings = parse_accept_encoding_header("x-zstd,deflate,x-tor-lzma,gzip");
   tt_uint_op(B_NONE|B_ZLIB|B_ZSTD|B_LZMA|B_GZIP, OP_EQ, encodings);
 
+  encodings = parse_accept_encoding_header("x-tor-zstd-dict, x-zstd");
+  tt_uint_op(B_NONE|B_ZSTD_DICT|B_ZSTD, OP_EQ, encodings);
+
  done:
   ;
 }
@@ -2947,6 +3005,7 @@ struct testcase_t dir_handle_get_tests[] = {
   DIR_HANDLE_CMD(status_vote_current_consensus_too_old, TT_FORK),
   DIR_HANDLE_CMD(status_vote_current_consensus_ns_busy, TT_FORK),
   DIR_HANDLE_CMD(status_vote_current_consensus_ns, TT_FORK),
+  DIR_HANDLE_CMD(status_vote_current_consensus_ns_zero_copy, TT_FORK),
   DIR_HANDLE_CMD(status_vote_current_d_not_found, 0),
   DIR_HANDLE_CMD(status_vote_next_d_not_found, 0),
   DIR_HANDLE_CMD(status_vote_d, 0),
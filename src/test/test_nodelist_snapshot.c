@@ -0,0 +1,471 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#define DIRVOTE_PRIVATE
+#define NODELIST_SNAPSHOT_PRIVATE
+
+#include "core/or/or.h"
+#include "app/config/config.h"
+#include "core/or/policies.h"
+#include "feature/dirauth/dirvote.h"
+#include "feature/dirauth/shared_random.h"
+#include "feature/dirparse/authcert_parse.h"
+#include "feature/dirparse/microdesc_parse.h"
+#include "feature/dirparse/ns_parse.h"
+#include "feature/nodelist/authcert.h"
+#include "feature/nodelist/microdesc.h"
+#include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/nodelist_snapshot.h"
+#include "feature/nodelist/verified_digests.h"
+#include "feature/relay/router.h"
+#include "lib/crypt_ops/crypto_curve25519.h"
+#include "lib/crypt_ops/crypto_ed25519.h"
+#include "lib/fs/files.h"
+
+#include "feature/nodelist/authority_cert_st.h"
+#include "feature/nodelist/microdesc_st.h"
+#include "feature/nodelist/networkstatus_st.h"
+#include "feature/nodelist/routerstatus_st.h"
+
+#include "test/test.h"
+#include "test/test_dir_common.h"
+#include "test/log_test_helpers.h"
+
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
+/** Point our data and cache directories at a new, empty directory called
+ * <b>name</b>, set up the key that authenticates snapshots, and start using
+ * snapshots. */
+static void
+setup_snapshots(const char *name)
+{
+  or_options_t *options = get_options_mutable();
+  char *dir = tor_strdup(get_fname(name));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(dir));
+#else
+  tt_int_op(0, OP_EQ, mkdir(dir, 0700));
+#endif
+  tor_free(options->DataDirectory);
+  tor_free(options->CacheDirectory);
+  options->DataDirectory = tor_strdup(dir);
+  options->CacheDirectory = dir;
+  tt_int_op(0, OP_EQ, verified_digests_load());
+  nodelist_snapshot_enable();
+ done:
+  ;
+}
+
+static authority_cert_t *mock_cert;
+
+static authority_cert_t *
+get_my_v3_authority_cert_m(void)
+{
+  tor_assert(mock_cert);
+  return mock_cert;
+}
+
+/** Set up the shared random subsystem, so that we can make votes. */
+static void
+init_sr(void)
+{
+  MOCK(get_my_v3_authority_cert, get_my_v3_authority_cert_m);
+  mock_cert = authority_cert_parse_from_string(AUTHORITY_CERT_1,
+                                               strlen(AUTHORITY_CERT_1),
+                                               NULL);
+  sr_init(0);
+  UNMOCK(get_my_v3_authority_cert);
+}
+
+/** Return the text of a new consensus of flavor <b>flav</b>, made from
+ * three votes at time <b>now</b>. */
+static char *
+make_consensus(consensus_flavor_t flav, time_t now)
+{
+  networkstatus_t *vote = NULL, *v1 = NULL, *v2 = NULL, *v3 = NULL;
+  authority_cert_t *cert1=NULL, *cert2=NULL, *cert3=NULL;
+  crypto_pk_t *sign_skey_1=NULL, *sign_skey_2=NULL, *sign_skey_3=NULL;
+  smartlist_t *votes = smartlist_new();
+  char *consensus = NULL;
+  int n_vrs;
+
+  tt_assert(!dir_common_authority_pk_init(&cert1, &cert2, &cert3,
+                                          &sign_skey_1, &sign_skey_2,
+                                          &sign_skey_3));
+  dir_common_construct_vote_1(&vote, cert1, sign_skey_1,
+                              &dir_common_gen_routerstatus_for_v3ns,
+                              &v1, &n_vrs, now, 1);
+  networkstatus_vote_free(vote);
+  dir_common_construct_vote_2(&vote, cert2, sign_skey_2,
+                              &dir_common_gen_routerstatus_for_v3ns,
+                              &v2, &n_vrs, now, 1);
+  networkstatus_vote_free(vote);
+  dir_common_construct_vote_3(&vote, cert3, sign_skey_3,
+                              &dir_common_gen_routerstatus_for_v3ns,
+                              &v3, &n_vrs, now, 1);
+  networkstatus_vote_free(vote);
+  tt_assert(v1 && v2 && v3);
+  smartlist_add(votes, v1);
+  smartlist_add(votes, v2);
+  smartlist_add(votes, v3);
+
+  consensus = networkstatus_compute_consensus(votes, 3, cert1->identity_key,
+                                              sign_skey_1,
+                                              "AAAAAAAAAAAAAAAAAAAA",
+                                              NULL, flav);
+
+ done:
+  SMARTLIST_FOREACH(votes, networkstatus_t *, v, networkstatus_vote_free(v));
+  smartlist_free(votes);
+  authority_cert_free(cert1);
+  authority_cert_free(cert2);
+  authority_cert_free(cert3);
+  crypto_pk_free(sign_skey_1);
+  crypto_pk_free(sign_skey_2);
+  crypto_pk_free(sign_skey_3);
+  return consensus;
+}
+
+/** Parse and return the consensus in <b>text</b>. */
+static networkstatus_t *
+parse_consensus(const char *text)
+{
+  return networkstatus_parse_vote_from_string(text, strlen(text), NULL,
+                                              NS_TYPE_CONSENSUS);
+}
+
+/** Assert that the routerstatus entries in <b>a</b> and <b>b</b> are the
+ * same. */
+static void
+assert_same_routerstatuses(const networkstatus_t *a, const networkstatus_t *b)
+{
+  tt_int_op(smartlist_len(a->routerstatus_list), OP_EQ,
+            smartlist_len(b->routerstatus_list));
+  SMARTLIST_FOREACH_BEGIN(a->routerstatus_list, routerstatus_t *, rs1) {
+    routerstatus_t *rs2 = smartlist_get(b->routerstatus_list, rs1_sl_idx);
+    routerstatus_t c1, c2;
+    tt_str_op(rs1->exitsummary ? rs1->exitsummary : "(none)", OP_EQ,
+              rs2->exitsummary ? rs2->exitsummary : "(none)");
+    memcpy(&c1, rs1, sizeof(c1));
+    memcpy(&c2, rs2, sizeof(c2));
+    c1.exitsummary = c2.exitsummary = NULL;
+    tt_mem_op(&c1, OP_EQ, &c2, sizeof(c1));
+  } SMARTLIST_FOREACH_END(rs1);
+ done:
+  ;
+}
+
+static void
+test_nodelist_snapshot_routerstatus(void *arg)
+{
+  consensus_flavor_t flav = networkstatus_parse_flavor_name(arg);
+  networkstatus_t *ns1 = NULL, *ns2 = NULL;
+  char *text = NULL, *fname = NULL;
+
+  setup_snapshots(flav == FLAV_NS ? "snapshot_rs_ns" : "snapshot_rs_md");
+  init_sr();
+  fname = nodelist_snapshot_get_fname(SNAPSHOT_KIND_ROUTERSTATUS, flav);
+  text = make_consensus(flav, time(NULL));
+  tt_assert(text);
+
+  /* With no snapshot, we parse the text. */
+  setup_capture_of_logs(LOG_INFO);
+  ns1 = parse_consensus(text);
+  tt_assert(ns1);
+  tt_int_op(ns1->flavor, OP_EQ, flav);
+  tt_int_op(smartlist_len(ns1->routerstatus_list), OP_EQ, 3);
+  expect_no_log_msg_containing("routerstatus entries from");
+  tt_int_op(0, OP_EQ, nodelist_snapshot_save_routerstatuses(ns1));
+  tt_int_op(file_status(fname), OP_EQ, FN_FILE);
+
+  /* Now we use the snapshot, and get the same answer. */
+  mock_clean_saved_logs();
+  ns2 = parse_consensus(text);
+  tt_assert(ns2);
+  expect_log_msg_containing("Loaded 3 routerstatus entries from");
+  assert_same_routerstatuses(ns1, ns2);
+  tt_int_op(ns2->valid_until, OP_EQ, ns1->valid_until);
+  tt_int_op(smartlist_len(ns2->voters), OP_EQ,
+            smartlist_len(ns1->voters));
+
+ done:
+  teardown_capture_of_logs();
+  nodelist_snapshot_free_all();
+  verified_digests_free_all();
+  networkstatus_vote_free(ns1);
+  networkstatus_vote_free(ns2);
+  authority_cert_free(mock_cert);
+  tor_free(text);
+  tor_free(fname);
+}
+
+static void
+test_nodelist_snapshot_routerstatus_fallback(void *arg)
+{
+  networkstatus_t *ns1 = NULL, *ns2 = NULL;
+  char *text = NULL, *text2 = NULL, *fname = NULL, *snap = NULL;
+  char *key_fname = NULL;
+  size_t snap_len = 0;
+  struct stat st;
+  const time_t now = time(NULL);
+  (void)arg;
+
+  setup_snapshots("snapshot_rs_fallback");
+  init_sr();
+  fname = nodelist_snapshot_get_fname(SNAPSHOT_KIND_ROUTERSTATUS,
+                                      FLAV_MICRODESC);
+  text = make_consensus(FLAV_MICRODESC, now);
+  tt_assert(text);
+  ns1 = parse_consensus(text);
+  tt_assert(ns1);
+  tt_int_op(0, OP_EQ, nodelist_snapshot_save_routerstatuses(ns1));
+  snap = read_file_to_str(fname, RFTS_BIN, &st);
+  tt_assert(snap);
+  snap_len = (size_t)st.st_size;
+  setup_capture_of_logs(LOG_INFO);
+
+  /* A snapshot of some other consensus is out of date. */
+  text2 = make_consensus(FLAV_MICRODESC, now + 3600);
+  tt_assert(text2);
+  ns2 = parse_consensus(text2);
+  tt_assert(ns2);
+  expect_log_msg_containing("out of date");
+  networkstatus_vote_free(ns2);
+
+  /* A damaged snapshot is corrupt. */
+  snap[snap_len - 3] ^= 0x20;
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname, snap, snap_len, 1));
+  mock_clean_saved_logs();
+  ns2 = parse_consensus(text);
+  tt_assert(ns2);
+  expect_log_msg_containing("corrupt");
+  assert_same_routerstatuses(ns1, ns2);
+  networkstatus_vote_free(ns2);
+
+  /* A snapshot from another build is ignored. */
+  snap[snap_len - 3] ^= 0x20;
+  snap[20] ^= 0x01;
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname, snap, snap_len, 1));
+  mock_clean_saved_logs();
+  ns2 = parse_consensus(text);
+  tt_assert(ns2);
+  expect_log_msg_containing("written by another version of Tor");
+  assert_same_routerstatuses(ns1, ns2);
+  networkstatus_vote_free(ns2);
+
+  /* Without our key, we can't trust a snapshot. */
+  snap[20] ^= 0x01;
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname, snap, snap_len, 1));
+  verified_digests_free_all();
+  mock_clean_saved_logs();
+  ns2 = parse_consensus(text);
+  tt_assert(ns2);
+  expect_log_msg_containing("no key to authenticate it");
+  assert_same_routerstatuses(ns1, ns2);
+  networkstatus_vote_free(ns2);
+
+  /* A snapshot made with some other key is refused. */
+  key_fname = get_datadir_fname("verified-digests-key");
+  tt_int_op(0, OP_EQ, unlink(key_fname));
+  tt_int_op(0, OP_EQ, verified_digests_load());
+  mock_clean_saved_logs();
+  ns2 = parse_consensus(text);
+  tt_assert(ns2);
+  expect_log_msg_containing("not written by us");
+  assert_same_routerstatuses(ns1, ns2);
+  networkstatus_vote_free(ns2);
+
+  /* A truncated snapshot is not a snapshot. */
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname, snap, 20, 1));
+  mock_clean_saved_logs();
+  ns2 = parse_consensus(text);
+  tt_assert(ns2);
+  expect_log_msg_containing("not a snapshot");
+  assert_same_routerstatuses(ns1, ns2);
+
+ done:
+  teardown_capture_of_logs();
+  nodelist_snapshot_free_all();
+  verified_digests_free_all();
+  networkstatus_vote_free(ns1);
+  networkstatus_vote_free(ns2);
+  authority_cert_free(mock_cert);
+  tor_free(text);
+  tor_free(text2);
+  tor_free(snap);
+  tor_free(fname);
+  tor_free(key_fname);
+}
+
+static const char test_mds[] =
+  "onion-key\n"
+  "-----BEGIN RSA PUBLIC KEY-----\n"
+  "MIGJAoGBAMjlHH/daN43cSVRaHBwgUfnszzAhg98EvivJ9Qxfv51mvQUxPjQ07es\n"
+  "gV/3n8fyh3Kqr/ehi9jxkdgSRfSnmF7giaHL1SLZ29kA7KtST+pBvmTpDtHa3ykX\n"
+  "Xorc7hJvIyTZoc1HU+5XSynj3gsBE5IGK1ZRzrNS688LnuZMVp1tAgMBAAE=\n"
+  "-----END RSA PUBLIC KEY-----\n"
+  "onion-key\n"
+  "-----BEGIN RSA PUBLIC KEY-----\n"
+  "MIGJAoGBAMHkZeXNDX/49JqM2BVLmh1Fnb5iMVnatvZZTLJyedqDLkbXZ1WKP5oh\n"
+  "7ec14dj/k3ntpwHD4s2o3Lb6nfagWbug4+F/rNJ7JuFru/PSyOvDyHGNAuegOXph\n"
+  "3gTGjdDpv/yPoiadGebbVe8E7n6hO+XxM2W/4dqheKimF0/s9B7HAgMBAAE=\n"
+  "-----END RSA PUBLIC KEY-----\n"
+  "ntor-onion-key QgF/EjqlNG1wRHLIop/nCekEH+ETGZSgYOhu26eiTF4=\n"
+  "a [2001:db8::7]:9001\n"
+  "family $00E9A86E7733240E60D8435A7BBD634A23894098 "
+  "$329BD7545DEEEBBDC8C4285F243916F248972102 nodeX\n"
+  "p accept 53,80,443,5222-5223,25565\n"
+  "p6 accept 80,443\n"
+  "id ed25519 BzffzY99z6Q8KltcFlUTLWjNTBU7yKK+uQhyi1Ivb3A\n"
+  "onion-key\n"
+  "-----BEGIN RSA PUBLIC KEY-----\n"
+  "MIGJAoGBAMH3340d4ENNGrqx7UxT+lB7x6DNUKOdPEOn4teceE11xlMyZ9TPv41c\n"
+  "qj2fRZzfxlc88G/tmiaHshmdtEpklZ740OFqaaJVj4LjPMKFNE+J7Xc1142BE9Ci\n"
+  "KgsbjGYe2RY261aADRWLetJ8T9QDMm+JngL4288hc8pq1uB/3TAbAgMBAAE=\n"
+  "-----END RSA PUBLIC KEY-----\n"
+  "p reject 1-65535\n";
+
+/** Return the exit policy summary <b>p</b> as a string, for comparing. */
+static char *
+policy_str(const short_policy_t *p)
+{
+  return p ? write_short_policy(p) : tor_strdup("(none)");
+}
+
+/** Assert that <b>md</b> is just what we get by parsing its body. */
+static void
+assert_md_matches_body(const microdesc_t *md)
+{
+  smartlist_t *parsed = NULL;
+  microdesc_t *md2;
+  char *p1 = NULL, *p2 = NULL;
+
+  parsed = microdescs_parse_from_string(md->body, md->body + md->bodylen, 0,
+                                        SAVED_NOWHERE, NULL);
+  tt_int_op(smartlist_len(parsed), OP_EQ, 1);
+  md2 = smartlist_get(parsed, 0);
+
+  tt_mem_op(md->digest, OP_EQ, md2->digest, DIGEST256_LEN);
+  tt_int_op(md->bodylen, OP_EQ, md2->bodylen);
+  tt_int_op(md->onion_pkey_len, OP_EQ, md2->onion_pkey_len);
+  tt_mem_op(md->onion_pkey, OP_EQ, md2->onion_pkey, md->onion_pkey_len);
+  tt_int_op(!md->onion_curve25519_pkey, OP_EQ, !md2->onion_curve25519_pkey);
+  if (md->onion_curve25519_pkey)
+    tt_mem_op(md->onion_curve25519_pkey->public_key, OP_EQ,
+              md2->onion_curve25519_pkey->public_key, CURVE25519_PUBKEY_LEN);
+  tt_int_op(!md->ed25519_identity_pkey, OP_EQ, !md2->ed25519_identity_pkey);
+  if (md->ed25519_identity_pkey)
+    tt_assert(ed25519_pubkey_eq(md->ed25519_identity_pkey,
+                                md2->ed25519_identity_pkey));
+  tt_assert(tor_addr_eq(&md->ipv6_addr, &md2->ipv6_addr));
+  tt_int_op(md->ipv6_orport, OP_EQ, md2->ipv6_orport);
+  tt_ptr_op(md->family, OP_EQ, md2->family);
+  p1 = policy_str(md->exit_policy);
+  p2 = policy_str(md2->exit_policy);
+  tt_str_op(p1, OP_EQ, p2);
+  tor_free(p1);
+  tor_free(p2);
+  p1 = policy_str(md->ipv6_exit_policy);
+  p2 = policy_str(md2->ipv6_exit_policy);
+  tt_str_op(p1, OP_EQ, p2);
+  tt_int_op(md->policy_is_reject_star, OP_EQ, md2->policy_is_reject_star);
+
+ done:
+  tor_free(p1);
+  tor_free(p2);
+  if (parsed) {
+    SMARTLIST_FOREACH(parsed, microdesc_t *, m, microdesc_free(m));
+    smartlist_free(parsed);
+  }
+}
+
+/** Assert that <b>mc</b> holds the microdescriptors in test_mds, stored in
+ * the cache file, each listed at <b>listed</b>, and each just what we get by
+ * parsing its body. */
+static void
+assert_cache_holds_test_mds(microdesc_cache_t *mc, time_t listed)
+{
+  smartlist_t *parsed;
+  parsed = microdescs_parse_from_string(test_mds, NULL, 0, SAVED_NOWHERE,
+                                        NULL);
+  tt_int_op(smartlist_len(parsed), OP_EQ, 3);
+  SMARTLIST_FOREACH_BEGIN(parsed, microdesc_t *, m) {
+    microdesc_t *md = microdesc_cache_lookup_by_digest256(mc, m->digest);
+    tt_assert(md);
+    tt_int_op(md->saved_location, OP_EQ, SAVED_IN_CACHE);
+    tt_int_op(md->last_listed, OP_EQ, listed);
+    assert_md_matches_body(md);
+  } SMARTLIST_FOREACH_END(m);
+ done:
+  SMARTLIST_FOREACH(parsed, microdesc_t *, m, microdesc_free(m));
+  smartlist_free(parsed);
+}
+
+static void
+test_nodelist_snapshot_microdesc(void *arg)
+{
+  microdesc_cache_t *mc;
+  smartlist_t *added = NULL;
+  char *fname = NULL, *snap = NULL;
+  const time_t listed = time(NULL) - 3600;
+  struct stat st;
+  (void)arg;
+
+  setup_snapshots("snapshot_md");
+  fname = nodelist_snapshot_get_fname(SNAPSHOT_KIND_MICRODESC, 0);
+  mc = get_microdesc_cache();
+  added = microdescs_add_to_cache(mc, test_mds, NULL, SAVED_NOWHERE, 0,
+                                  listed, NULL);
+  tt_int_op(smartlist_len(added), OP_EQ, 3);
+  smartlist_free(added);
+
+  /* Rebuilding the cache writes a snapshot of it. */
+  tt_int_op(file_status(fname), OP_EQ, FN_NOENT);
+  tt_int_op(0, OP_EQ, microdesc_cache_rebuild(mc, 1));
+  tt_int_op(file_status(fname), OP_EQ, FN_FILE);
+
+  /* Reloading uses the snapshot, and gets what the text says. */
+  setup_capture_of_logs(LOG_INFO);
+  tt_int_op(0, OP_EQ, microdesc_cache_reload(mc));
+  expect_log_msg_containing("Loaded 3 microdescriptors from");
+  assert_cache_holds_test_mds(mc, listed);
+
+  /* If the snapshot is damaged, we parse the text, and write a new
+   * snapshot. */
+  snap = read_file_to_str(fname, RFTS_BIN, &st);
+  tt_assert(snap);
+  snap[st.st_size - 1] ^= 0x01;
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname, snap, st.st_size, 1));
+  mock_clean_saved_logs();
+  tt_int_op(0, OP_EQ, microdesc_cache_reload(mc));
+  expect_log_msg_containing("corrupt");
+  expect_no_log_msg_containing("Loaded 3 microdescriptors from");
+  assert_cache_holds_test_mds(mc, listed);
+  mock_clean_saved_logs();
+  tt_int_op(0, OP_EQ, microdesc_cache_reload(mc));
+  expect_log_msg_containing("Loaded 3 microdescriptors from");
+  assert_cache_holds_test_mds(mc, listed);
+
+ done:
+  teardown_capture_of_logs();
+  nodelist_snapshot_free_all();
+  verified_digests_free_all();
+  microdesc_free_all();
+  tor_free(fname);
+  tor_free(snap);
+}
+
+#define SNAPSHOT_TEST(name) \
+  { #name, test_nodelist_snapshot_ ## name, TT_FORK, NULL, NULL }
+
+struct testcase_t nodelist_snapshot_tests[] = {
+  { "routerstatus_ns", test_nodelist_snapshot_routerstatus, TT_FORK,
+    &passthrough_setup, (void*)"ns" },
+  { "routerstatus_md", test_nodelist_snapshot_routerstatus, TT_FORK,
+    &passthrough_setup, (void*)"microdesc" },
+  SNAPSHOT_TEST(routerstatus_fallback),
+  SNAPSHOT_TEST(microdesc),
+  END_OF_TESTCASES
+};
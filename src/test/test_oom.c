@@ -9,6 +9,7 @@
 #define CONNECTION_PRIVATE
 #include "core/or/or.h"
 #include "lib/buf/buffers.h"
+#include "core/or/cellpool.h"
 #include "core/or/circuitlist.h"
 #include "lib/evloop/compat_libevent.h"
 #include "core/mainloop/connection.h"
@@ -144,6 +145,8 @@ test_oom_circbuf(void *arg)
   c2 = dummy_or_circuit_new(20, 20);
 
   tt_int_op(packed_cell_mem_cost(), OP_EQ,
+            cell_pool_item_mem_cost() + sizeof(packed_cell_t *));
+  tt_int_op(packed_cell_mem_cost(), OP_GE,
             sizeof(packed_cell_t));
   tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
             packed_cell_mem_cost() * 70);
@@ -222,6 +225,8 @@ test_oom_streambuf(void *arg)
   /* Far too low for real life. */
   options->MaxMemInQueues = 81*packed_cell_mem_cost() + 4096 * 34;
   options->CellStatistics = 0;
+  /* Freed chunks must really be freed for the totals below to add up. */
+  buf_set_freelist_cap(0);
 
   tt_int_op(cell_queues_check_size(), OP_EQ, 0); /* We don't start out OOM. */
   tt_int_op(cell_queues_get_total_allocation(), OP_EQ, 0);
@@ -227,6 +227,73 @@ test_parsecommon_tokenize_string_no_annotations(void *arg)
   return;
 }
 
+static void
+test_parsecommon_tokenize_string_keyword_lookup(void *arg)
+{
+  memarea_t *area = memarea_new();
+  smartlist_t *tokens = smartlist_new();
+  directory_token_t *token;
+  int pass;
+  (void)arg;
+
+  /* Keywords that are prefixes of one another, and a repeated keyword: the
+   * first rule for a keyword must win, as it does when we scan. */
+  token_rule_t table[] = {
+    T0N("r", K_DIRREQ_END, ARGS, NO_OBJ),
+    T0N("router", K_ROUTER, ARGS, NO_OBJ),
+    T0N("reject", K_REJECT, ARGS, NO_OBJ),
+    T0N("rejec", K_ACCEPT, ARGS, NO_OBJ),
+    T0N("router", K_UPTIME, ARGS, NO_OBJ),
+    T0N("@purpose", A_PURPOSE, GE(1), NO_OBJ),
+    END_OF_TABLE,
+  };
+  const char *str =
+    "@unknown z\n"
+    "@purpose bridge\n"
+    "router a\tb  c\n"
+    "r x\n"
+    "rejec *:*\n"
+    "reject *:80\n"
+    "routers y\n";
+
+  /* First we scan the table; then we look keywords up in its index. */
+  for (pass = 0; pass < 2; ++pass) {
+    if (pass)
+      token_table_add_index(table);
+    tt_int_op(0, OP_EQ, tokenize_string(area, str, NULL, tokens, table,
+                                        TS_ANNOTATIONS_OK));
+    tt_int_op(smartlist_len(tokens), OP_EQ, 7);
+    token = smartlist_get(tokens, 0);
+    tt_int_op(token->tp, OP_EQ, A_UNKNOWN_);
+    token = smartlist_get(tokens, 1);
+    tt_int_op(token->tp, OP_EQ, A_PURPOSE);
+    token = smartlist_get(tokens, 2);
+    tt_int_op(token->tp, OP_EQ, K_ROUTER);
+    tt_int_op(token->n_args, OP_EQ, 3);
+    tt_str_op(token->args[0], OP_EQ, "a");
+    tt_str_op(token->args[1], OP_EQ, "b");
+    tt_str_op(token->args[2], OP_EQ, "c");
+    token = smartlist_get(tokens, 3);
+    tt_int_op(token->tp, OP_EQ, K_DIRREQ_END);
+    token = smartlist_get(tokens, 4);
+    tt_int_op(token->tp, OP_EQ, K_ACCEPT);
+    token = smartlist_get(tokens, 5);
+    tt_int_op(token->tp, OP_EQ, K_REJECT);
+    token = smartlist_get(tokens, 6);
+    tt_int_op(token->tp, OP_EQ, K_OPT);
+    tt_str_op(token->args[0], OP_EQ, "routers y");
+    SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+    smartlist_clear(tokens);
+  }
+
+ done:
+  SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+  memarea_drop_all(area);
+  smartlist_free(tokens);
+  /* Don't leave an index for our stack table behind. */
+  parsecommon_free_all();
+}
+
 static void
 test_parsecommon_get_next_token_success(void *arg)
 {
@@ -580,6 +647,7 @@ struct testcase_t parsecommon_tests[] = {
   PARSECOMMON_TEST(tokenize_string_at_start),
   PARSECOMMON_TEST(tokenize_string_at_end),
   PARSECOMMON_TEST(tokenize_string_no_annotations),
+  PARSECOMMON_TEST(tokenize_string_keyword_lookup),
   PARSECOMMON_TEST(get_next_token_success),
   PARSECOMMON_TEST(get_next_token_concat_args),
   PARSECOMMON_TEST(get_next_token_parse_keys),
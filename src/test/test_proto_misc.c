@@ -15,6 +15,7 @@
 #include "core/proto/proto_control0.h"
 #include "core/proto/proto_ext_or.h"
 
+#include "core/or/cell_st.h"
 #include "core/or/var_cell_st.h"
 
 static void
@@ -104,6 +105,87 @@ test_proto_var_cell(void *arg)
   tor_free(mem_op_hex_tmp);
 }
 
+static void
+test_proto_fixed_cells(void *arg)
+{
+  (void)arg;
+  char tmp[CELL_MAX_NETWORK_SIZE];
+  cell_t cells[8];
+  buf_t *buf = NULL;
+  const char *head;
+  size_t head_len;
+  int i, n, n_in_head;
+
+  buf = buf_new();
+
+  /* Nothing, or a partial cell, gives us no cells. */
+  tt_int_op(0, OP_EQ, fetch_cells_from_buf(buf, cells, 8, 4));
+  memset(tmp, 0, sizeof(tmp));
+  buf_add(buf, tmp, 100);
+  tt_int_op(0, OP_EQ, fetch_cells_from_buf(buf, cells, 8, 4));
+  buf_clear(buf);
+
+  /* Three fixed-length cells, then a VERSIONS cell: we get the first three
+   * and leave the variable-length cell alone. */
+  for (i = 0; i < 3; ++i) {
+    memset(tmp, 'a'+i, sizeof(tmp));
+    set_uint32(tmp, htonl(0x80000000u + i));
+    tmp[4] = CELL_RELAY;
+    buf_add(buf, tmp, CELL_MAX_NETWORK_SIZE);
+  }
+  buf_add(buf, "\x00\x00\x00\x00\x07\x00\x02\x00\x04", 9);
+  tt_int_op(3, OP_EQ, fetch_cells_from_buf(buf, cells, 8, 4));
+  for (i = 0; i < 3; ++i) {
+    tt_uint_op(cells[i].circ_id, OP_EQ, 0x80000000u + i);
+    tt_int_op(cells[i].command, OP_EQ, CELL_RELAY);
+    tt_int_op(cells[i].payload[0], OP_EQ, 'a'+i);
+    tt_int_op(cells[i].payload[CELL_PAYLOAD_SIZE-1], OP_EQ, 'a'+i);
+  }
+  tt_int_op(buf_datalen(buf), OP_EQ, 9);
+  tt_int_op(0, OP_EQ, fetch_cells_from_buf(buf, cells, 8, 4));
+  tt_int_op(buf_datalen(buf), OP_EQ, 9);
+  buf_clear(buf);
+
+  /* In link protocol 3, circuit IDs are two bytes, and commands of 128 and
+   * up are variable-length. */
+  memset(tmp, 'x', sizeof(tmp));
+  set_uint16(tmp, htons(0x1234));
+  tmp[2] = CELL_CREATE_FAST;
+  buf_add(buf, tmp, CELL_MAX_NETWORK_SIZE - 2);
+  tmp[2] = (char)CELL_AUTH_CHALLENGE;
+  buf_add(buf, tmp, CELL_MAX_NETWORK_SIZE - 2);
+  tt_int_op(1, OP_EQ, fetch_cells_from_buf(buf, cells, 8, 3));
+  tt_uint_op(cells[0].circ_id, OP_EQ, 0x1234);
+  tt_int_op(cells[0].command, OP_EQ, CELL_CREATE_FAST);
+  tt_int_op(cells[0].payload[0], OP_EQ, 'x');
+  tt_int_op(0, OP_EQ, fetch_cells_from_buf(buf, cells, 8, 3));
+  /* ... but in link protocol 1, nothing is. */
+  tt_int_op(1, OP_EQ, fetch_cells_from_buf(buf, cells, 8, 1));
+  tt_int_op(cells[0].command, OP_EQ, CELL_AUTH_CHALLENGE);
+  tt_int_op(buf_datalen(buf), OP_EQ, 0);
+
+  /* We never take more than we're asked for, and we never take a cell that
+   * runs past the end of the first chunk. */
+  memset(tmp, 0, sizeof(tmp));
+  tmp[4] = CELL_PADDING;
+  for (i = 0; i < 20; ++i)
+    buf_add(buf, tmp, CELL_MAX_NETWORK_SIZE);
+  buf_pullup(buf, 0, &head, &head_len);
+  n_in_head = (int)(head_len / CELL_MAX_NETWORK_SIZE);
+  tt_int_op(n_in_head, OP_GT, 2);
+  tt_int_op(n_in_head, OP_LT, 20);
+  tt_int_op(2, OP_EQ, fetch_cells_from_buf(buf, cells, 2, 4));
+  n = 2;
+  while ((i = fetch_cells_from_buf(buf, cells, 8, 4)) > 0)
+    n += i;
+  tt_int_op(n, OP_EQ, n_in_head);
+  tt_int_op(buf_datalen(buf), OP_EQ,
+            (20 - n_in_head) * CELL_MAX_NETWORK_SIZE);
+
+ done:
+  buf_free(buf);
+}
+
 static void
 test_proto_control0(void *arg)
 {
@@ -256,6 +338,7 @@ test_proto_line(void *arg)
 
 struct testcase_t proto_misc_tests[] = {
   { "var_cell", test_proto_var_cell, 0, NULL, NULL },
+  { "fixed_cells", test_proto_fixed_cells, 0, NULL, NULL },
   { "control0", test_proto_control0, 0, NULL, NULL },
   { "ext_or_cmd", test_proto_ext_or_cmd, TT_FORK, NULL, NULL },
   { "line", test_proto_line, 0, NULL, NULL },
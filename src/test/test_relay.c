@@ -5,6 +5,7 @@
 #define RELAY_PRIVATE
 #define REPHIST_PRIVATE
 #include "core/or/or.h"
+#include "core/or/cell_queue.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
 #include "core/or/channeltls.h"
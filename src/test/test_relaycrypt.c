@@ -9,6 +9,7 @@
 #include "core/or/circuitbuild.h"
 #define CIRCUITLIST_PRIVATE
 #include "core/or/circuitlist.h"
+#include "lib/crypt_ops/crypto_cipher.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "core/or/relay.h"
 #include "core/crypto/relay_crypto.h"
@@ -181,12 +182,132 @@ test_relaycrypt_inbound(void *arg)
   ;
 }
 
+/* As above, but hand the cells to the middle relays in batches, the way
+ * relay_decrypt_cells() sees them. */
+static void
+test_relaycrypt_batch(void *arg)
+{
+  testing_circuitset_t *cs = arg;
+
+  /* More than one batch's worth, and not a multiple of the batch size. */
+  const int n_cells = RELAY_CRYPT_BATCH_MAX * 2 + 3;
+  relay_header_t rh;
+  cell_t *orig = tor_calloc(n_cells, sizeof(cell_t));
+  cell_t *encrypted = tor_calloc(n_cells, sizeof(cell_t));
+  cell_t **cellp = tor_calloc(n_cells, sizeof(cell_t *));
+  char *recognized = tor_malloc_zero(n_cells);
+  int i, j;
+
+  tt_assert(cs);
+
+  for (i = 0; i < n_cells; ++i) {
+    crypto_rand((char *)&orig[i], sizeof(cell_t));
+    relay_header_unpack(&rh, orig[i].payload);
+    rh.recognized = 0;
+    memset(rh.integrity, 0, sizeof(rh.integrity));
+    relay_header_pack(orig[i].payload, &rh);
+    cellp[i] = &encrypted[i];
+  }
+
+  /* Outbound to the last hop. */
+  memcpy(encrypted, orig, n_cells * sizeof(cell_t));
+  for (i = 0; i < n_cells; ++i) {
+    relay_encrypt_cell_outbound(&encrypted[i], cs->origin_circ,
+                                cs->origin_circ->cpath->prev);
+  }
+  for (j = 0; j < 3; ++j) {
+    relay_decrypt_cells(TO_CIRCUIT(cs->or_circ[j]), cellp, n_cells,
+                        CELL_DIRECTION_OUT, recognized);
+    for (i = 0; i < n_cells; ++i) {
+      tt_int_op(recognized[i] != 0, OP_EQ, j == 2);
+    }
+  }
+  for (i = 0; i < n_cells; ++i) {
+    tt_mem_op(orig[i].payload, OP_EQ, encrypted[i].payload,
+              CELL_PAYLOAD_SIZE);
+  }
+
+  /* Inbound from the last hop. */
+  memcpy(encrypted, orig, n_cells * sizeof(cell_t));
+  for (i = 0; i < n_cells; ++i) {
+    relay_encrypt_cell_inbound(&encrypted[i], cs->or_circ[2]);
+  }
+  for (j = 1; j >= 0; --j) {
+    relay_decrypt_cells(TO_CIRCUIT(cs->or_circ[j]), cellp, n_cells,
+                        CELL_DIRECTION_IN, recognized);
+    for (i = 0; i < n_cells; ++i) {
+      tt_int_op(recognized[i], OP_EQ, 0);
+    }
+  }
+  for (i = 0; i < n_cells; ++i) {
+    crypt_path_t *layer_hint = NULL;
+    char r = 0;
+    tt_int_op(relay_decrypt_cell(TO_CIRCUIT(cs->origin_circ),
+                                 &encrypted[i], CELL_DIRECTION_IN,
+                                 &layer_hint, &r), OP_EQ, 0);
+    tt_int_op(r, OP_EQ, 1);
+    tt_ptr_op(layer_hint, OP_EQ, cs->origin_circ->cpath->prev);
+    tt_mem_op(orig[i].payload, OP_EQ, encrypted[i].payload,
+              CELL_PAYLOAD_SIZE);
+  }
+
+ done:
+  tor_free(orig);
+  tor_free(encrypted);
+  tor_free(cellp);
+  tor_free(recognized);
+}
+
+/* Check that relay_crypt_payloads() produces exactly what the per-cell path
+ * does, for runs that are shorter than, equal to, and longer than a batch. */
+static void
+test_relaycrypt_payloads(void *arg)
+{
+  const int max_cells = RELAY_CRYPT_BATCH_MAX * 2 + 3;
+  const int n_cells_list[] = { 0, 1, 2, RELAY_CRYPT_BATCH_MAX,
+                               RELAY_CRYPT_BATCH_MAX + 1, max_cells, -1 };
+  uint8_t *one = tor_malloc_zero(max_cells * CELL_PAYLOAD_SIZE);
+  uint8_t *batched = tor_malloc_zero(max_cells * CELL_PAYLOAD_SIZE);
+  uint8_t **payloads = tor_calloc(max_cells, sizeof(uint8_t *));
+  crypto_cipher_t *c_one = NULL, *c_batched = NULL;
+  char key[CIPHER_KEY_LEN];
+  int i, k;
+  (void)arg;
+
+  crypto_rand(key, sizeof(key));
+  c_one = crypto_cipher_new(key);
+  c_batched = crypto_cipher_new(key);
+
+  /* Run several lengths through the same pair of ciphers, so that we also
+   * check that the batched path leaves the stream where it should. */
+  for (k = 0; n_cells_list[k] >= 0; ++k) {
+    const int n_cells = n_cells_list[k];
+    crypto_rand((char *) one, n_cells * CELL_PAYLOAD_SIZE);
+    memcpy(batched, one, n_cells * CELL_PAYLOAD_SIZE);
+    for (i = 0; i < n_cells; ++i) {
+      relay_crypt_one_payload(c_one, one + i * CELL_PAYLOAD_SIZE);
+      payloads[i] = batched + i * CELL_PAYLOAD_SIZE;
+    }
+    relay_crypt_payloads(c_batched, payloads, n_cells);
+    tt_mem_op(one, OP_EQ, batched, n_cells * CELL_PAYLOAD_SIZE);
+  }
+
+ done:
+  crypto_cipher_free(c_one);
+  crypto_cipher_free(c_batched);
+  tor_free(one);
+  tor_free(batched);
+  tor_free(payloads);
+}
+
 #define TEST(name) \
   { # name, test_relaycrypt_ ## name, 0, &relaycrypt_setup, NULL }
 
 struct testcase_t relaycrypt_tests[] = {
   TEST(outbound),
   TEST(inbound),
+  TEST(batch),
+  { "payloads", test_relaycrypt_payloads, 0, NULL, NULL },
   END_OF_TESTCASES
 };
 
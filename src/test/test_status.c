@@ -347,7 +347,7 @@ test_status_hb_not_in_consensus(void *arg)
   actual = log_heartbeat(0);
 
   tt_int_op(actual, OP_EQ, expected);
-  tt_int_op(status_hb_not_in_consensus_logv_called, OP_EQ, 6);
+  tt_int_op(status_hb_not_in_consensus_logv_called, OP_EQ, 8);
 
   done:
     UNMOCK(tls_get_write_overhead_ratio);
@@ -441,12 +441,21 @@ status_hb_not_in_consensus_logv(int severity, log_domain_mask_t domain,
       tt_int_op(va_arg(ap, int), OP_EQ, 1);  /* handshakes requested (NTOR) */
       break;
     case 4:
+    case 5:
+      tt_int_op(severity, OP_EQ, LOG_NOTICE);
+      tt_u64_op(domain, OP_EQ, LD_HEARTBEAT);
+      tt_ptr_op(strstr(funcname, "onion_queue_log_delay_stats"),
+                OP_NE, NULL);
+      tt_str_op(va_arg(ap, char *), OP_EQ,
+                status_hb_not_in_consensus_logv_called == 4 ? "TAP" : "NTor");
+      break;
+    case 6:
       tt_int_op(severity, OP_EQ, LOG_NOTICE);
       tt_u64_op(domain, OP_EQ, LD_HEARTBEAT);
       tt_ptr_op(strstr(funcname, "rep_hist_log_link_protocol_counts"),
                 OP_NE, NULL);
       break;
-    case 5:
+    case 7:
       tt_int_op(severity, OP_EQ, LOG_NOTICE);
       tt_u64_op(domain, OP_EQ, LD_HEARTBEAT);
       tt_str_op(format, OP_EQ, "DoS mitigation since startup:%s%s%s%s%s");
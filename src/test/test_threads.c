@@ -5,8 +5,10 @@
 
 #include "orconfig.h"
 #include "core/or/or.h"
+#include "lib/evloop/workqueue.h"
 #include "lib/thread/threads.h"
 #include "test/test.h"
+#include "test/log_test_helpers.h"
 
 /** mutex for thread test to stop the threads hitting data at the same time. */
 static tor_mutex_t *thread_test_mutex_ = NULL;
@@ -299,6 +301,62 @@ test_threads_conditionvar(void *arg)
   cv_testinfo_free(ti);
 }
 
+/** Number of times that spawn_func_fail_third() has been called. */
+static int n_spawn_calls = 0;
+
+/** Mock for spawn_func(): launch threads, except on the third call. */
+static int
+spawn_func_fail_third(void (*func)(void *), void *data)
+{
+  if (++n_spawn_calls == 3)
+    return -1;
+  return spawn_func__real(func, data);
+}
+
+/** Number of threadpool thread states that we've made and not freed. */
+static int n_threadpool_states = 0;
+
+static void *
+threadpool_new_state(void *arg)
+{
+  ++n_threadpool_states;
+  return arg;
+}
+
+static void
+threadpool_free_state(void *arg)
+{
+  (void)arg;
+  --n_threadpool_states;
+}
+
+static void
+test_threads_threadpool_spawn_fails(void *arg)
+{
+  replyqueue_t *rq;
+  threadpool_t *tp;
+  (void)arg;
+
+  rq = replyqueue_new(0);
+  tt_assert(rq);
+  MOCK(spawn_func, spawn_func_fail_third);
+  setup_full_capture_of_logs(LOG_ERR);
+
+  /* We launch two threads, fail on the third, and give up on the pool.
+   * By the time we return, the two threads must have exited without
+   * touching the pool, and all four states must be gone. */
+  tp = threadpool_new(4, rq, threadpool_new_state, threadpool_free_state,
+                      NULL);
+  tt_ptr_op(tp, OP_EQ, NULL);
+  tt_int_op(n_spawn_calls, OP_EQ, 3);
+  tt_int_op(n_threadpool_states, OP_EQ, 0);
+  expect_single_log_msg_containing("Can't launch worker thread");
+
+ done:
+  teardown_capture_of_logs();
+  UNMOCK(spawn_func);
+}
+
 #define THREAD_TEST(name)                                               \
   { #name, test_threads_##name, TT_FORK, NULL, NULL }
 
@@ -308,5 +366,6 @@ struct testcase_t thread_tests[] = {
     &passthrough_setup, (void*)"no-tv" },
   { "conditionvar_timeout", test_threads_conditionvar, TT_FORK,
     &passthrough_setup, (void*)"tv" },
+  THREAD_TEST(threadpool_spawn_fails),
   END_OF_TESTCASES
 };
@@ -23,7 +23,12 @@
 #include "lib/tls/tortls.h"
 #include "lib/tls/tortls_st.h"
 #include "lib/tls/tortls_internal.h"
+#include "lib/tls/buffers_tls.h"
+#include "lib/tls/tls_dataplane.h"
+#include "lib/buf/buffers.h"
 #include "lib/encoding/pem.h"
+#include "lib/net/socket.h"
+#include "lib/net/socketpair.h"
 #include "app/config/or_state_st.h"
 
 #include "test/test.h"
@@ -462,6 +467,163 @@ test_tortls_is_server(void *arg)
   crypto_pk_free(pk2);
 }
 
+/** Helper for test_tortls_dataplane: make a client and a server TLS object
+ * that have finished a handshake with each other over a socketpair, and
+ * store them in *<b>client_out</b> and *<b>server_out</b>.  Return 0 on
+ * success and -1 on failure. */
+static int
+dataplane_tls_pair_new(tor_tls_t **client_out, tor_tls_t **server_out)
+{
+  tor_socket_t fds[2];
+  tor_tls_t *client, *server;
+  int client_done = 0, server_done = 0;
+
+  if (tor_ersatz_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    return -1;
+  set_socket_nonblocking(fds[0]);
+  set_socket_nonblocking(fds[1]);
+  *client_out = client = tor_tls_new(fds[0], 0);
+  *server_out = server = tor_tls_new(fds[1], 1);
+  if (!client || !server)
+    return -1;
+
+  for (int i = 0; i < 100 && !(client_done && server_done); ++i) {
+    int r;
+    if (!client_done) {
+      r = tor_tls_handshake(client);
+      if (TOR_TLS_IS_ERROR(r))
+        return -1;
+      client_done = (r == TOR_TLS_DONE);
+    }
+    if (!server_done) {
+      r = tor_tls_handshake(server);
+      if (TOR_TLS_IS_ERROR(r))
+        return -1;
+      server_done = (r == TOR_TLS_DONE);
+    }
+  }
+  return (client_done && server_done) ? 0 : -1;
+}
+
+static void
+test_tortls_dataplane(void *arg)
+{
+  (void)arg;
+#define N_PAIRS 12
+#define N_BYTES 10000
+  crypto_pk_t *pk1 = NULL, *pk2 = NULL;
+  tor_tls_t *client[N_PAIRS], *server[N_PAIRS];
+  buf_t *outbuf[N_PAIRS], *inbuf[N_PAIRS];
+  size_t flushlen[N_PAIRS];
+  char *data = NULL, *got = NULL;
+  tls_dataplane_stats_t stats;
+  int i, r, round;
+
+  memset(client, 0, sizeof(client));
+  memset(server, 0, sizeof(server));
+  memset(outbuf, 0, sizeof(outbuf));
+  memset(inbuf, 0, sizeof(inbuf));
+  pk1 = pk_generate(2);
+  pk2 = pk_generate(0);
+  tt_int_op(0, OP_EQ, tor_tls_context_init(TOR_TLS_CTX_IS_PUBLIC_SERVER,
+                                           pk1, pk2, 86400));
+  tt_int_op(0, OP_EQ, tls_dataplane_init(3));
+  tt_int_op(3, OP_EQ, tls_dataplane_get_n_threads());
+
+  data = tor_malloc(N_BYTES);
+  got = tor_malloc(N_BYTES);
+  for (i = 0; i < N_PAIRS; ++i) {
+    if (dataplane_tls_pair_new(&client[i], &server[i]) < 0)
+      tt_skip();
+    outbuf[i] = buf_new();
+    inbuf[i] = buf_new();
+    memset(data, 'a' + i, N_BYTES);
+    buf_add(outbuf[i], data, N_BYTES);
+    flushlen[i] = N_BYTES;
+  }
+
+  /* Every client writes its whole outbuf in one batch; buf_flush_to_tls()
+   * then collects the results. */
+  for (i = 0; i < N_PAIRS; ++i)
+    tls_dataplane_prepare_flush(outbuf[i], client[i], N_BYTES, &flushlen[i],
+                                i);
+  tls_dataplane_start();
+  tls_dataplane_finish();
+  for (i = 0; i < N_PAIRS; ++i) {
+    r = buf_flush_to_tls(outbuf[i], client[i], flushlen[i], &flushlen[i]);
+    tt_int_op(r, OP_EQ, N_BYTES);
+    tt_int_op(flushlen[i], OP_EQ, 0);
+    tt_int_op(buf_datalen(outbuf[i]), OP_EQ, 0);
+  }
+  tls_dataplane_clear_results();
+
+  /* Now the servers read it back.  We leave the results for odd-numbered
+   * pairs uncollected: tls_dataplane_clear_results() must still add their
+   * data to the buffers. */
+  for (round = 0; round < 20; ++round) {
+    int done = 1;
+    for (i = 0; i < N_PAIRS; ++i) {
+      if (buf_datalen(inbuf[i]) < N_BYTES) {
+        tls_dataplane_prepare_read(inbuf[i], server[i],
+                                   N_BYTES - buf_datalen(inbuf[i]), i);
+        done = 0;
+      }
+    }
+    if (done)
+      break;
+    tls_dataplane_start();
+    tls_dataplane_finish();
+    for (i = 0; i < N_PAIRS; i += 2) {
+      size_t before = buf_datalen(inbuf[i]);
+      r = buf_read_from_tls(inbuf[i], server[i], N_BYTES);
+      if (r >= 0)
+        tt_int_op(buf_datalen(inbuf[i]), OP_EQ, before + r);
+      else
+        tt_int_op(r, OP_EQ, TOR_TLS_WANTREAD);
+    }
+    tls_dataplane_clear_results();
+  }
+  for (i = 0; i < N_PAIRS; ++i) {
+    memset(data, 'a' + i, N_BYTES);
+    tt_int_op(buf_datalen(inbuf[i]), OP_EQ, N_BYTES);
+    buf_get_bytes(inbuf[i], got, N_BYTES);
+    tt_mem_op(got, OP_EQ, data, N_BYTES);
+  }
+
+  /* Results for a forgotten buffer are dropped. */
+  buf_add(outbuf[0], "hello", 5);
+  flushlen[0] = 5;
+  tls_dataplane_prepare_flush(outbuf[0], client[0], 5, &flushlen[0], 0);
+  tls_dataplane_start();
+  tls_dataplane_finish();
+  tls_dataplane_forget(outbuf[0]);
+  r = buf_flush_to_tls(outbuf[0], client[0], 0, &flushlen[0]);
+  tt_int_op(r, OP_EQ, 0);
+  tls_dataplane_clear_results();
+  tt_int_op(buf_datalen(outbuf[0]), OP_EQ, 5);
+
+  tls_dataplane_get_stats(&stats);
+  tt_u64_op(stats.n_writes, OP_EQ, N_PAIRS + 1);
+  tt_u64_op(stats.n_bytes_written, OP_EQ, N_PAIRS * N_BYTES + 5);
+  tt_u64_op(stats.n_bytes_read, OP_EQ, N_PAIRS * N_BYTES);
+  tt_u64_op(stats.n_parallel_batches, OP_GE, 2);
+
+ done:
+  tls_dataplane_free_all();
+  for (i = 0; i < N_PAIRS; ++i) {
+    tor_tls_free(client[i]);
+    tor_tls_free(server[i]);
+    buf_free(outbuf[i]);
+    buf_free(inbuf[i]);
+  }
+  tor_free(data);
+  tor_free(got);
+  crypto_pk_free(pk1);
+  crypto_pk_free(pk2);
+#undef N_PAIRS
+#undef N_BYTES
+}
+
 static void
 test_tortls_verify(void *ignored)
 {
@@ -532,6 +694,7 @@ struct testcase_t tortls_tests[] = {
   LOCAL_TEST_CASE(address, TT_FORK),
   LOCAL_TEST_CASE(is_server, 0),
   LOCAL_TEST_CASE(bridge_init, TT_FORK),
+  LOCAL_TEST_CASE(dataplane, TT_FORK),
   LOCAL_TEST_CASE(verify, TT_FORK),
   END_OF_TESTCASES
 };
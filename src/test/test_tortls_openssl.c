@@ -40,6 +40,8 @@ ENABLE_GCC_WARNING("-Wredundant-decls")
 #include "lib/tls/tortls.h"
 #include "lib/tls/tortls_st.h"
 #include "lib/tls/tortls_internal.h"
+#include "lib/net/socket.h"
+#include "lib/net/socketpair.h"
 #include "app/config/or_state_st.h"
 
 #include "test/test.h"
@@ -2256,6 +2258,267 @@ test_tortls_context_init_one(void *ignored)
   UNMOCK(crypto_pk_new);
 }
 
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+/* OpenSSL's internal BIO control for handing one direction's record keys
+ * to the kernel.  On a socket BIO, this is where the setsockopt() calls
+ * happen. */
+#define FAKE_KTLS_CTRL_SET_KTLS 72
+#define FAKE_KTLS_CTRL_SET_KTLS_SEND_CTRL_MSG 74
+#define FAKE_KTLS_CTRL_CLEAR_KTLS_CTRL_MSG 75
+
+/** What a fake_ktls BIO pretends the kernel did with the keys that OpenSSL
+ * tried to hand it. */
+typedef struct fake_ktls_t {
+  int accept; /**< Should the kernel take over the keys it's given? */
+  int n_tx_offers; /**< How many times were we offered send keys? */
+  int n_rx_offers; /**< How many times were we offered receive keys? */
+  int tx; /**< Has the kernel taken over encrypting what we send? */
+  int rx; /**< Has the kernel taken over decrypting what we receive? */
+  /** Plaintext that was written after the kernel took over encryption. */
+  char sent[64];
+  size_t sent_len;
+} fake_ktls_t;
+
+static BIO_METHOD *fake_ktls_method = NULL;
+
+static int
+fake_ktls_bio_write(BIO *b, const char *data, int len)
+{
+  fake_ktls_t *k = BIO_get_data(b);
+  int r;
+  BIO_clear_retry_flags(b);
+  if (k->tx) {
+    /* This would be the kernel's job to encrypt; just remember it. */
+    size_t n = MIN((size_t)len, sizeof(k->sent) - k->sent_len);
+    memcpy(k->sent + k->sent_len, data, n);
+    k->sent_len += n;
+    return len;
+  }
+  r = BIO_write(BIO_next(b), data, len);
+  BIO_copy_next_retry(b);
+  return r;
+}
+
+static int
+fake_ktls_bio_read(BIO *b, char *data, int len)
+{
+  int r;
+  BIO_clear_retry_flags(b);
+  r = BIO_read(BIO_next(b), data, len);
+  BIO_copy_next_retry(b);
+  return r;
+}
+
+static long
+fake_ktls_bio_ctrl(BIO *b, int cmd, long num, void *ptr)
+{
+  fake_ktls_t *k = BIO_get_data(b);
+  switch (cmd) {
+    case FAKE_KTLS_CTRL_SET_KTLS:
+      if (num) {
+        ++k->n_tx_offers;
+        k->tx |= k->accept;
+      } else {
+        ++k->n_rx_offers;
+        k->rx |= k->accept;
+      }
+      return k->accept;
+    case BIO_CTRL_GET_KTLS_SEND:
+      return k->tx;
+    case BIO_CTRL_GET_KTLS_RECV:
+      return k->rx;
+    case FAKE_KTLS_CTRL_SET_KTLS_SEND_CTRL_MSG:
+    case FAKE_KTLS_CTRL_CLEAR_KTLS_CTRL_MSG:
+      return 1;
+    default:
+      if (! BIO_next(b))
+        return 0;
+      return BIO_ctrl(BIO_next(b), cmd, num, ptr);
+  }
+}
+
+static int
+fake_ktls_bio_create(BIO *b)
+{
+  BIO_set_init(b, 1);
+  return 1;
+}
+
+/** Put a BIO in front of <b>tls</b>'s socket that stands in for the
+ * kernel's TLS support, and reports what happens to <b>kernel</b>. */
+static void
+fake_ktls_install(tor_tls_t *tls, fake_ktls_t *kernel)
+{
+  BIO *sock = SSL_get_rbio(tls->ssl);
+  BIO *filter;
+
+  if (!fake_ktls_method) {
+    fake_ktls_method = BIO_meth_new(BIO_get_new_index()|BIO_TYPE_FILTER,
+                                    "fake kernel TLS");
+    BIO_meth_set_write(fake_ktls_method, fake_ktls_bio_write);
+    BIO_meth_set_read(fake_ktls_method, fake_ktls_bio_read);
+    BIO_meth_set_ctrl(fake_ktls_method, fake_ktls_bio_ctrl);
+    BIO_meth_set_create(fake_ktls_method, fake_ktls_bio_create);
+  }
+  filter = BIO_new(fake_ktls_method);
+  BIO_set_data(filter, kernel);
+  BIO_up_ref(sock);
+  BIO_push(filter, sock);
+  SSL_set_bio(tls->ssl, filter, filter);
+}
+
+/** Make a client and a server TLS object that ask for kernel offload, in
+ * front of fake kernels <b>client_kernel</b> and <b>server_kernel</b>, and
+ * have them finish a handshake with each other.  Return 0 on success and -1
+ * on failure. */
+static int
+fake_ktls_handshake(fake_ktls_t *client_kernel, fake_ktls_t *server_kernel,
+                    tor_tls_t **client_out, tor_tls_t **server_out)
+{
+  tor_socket_t fds[2];
+  int client_done = 0, server_done = 0;
+  int i;
+
+  *client_out = *server_out = NULL;
+  if (tor_ersatz_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    return -1;
+  set_socket_nonblocking(fds[0]);
+  set_socket_nonblocking(fds[1]);
+  *client_out = tor_tls_new(fds[0], 0);
+  *server_out = tor_tls_new(fds[1], 1);
+  if (!*client_out || !*server_out)
+    return -1;
+  fake_ktls_install(*client_out, client_kernel);
+  fake_ktls_install(*server_out, server_kernel);
+
+  /* Loopback TCP doesn't always deliver at once, so give each side up to a
+   * second to hear from the other. */
+  for (i = 0; i < 1000 && !(client_done && server_done); ++i) {
+    int r;
+    if (!client_done) {
+      r = tor_tls_handshake(*client_out);
+      if (TOR_TLS_IS_ERROR(r))
+        return -1;
+      client_done = (r == TOR_TLS_DONE);
+    }
+    if (!server_done) {
+      r = tor_tls_handshake(*server_out);
+      if (TOR_TLS_IS_ERROR(r))
+        return -1;
+      server_done = (r == TOR_TLS_DONE);
+    }
+    if (!(client_done && server_done))
+      tor_sleep_msec(1);
+  }
+  return (client_done && server_done) ? 0 : -1;
+}
+
+/** Read up to <b>len</b> bytes from <b>tls</b> into <b>buf</b>, waiting up
+ * to a second for them to arrive.  Return as tor_tls_read(). */
+static int
+fake_ktls_read(tor_tls_t *tls, char *buf, size_t len)
+{
+  int i, r = TOR_TLS_WANTREAD;
+  for (i = 0; i < 1000 && r == TOR_TLS_WANTREAD; ++i) {
+    r = tor_tls_read(tls, buf, len);
+    if (r == TOR_TLS_WANTREAD)
+      tor_sleep_msec(1);
+  }
+  return r;
+}
+
+static void
+test_tortls_kernel_offload(void *ignored)
+{
+  (void)ignored;
+  crypto_pk_t *pk1 = NULL, *pk2 = NULL;
+  tor_tls_t *client = NULL, *server = NULL;
+  fake_ktls_t client_kernel, server_kernel;
+  int tx = -1, rx = -1;
+
+  memset(&client_kernel, 0, sizeof(client_kernel));
+  memset(&server_kernel, 0, sizeof(server_kernel));
+  client_kernel.accept = server_kernel.accept = 1;
+  pk1 = pk_generate(2);
+  pk2 = pk_generate(0);
+  tt_int_op(tor_tls_context_init(
+                 TOR_TLS_CTX_IS_PUBLIC_SERVER|TOR_TLS_CTX_USE_KTLS,
+                 pk1, pk2, 86400), OP_EQ, 0);
+  tt_int_op(fake_ktls_handshake(&client_kernel, &server_kernel,
+                                &client, &server), OP_EQ, 0);
+
+  /* OpenSSL handed the send keys to the kernel, and we say so. */
+  tt_int_op(client_kernel.n_tx_offers, OP_GE, 1);
+  tt_int_op(client_kernel.tx, OP_EQ, 1);
+  tt_int_op(tor_tls_get_kernel_offload(client, &tx, &rx), OP_EQ, 0);
+  tt_int_op(tx, OP_EQ, 1);
+  tt_int_op(rx, OP_EQ, client_kernel.rx);
+
+  /* From now on, our writes reach the kernel unencrypted. */
+  tt_int_op(tor_tls_write(client, "offload", 7), OP_EQ, 7);
+  tt_int_op(client_kernel.sent_len, OP_EQ, 7);
+  tt_mem_op(client_kernel.sent, OP_EQ, "offload", 7);
+
+ done:
+  tor_tls_free(client);
+  tor_tls_free(server);
+  crypto_pk_free(pk1);
+  crypto_pk_free(pk2);
+}
+
+static void
+test_tortls_kernel_offload_fallback(void *ignored)
+{
+  (void)ignored;
+  crypto_pk_t *pk1 = NULL, *pk2 = NULL;
+  tor_tls_t *client = NULL, *server = NULL;
+  fake_ktls_t client_kernel, server_kernel;
+  int tx = -1, rx = -1;
+  char buf[16];
+
+  /* The kernel turns down every offer, as it would without the "tls"
+   * module, or for a cipher it doesn't know. */
+  memset(&client_kernel, 0, sizeof(client_kernel));
+  memset(&server_kernel, 0, sizeof(server_kernel));
+  pk1 = pk_generate(2);
+  pk2 = pk_generate(0);
+  tt_int_op(tor_tls_context_init(
+                 TOR_TLS_CTX_IS_PUBLIC_SERVER|TOR_TLS_CTX_USE_KTLS,
+                 pk1, pk2, 86400), OP_EQ, 0);
+  tt_int_op(fake_ktls_handshake(&client_kernel, &server_kernel,
+                                &client, &server), OP_EQ, 0);
+
+  tt_int_op(client_kernel.n_tx_offers, OP_GE, 1);
+  tt_int_op(server_kernel.n_tx_offers, OP_GE, 1);
+  tt_int_op(tor_tls_get_kernel_offload(client, &tx, &rx), OP_EQ, 0);
+  tt_int_op(tx, OP_EQ, 0);
+  tt_int_op(rx, OP_EQ, 0);
+  tt_int_op(tor_tls_get_kernel_offload(server, &tx, &rx), OP_EQ, 0);
+  tt_int_op(tx, OP_EQ, 0);
+  tt_int_op(rx, OP_EQ, 0);
+
+  /* OpenSSL keeps doing the record crypto, in both directions. */
+  tt_int_op(tor_tls_write(client, "fallback", 8), OP_EQ, 8);
+  tt_int_op(fake_ktls_read(server, buf, sizeof(buf)), OP_EQ, 8);
+  tt_mem_op(buf, OP_EQ, "fallback", 8);
+
+  tt_int_op(tor_tls_write(server, "userspace", 9), OP_EQ, 9);
+  tt_int_op(fake_ktls_read(client, buf, sizeof(buf)), OP_EQ, 9);
+  tt_mem_op(buf, OP_EQ, "userspace", 9);
+  tt_int_op(client_kernel.sent_len, OP_EQ, 0);
+
+ done:
+  tor_tls_free(client);
+  tor_tls_free(server);
+  crypto_pk_free(pk1);
+  crypto_pk_free(pk2);
+}
+#define KTLS_TEST_CASE(name, flags) LOCAL_TEST_CASE(name, flags)
+#else /* !(defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)) */
+#define KTLS_TEST_CASE(name, flags)             \
+  { #name, NULL, TT_SKIP, NULL, NULL }
+#endif /* defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS) */
+
 #define LOCAL_TEST_CASE(name, flags)                    \
   { #name, test_tortls_##name, (flags|TT_FORK), NULL, NULL }
 
@@ -2308,5 +2571,7 @@ struct testcase_t tortls_openssl_tests[] = {
   LOCAL_TEST_CASE(cert_new, 0),
   LOCAL_TEST_CASE(cert_is_valid, 0),
   LOCAL_TEST_CASE(context_init_one, 0),
+  KTLS_TEST_CASE(kernel_offload, 0),
+  KTLS_TEST_CASE(kernel_offload_fallback, 0),
   END_OF_TESTCASES
 };
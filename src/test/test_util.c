@@ -2460,6 +2460,10 @@ test_util_compress_impl(compress_method_t method)
     // detectable as "the identity transform."
     tt_int_op(len1, OP_EQ, strlen(buf1)+1);
     tt_int_op(detect_compression_method(buf2, len1), OP_EQ, UNKNOWN_METHOD);
+  } else if (method == ZSTD_DICT_METHOD) {
+    // Our dictionary doesn't show up in the frame header.
+    tt_int_op(len1, OP_LT, strlen(buf1));
+    tt_int_op(detect_compression_method(buf2, len1), OP_EQ, ZSTD_METHOD);
   } else {
     tt_int_op(len1, OP_LT, strlen(buf1));
     tt_int_op(detect_compression_method(buf2, len1), OP_EQ, method);
@@ -2490,7 +2494,7 @@ test_util_compress_impl(compress_method_t method)
   tor_free(buf3);
 
   size_t b1len = 1<<10;
-  if (method == ZSTD_METHOD) {
+  if (method == ZSTD_METHOD || method == ZSTD_DICT_METHOD) {
     // zstd needs a big input before it starts generating output that it
     // can partially decompress.
     b1len = 1<<18;
@@ -2804,6 +2808,56 @@ test_util_decompress_dos(void *arg)
   ;
 }
 
+static void
+test_util_compress_zstd_dict(void *arg)
+{
+  /* A single microdescriptor: small enough that plain zstd has almost
+   * nothing to work with. */
+  static const char md[] =
+    "onion-key\n"
+    "-----BEGIN RSA PUBLIC KEY-----\n"
+    "MIGJAoGBAMHkZeXNDX/49JqM2BVLmh1Fnb5iMVnatvZZTLJyedqDLkbXZ1WKP5oh\n"
+    "7ec14dj/k3ntpwHD4s2o3Lb6nfagWbug4+F/rNJ7JuFru/PSyOvDyHGNAuegOXph\n"
+    "3gTGjdDpv/yPoiadGebbVe8E7n6hO+XxM2W/4dqheKimF0/s9B7HAgMBAAE=\n"
+    "-----END RSA PUBLIC KEY-----\n"
+    "ntor-onion-key QgF/EjqlNG1wRHLIop/nCekEH+ETGZSgYOhu26eiTF4=\n"
+    "p accept 20-23,43,53,79-81,88,110,143,194,220,389,443,464,531,543-544\n"
+    "id ed25519 BzffzY99z6Q8KltcFlUTLWjNTBU7yKK+uQhyi1Ivb3A\n";
+  char *plain = NULL, *with_dict = NULL, *out = NULL;
+  size_t plain_len, with_dict_len, out_len;
+  (void)arg;
+
+  if (! tor_compress_supports_method(ZSTD_DICT_METHOD)) {
+    tt_skip();
+  }
+  tt_assert(tor_compress_supports_method(ZSTD_METHOD));
+
+  tt_int_op(0, OP_EQ, tor_compress(&plain, &plain_len, md, strlen(md),
+                                   ZSTD_METHOD));
+  tt_int_op(0, OP_EQ, tor_compress(&with_dict, &with_dict_len,
+                                   md, strlen(md), ZSTD_DICT_METHOD));
+  tt_int_op(with_dict_len, OP_LT, plain_len);
+
+  tt_int_op(0, OP_EQ, tor_uncompress(&out, &out_len, with_dict, with_dict_len,
+                                     ZSTD_DICT_METHOD, 1, LOG_WARN));
+  tt_str_op(out, OP_EQ, md);
+  tor_free(out);
+
+  /* Without the dictionary, the frame makes no sense. */
+  setup_capture_of_logs(LOG_WARN);
+  tt_int_op(-1, OP_EQ, tor_uncompress(&out, &out_len,
+                                      with_dict, with_dict_len,
+                                      ZSTD_METHOD, 1, LOG_INFO));
+  tt_ptr_op(out, OP_EQ, NULL);
+  expect_log_msg_containing("Zstandard decompression didn't finish");
+
+ done:
+  teardown_capture_of_logs();
+  tor_free(plain);
+  tor_free(with_dict);
+  tor_free(out);
+}
+
 static void
 test_util_gzip_compression_bomb(void *arg)
 {
@@ -6441,12 +6495,14 @@ struct testcase_t util_tests[] = {
   COMPRESS(lzma, "x-tor-lzma"),
   COMPRESS(zstd, "x-zstd"),
   COMPRESS(zstd_nostatic, "x-zstd:nostatic"),
+  COMPRESS(zstd_dict, "x-tor-zstd-dict"),
   COMPRESS(none, "identity"),
   COMPRESS_CONCAT(zlib, "deflate"),
   COMPRESS_CONCAT(gzip, "gzip"),
   COMPRESS_CONCAT(lzma, "x-tor-lzma"),
   COMPRESS_CONCAT(zstd, "x-zstd"),
   COMPRESS_CONCAT(zstd_nostatic, "x-zstd:nostatic"),
+  COMPRESS_CONCAT(zstd_dict, "x-tor-zstd-dict"),
   COMPRESS_CONCAT(none, "identity"),
   COMPRESS_JUNK(zlib, "deflate"),
   COMPRESS_JUNK(gzip, "gzip"),
@@ -6456,6 +6512,8 @@ struct testcase_t util_tests[] = {
   COMPRESS_DOS(lzma, "x-tor-lzma"),
   COMPRESS_DOS(zstd, "x-zstd"),
   COMPRESS_DOS(zstd_nostatic, "x-zstd:nostatic"),
+  COMPRESS_DOS(zstd_dict, "x-tor-zstd-dict"),
+  UTIL_TEST(compress_zstd_dict, 0),
   UTIL_TEST(gzip_compression_bomb, TT_FORK),
   UTIL_LEGACY(datadir),
   UTIL_LEGACY(memarea),
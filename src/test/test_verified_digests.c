@@ -0,0 +1,279 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#define VERIFIED_DIGESTS_PRIVATE
+
+#include "core/or/or.h"
+#include "app/config/config.h"
+#include "feature/nodelist/verified_digests.h"
+#include "lib/crypt_ops/crypto_digest.h"
+#include "lib/crypt_ops/crypto_rand.h"
+#include "lib/encoding/binascii.h"
+#include "lib/fs/files.h"
+#include "lib/version/torversion.h"
+
+#include "test/test.h"
+
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
+/** Point our data and cache directories at a new, empty directory called
+ * <b>name</b>. */
+static void
+setup_dirs(const char *name)
+{
+  or_options_t *options = get_options_mutable();
+  char *dir = tor_strdup(get_fname(name));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(dir));
+#else
+  tt_int_op(0, OP_EQ, mkdir(dir, 0700));
+#endif
+  tor_free(options->DataDirectory);
+  tor_free(options->CacheDirectory);
+  options->DataDirectory = tor_strdup(dir);
+  options->CacheDirectory = dir;
+ done:
+  ;
+}
+
+static void
+test_verified_digests_roundtrip(void *arg)
+{
+  uint8_t d[3][DIGEST256_LEN], other[DIGEST256_LEN];
+  char *fname = NULL;
+  (void)arg;
+
+  update_approx_time(1500000000);
+  setup_dirs("vd_roundtrip");
+  crypto_rand((char *)d, sizeof(d));
+  crypto_rand((char *)other, sizeof(other));
+
+  /* Until we load, we know nothing and remember nothing. */
+  tt_assert(!verified_digests_is_loaded());
+  verified_digests_add(d[0]);
+  tt_assert(!verified_digests_contains(d[0]));
+  tt_int_op(0, OP_EQ, verified_digests_save());
+
+  tt_int_op(0, OP_EQ, verified_digests_load());
+  tt_assert(verified_digests_is_loaded());
+  tt_int_op(0, OP_EQ, verified_digests_size());
+  verified_digests_add(d[0]);
+  verified_digests_add(d[1]);
+  verified_digests_add(d[2]);
+  tt_assert(verified_digests_contains(d[1]));
+  tt_assert(!verified_digests_contains(other));
+  tt_int_op(0, OP_EQ, verified_digests_save());
+  verified_digests_free_all();
+  tt_assert(!verified_digests_contains(d[1]));
+
+  tt_int_op(0, OP_EQ, verified_digests_load());
+  tt_int_op(3, OP_EQ, verified_digests_size());
+  tt_assert(verified_digests_contains(d[0]));
+  tt_assert(verified_digests_contains(d[1]));
+  tt_assert(verified_digests_contains(d[2]));
+  tt_assert(!verified_digests_contains(other));
+
+  /* Lookups alone, or adding what we already have, don't make us rewrite
+   * the journal. */
+  fname = get_cachedir_fname("cached-verified-digests");
+  tt_int_op(0, OP_EQ, unlink(fname));
+  verified_digests_add(d[2]);
+  tt_int_op(0, OP_EQ, verified_digests_save());
+  tt_assert(file_status(fname) == FN_NOENT);
+  verified_digests_add(other);
+  tt_int_op(0, OP_EQ, verified_digests_save());
+  tt_assert(file_status(fname) == FN_FILE);
+
+ done:
+  verified_digests_free_all();
+  tor_free(fname);
+}
+
+static void
+test_verified_digests_expire(void *arg)
+{
+  uint8_t d[2][DIGEST256_LEN];
+  const time_t start = 1500000000;
+  (void)arg;
+
+  update_approx_time(start);
+  setup_dirs("vd_expire");
+  crypto_rand((char *)d, sizeof(d));
+
+  tt_int_op(0, OP_EQ, verified_digests_load());
+  verified_digests_add(d[0]);
+  verified_digests_add(d[1]);
+
+  /* Looking up d[1] later keeps it alive. */
+  update_approx_time(start + VERIFIED_DIGESTS_MAX_AGE - 10);
+  tt_assert(verified_digests_contains(d[1]));
+  update_approx_time(start + VERIFIED_DIGESTS_MAX_AGE + 10);
+  tt_int_op(0, OP_EQ, verified_digests_save());
+  tt_int_op(1, OP_EQ, verified_digests_size());
+
+  tt_int_op(0, OP_EQ, verified_digests_load());
+  tt_int_op(1, OP_EQ, verified_digests_size());
+  tt_assert(!verified_digests_contains(d[0]));
+  tt_assert(verified_digests_contains(d[1]));
+
+ done:
+  verified_digests_free_all();
+}
+
+/** Save a journal with one digest in it, and return its contents. */
+static char *
+save_one_digest(void)
+{
+  uint8_t d[DIGEST256_LEN];
+  char *fname = get_cachedir_fname("cached-verified-digests");
+  char *body = NULL;
+
+  crypto_rand((char *)d, sizeof(d));
+  tt_int_op(0, OP_EQ, verified_digests_load());
+  verified_digests_add(d);
+  tt_int_op(0, OP_EQ, verified_digests_save());
+  verified_digests_free_all();
+  body = read_file_to_str(fname, 0, NULL);
+ done:
+  tor_free(fname);
+  return body;
+}
+
+static void
+test_verified_digests_tampered(void *arg)
+{
+  char *fname = NULL, *keyfname = NULL, *body = NULL, *p;
+  (void)arg;
+
+  update_approx_time(1500000000);
+  setup_dirs("vd_tampered");
+  fname = get_cachedir_fname("cached-verified-digests");
+  keyfname = get_datadir_fname("verified-digests-key");
+
+  /* Change a digest. */
+  body = save_one_digest();
+  tt_assert(body);
+  p = strstr(body, "\ntor-version ");
+  tt_assert(p);
+  p = strchr(p + 1, '\n');
+  tt_assert(p);
+  p[1] = (p[1] == '0') ? '1' : '0';
+  tt_int_op(0, OP_EQ, write_str_to_file(fname, body, 0));
+  tt_int_op(0, OP_EQ, verified_digests_load());
+  tt_int_op(0, OP_EQ, verified_digests_size());
+  tor_free(body);
+
+  /* Remove the MAC. */
+  body = save_one_digest();
+  tt_assert(body);
+  p = strstr(body, "mac ");
+  tt_assert(p);
+  *p = '\0';
+  tt_int_op(0, OP_EQ, write_str_to_file(fname, body, 0));
+  tt_int_op(0, OP_EQ, verified_digests_load());
+  tt_int_op(0, OP_EQ, verified_digests_size());
+  tor_free(body);
+
+  /* Add junk after the MAC. */
+  body = save_one_digest();
+  tt_assert(body);
+  tt_int_op(0, OP_EQ, verified_digests_load());
+  tt_int_op(1, OP_EQ, verified_digests_size());
+  p = strrchr(body, '\n');
+  tt_assert(p);
+  *p = '\0';
+  tor_asprintf(&p, "%s0\n", body);
+  tor_free(body);
+  body = p;
+  tt_int_op(0, OP_EQ, write_str_to_file(fname, body, 0));
+  tt_int_op(0, OP_EQ, verified_digests_load());
+  tt_int_op(0, OP_EQ, verified_digests_size());
+  tor_free(body);
+
+  /* Replace the key. */
+  body = save_one_digest();
+  tt_assert(body);
+  tt_int_op(0, OP_EQ, write_str_to_file(keyfname,
+                                "0123456789abcdef0123456789abcdef", 1));
+  tt_int_op(0, OP_EQ, verified_digests_load());
+  tt_int_op(0, OP_EQ, verified_digests_size());
+  tor_free(body);
+
+  /* Lose the key: we should make a new one, and not trust the journal. */
+  body = save_one_digest();
+  tt_assert(body);
+  tt_int_op(0, OP_EQ, unlink(keyfname));
+  tt_int_op(0, OP_EQ, verified_digests_load());
+  tt_int_op(0, OP_EQ, verified_digests_size());
+  tt_assert(file_status(keyfname) == FN_FILE);
+
+ done:
+  verified_digests_free_all();
+  tor_free(body);
+  tor_free(fname);
+  tor_free(keyfname);
+}
+
+static void
+test_verified_digests_new_version(void *arg)
+{
+  char *fname = NULL, *keyfname = NULL, *body = NULL, *key = NULL;
+  char *newbody = NULL, *version_line = NULL, *p;
+  char mac[DIGEST256_LEN], hexmac[HEX_DIGEST256_LEN+1];
+  struct stat st;
+  (void)arg;
+
+  update_approx_time(1500000000);
+  setup_dirs("vd_version");
+  fname = get_cachedir_fname("cached-verified-digests");
+  keyfname = get_datadir_fname("verified-digests-key");
+
+  body = save_one_digest();
+  tt_assert(body);
+  tt_int_op(0, OP_EQ, verified_digests_load());
+  tt_int_op(1, OP_EQ, verified_digests_size());
+  verified_digests_free_all();
+
+  /* Make a correctly authenticated journal that claims to come from some
+   * other version of Tor. */
+  tor_asprintf(&version_line, "tor-version %s\n", get_version());
+  p = strstr(body, version_line);
+  tt_assert(p);
+  *p = '\0';
+  p += strlen(version_line);
+  *strstr(p, "mac ") = '\0';
+  tor_asprintf(&newbody, "%stor-version 0.0.1-alpha\n%s", body, p);
+  key = read_file_to_str(keyfname, RFTS_BIN, &st);
+  tt_assert(key);
+  crypto_hmac_sha256(mac, key, (size_t)st.st_size,
+                     newbody, strlen(newbody));
+  base16_encode(hexmac, sizeof(hexmac), mac, sizeof(mac));
+  tor_free(body);
+  tor_asprintf(&body, "%smac %s\n", newbody, hexmac);
+  tt_int_op(0, OP_EQ, write_str_to_file(fname, body, 0));
+
+  tt_int_op(0, OP_EQ, verified_digests_load());
+  tt_int_op(0, OP_EQ, verified_digests_size());
+
+ done:
+  verified_digests_free_all();
+  tor_free(body);
+  tor_free(newbody);
+  tor_free(version_line);
+  tor_free(key);
+  tor_free(fname);
+  tor_free(keyfname);
+}
+
+#define VD_TEST(name) \
+  { #name, test_verified_digests_ ## name, TT_FORK, NULL, NULL }
+
+struct testcase_t verified_digests_tests[] = {
+  VD_TEST(roundtrip),
+  VD_TEST(expire),
+  VD_TEST(tampered),
+  VD_TEST(new_version),
+  END_OF_TESTCASES
+};